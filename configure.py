@@ -221,6 +221,9 @@ parser.add_option('--with-python', metavar='EXE',
 parser.add_option('--force-pselect', action='store_true',
                   help='ppoll() is used by default where available, '
                        'but some platforms may need to use pselect instead',)
+parser.add_option('--no-epoll', action='store_true',
+                  help='epoll is used by default on Linux; use ppoll() '
+                       'instead',)
 (options, args) = parser.parse_args()
 if args:
     print('ERROR: extra unparsed command-line arguments:', args)
@@ -390,6 +393,9 @@ elif platform.is_aix():
 elif platform.is_msvc():
     pass
 else:
+    # ThreadPool (used for bulk stat) needs the platform thread library.
+    cflags.append('-pthread')
+    ldflags.append('-pthread')
     if options.profile == 'gmon':
         cflags.append('-pg')
         ldflags.append('-pg')
@@ -399,6 +405,9 @@ else:
 
 if platform.supports_ppoll() and not options.force_pselect:
     cflags.append('-DUSE_PPOLL')
+if (platform.is_linux() and not options.force_pselect and
+        not options.no_epoll):
+    cflags.append('-DUSE_EPOLL')
 if platform.supports_ninja_browse():
     cflags.append('-DNINJA_HAVE_BROWSE')
 
@@ -517,10 +526,14 @@ n.newline()
 
 n.comment('Core source files all build into ninja library.')
 objs.extend(re2c_objs)
-for name in ['build',
+for name in ['adaptive_jobs',
+             'build',
              'build_log',
+             'build_snapshot',
+             'bulk_stat',
              'clean',
              'clparser',
+             'command_output',
              'debug_flags',
              'deps_log',
              'disk_interface',
@@ -528,18 +541,23 @@ for name in ['build',
              'dyndep_parser',
              'edit_distance',
              'eval_env',
+             'failure_log',
              'graph',
              'graphviz',
+             'jobserver',
              'json',
              'line_printer',
              'manifest_parser',
              'manifest_to_bin_parser',
              'metrics',
              'missing_deps',
+             'parallel_scan',
              'parser',
+             'pressure',
              'state',
              'status',
              'string_piece_util',
+             'thread_pool',
              'util',
              'version']:
     objs += cxx(name, variables=cxxvariables)
@@ -553,6 +571,7 @@ if platform.is_windows():
         objs += cxx('minidump-win32', variables=cxxvariables)
     objs += cc('getopt')
 else:
+    objs += cxx('remote-posix')
     objs += cxx('subprocess-posix')
 if platform.is_aix():
     objs += cc('getopt')
@@ -591,21 +610,27 @@ objs = []
 if platform.is_msvc():
     cxxvariables = [('pdb', 'ninja_test.pdb')]
 
-for name in ['build_log_test',
+for name in ['adaptive_jobs_test',
+             'build_log_test',
+             'build_snapshot_test',
              'build_test',
              'clean_test',
              'clparser_test',
+             'command_output_test',
              'depfile_parser_test',
              'deps_log_test',
              'dyndep_parser_test',
              'disk_interface_test',
              'edit_distance_test',
+             'failure_log_test',
              'graph_test',
+             'jobserver_test',
              'json_test',
              'lexer_test',
              'manifest_parser_test',
              'missing_deps_test',
              'ninja_test',
+             'pressure_test',
              'state_test',
              'status_test',
              'string_piece_util_test',
@@ -616,6 +641,8 @@ for name in ['build_log_test',
 if platform.is_windows():
     for name in ['includes_normalize_test', 'msvc_helper_test']:
         objs += cxx(name, variables=cxxvariables)
+else:
+    objs += cxx('remote_test', variables=cxxvariables)
 
 ninja_test = n.build(binary('ninja_test'), 'link', objs, implicit=ninja_lib,
                      variables=[('libs', libs)])
@@ -633,8 +660,12 @@ if platform.is_aix() and '-maix64' not in ldflags:
 for name in ['build_log_perftest',
              'canon_perftest',
              'depfile_parser_perftest',
+             'disk_interface_perftest',
+             'graph_perftest',
              'hash_collision_bench',
              'manifest_parser_perftest',
+             'plan_perftest',
+             'subprocess_perftest',
              'clparser_perftest']:
   if platform.is_msvc():
     cxxvariables = [('pdb', name + '.pdb')]
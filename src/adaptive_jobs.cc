@@ -0,0 +1,220 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "adaptive_jobs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "debug_flags.h"
+#include "pressure.h"
+#include "util.h"
+
+using namespace std;
+
+bool ParseProcStat(const string& contents, CpuTimes* times) {
+  // cpu  user nice system idle iowait irq softirq steal guest guest_nice
+  if (contents.compare(0, 4, "cpu ") != 0)
+    return false;
+  const char* p = contents.c_str() + 4;
+  int64_t fields[8];
+  int count = 0;
+  for (; count < 8; ++count) {
+    char* end;
+    fields[count] = strtoll(p, &end, 10);
+    if (end == p)
+      break;
+    p = end;
+  }
+  // Kernels before 2.6 have no iowait and later fields.
+  if (count < 4)
+    return false;
+  for (int i = count; i < 8; ++i)
+    fields[i] = 0;
+  // guest time is already counted in user time.
+  times->iowait = fields[4];
+  times->busy = fields[0] + fields[1] + fields[2] + fields[5] + fields[6] +
+                fields[7];
+  times->total = times->busy + fields[3] + times->iowait;
+  return true;
+}
+
+bool ParseCpuStat(const string& contents, int64_t* usage_usec) {
+  size_t line = 0;
+  while (line < contents.size()) {
+    if (contents.compare(line, 11, "usage_usec ") == 0) {
+      const char* start = contents.c_str() + line + 11;
+      char* end;
+      *usage_usec = strtoll(start, &end, 10);
+      return end != start;
+    }
+    line = contents.find('\n', line);
+    if (line == string::npos)
+      break;
+    ++line;
+  }
+  return false;
+}
+
+namespace {
+
+/// Return how many cpus the quota in a cgroup's cpu.max allows, or 0 if
+/// there is no quota.
+double ParseCpuMax(const string& contents) {
+  // "max 100000" or "50000 100000"
+  const char* start = contents.c_str();
+  char* end;
+  long long quota = strtoll(start, &end, 10);
+  if (end == start || quota <= 0)
+    return 0;
+  start = end;
+  long long period = strtoll(start, &end, 10);
+  if (end == start || period <= 0)
+    return 0;
+  return (double)quota / period;
+}
+
+}  // namespace
+
+CpuReader::CpuReader()
+    : located_(false), proc_stat_("/proc/stat") {}
+
+CpuReader::CpuReader(const string& cgroup_dir, const string& proc_stat)
+    : located_(true), cgroup_dir_(cgroup_dir), proc_stat_(proc_stat) {}
+
+bool CpuReader::Read(int64_t now_millis, CpuTimes* times) {
+  if (!located_) {
+    cgroup_dir_ = GetCGroup2Path();
+    located_ = true;
+  }
+  string contents, err;
+  // Only a cgroup with a cpu quota has cpus of its own to keep busy;
+  // otherwise commands compete with everything else on the machine.
+  if (!cgroup_dir_.empty() &&
+      ::ReadFile(cgroup_dir_ + "/cpu.max", &contents, &err) >= 0) {
+    double cpus = ParseCpuMax(contents);
+    int64_t usage_usec;
+    contents.clear();
+    if (cpus > 0 &&
+        ::ReadFile(cgroup_dir_ + "/cpu.stat", &contents, &err) >= 0 &&
+        ParseCpuStat(contents, &usage_usec)) {
+      times->busy = usage_usec;
+      times->iowait = 0;
+      times->total = (int64_t)(now_millis * 1000 * cpus);
+      return true;
+    }
+  }
+  contents.clear();
+  return !proc_stat_.empty() &&
+         ::ReadFile(proc_stat_, &contents, &err) >= 0 &&
+         ParseProcStat(contents, times);
+}
+
+bool AdaptiveJobs::Parse(const string& spec, string* err) {
+  const char* start = spec.c_str();
+  char* end;
+  long min = strtol(start, &end, 10);
+  long max = -1;
+  if (end != start && *end == ':') {
+    start = end + 1;
+    max = strtol(start, &end, 10);
+  }
+  if (end == start || *end != '\0' || min < 1 || max < min ||
+      max > 1000000) {
+    *err = "invalid bounds '" + spec + "' (expected MIN:MAX, 1 <= MIN <= MAX)";
+    return false;
+  }
+  min_jobs = (int)min;
+  max_jobs = (int)max;
+  return true;
+}
+
+const double JobsController::kBusyRatio = 0.95;
+const double JobsController::kIdleRatio = 0.75;
+const double JobsController::kMaxCpuPressure = 20;
+const double JobsController::kMaxMemoryPressure = 10;
+
+JobsController::JobsController(const AdaptiveJobs& bounds, int initial_jobs,
+                               int processors, CpuReader* cpu,
+                               PressureReader* pressure)
+    : bounds_(bounds), processors_(max(processors, 1)), cpu_(cpu),
+      pressure_(pressure), reached_(false), has_sample_(false),
+      last_sample_millis_(0) {
+  limit_ = min(max(initial_jobs, bounds.min_jobs), bounds.max_jobs);
+}
+
+int JobsController::Limit(int64_t now_millis, int running) {
+  if (running >= limit_)
+    reached_ = true;
+  if (!has_sample_ ||
+      now_millis - last_sample_millis_ >= kSampleIntervalMillis)
+    Sample(now_millis);
+  return limit_;
+}
+
+void JobsController::Sample(int64_t now_millis) {
+  last_sample_millis_ = now_millis;
+  CpuTimes times;
+  if (!cpu_->Read(now_millis, &times))
+    return;
+  bool had_sample = has_sample_;
+  CpuTimes last = last_times_;
+  has_sample_ = true;
+  last_times_ = times;
+  bool reached = reached_;
+  reached_ = false;
+  int64_t total = times.total - last.total;
+  if (!had_sample || total <= 0)
+    return;
+
+  double busy = (double)(times.busy - last.busy) / total;
+  double iowait = (double)(times.iowait - last.iowait) / total;
+  PressureReading pressure;
+  if (pressure_)
+    pressure = pressure_->Read();
+
+  // Back off by a quarter, but only grow by one job at a time unless the
+  // commands barely use the cpus they have, e.g. while they wait on I/O.
+  int step = max(limit_ / 4, 1);
+  if (pressure.memory >= kMaxMemoryPressure) {
+    SetLimit(limit_ - step, "memory pressure", busy, iowait, pressure.cpu,
+             pressure.memory);
+  } else if (busy >= kBusyRatio &&
+             (pressure.cpu < 0 || pressure.cpu >= kMaxCpuPressure)) {
+    SetLimit(limit_ - step, "cpus saturated", busy, iowait, pressure.cpu,
+             pressure.memory);
+  } else if (reached && busy < kIdleRatio) {
+    double cpus_per_job = busy * processors_ / limit_;
+    SetLimit(limit_ + (cpus_per_job < 0.5 ? step : 1), "cpus idle", busy,
+             iowait, pressure.cpu, pressure.memory);
+  }
+}
+
+void JobsController::SetLimit(int limit, const char* reason, double busy,
+                              double iowait, double cpu_pressure,
+                              double memory_pressure) {
+  limit = min(max(limit, bounds_.min_jobs), bounds_.max_jobs);
+  if (limit == limit_)
+    return;
+  if (g_debug_jobs) {
+    fprintf(stderr,
+            "ninja jobs: %d -> %d (%s: cpu busy %.0f%%, iowait %.0f%%, "
+            "cpu pressure %.1f%%, memory pressure %.1f%%)\n",
+            limit_, limit, reason, 100 * busy, 100 * iowait, cpu_pressure,
+            memory_pressure);
+  }
+  limit_ = limit;
+}
@@ -0,0 +1,120 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ADAPTIVE_JOBS_H_
+#define NINJA_ADAPTIVE_JOBS_H_
+
+#include <stdint.h>
+
+#include <string>
+
+struct PressureReader;
+
+/// Cumulative cpu time, in any unit as long as it is the same for all
+/// fields.  Only differences between two readings mean anything.
+struct CpuTimes {
+  CpuTimes() : busy(0), iowait(0), total(0) {}
+
+  /// Time spent running tasks.
+  int64_t busy;
+  /// Time idle cpus spent with tasks waiting for I/O; 0 if unknown.
+  int64_t iowait;
+  /// All time of all cpus, idle or not.
+  int64_t total;
+};
+
+/// Parse the aggregate "cpu" line of the contents of /proc/stat.
+/// Returns false if there is none.
+bool ParseProcStat(const std::string& contents, CpuTimes* times);
+
+/// Parse usage_usec out of the contents of a cgroup's cpu.stat.
+/// Returns false if there is none.
+bool ParseCpuStat(const std::string& contents, int64_t* usage_usec);
+
+/// Reads CpuTimes for the cgroup this process is in, from its cpu.stat,
+/// falling back to the whole system's /proc/stat.
+struct CpuReader {
+  /// Read the cgroup this process is in, found on the first Read().
+  CpuReader();
+  /// Read the given files instead; either may be empty.
+  CpuReader(const std::string& cgroup_dir, const std::string& proc_stat);
+  virtual ~CpuReader() {}
+
+  /// Returns false if no reading is available.
+  virtual bool Read(int64_t now_millis, CpuTimes* times);
+
+ private:
+  bool located_;
+  std::string cgroup_dir_;
+  std::string proc_stat_;
+};
+
+/// The bounds within which JobsController may move the number of commands
+/// run in parallel.
+struct AdaptiveJobs {
+  AdaptiveJobs() : min_jobs(0), max_jobs(0) {}
+
+  bool enabled() const { return max_jobs > 0; }
+
+  /// Parse "MIN:MAX".
+  bool Parse(const std::string& spec, std::string* err);
+
+  int min_jobs;
+  int max_jobs;
+};
+
+/// Tunes the number of commands run in parallel from how busy the cpus
+/// are: more while commands leave cpus idle waiting on I/O, fewer while
+/// they wait for cpus or memory.
+struct JobsController {
+  JobsController(const AdaptiveJobs& bounds, int initial_jobs, int processors,
+                 CpuReader* cpu, PressureReader* pressure);
+
+  /// Return the current limit on commands run in parallel, with |running|
+  /// commands running now.  The limit changes at most every
+  /// kSampleIntervalMillis, and only goes up if it was reached since the
+  /// last change.
+  int Limit(int64_t now_millis, int running);
+
+  int limit() const { return limit_; }
+
+  static const int64_t kSampleIntervalMillis = 1000;
+
+  /// Above this share of busy cpu time, with tasks waiting for a cpu, the
+  /// limit goes down.
+  static const double kBusyRatio;
+  /// Below this share of busy cpu time the limit goes up.
+  static const double kIdleRatio;
+  /// Cpu and memory pressure, in percent, above which the limit goes down.
+  static const double kMaxCpuPressure;
+  static const double kMaxMemoryPressure;
+
+ private:
+  void Sample(int64_t now_millis);
+  void SetLimit(int limit, const char* reason, double busy, double iowait,
+                double cpu_pressure, double memory_pressure);
+
+  AdaptiveJobs bounds_;
+  int processors_;
+  CpuReader* cpu_;
+  PressureReader* pressure_;
+  int limit_;
+  /// Whether |limit_| commands ran at once since the last sample.
+  bool reached_;
+  bool has_sample_;
+  int64_t last_sample_millis_;
+  CpuTimes last_times_;
+};
+
+#endif  // NINJA_ADAPTIVE_JOBS_H_
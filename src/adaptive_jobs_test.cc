@@ -0,0 +1,200 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "adaptive_jobs.h"
+
+#include "disk_interface.h"
+#include "pressure.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+TEST(AdaptiveJobsTest, ParseProcStat) {
+  CpuTimes times;
+  EXPECT_TRUE(ParseProcStat(
+      "cpu  100 20 30 400 50 6 4 10 0 0\n"
+      "cpu0 50 10 15 200 25 3 2 5 0 0\n", &times));
+  EXPECT_EQ(170, times.busy);
+  EXPECT_EQ(50, times.iowait);
+  EXPECT_EQ(620, times.total);
+
+  // Old kernels stop after idle.
+  EXPECT_TRUE(ParseProcStat("cpu  100 20 30 400\n", &times));
+  EXPECT_EQ(150, times.busy);
+  EXPECT_EQ(0, times.iowait);
+  EXPECT_EQ(550, times.total);
+
+  EXPECT_FALSE(ParseProcStat("", &times));
+  EXPECT_FALSE(ParseProcStat("cpu0 1 2 3 4\n", &times));
+  EXPECT_FALSE(ParseProcStat("cpu  1 2\n", &times));
+}
+
+TEST(AdaptiveJobsTest, ParseCpuStat) {
+  int64_t usage = 0;
+  EXPECT_TRUE(ParseCpuStat("usage_usec 12345\nuser_usec 10000\n", &usage));
+  EXPECT_EQ(12345, usage);
+  EXPECT_FALSE(ParseCpuStat("user_usec 10000\n", &usage));
+}
+
+TEST(AdaptiveJobsTest, ParseBounds) {
+  AdaptiveJobs bounds;
+  string err;
+  EXPECT_FALSE(bounds.enabled());
+  EXPECT_TRUE(bounds.Parse("2:16", &err));
+  EXPECT_TRUE(bounds.enabled());
+  EXPECT_EQ(2, bounds.min_jobs);
+  EXPECT_EQ(16, bounds.max_jobs);
+  EXPECT_TRUE(bounds.Parse("4:4", &err));
+
+  EXPECT_FALSE(bounds.Parse("8", &err));
+  EXPECT_EQ("invalid bounds '8' (expected MIN:MAX, 1 <= MIN <= MAX)", err);
+  EXPECT_FALSE(bounds.Parse("8:4", &err));
+  EXPECT_FALSE(bounds.Parse("0:4", &err));
+  EXPECT_FALSE(bounds.Parse("1:x", &err));
+}
+
+struct CpuReaderTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-CpuReaderTest");
+    ASSERT_TRUE(disk_.MakeDir("cgroup"));
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+};
+
+TEST_F(CpuReaderTest, CGroupQuota) {
+  // Two cpus' worth of quota.
+  ASSERT_TRUE(disk_.WriteFile("cgroup/cpu.max", "200000 100000\n"));
+  ASSERT_TRUE(disk_.WriteFile("cgroup/cpu.stat", "usage_usec 5000\n"));
+  ASSERT_TRUE(disk_.WriteFile("stat", "cpu  1 1 1 1\n"));
+
+  CpuReader reader("cgroup", "stat");
+  CpuTimes times;
+  ASSERT_TRUE(reader.Read(10, &times));
+  EXPECT_EQ(5000, times.busy);
+  EXPECT_EQ(20000, times.total);
+}
+
+TEST_F(CpuReaderTest, NoQuota) {
+  // Without a quota the cgroup shares the machine with everybody else.
+  ASSERT_TRUE(disk_.WriteFile("cgroup/cpu.max", "max 100000\n"));
+  ASSERT_TRUE(disk_.WriteFile("cgroup/cpu.stat", "usage_usec 5000\n"));
+  ASSERT_TRUE(disk_.WriteFile("stat", "cpu  1 2 3 4 5\n"));
+
+  CpuReader reader("cgroup", "stat");
+  CpuTimes times;
+  ASSERT_TRUE(reader.Read(10, &times));
+  EXPECT_EQ(6, times.busy);
+  EXPECT_EQ(15, times.total);
+
+  CpuReader missing("", "");
+  EXPECT_FALSE(missing.Read(10, &times));
+}
+
+struct FakeCpuReader : public CpuReader {
+  FakeCpuReader() : CpuReader("", "") {}
+  virtual bool Read(int64_t now_millis, CpuTimes* times) {
+    *times = times_;
+    return true;
+  }
+  /// Advance the clock by |total| with |busy| of it spent running tasks.
+  void Add(int64_t busy, int64_t total) {
+    times_.busy += busy;
+    times_.total += total;
+  }
+  CpuTimes times_;
+};
+
+struct FakePressureReader : public PressureReader {
+  FakePressureReader() : PressureReader("", "") {}
+  virtual PressureReading Read() { return reading; }
+  PressureReading reading;
+};
+
+struct JobsControllerTest : public testing::Test {
+  JobsControllerTest() : now_(1000) {
+    bounds_.min_jobs = 2;
+    bounds_.max_jobs = 16;
+  }
+
+  /// Let a sample interval pass with |busy| percent of cpu time used.
+  int Tick(JobsController* jobs, int busy, int running) {
+    now_ += JobsController::kSampleIntervalMillis;
+    cpu_.Add(busy, 100);
+    return jobs->Limit(now_, running);
+  }
+
+  AdaptiveJobs bounds_;
+  FakeCpuReader cpu_;
+  FakePressureReader pressure_;
+  int64_t now_;
+};
+
+TEST_F(JobsControllerTest, Bounds) {
+  JobsController jobs(bounds_, 40, 4, &cpu_, &pressure_);
+  EXPECT_EQ(16, jobs.limit());
+  JobsController few(bounds_, 1, 4, &cpu_, &pressure_);
+  EXPECT_EQ(2, few.limit());
+}
+
+TEST_F(JobsControllerTest, RaiseWhileIdle) {
+  JobsController jobs(bounds_, 4, 4, &cpu_, &pressure_);
+  EXPECT_EQ(4, jobs.Limit(now_, 4));
+
+  // Idle cpus alone don't raise the limit while it isn't reached.
+  EXPECT_EQ(4, Tick(&jobs, 50, 2));
+  // Four jobs using 60% of four cpus: one more.
+  EXPECT_EQ(5, Tick(&jobs, 60, 5));
+  // Five jobs using 40% of four cpus, so mostly waiting: a quarter more.
+  EXPECT_EQ(6, Tick(&jobs, 40, 5));
+  EXPECT_EQ(7, Tick(&jobs, 10, 6));
+  EXPECT_EQ(8, Tick(&jobs, 10, 7));
+  EXPECT_EQ(10, Tick(&jobs, 10, 8));
+  // Not before the next interval.
+  EXPECT_EQ(10, jobs.Limit(now_ + 1, 10));
+
+  // Busy, but no task waits for a cpu.
+  pressure_.reading.cpu = 5;
+  EXPECT_EQ(10, Tick(&jobs, 99, 10));
+}
+
+TEST_F(JobsControllerTest, LowerUnderPressure) {
+  JobsController jobs(bounds_, 16, 4, &cpu_, &pressure_);
+  jobs.Limit(now_, 16);
+
+  // Saturated cpus, with no pressure reading to say whether tasks wait.
+  EXPECT_EQ(12, Tick(&jobs, 100, 16));
+  pressure_.reading.cpu = 50;
+  EXPECT_EQ(9, Tick(&jobs, 97, 12));
+
+  // Memory pressure lowers the limit even with idle cpus.
+  pressure_.reading.cpu = 0;
+  pressure_.reading.memory = 30;
+  EXPECT_EQ(7, Tick(&jobs, 20, 9));
+  EXPECT_EQ(6, Tick(&jobs, 20, 7));
+  EXPECT_EQ(5, Tick(&jobs, 20, 6));
+  EXPECT_EQ(4, Tick(&jobs, 20, 5));
+  EXPECT_EQ(3, Tick(&jobs, 20, 4));
+  EXPECT_EQ(2, Tick(&jobs, 20, 3));
+  EXPECT_EQ(2, Tick(&jobs, 20, 2));
+}
+
+}  // anonymous namespace
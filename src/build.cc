@@ -18,7 +18,15 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #if defined(__SVR4) && defined(__sun)
 #include <sys/termios.h>
@@ -30,11 +38,16 @@
 #include "depfile_parser.h"
 #include "deps_log.h"
 #include "disk_interface.h"
+#include "failure_log.h"
 #include "graph.h"
 #include "metrics.h"
+#ifndef _WIN32
+#include "remote.h"
+#endif
 #include "state.h"
 #include "status.h"
 #include "subprocess.h"
+#include "thread_pool.h"
 #include "util.h"
 
 using namespace std;
@@ -76,16 +89,31 @@ bool DryRunCommandRunner::WaitForCommand(Result* result) {
 }  // namespace
 
 Plan::Plan(Builder* builder)
-  : builder_(builder)
+  : generation_(1)
+  , critical_path_stale_(false)
+  , scanning_(false)
+  , builder_(builder)
   , command_edges_(0)
   , wanted_edges_(0)
+  , total_cost_(0)
+  , known_costs_(0)
 {}
 
 void Plan::Reset() {
   command_edges_ = 0;
   wanted_edges_ = 0;
   ready_.clear();
-  want_.clear();
+  planned_.clear();
+  reweigh_.clear();
+  held_.clear();
+  total_cost_ = 0;
+  known_costs_ = 0;
+  if (++generation_ == 0) {
+    // Entries from 4 billion resets ago must not come back to life.
+    want_.clear();
+    generation_ = 1;
+  }
+  critical_path_stale_ = false;
 }
 
 bool Plan::AddTarget(const Node* target, string* err) {
@@ -111,9 +139,10 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
 
   // If an entry in want_ does not already exist for edge, create an entry which
   // maps to kWantNothing, indicating that we do not want to build this entry itself.
-  pair<map<Edge*, Want>::iterator, bool> want_ins =
-    want_.insert(make_pair(edge, kWantNothing));
-  Want& want = want_ins.first->second;
+  bool added = AddToPlan(edge);
+  if (added)
+    CountPendingInputs(edge);
+  Want& want = WantOf(edge);
 
   if (dyndep_walk && want == kWantToFinish)
     return false;  // Don't need to do anything with already-scheduled edge.
@@ -123,14 +152,14 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
   if (node->dirty() && want == kWantNothing) {
     want = kWantToStart;
     EdgeWanted(edge);
-    if (!dyndep_walk && edge->AllInputsReady())
-      ScheduleWork(want_ins.first);
+    if (!dyndep_walk && edge->pending_inputs_ == 0)
+      ScheduleWork(edge);
   }
 
   if (dyndep_walk)
     dyndep_walk->insert(edge);
 
-  if (!want_ins.second)
+  if (!added)
     return true;  // We've already processed the inputs.
 
   for (vector<Node*>::iterator i = edge->inputs_.begin();
@@ -142,47 +171,230 @@ bool Plan::AddSubTarget(const Node* node, const Node* dependent, string* err,
   return true;
 }
 
-void Plan::EdgeWanted(const Edge* edge) {
+void Plan::EdgeWanted(Edge* edge) {
   ++wanted_edges_;
   if (!edge->is_phony())
     ++command_edges_;
+  critical_path_stale_ = true;
+  if (builder_ && builder_->config_.schedule == BuildConfig::SCHEDULE_FAIL_FAST)
+    edge->set_urgency(FailFastUrgency(edge));
+}
+
+int64_t Plan::FailFastUrgency(const Edge* edge) const {
+  FailureLog* failure_log = builder_->failure_log();
+  if (failure_log && failure_log->Failed(edge))
+    return numeric_limits<int64_t>::max();
+  // The newest inputs are likely those just edited.
+  TimeStamp newest = 0;
+  for (size_t i = 0; i < edge->inputs_.size(); ++i) {
+    if (!edge->is_order_only(i))
+      newest = max(newest, edge->inputs_[i]->mtime());
+  }
+  return newest;
+}
+
+bool Plan::AddToPlan(Edge* edge) {
+  if (edge->id_ >= want_.size())
+    want_.resize(edge->id_ + 1);
+  WantEntry& entry = want_[edge->id_];
+  if (entry.generation != generation_) {
+    entry.generation = generation_;
+    entry.cost = EdgeCost(edge);
+    if (entry.cost > 0) {
+      total_cost_ += entry.cost;
+      ++known_costs_;
+    }
+    planned_.push_back(edge);
+  } else if (entry.in_plan) {
+    return false;
+  }
+  entry.in_plan = true;
+  entry.want = kWantNothing;
+  reweigh_.push_back(edge);
+  return true;
+}
+
+void Plan::RemoveFromPlan(Edge* edge) {
+  want_[edge->id_].in_plan = false;
+}
+
+void Plan::CountPendingInputs(Edge* edge) {
+  // The Plan finishes every in-edge it holds, even one RecomputeDirty has
+  // since found ready, and each input waits for that.
+  edge->pending_inputs_ = 0;
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (in_edge && (!in_edge->outputs_ready() || InPlan(in_edge)))
+      ++edge->pending_inputs_;
+  }
 }
 
 Edge* Plan::FindWork() {
+  PrepareQueue();
   if (ready_.empty())
     return NULL;
-  EdgeSet::iterator e = ready_.begin();
-  Edge* edge = *e;
-  ready_.erase(e);
+  Edge* edge = ready_.top();
+  ready_.pop();
   return edge;
 }
 
-void Plan::ScheduleWork(map<Edge*, Want>::iterator want_e) {
-  if (want_e->second == kWantToFinish) {
+int64_t Plan::EdgeCost(const Edge* edge) {
+  if (edge->is_phony())
+    return 0;
+  BuildLog* build_log = builder_ ? builder_->build_log() : NULL;
+  for (vector<Node*>::const_iterator o = edge->outputs_.begin();
+       build_log && o != edge->outputs_.end(); ++o) {
+    std::shared_ptr<BuildLog::LogEntry> entry =
+        build_log->LookupByOutput((*o)->path());
+    if (entry)
+      return max(1, entry->end_time - entry->start_time);
+  }
+  return -1;
+}
+
+void Plan::ComputeCriticalPath() {
+  METRIC_RECORD("critical path");
+
+  // Edges without a record are assumed to take as long as the average edge
+  // which has one.
+  const int64_t default_cost = known_costs_ ? total_cost_ / known_costs_ : 1;
+
+  // Only the edges reweighed and those they depend on can change weight.
+  // Count each one's dependents among them, so that they can be visited in
+  // topological order from the targets down: an edge's weight is known
+  // once all of its dependents' are.
+  struct Visit {
+    Visit() : dependents(0), tail(0) {}
+    int dependents;
+    /// The heaviest chain through the edge's dependents.
+    int64_t tail;
+  };
+  unordered_map<Edge*, Visit> visits;
+  vector<Edge*> stack;
+  for (vector<Edge*>::iterator e = reweigh_.begin(); e != reweigh_.end(); ++e) {
+    if (InPlan(*e) && visits.insert(make_pair(*e, Visit())).second)
+      stack.push_back(*e);
+  }
+  reweigh_.clear();
+  while (!stack.empty()) {
+    Edge* edge = stack.back();
+    stack.pop_back();
+    for (vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      Edge* producer = (*i)->in_edge();
+      if (!producer || !InPlan(producer))
+        continue;
+      pair<unordered_map<Edge*, Visit>::iterator, bool> v =
+          visits.insert(make_pair(producer, Visit()));
+      ++v.first->second.dependents;
+      if (v.second)
+        stack.push_back(producer);
+    }
+  }
+
+  // Dependents not reweighed keep their weights.
+  vector<Edge*> ready;
+  for (unordered_map<Edge*, Visit>::iterator v = visits.begin();
+       v != visits.end(); ++v) {
+    Edge* edge = v->first;
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      for (vector<Edge*>::const_iterator d = (*o)->out_edges().begin();
+           d != (*o)->out_edges().end(); ++d) {
+        if (InPlan(*d) && !visits.count(*d))
+          v->second.tail = max(v->second.tail, want_[(*d)->id_].weight);
+      }
+    }
+    if (v->second.dependents == 0)
+      ready.push_back(edge);
+  }
+
+  while (!ready.empty()) {
+    Edge* edge = ready.back();
+    ready.pop_back();
+    WantEntry& entry = want_[edge->id_];
+    entry.weight = visits[edge].tail +
+        (entry.cost < 0 ? default_cost : entry.cost);
+    // Queued edges keep the weight they were queued with.
+    if (entry.want != kWantToFinish)
+      edge->set_critical_path_weight(entry.weight);
+    for (vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      Edge* producer = (*i)->in_edge();
+      if (!producer || !InPlan(producer))
+        continue;
+      Visit& visit = visits[producer];
+      visit.tail = max(visit.tail, entry.weight);
+      if (--visit.dependents == 0)
+        ready.push_back(producer);
+    }
+  }
+}
+
+void Plan::PrepareQueue() {
+  if (!critical_path_stale_ || scanning_)
+    return;
+
+  ComputeCriticalPath();
+  critical_path_stale_ = false;
+
+  // Delay edges in their pools first, and only then let the pools release
+  // them, so that each pool releases its heaviest edges.
+  vector<Edge*> held;
+  held.swap(held_);
+  set<Pool*> pools;
+  for (vector<Edge*>::iterator e = held.begin(); e != held.end(); ++e) {
+    Edge* edge = *e;
+    if (!InPlan(edge))
+      continue;
+    Want& want = WantOf(edge);
+    if (want != kWantToStart || edge->pending_inputs_ != 0)
+      continue;
+    want = kWantToFinish;
+    Pool* pool = edge->pool();
+    if (pool->ShouldDelayEdge(*edge)) {
+      pool->DelayEdge(edge);
+      pools.insert(pool);
+    } else {
+      pool->EdgeScheduled(*edge);
+      ready_.push(edge);
+    }
+  }
+  for (set<Pool*>::iterator p = pools.begin(); p != pools.end(); ++p)
+    (*p)->RetrieveReadyEdges(&ready_);
+}
+
+void Plan::ScheduleWork(Edge* edge) {
+  Want& want = WantOf(edge);
+  if (want == kWantToFinish) {
     // This edge has already been scheduled.  We can get here again if an edge
     // and one of its dependencies share an order-only input, or if a node
     // duplicates an out edge (see https://github.com/ninja-build/ninja/pull/519).
     // Avoid scheduling the work again.
     return;
   }
-  assert(want_e->second == kWantToStart);
-  want_e->second = kWantToFinish;
+  assert(want == kWantToStart);
+  // PrepareQueue() will schedule the edge once it has a weight.
+  if (critical_path_stale_ && !scanning_) {
+    held_.push_back(edge);
+    return;
+  }
+  want = kWantToFinish;
 
-  Edge* edge = want_e->first;
   Pool* pool = edge->pool();
-  if (pool->ShouldDelayEdge()) {
+  if (pool->ShouldDelayEdge(*edge)) {
     pool->DelayEdge(edge);
     pool->RetrieveReadyEdges(&ready_);
   } else {
     pool->EdgeScheduled(*edge);
-    ready_.insert(edge);
+    ready_.push(edge);
   }
 }
 
 bool Plan::EdgeFinished(Edge* edge, EdgeResult result, string* err) {
-  map<Edge*, Want>::iterator e = want_.find(edge);
-  assert(e != want_.end());
-  bool directly_wanted = e->second != kWantNothing;
+  assert(InPlan(edge));
+  bool directly_wanted = WantOf(edge) != kWantNothing;
 
   // See if this job frees up any delayed jobs.
   if (directly_wanted)
@@ -195,9 +407,23 @@ bool Plan::EdgeFinished(Edge* edge, EdgeResult result, string* err) {
 
   if (directly_wanted)
     --wanted_edges_;
-  want_.erase(e);
+  RemoveFromPlan(edge);
   edge->outputs_ready_ = true;
 
+  // Check the outputs off in the edges waiting for them, all before any
+  // dyndep file among them is loaded and recounts its dependents.  An edge
+  // lists a node among its out-edges once for each time it is an input.
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    for (vector<Edge*>::const_iterator oe = (*o)->out_edges().begin();
+         oe != (*o)->out_edges().end(); ++oe) {
+      if (InPlan(*oe)) {
+        assert((*oe)->pending_inputs_ > 0);
+        --(*oe)->pending_inputs_;
+      }
+    }
+  }
+
   // Check off any nodes we were waiting for with this edge.
   for (vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
@@ -219,22 +445,20 @@ bool Plan::NodeFinished(Node* node, string* err) {
   // See if we we want any edges from this node.
   for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end())
+    if (!InPlan(*oe))
       continue;
 
     // See if the edge is now ready.
-    if (!EdgeMaybeReady(want_e, err))
+    if (!EdgeMaybeReady(*oe, err))
       return false;
   }
   return true;
 }
 
-bool Plan::EdgeMaybeReady(map<Edge*, Want>::iterator want_e, string* err) {
-  Edge* edge = want_e->first;
-  if (edge->AllInputsReady()) {
-    if (want_e->second != kWantNothing) {
-      ScheduleWork(want_e);
+bool Plan::EdgeMaybeReady(Edge* edge, string* err) {
+  if (edge->pending_inputs_ == 0) {
+    if (WantOf(edge) != kWantNothing) {
+      ScheduleWork(edge);
     } else {
       // We do not need to build this edge, but we might need to build one of
       // its dependents.
@@ -251,8 +475,7 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
   for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
     // Don't process edges that we don't actually want.
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end() || want_e->second == kWantNothing)
+    if (!InPlan(*oe) || WantOf(*oe) == kWantNothing)
       continue;
 
     // Don't attempt to clean an edge if it failed to load deps.
@@ -292,7 +515,7 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
             return false;
         }
 
-        want_e->second = kWantNothing;
+        WantOf(*oe) = kWantNothing;
         --wanted_edges_;
         if (!(*oe)->is_phony())
           --command_edges_;
@@ -319,18 +542,31 @@ bool Plan::DyndepsLoaded(DependencyScan* scan, const Node* node,
   for (DyndepFile::const_iterator oe = ddf.begin(); oe != ddf.end(); ++oe) {
     Edge* edge = oe->first;
 
+    // Edges reading a newly discovered output (e.g. through a depfile) now
+    // wait for this edge rather than for a phony one.
+    for (vector<Node*>::const_iterator o = oe->second.implicit_outputs_.begin();
+         o != oe->second.implicit_outputs_.end(); ++o) {
+      for (vector<Edge*>::const_iterator d = (*o)->out_edges().begin();
+           d != (*o)->out_edges().end(); ++d) {
+        if (InPlan(*d))
+          CountPendingInputs(*d);
+      }
+    }
+
     // If the edge outputs are ready we do not need to consider it here.
     if (edge->outputs_ready())
       continue;
 
-    map<Edge*, Want>::iterator want_e = want_.find(edge);
-
     // If the edge has not been encountered before then nothing already in the
     // plan depends on it so we do not need to consider the edge yet either.
-    if (want_e == want_.end())
+    if (!InPlan(edge))
       continue;
 
-    // This edge is already in the plan so queue it for the walk.
+    // This edge is already in the plan so queue it for the walk.  It may
+    // have new inputs to wait for, and new dependents to weigh it by.
+    CountPendingInputs(edge);
+    reweigh_.push_back(edge);
+    critical_path_stale_ = true;
     dyndep_roots.push_back(oe);
   }
 
@@ -351,19 +587,16 @@ bool Plan::DyndepsLoaded(DependencyScan* scan, const Node* node,
   // Plan::NodeFinished would have without taking the dyndep code path).
   for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end())
-      continue;
-    dyndep_walk.insert(want_e->first);
+    if (InPlan(*oe))
+      dyndep_walk.insert(*oe);
   }
 
   // See if any encountered edges are now ready.
   for (set<Edge*>::iterator wi = dyndep_walk.begin();
        wi != dyndep_walk.end(); ++wi) {
-    map<Edge*, Want>::iterator want_e = want_.find(*wi);
-    if (want_e == want_.end())
+    if (!InPlan(*wi))
       continue;
-    if (!EdgeMaybeReady(want_e, err))
+    if (!EdgeMaybeReady(*wi, err))
       return false;
   }
 
@@ -374,12 +607,12 @@ bool Plan::RefreshDyndepDependents(DependencyScan* scan, const Node* node,
                                    string* err) {
   // Collect the transitive closure of dependents and mark their edges
   // as not yet visited by RecomputeDirty.
-  set<Node*> dependents;
+  vector<Node*> dependents;
   UnmarkDependents(node, &dependents);
 
   // Update the dirty state of all dependents and check if their edges
   // have become wanted.
-  for (set<Node*>::iterator i = dependents.begin();
+  for (vector<Node*>::iterator i = dependents.begin();
        i != dependents.end(); ++i) {
     Node* n = *i;
 
@@ -407,83 +640,236 @@ bool Plan::RefreshDyndepDependents(DependencyScan* scan, const Node* node,
     // information an output is now known to be dirty, so we want the edge.
     Edge* edge = n->in_edge();
     assert(edge && !edge->outputs_ready());
-    map<Edge*, Want>::iterator want_e = want_.find(edge);
-    assert(want_e != want_.end());
-    if (want_e->second == kWantNothing) {
-      want_e->second = kWantToStart;
+    assert(InPlan(edge));
+    if (WantOf(edge) == kWantNothing) {
+      WantOf(edge) = kWantToStart;
       EdgeWanted(edge);
     }
   }
   return true;
 }
 
-void Plan::UnmarkDependents(const Node* node, set<Node*>* dependents) {
+void Plan::UnmarkDependents(const Node* node, vector<Node*>* dependents) {
   for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
     Edge* edge = *oe;
 
-    map<Edge*, Want>::iterator want_e = want_.find(edge);
-    if (want_e == want_.end())
+    if (!InPlan(edge))
       continue;
 
+    // Clearing the mark makes sure we visit each edge, and so each of
+    // the outputs it alone produces, once.
     if (edge->mark_ != Edge::VisitNone) {
       edge->mark_ = Edge::VisitNone;
       for (vector<Node*>::iterator o = edge->outputs_.begin();
            o != edge->outputs_.end(); ++o) {
-        if (dependents->insert(*o).second)
-          UnmarkDependents(*o, dependents);
+        dependents->push_back(*o);
+        UnmarkDependents(*o, dependents);
       }
     }
   }
 }
 
 void Plan::Dump() const {
-  printf("pending: %d\n", (int)want_.size());
-  for (map<Edge*, Want>::const_iterator e = want_.begin(); e != want_.end(); ++e) {
-    if (e->second != kWantNothing)
+  int pending = 0;
+  for (vector<Edge*>::const_iterator e = planned_.begin();
+       e != planned_.end(); ++e) {
+    if (InPlan(*e))
+      ++pending;
+  }
+  printf("pending: %d\n", pending);
+  for (vector<Edge*>::const_iterator e = planned_.begin();
+       e != planned_.end(); ++e) {
+    if (!InPlan(*e))
+      continue;
+    if (want_[(*e)->id_].want != kWantNothing)
       printf("want ");
-    e->first->Dump();
+    (*e)->Dump();
   }
   printf("ready: %d\n", (int)ready_.size());
 }
 
 struct RealCommandRunner : public CommandRunner {
-  explicit RealCommandRunner(const BuildConfig& config) : config_(config) {}
+  RealCommandRunner(const BuildConfig& config, DiskInterface* disk_interface)
+      : config_(config), disk_interface_(disk_interface),
+        admission_(config.pressure_limits, &pressure_),
+        jobs_(config.adaptive_jobs, config.parallelism,
+              config.adaptive_jobs.enabled() ? GetProcessorCount() : 1,
+              &cpu_, &pressure_),
+        interrupted_(false) {
+    string err;
+    if (config.jobserver.mode != JobserverConfig::kModeNone &&
+        !jobserver_.Connect(config.jobserver, &err))
+      Warning("ignoring jobserver: %s", err.c_str());
+  }
   virtual ~RealCommandRunner() {}
   virtual bool CanRunMore() const;
   virtual bool StartCommand(Edge* edge);
   virtual bool WaitForCommand(Result* result);
+  virtual bool PollCommand(Result* result);
   virtual vector<Edge*> GetActiveEdges();
   virtual void Abort();
 
+  /// Fill in |result| for a finished |subproc|.
+  void FinishSubprocess(const std::shared_ptr<Subprocess>& subproc,
+                        Result* result);
+
+  /// Run |edge|'s command in a subprocess of its own.
+  bool StartSubprocess(Edge* edge);
+  /// Run the edges of |batch| with one batch_command, or on its own if
+  /// there is only one.
+  bool StartBatch(const vector<Edge*>& batch);
+  /// Split the |result| of a batch into one result per edge, the first in
+  /// |result| and the others in |batch_results_|.
+  void FinishBatch(const vector<Edge*>& batch, Result* result);
+
   const BuildConfig& config_;
+  /// Where batch rspfiles and status files are written.
+  DiskInterface* disk_interface_;
   SubprocessSet subprocs_;
   map<Subprocess*, Edge*> subproc_to_edge_;
+  /// Edges of rules with a `batch` size, waiting for more edges with the
+  /// same batch_command.  They don't count as running until they start.
+  map<string, vector<Edge*> > pending_batches_;
+  /// The edges of running batches of more than one edge.
+  map<Subprocess*, vector<Edge*> > batches_;
+  /// Results of edges of finished batches, not yet returned.
+  deque<Result> batch_results_;
+  PressureReader pressure_;
+  mutable AdmissionController admission_;
+  CpuReader cpu_;
+  mutable JobsController jobs_;
+  mutable JobserverClient jobserver_;
+  /// Whether PollCommand() saw an interruption WaitForCommand() must report.
+  bool interrupted_;
 };
 
 vector<Edge*> RealCommandRunner::GetActiveEdges() {
   vector<Edge*> edges;
   for (auto e = subproc_to_edge_.begin();
-       e != subproc_to_edge_.end(); ++e)
-    edges.push_back(e->second);
+       e != subproc_to_edge_.end(); ++e) {
+    auto batch = batches_.find(e->first);
+    if (batch != batches_.end())
+      edges.insert(edges.end(), batch->second.begin(), batch->second.end());
+    else
+      edges.push_back(e->second);
+  }
+  for (auto b = pending_batches_.begin(); b != pending_batches_.end(); ++b)
+    edges.insert(edges.end(), b->second.begin(), b->second.end());
+  for (auto r = batch_results_.begin(); r != batch_results_.end(); ++r)
+    edges.push_back(r->edge);
   return edges;
 }
 
 void RealCommandRunner::Abort() {
   subprocs_.Clear();
+  pending_batches_.clear();
+  batches_.clear();
+  batch_results_.clear();
+  jobserver_.Release(0);
 }
 
 bool RealCommandRunner::CanRunMore() const {
   size_t subproc_number =
       subprocs_.running_.size() + subprocs_.finished_.size();
-  return (int)subproc_number < config_.parallelism
-    && ((subprocs_.running_.empty() || config_.max_load_average <= 0.0f)
-        || GetLoadAverage() < config_.max_load_average);
+  int parallelism = config_.parallelism;
+  if (config_.adaptive_jobs.enabled())
+    parallelism = jobs_.Limit(GetTimeMillis(), (int)subproc_number);
+  if ((int)subproc_number >= parallelism)
+    return false;
+  // Load and pressure never hold back the only command, so that the build
+  // makes progress.
+  if (!subprocs_.running_.empty()) {
+    if (config_.max_load_average > 0.0f &&
+        GetLoadAverage() >= config_.max_load_average)
+      return false;
+    if (!admission_.Admit(GetTimeMillis()))
+      return false;
+  }
+  return jobserver_.Acquire(subproc_number + 1);
 }
 
+namespace {
+
+/// Evaluates a batch_command for a batch starting with |edge|.
+struct BatchEnv : public Env {
+  BatchEnv(const Edge* edge, const string& rspfile, const string& status)
+      : edge_(edge), rspfile_(rspfile), status_(status) {}
+
+  virtual string LookupVariable(const string& var) {
+    if (var == "batch_rspfile")
+      return Escape(rspfile_);
+    if (var == "batch_status")
+      return Escape(status_);
+    return edge_->GetBinding(var);
+  }
+
+  static string Escape(const string& path) {
+    string result;
+#ifdef _WIN32
+    GetWin32EscapedString(path, &result);
+#else
+    GetShellEscapedString(path, &result);
+#endif
+    return result;
+  }
+
+  const Edge* edge_;
+  string rspfile_;
+  string status_;
+};
+
+/// Return how many edges of |edge|'s rule may run in one batch_command.
+int BatchSize(const Edge* edge) {
+  // Console commands run on their own, and msvc deps need each edge's
+  // own output.
+  if (edge->use_console() || edge->GetBinding("deps") == "msvc" ||
+      !edge->rule().GetBinding("batch_command"))
+    return 1;
+  return max(atoi(edge->GetBinding("batch").c_str()), 1);
+}
+
+/// The files a batch starting with |edge| reads its edges from and writes
+/// their exit codes to.
+string BatchRspfile(const Edge* edge) {
+  return edge->outputs_[0]->path() + ".batch.rsp";
+}
+
+string BatchStatusFile(const Edge* edge) {
+  return edge->outputs_[0]->path() + ".batch.status";
+}
+
+}  // namespace
+
 bool RealCommandRunner::StartCommand(Edge* edge) {
+  int batch_size = BatchSize(edge);
+  if (batch_size > 1) {
+    // Only edges whose batch_command comes out the same can share one.
+    BatchEnv env(edge, "", "");
+    string key = edge->rule().name() + '\0' +
+                 edge->rule().GetBinding("batch_command")->Evaluate(&env);
+    vector<Edge*>& batch = pending_batches_[key];
+    batch.push_back(edge);
+    if ((int)batch.size() < batch_size)
+      return true;
+    vector<Edge*> edges;
+    edges.swap(batch);
+    pending_batches_.erase(key);
+    return StartBatch(edges);
+  }
+  return StartSubprocess(edge);
+}
+
+bool RealCommandRunner::StartSubprocess(Edge* edge) {
   string command = edge->EvaluateCommand();
-  auto subproc = subprocs_.Add(command, edge->use_console()).get();
+  bool direct_exec =
+      config_.direct_exec || edge->GetBindingBool("direct_exec");
+  // Console commands need the terminal, which workers don't have.
+  string worker = edge->GetBinding("worker");
+  auto subproc =
+      !worker.empty() && !edge->use_console()
+          ? subprocs_.AddToWorker(worker, command).get()
+          : subprocs_.Add(command, edge->use_console(), direct_exec).get();
   if (!subproc)
     return false;
   subproc_to_edge_.insert(make_pair(subproc, edge));
@@ -491,8 +877,55 @@ bool RealCommandRunner::StartCommand(Edge* edge) {
   return true;
 }
 
+bool RealCommandRunner::StartBatch(const vector<Edge*>& batch) {
+  if (batch.size() == 1)
+    return StartSubprocess(batch[0]);
+
+  // One line of "$in<tab>$out" per edge.
+  string content;
+  for (vector<Edge*>::const_iterator e = batch.begin(); e != batch.end();
+       ++e) {
+    content += (*e)->GetBinding("in") + '\t' + (*e)->GetBinding("out") +
+               '\n';
+  }
+  Edge* first = batch[0];
+  string rspfile = BatchRspfile(first);
+  string status_file = BatchStatusFile(first);
+  disk_interface_->RemoveFile(status_file);
+  if (!disk_interface_->WriteFile(rspfile, content))
+    return false;
+
+  BatchEnv env(first, rspfile, status_file);
+  string command = first->rule().GetBinding("batch_command")->Evaluate(&env);
+  bool direct_exec =
+      config_.direct_exec || first->GetBindingBool("direct_exec");
+  Subprocess* subproc = subprocs_.Add(command, false, direct_exec).get();
+  if (!subproc)
+    return false;
+  subproc_to_edge_.insert(make_pair(subproc, first));
+  batches_.insert(make_pair(subproc, batch));
+  return true;
+}
+
 bool RealCommandRunner::WaitForCommand(Result* result) {
   std::shared_ptr<Subprocess> subproc;
+  if (!batch_results_.empty()) {
+    *result = std::move(batch_results_.front());
+    batch_results_.pop_front();
+    return true;
+  }
+  if (interrupted_)
+    return false;
+  // No more edges are coming for the batches that wait for some, so start
+  // those there is room for.
+  while (!pending_batches_.empty() &&
+         (subprocs_.running_.empty() || CanRunMore())) {
+    vector<Edge*> batch;
+    batch.swap(pending_batches_.begin()->second);
+    pending_batches_.erase(pending_batches_.begin());
+    if (!StartBatch(batch))
+      Fatal("can't start batch of %s", batch[0]->rule().name().c_str());
+  }
   while ((subproc = subprocs_.NextFinished()) == nullptr) {
     bool interrupted = subprocs_.DoWork();
     if (interrupted) {
@@ -500,25 +933,441 @@ bool RealCommandRunner::WaitForCommand(Result* result) {
       return false;
     }
   }
+  FinishSubprocess(subproc, result);
+  return true;
+}
+
+bool RealCommandRunner::PollCommand(Result* result) {
+  if (!batch_results_.empty()) {
+    *result = std::move(batch_results_.front());
+    batch_results_.pop_front();
+    return true;
+  }
+  std::shared_ptr<Subprocess> subproc = subprocs_.NextFinished();
+  if (!subproc) {
+    if (interrupted_ || subprocs_.running_.empty())
+      return false;
+    if (subprocs_.DoWork(0)) {
+      interrupted_ = true;
+      return false;
+    }
+    if ((subproc = subprocs_.NextFinished()) == nullptr)
+      return false;
+  }
+  FinishSubprocess(subproc, result);
+  return true;
+}
 
+void RealCommandRunner::FinishSubprocess(
+    const std::shared_ptr<Subprocess>& subproc, Result* result) {
   result->status = subproc->Finish();
-  result->output = subproc->GetOutput();
+  subproc->TakeOutput(&result->output);
+  result->usage = subproc->GetResourceUsage();
 
   auto e = subproc_to_edge_.find(subproc.get());
   result->edge = e->second;
   subproc_to_edge_.erase(e);
+  auto batch = batches_.find(subproc.get());
+  if (batch != batches_.end()) {
+    FinishBatch(batch->second, result);
+    batches_.erase(batch);
+  }
+  jobserver_.Release(subprocs_.running_.size() + subprocs_.finished_.size());
+}
 
-  return true;
+void RealCommandRunner::FinishBatch(const vector<Edge*>& batch,
+                                    Result* result) {
+  Edge* first = batch[0];
+  string rspfile = BatchRspfile(first);
+  string status_file = BatchStatusFile(first);
+  string contents, err;
+  vector<ExitStatus> statuses;
+  if (result->status != ExitInterrupted &&
+      disk_interface_->ReadFile(status_file, &contents, &err) ==
+          DiskInterface::Okay) {
+    // One exit code per line, in the order of the edges in the rspfile.
+    const char* p = contents.c_str();
+    while (*p && statuses.size() < batch.size()) {
+      char* end;
+      long code = strtol(p, &end, 10);
+      if (end == p)
+        break;
+      statuses.push_back(code == 0 ? ExitSuccess : ExitFailure);
+      p = end + strspn(end, " \t\r\n");
+    }
+  }
+  disk_interface_->RemoveFile(status_file);
+  if (!g_keep_rsp)
+    disk_interface_->RemoveFile(rspfile);
+
+  // Edges the tool didn't report on share the batch's exit status, and the
+  // output goes with the first edge that failed.
+  size_t output_edge = batch.size();
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (i >= statuses.size())
+      statuses.push_back(result->status);
+    if (output_edge == batch.size() && statuses[i] != ExitSuccess)
+      output_edge = i;
+  }
+  if (output_edge == batch.size())
+    output_edge = 0;
+
+  // Spread the time and I/O the batch took over its edges.
+  ResourceUsage usage = result->usage;
+  int64_t n = (int64_t)batch.size();
+  usage.user_millis /= n;
+  usage.system_millis /= n;
+  usage.read_bytes /= n;
+  usage.write_bytes /= n;
+
+  CommandOutput output(std::move(result->output));
+  for (size_t i = 0; i < batch.size(); ++i) {
+    Result edge_result;
+    edge_result.edge = batch[i];
+    edge_result.status = statuses[i];
+    edge_result.usage = usage;
+    if (i == output_edge)
+      edge_result.output = std::move(output);
+    if (i == 0)
+      *result = std::move(edge_result);
+    else
+      batch_results_.push_back(std::move(edge_result));
+  }
 }
 
+/// Makes the directories an edge's outputs go in and writes its response
+/// file before its command starts.  If the disk allows, this is done on a
+/// thread of its own for edges queued ahead of time, so that a slow
+/// filesystem holds up only their commands, not the rest of the build.
+struct OutputPreparer {
+  explicit OutputPreparer(DiskInterface* disk)
+      : disk_(disk), threaded_(false) {}
+
+  bool threaded() const { return threaded_; }
+
+  /// Whether edges may be posted to the thread.  Settled when the build
+  /// starts, as the disk may only allow other threads from then on.
+  void set_threaded(bool threaded) { threaded_ = threaded; }
+
+  /// Start preparing |edge| on the thread.
+  void Post(Edge* edge) {
+    if (!pool_)
+      pool_.reset(new ThreadPool(1));
+    std::shared_ptr<Work> work = MakeWork(edge);
+    std::shared_ptr<std::packaged_task<bool()> > task =
+        std::make_shared<std::packaged_task<bool()> >(
+            [this, work]() { return Prepare(*work); });
+    posted_[edge] = task->get_future();
+    pool_->Post([task]() { (*task)(); });
+  }
+
+  /// Finish preparing |edge|: wait for it if it was posted, else do it now.
+  /// Returns false if a directory or the response file could not be made.
+  bool Finish(Edge* edge) {
+    std::map<Edge*, std::future<bool> >::iterator i = posted_.find(edge);
+    if (i == posted_.end())
+      return Prepare(*MakeWork(edge));
+    bool ok = i->second.get();
+    posted_.erase(i);
+    return ok;
+  }
+
+  /// Wait for everything posted, and remove the response files of the
+  /// edges that will not be started after all.
+  void Drop() {
+    for (std::map<Edge*, std::future<bool> >::iterator i = posted_.begin();
+         i != posted_.end(); ++i) {
+      i->second.wait();
+      string rspfile = i->first->GetUnescapedRspfile();
+      if (!rspfile.empty() && !g_keep_rsp)
+        disk_->RemoveFile(rspfile);
+    }
+    posted_.clear();
+  }
+
+  /// Forget the directories known to exist at or below |edge|'s outputs,
+  /// which its command may have removed or replaced.
+  void OutputsChanged(Edge* edge) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      // |dirs_| holds the parents of all its directories, so there are none
+      // below an output unless the output is there too.
+      const string& path = (*o)->path();
+      if (!dirs_.erase(path))
+        continue;
+      string prefix = path + '/';
+      for (std::unordered_set<string>::iterator d = dirs_.begin();
+           d != dirs_.end();) {
+        if (d->compare(0, prefix.size(), prefix) == 0)
+          d = dirs_.erase(d);
+        else
+          ++d;
+      }
+    }
+  }
+
+ private:
+  /// What to do on disk, worked out on the main thread as it evaluates
+  /// the edge's bindings.
+  struct Work {
+    vector<string> outputs;
+    string rspfile;
+    string rspfile_content;
+  };
+
+  std::shared_ptr<Work> MakeWork(Edge* edge) {
+    std::shared_ptr<Work> work = std::make_shared<Work>();
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o)
+      work->outputs.push_back((*o)->path());
+    work->rspfile = edge->GetUnescapedRspfile();
+    if (!work->rspfile.empty())
+      work->rspfile_content = edge->GetBinding("rspfile_content");
+    return work;
+  }
+
+  bool Prepare(const Work& work) {
+    for (vector<string>::const_iterator o = work.outputs.begin();
+         o != work.outputs.end(); ++o) {
+      if (!MakeDirs(*o))
+        return false;
+    }
+    return work.rspfile.empty() ||
+           disk_->WriteFile(work.rspfile, work.rspfile_content);
+  }
+
+  /// Make the directories |path| goes in, unless known to exist already.
+  bool MakeDirs(const string& path) {
+    string dir = DirName(path);
+    if (dir.empty())
+      return true;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (dirs_.count(dir))
+        return true;
+    }
+    if (!disk_->MakeDirs(path))
+      return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (string d = dir; !d.empty() && dirs_.insert(d).second;
+         d = DirName(d)) {
+    }
+    return true;
+  }
+
+  DiskInterface* disk_;
+  bool threaded_;
+  std::unique_ptr<ThreadPool> pool_;
+  std::map<Edge*, std::future<bool> > posted_;
+  /// Guards |dirs_|, the directories known to exist.
+  std::mutex mutex_;
+  std::unordered_set<string> dirs_;
+};
+
+/// A finished command on its way through Builder::FinishCommand().  What
+/// that needs from the disk is read by Completer::Read(), which may run on
+/// another thread, and so only sees what is copied here.
+struct Completion {
+  Completion() : end_time_millis(0), stat_outputs(false), deps_ok(true),
+                 stat_ok(true) {}
+
+  CommandRunner::Result result;
+  int64_t end_time_millis;
+
+  // Worked out from the edge on the main thread.
+  string deps_type;
+  string deps_prefix;
+  string depfile;
+  /// Whether to stat() |outputs| once the command has succeeded.
+  bool stat_outputs;
+  vector<string> outputs;
+
+  // Read from the disk.
+  bool deps_ok;
+  string deps_err;
+  /// The canonical paths of the dependencies found, with their slash bits.
+  vector<pair<string, uint64_t> > deps;
+  bool stat_ok;
+  string stat_err;
+  vector<TimeStamp> mtimes;
+
+  bool reads_disk() const { return !deps_type.empty() || stat_outputs; }
+};
+
+/// Reads and parses depfiles and restats outputs of finished commands.  If
+/// the disk allows, this is done on a pool of threads, so that the main
+/// loop can go on starting commands meanwhile; the completions come back
+/// to it in the order they are read.
+struct Completer {
+  Completer(DiskInterface* disk, const DepfileParserOptions* options)
+      : disk_(disk), options_(options), threaded_(false), posted_(0) {}
+
+  ~Completer() { Drop(); }
+
+  bool threaded() const { return threaded_; }
+
+  /// Whether completions may be posted to the pool.  Settled when the
+  /// build starts, like OutputPreparer::set_threaded().
+  void set_threaded(bool threaded) { threaded_ = threaded; }
+
+  /// Number of completions posted and not yet taken back.
+  int posted() const { return posted_; }
+
+  /// Read |completion| on the pool.
+  void Post(unique_ptr<Completion> completion) {
+    // Two threads keep up with one large depfile while others come in.
+    static const int kThreads = 2;
+    if (!pool_)
+      pool_.reset(new ThreadPool(kThreads));
+    Completion* c = completion.release();
+    ++posted_;
+    pool_->Post([this, c]() {
+      Read(c);
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_.push_back(c);
+      read_.notify_one();
+    });
+  }
+
+  /// Take back a completion that has been read, waiting for one if |wait|.
+  /// Returns NULL if there is none.
+  unique_ptr<Completion> Take(bool wait) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (wait) {
+      assert(posted_ > 0);
+      read_.wait(lock, [this]() { return !done_.empty(); });
+    }
+    if (done_.empty())
+      return unique_ptr<Completion>();
+    unique_ptr<Completion> c(done_.front());
+    done_.pop_front();
+    --posted_;
+    return c;
+  }
+
+  /// Wait for everything posted, and forget it.
+  void Drop() {
+    if (pool_)
+      pool_->Wait();
+    for (deque<Completion*>::iterator i = done_.begin(); i != done_.end();
+         ++i)
+      delete *i;
+    done_.clear();
+    posted_ = 0;
+  }
+
+  /// Read the dependencies of |c|'s command and the mtimes of its outputs.
+  void Read(Completion* c) {
+    METRIC_RECORD("read completion");
+    // This must happen first as it filters the command output (we want
+    // to filter /showIncludes output, even on compile failure) and
+    // extraction itself can fail, which makes the command fail from a
+    // build perspective.
+    if (!c->deps_type.empty())
+      c->deps_ok = ReadDeps(c, &c->deps_err);
+    if (!c->stat_outputs || !c->result.success() || !c->deps_ok)
+      return;
+    // Stat() rather than StatBatch(), which is not meant for use from
+    // other threads; edges rarely have enough outputs to batch anyway.
+    c->mtimes.resize(c->outputs.size());
+    for (size_t i = 0; i < c->outputs.size(); ++i) {
+      c->mtimes[i] = disk_->Stat(c->outputs[i], &c->stat_err);
+      if (c->mtimes[i] == -1) {
+        c->stat_ok = false;
+        return;
+      }
+    }
+  }
+
+ private:
+  bool ReadDeps(Completion* c, string* err) {
+    if (c->deps_type == "msvc") {
+      CLParser parser;
+      string output;
+      if (!parser.Parse(c->result.output.ToString(), c->deps_prefix, &output,
+                        err))
+        return false;
+      c->result.output.Assign(output);
+      for (set<string>::iterator i = parser.includes_.begin();
+           i != parser.includes_.end(); ++i) {
+        // ~0 is assuming that with MSVC-parsed headers, it's ok to always
+        // make all backslashes (as some of the slashes will certainly be
+        // backslashes anyway). This could be fixed if necessary with some
+        // additional complexity in IncludesNormalize::Relativize.
+        c->deps.push_back(make_pair(*i, (uint64_t)~0u));
+      }
+    } else if (c->deps_type == "gcc") {
+      if (c->depfile.empty()) {
+        *err = string("edge with deps=gcc but no depfile makes no sense");
+        return false;
+      }
+
+      // Read depfile content.  Treat a missing depfile as empty.
+      string content;
+      switch (disk_->ReadFile(c->depfile, &content, err)) {
+      case DiskInterface::Okay:
+        break;
+      case DiskInterface::NotFound:
+        err->clear();
+        break;
+      case DiskInterface::OtherError:
+        return false;
+      }
+      if (content.empty())
+        return true;
+
+      DepfileParser deps(*options_);
+      if (!deps.Parse(&content, err))
+        return false;
+
+      // XXX check depfile matches expected output.
+      c->deps.reserve(deps.ins_.size());
+      for (vector<StringPiece>::iterator i = deps.ins_.begin();
+           i != deps.ins_.end(); ++i) {
+        uint64_t slash_bits;
+        CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits);
+        c->deps.push_back(make_pair(i->AsString(), slash_bits));
+      }
+
+      if (!g_keep_depfile) {
+        if (disk_->RemoveFile(c->depfile) < 0) {
+          *err = string("deleting depfile: ") + strerror(errno) + string("\n");
+          return false;
+        }
+      }
+    } else {
+      Fatal("unknown deps type '%s'", c->deps_type.c_str());
+    }
+    return true;
+  }
+
+  DiskInterface* disk_;
+  const DepfileParserOptions* options_;
+  bool threaded_;
+  std::unique_ptr<ThreadPool> pool_;
+  /// Posted and not taken back; only used on the main thread.
+  int posted_;
+  /// Guards |done_|, the completions read and not yet taken back.
+  std::mutex mutex_;
+  std::condition_variable read_;
+  deque<Completion*> done_;
+};
+
 Builder::Builder(State* state, const BuildConfig& config,
                  BuildLog* build_log, DepsLog* deps_log,
                  DiskInterface* disk_interface, Status *status,
                  int64_t start_time_millis)
     : state_(state), config_(config), plan_(this), status_(status),
-      start_time_millis_(start_time_millis), disk_interface_(disk_interface),
+      start_time_millis_(start_time_millis), pending_commands_(0),
+      started_while_scanning_(false), last_poll_millis_(0),
+      preparer_(new OutputPreparer(disk_interface)),
+      completer_(new Completer(disk_interface,
+                               &config_.depfile_parser_options)),
+      disk_interface_(disk_interface), failure_log_(NULL),
       scan_(state, build_log, deps_log, disk_interface,
             &config_.depfile_parser_options) {
+  scan_.set_scan_threads(config_.scan_threads);
   lock_file_path_ = ".ninja_lock";
   string build_dir = state_->bindings_->LookupVariable("builddir");
   if (!build_dir.empty())
@@ -533,6 +1382,11 @@ void Builder::Cleanup() {
   if (command_runner_.get()) {
     vector<Edge*> active_edges = command_runner_->GetActiveEdges();
     command_runner_->Abort();
+    pending_commands_ = 0;
+    early_results_ = std::queue<EarlyResult>();
+    preparer_->Drop();
+    prepared_ = std::queue<Edge*>();
+    completer_->Drop();
 
     for (vector<Edge*>::iterator e = active_edges.begin();
          e != active_edges.end(); ++e) {
@@ -576,7 +1430,14 @@ Node* Builder::AddTarget(const string& name, string* err) {
 
 bool Builder::AddTarget(Node* target, string* err) {
   std::vector<Node*> validation_nodes;
-  if (!scan_.RecomputeDirty(target, &validation_nodes, err))
+  if (config_.pipelined_scan) {
+    scan_.set_observer(this);
+    plan_.set_scanning(true);
+  }
+  bool scanned = scan_.RecomputeDirty(target, &validation_nodes, err);
+  scan_.set_observer(NULL);
+  plan_.set_scanning(false);
+  if (!scanned)
     return false;
 
   Edge* in_edge = target->in_edge();
@@ -601,27 +1462,101 @@ bool Builder::AddTarget(Node* target, string* err) {
   return true;
 }
 
+bool Builder::EdgeScanned(Edge* edge, string* err) {
+  // Plan the edge just as planning the target would, now that the edges it
+  // depends on are planned.
+  if (edge->outputs_ready())
+    return true;
+  if (!plan_.AddTarget(edge->outputs_[0], err) && !err->empty())
+    return false;
+  status_->PlanHasTotalEdges(plan_.command_edge_count());
+  return StartEdgesWhileScanning(err);
+}
+
+bool Builder::StartEdgesWhileScanning(string* err) {
+  CreateCommandRunner();
+
+  // Make room for more commands by collecting those that have finished,
+  // but only every so often, as each look takes a system call.
+  const int64_t kPollIntervalMillis = 10;
+  int64_t now = GetTimeMillis();
+  if (pending_commands_ && now - last_poll_millis_ >= kPollIntervalMillis) {
+    last_poll_millis_ = now;
+    EarlyResult early;
+    while (command_runner_->PollCommand(&early.result)) {
+      --pending_commands_;
+      early.end_time_millis = now - start_time_millis_;
+      early_results_.push(std::move(early));
+      early.result = CommandRunner::Result();
+    }
+  }
+
+  while (command_runner_->CanRunMore()) {
+    Edge* edge = plan_.FindWork();
+    if (!edge)
+      break;
+    if (!started_while_scanning_) {
+      status_->BuildStarted();
+      started_while_scanning_ = true;
+    }
+    if (edge->GetBindingBool("generator")) {
+      scan_.build_log()->Close();
+    }
+
+    if (!StartEdge(edge, err))
+      return false;
+
+    if (edge->is_phony()) {
+      EarlyResult early;
+      early.result.edge = edge;
+      early.result.status = ExitSuccess;
+      early.end_time_millis = 0;
+      early_results_.push(std::move(early));
+    } else {
+      ++pending_commands_;
+    }
+  }
+  return true;
+}
+
 bool Builder::AlreadyUpToDate() const {
   return !plan_.more_to_do();
 }
 
+void Builder::CreateCommandRunner() {
+  if (command_runner_.get())
+    return;
+  if (config_.dry_run)
+    command_runner_.reset(new DryRunCommandRunner);
+#ifndef _WIN32
+  else if (!config_.remote_workers.empty())
+    command_runner_.reset(new RemoteCommandRunner(config_));
+#endif
+  else
+    command_runner_.reset(new RealCommandRunner(config_, disk_interface_));
+}
+
 bool Builder::Build(string* err) {
   assert(!AlreadyUpToDate());
 
   status_->PlanHasTotalEdges(plan_.command_edge_count());
-  int pending_commands = 0;
   int failures_allowed = config_.failures_allowed;
 
   // Set up the command runner if we haven't done so already.
-  if (!command_runner_.get()) {
-    if (config_.dry_run)
-      command_runner_.reset(new DryRunCommandRunner);
-    else
-      command_runner_.reset(new RealCommandRunner(config_));
-  }
+  CreateCommandRunner();
+
+  // Only now is the disk as the build will use it: ninja turns its stat
+  // cache off after making the Builder.  Metrics are not thread-safe, and
+  // stat() records them.
+  bool threaded = disk_interface_->ThreadSafe() && !g_metrics;
+  preparer_->set_threaded(threaded);
+  completer_->set_threaded(threaded);
 
-  // We are about to start the build process.
-  status_->BuildStarted();
+  // We are about to start the build process, unless commands already
+  // started while the graph was being scanned.
+  if (!started_while_scanning_)
+    status_->BuildStarted();
+  started_while_scanning_ = false;
 
   // This main loop runs the entire build process.
   // It is structured like this:
@@ -629,9 +1564,11 @@ bool Builder::Build(string* err) {
   // command runner.
   // Second, we attempt to wait for / reap the next finished command.
   while (plan_.more_to_do()) {
-    // See if we can start any more commands.
-    if (failures_allowed && command_runner_->CanRunMore()) {
-      if (Edge* edge = plan_.FindWork()) {
+    // See if we can start any more commands.  Edges that finished while
+    // scanning are checked off first, in case any of them failed.
+    if (failures_allowed && early_results_.empty() &&
+        command_runner_->CanRunMore()) {
+      if (Edge* edge = NextEdge()) {
         if (edge->GetBindingBool("generator")) {
           scan_.build_log()->Close();
         }
@@ -649,7 +1586,7 @@ bool Builder::Build(string* err) {
             return false;
           }
         } else {
-          ++pending_commands;
+          ++pending_commands_;
         }
 
         // We made some progress; go back to the main loop.
@@ -658,7 +1595,65 @@ bool Builder::Build(string* err) {
     }
 
     // See if we can reap any finished commands.
-    if (pending_commands) {
+    if (!early_results_.empty()) {
+      EarlyResult early = std::move(early_results_.front());
+      early_results_.pop();
+      if (early.result.status == ExitInterrupted) {
+        Cleanup();
+        status_->BuildFinished();
+        *err = "interrupted by user";
+        return false;
+      }
+      bool finished = early.result.edge->is_phony() ?
+          plan_.EdgeFinished(early.result.edge, Plan::kEdgeSucceeded, err) :
+          FinishCommand(&early.result, early.end_time_millis, err);
+      if (!finished) {
+        Cleanup();
+        status_->BuildFinished();
+        return false;
+      }
+      if (!early.result.success() && failures_allowed)
+        failures_allowed--;
+      continue;
+    }
+    // Check off the commands whose depfiles and outputs the completer has
+    // read.  Until one is ready, collect other commands that have finished.
+    if (completer_->posted()) {
+      unique_ptr<Completion> completion = completer_->Take(false);
+      CommandRunner::Result result;
+      if (!completion && pending_commands_ &&
+          command_runner_->PollCommand(&result)) {
+        if (result.status == ExitInterrupted) {
+          Cleanup();
+          status_->BuildFinished();
+          *err = "interrupted by user";
+          return false;
+        }
+        --pending_commands_;
+        if (!CommandFinished(&result, &failures_allowed, err)) {
+          Cleanup();
+          status_->BuildFinished();
+          return false;
+        }
+        continue;
+      }
+      if (!completion)
+        completion = completer_->Take(true);
+      // The command counted as a failure already if it failed to run.
+      bool succeeded = completion->result.success();
+      if (!FinishCompletion(completion.get(), err)) {
+        Cleanup();
+        status_->BuildFinished();
+        return false;
+      }
+      if (succeeded && !completion->result.success() && failures_allowed)
+        failures_allowed--;
+      continue;
+    }
+
+    if (pending_commands_) {
+      if (failures_allowed)
+        PrepareAhead();
       CommandRunner::Result result;
       if (!command_runner_->WaitForCommand(&result) ||
           result.status == ExitInterrupted) {
@@ -668,23 +1663,20 @@ bool Builder::Build(string* err) {
         return false;
       }
 
-      --pending_commands;
-      if (!FinishCommand(&result, err)) {
+      --pending_commands_;
+      if (!CommandFinished(&result, &failures_allowed, err)) {
         Cleanup();
         status_->BuildFinished();
         return false;
       }
 
-      if (!result.success()) {
-        if (failures_allowed)
-          failures_allowed--;
-      }
-
       // We made some progress; start the main loop over.
       continue;
     }
 
     // If we get here, we cannot make any more progress.
+    preparer_->Drop();
+    prepared_ = std::queue<Edge*>();
     status_->BuildFinished();
     if (failures_allowed == 0) {
       if (config_.failures_allowed > 1)
@@ -703,6 +1695,27 @@ bool Builder::Build(string* err) {
   return true;
 }
 
+Edge* Builder::NextEdge() {
+  if (prepared_.empty())
+    return plan_.FindWork();
+  Edge* edge = prepared_.front();
+  prepared_.pop();
+  return edge;
+}
+
+void Builder::PrepareAhead() {
+  if (!preparer_->threaded())
+    return;
+  while (prepared_.size() < kPrepareAhead) {
+    Edge* edge = plan_.FindWork();
+    if (!edge)
+      break;
+    if (!edge->is_phony())
+      preparer_->Post(edge);
+    prepared_.push(edge);
+  }
+}
+
 bool Builder::StartEdge(Edge* edge, string* err) {
   METRIC_RECORD("StartEdge");
   if (edge->is_phony())
@@ -713,34 +1726,21 @@ bool Builder::StartEdge(Edge* edge, string* err) {
 
   status_->BuildEdgeStarted(edge, start_time_millis);
 
-  TimeStamp build_start = -1;
+  // Create directories necessary for outputs and the response file, if
+  // they are not already there from PrepareAhead().
+  if (!preparer_->Finish(edge))
+    return false;
 
-  // Create directories necessary for outputs and remember the current
-  // filesystem mtime to record later
-  // XXX: this will block; do we care?
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
-       o != edge->outputs_.end(); ++o) {
-    if (!disk_interface_->MakeDirs((*o)->path()))
-      return false;
-    if (build_start == -1) {
-      disk_interface_->WriteFile(lock_file_path_, "");
-      build_start = disk_interface_->Stat(lock_file_path_, err);
-      if (build_start == -1)
-        build_start = 0;
-    }
+  // Remember the current filesystem mtime to record later.
+  TimeStamp build_start = -1;
+  if (!edge->outputs_.empty()) {
+    disk_interface_->WriteFile(lock_file_path_, "");
+    build_start = disk_interface_->Stat(lock_file_path_, err);
+    if (build_start == -1)
+      build_start = 0;
   }
-
   edge->command_start_time_ = build_start;
 
-  // Create response file, if needed
-  // XXX: this may also block; do we care?
-  string rspfile = edge->GetUnescapedRspfile();
-  if (!rspfile.empty()) {
-    string content = edge->GetBinding("rspfile_content");
-    if (!disk_interface_->WriteFile(rspfile, content))
-      return false;
-  }
-
   // start command computing and run it
   if (!command_runner_->StartCommand(edge)) {
     err->assign("command '" + edge->EvaluateCommand() + "' failed.");
@@ -751,44 +1751,104 @@ bool Builder::StartEdge(Edge* edge, string* err) {
 }
 
 bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
+  return FinishCommand(result, GetTimeMillis() - start_time_millis_, err);
+}
+
+bool Builder::FinishCommand(CommandRunner::Result* result,
+                            int64_t end_time_millis, string* err) {
   METRIC_RECORD("FinishCommand");
+  unique_ptr<Completion> completion =
+      StartCompletion(result, end_time_millis);
+  completer_->Read(completion.get());
+  bool finished = FinishCompletion(completion.get(), err);
+  *result = std::move(completion->result);
+  return finished;
+}
 
+bool Builder::CommandFinished(CommandRunner::Result* result,
+                              int* failures_allowed, string* err) {
+  unique_ptr<Completion> completion =
+      StartCompletion(result, GetTimeMillis() - start_time_millis_);
+  if (completer_->threaded() && completion->reads_disk()) {
+    // Start more commands while the completer reads this one's depfile
+    // and outputs.  It counts as failed already if it failed to run.
+    if (!completion->result.success() && *failures_allowed)
+      --*failures_allowed;
+    completer_->Post(std::move(completion));
+    return true;
+  }
+  completer_->Read(completion.get());
+  if (!FinishCompletion(completion.get(), err))
+    return false;
+  if (!completion->result.success() && *failures_allowed)
+    --*failures_allowed;
+  return true;
+}
+
+unique_ptr<Completion> Builder::StartCompletion(CommandRunner::Result* result,
+                                                int64_t end_time_millis) {
+  unique_ptr<Completion> c(new Completion);
+  Edge* edge = result->edge;
+  c->result = std::move(*result);
+  c->end_time_millis = end_time_millis;
+  c->deps_type = edge->GetBinding("deps");
+  if (!c->deps_type.empty()) {
+    c->deps_prefix = edge->GetBinding("msvc_deps_prefix");
+    c->depfile = edge->GetUnescapedDepfile();
+  }
+  // restat and generator rules must restat the outputs after the build
+  // has finished. if command_start_time_ == 0, then there was an error
+  // while attempting to touch/stat the temp file when the edge started and
+  // we should fall back to recording the outputs' current mtime in the
+  // log.  The deps log records the outputs' mtimes too.
+  if (!config_.dry_run &&
+      (edge->command_start_time_ == 0 || edge->GetBindingBool("restat") ||
+       edge->GetBindingBool("generator") || !c->deps_type.empty())) {
+    c->stat_outputs = true;
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o)
+      c->outputs.push_back((*o)->path());
+  }
+  return c;
+}
+
+bool Builder::FinishCompletion(Completion* c, string* err) {
+  CommandRunner::Result* result = &c->result;
   Edge* edge = result->edge;
 
-  // First try to extract dependencies from the result, if any.
-  // This must happen first as it filters the command output (we want
-  // to filter /showIncludes output, even on compile failure) and
-  // extraction itself can fail, which makes the command fail from a
-  // build perspective.
-  vector<Node*> deps_nodes;
-  string deps_type = edge->GetBinding("deps");
-  const string deps_prefix = edge->GetBinding("msvc_deps_prefix");
-  if (!deps_type.empty()) {
-    string extract_err;
-    if (!ExtractDeps(result, deps_type, deps_prefix, &deps_nodes,
-                     &extract_err) &&
-        result->success()) {
-      if (!result->output.empty())
-        result->output.append("\n");
-      result->output.append(extract_err);
-      result->status = ExitFailure;
-    }
+  if (!c->deps_ok && result->success()) {
+    if (!result->output.empty())
+      result->output.Append("\n");
+    result->output.Append(c->deps_err);
+    result->status = ExitFailure;
   }
+  vector<Node*> deps_nodes;
+  deps_nodes.reserve(c->deps.size());
+  for (vector<pair<string, uint64_t> >::iterator d = c->deps.begin();
+       d != c->deps.end(); ++d)
+    deps_nodes.push_back(state_->GetNode(d->first, d->second));
 
-  int64_t start_time_millis, end_time_millis;
+  int64_t start_time_millis;
   RunningEdgeMap::iterator it = running_edges_.find(edge);
   start_time_millis = it->second;
-  end_time_millis = GetTimeMillis() - start_time_millis_;
   running_edges_.erase(it);
 
-  status_->BuildEdgeFinished(edge, end_time_millis, result->success(),
-                             result->output);
+  status_->BuildEdgeFinished(edge, c->end_time_millis, result->success(),
+                             result->output, result->usage);
+  if (failure_log_ && !config_.dry_run)
+    failure_log_->RecordResult(edge, result->success());
+  preparer_->OutputsChanged(edge);
 
   // The rest of this function only applies to successful commands.
   if (!result->success()) {
     return plan_.EdgeFinished(edge, Plan::kEdgeFailed, err);
   }
 
+  if (!c->stat_ok) {
+    *err = c->stat_err;
+    return false;
+  }
+
   // Restat the edge outputs
   TimeStamp record_mtime = 0;
   if (!config_.dry_run) {
@@ -797,17 +1857,10 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
     bool node_cleaned = false;
     record_mtime = edge->command_start_time_;
 
-    // restat and generator rules must restat the outputs after the build
-    // has finished. if record_mtime == 0, then there was an error while
-    // attempting to touch/stat the temp file when the edge started and
-    // we should fall back to recording the outputs' current mtime in the
-    // log.
     if (record_mtime == 0 || restat || generator) {
       for (vector<Node*>::iterator o = edge->outputs_.begin();
            o != edge->outputs_.end(); ++o) {
-        TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), err);
-        if (new_mtime == -1)
-          return false;
+        TimeStamp new_mtime = c->mtimes[o - edge->outputs_.begin()];
         if (new_mtime > record_mtime)
           record_mtime = new_mtime;
         if ((*o)->mtime() == new_mtime && restat) {
@@ -839,19 +1892,18 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
 
   if (scan_.build_log()) {
     if (!scan_.build_log()->RecordCommand(edge, start_time_millis,
-                                          end_time_millis, record_mtime)) {
+                                          c->end_time_millis, record_mtime,
+                                          result->usage)) {
       *err = string("Error writing to build log: ") + strerror(errno);
       return false;
     }
   }
 
-  if (!deps_type.empty() && !config_.dry_run) {
+  if (!c->deps_type.empty() && !config_.dry_run) {
     assert(!edge->outputs_.empty() && "should have been rejected by parser");
     for (std::vector<Node*>::const_iterator o = edge->outputs_.begin();
          o != edge->outputs_.end(); ++o) {
-      TimeStamp deps_mtime = disk_interface_->Stat((*o)->path(), err);
-      if (deps_mtime == -1)
-        return false;
+      TimeStamp deps_mtime = c->mtimes[o - edge->outputs_.begin()];
       if (!scan_.deps_log()->RecordDeps(*o, deps_mtime, deps_nodes)) {
         *err = std::string("Error writing to deps log: ") + strerror(errno);
         return false;
@@ -861,72 +1913,6 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
   return true;
 }
 
-bool Builder::ExtractDeps(CommandRunner::Result* result,
-                          const string& deps_type,
-                          const string& deps_prefix,
-                          vector<Node*>* deps_nodes,
-                          string* err) {
-  if (deps_type == "msvc") {
-    CLParser parser;
-    string output;
-    if (!parser.Parse(result->output, deps_prefix, &output, err))
-      return false;
-    result->output = output;
-    for (set<string>::iterator i = parser.includes_.begin();
-         i != parser.includes_.end(); ++i) {
-      // ~0 is assuming that with MSVC-parsed headers, it's ok to always make
-      // all backslashes (as some of the slashes will certainly be backslashes
-      // anyway). This could be fixed if necessary with some additional
-      // complexity in IncludesNormalize::Relativize.
-      deps_nodes->push_back(state_->GetNode(*i, ~0u));
-    }
-  } else if (deps_type == "gcc") {
-    string depfile = result->edge->GetUnescapedDepfile();
-    if (depfile.empty()) {
-      *err = string("edge with deps=gcc but no depfile makes no sense");
-      return false;
-    }
-
-    // Read depfile content.  Treat a missing depfile as empty.
-    string content;
-    switch (disk_interface_->ReadFile(depfile, &content, err)) {
-    case DiskInterface::Okay:
-      break;
-    case DiskInterface::NotFound:
-      err->clear();
-      break;
-    case DiskInterface::OtherError:
-      return false;
-    }
-    if (content.empty())
-      return true;
-
-    DepfileParser deps(config_.depfile_parser_options);
-    if (!deps.Parse(&content, err))
-      return false;
-
-    // XXX check depfile matches expected output.
-    deps_nodes->reserve(deps.ins_.size());
-    for (vector<StringPiece>::iterator i = deps.ins_.begin();
-         i != deps.ins_.end(); ++i) {
-      uint64_t slash_bits;
-      CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits);
-      deps_nodes->push_back(state_->GetNode(*i, slash_bits));
-    }
-
-    if (!g_keep_depfile) {
-      if (disk_interface_->RemoveFile(depfile) < 0) {
-        *err = string("deleting depfile: ") + strerror(errno) + string("\n");
-        return false;
-      }
-    }
-  } else {
-    Fatal("unknown deps type '%s'", deps_type.c_str());
-  }
-
-  return true;
-}
-
 bool Builder::LoadDyndeps(Node* node, string* err) {
   status_->BuildLoadDyndeps();
 
@@ -22,16 +22,25 @@
 #include <string>
 #include <vector>
 
+#include "adaptive_jobs.h"
+#include "command_output.h"
 #include "depfile_parser.h"
 #include "graph.h"  // XXX needed for DependencyScan; should rearrange.
 #include "exit_status.h"
+#include "jobserver.h"
+#include "pressure.h"
+#include "resource_usage.h"
 #include "util.h"  // int64_t
 
 struct BuildLog;
 struct Builder;
+struct Completer;
+struct Completion;
 struct DiskInterface;
 struct Edge;
+struct FailureLog;
 struct Node;
+struct OutputPreparer;
 struct State;
 struct Status;
 
@@ -45,7 +54,8 @@ struct Plan {
   /// fill in |err| with an error message if there's a problem.
   bool AddTarget(const Node* target, std::string* err);
 
-  // Pop a ready edge off the queue of edges to build.
+  // Pop a ready edge off the queue of edges to build, the edge with the
+  // longest critical path first.
   // Returns NULL if there's no work to do.
   Edge* FindWork();
 
@@ -76,13 +86,18 @@ struct Plan {
   /// Reset state.  Clears want and ready sets.
   void Reset();
 
+  /// While the graph is still being scanned, queue edges as soon as they
+  /// are ready rather than hold them back for their critical path weights,
+  /// which depend on dependents not seen yet.
+  void set_scanning(bool scanning) { scanning_ = scanning; }
+
   /// Update the build plan to account for modifications made to the graph
   /// by information loaded from a dyndep file.
   bool DyndepsLoaded(DependencyScan* scan, const Node* node,
                      const DyndepFile& ddf, std::string* err);
 private:
   bool RefreshDyndepDependents(DependencyScan* scan, const Node* node, std::string* err);
-  void UnmarkDependents(const Node* node, std::set<Node*>* dependents);
+  void UnmarkDependents(const Node* node, std::vector<Node*>* dependents);
   bool AddSubTarget(const Node* node, const Node* dependent, std::string* err,
                     std::set<Edge*>* dyndep_walk);
 
@@ -105,21 +120,95 @@ private:
     kWantToFinish
   };
 
-  void EdgeWanted(const Edge* edge);
-  bool EdgeMaybeReady(std::map<Edge*, Want>::iterator want_e, std::string* err);
+  void EdgeWanted(Edge* edge);
+
+  /// The urgency of |edge| when running failures first: edges which failed
+  /// last time come first, then those whose inputs changed most recently.
+  int64_t FailFastUrgency(const Edge* edge) const;
+
+  /// Whether |edge| is in the plan, i.e. has an entry in want_.
+  bool InPlan(const Edge* edge) const {
+    return edge->id_ < want_.size() &&
+           want_[edge->id_].generation == generation_ &&
+           want_[edge->id_].in_plan;
+  }
+
+  /// What we want for |edge|, which must be in the plan.
+  Want& WantOf(const Edge* edge) { return want_[edge->id_].want; }
+
+  /// Add |edge| to the plan wanting nothing, unless it is already there.
+  /// Returns whether it was added.
+  bool AddToPlan(Edge* edge);
+
+  void RemoveFromPlan(Edge* edge);
+
+  /// Set |edge|'s pending_inputs_ from scratch.
+  void CountPendingInputs(Edge* edge);
+
+  bool EdgeMaybeReady(Edge* edge, std::string* err);
+
+  /// Look up what |edge| took last time in the build log.
+  int64_t EdgeCost(const Edge* edge);
+
+  /// Set the critical path weight of the edges in reweigh_ and of every edge
+  /// they depend on, from the durations recorded in the build log.  Edges
+  /// already scheduled keep the weight they were queued with.
+  void ComputeCriticalPath();
+
+  /// Compute critical path weights if wanted edges have been added since
+  /// they were last computed, and schedule the edges held back meanwhile.
+  void PrepareQueue();
 
   /// Submits a ready edge as a candidate for execution.
   /// The edge may be delayed from running, for example if it's a member of a
   /// currently-full pool.
-  void ScheduleWork(std::map<Edge*, Want>::iterator want_e);
+  void ScheduleWork(Edge* edge);
+
+  /// An edge's entry in want_.  Entries from before the last Reset() have
+  /// an older generation and count as absent.
+  struct WantEntry {
+    WantEntry()
+        : generation(0), in_plan(false), want(kWantNothing), cost(0),
+          weight(0) {}
+    unsigned generation;
+    /// Whether the edge is still in the plan; false once it has finished.
+    bool in_plan;
+    Want want;
+    /// What the edge took last time: 0 if phony and -1 if unknown.
+    int64_t cost;
+    /// The edge's critical path weight as last computed, which unlike the
+    /// edge's own still changes once it is queued.
+    int64_t weight;
+  };
 
-  /// Keep track of which edges we want to build in this plan.  If this map does
-  /// not contain an entry for an edge, we do not want to build the entry or its
-  /// dependents.  If it does contain an entry, the enumeration indicates what
+  /// Keep track of which edges we want to build in this plan, indexed by
+  /// Edge::id_.  If an edge has no entry, we do not want to build the edge
+  /// or its dependents.  If it does have one, the enumeration indicates what
   /// we want for the edge.
-  std::map<Edge*, Want> want_;
+  std::vector<WantEntry> want_;
+
+  /// The edges given an entry in want_ this generation, in the order they
+  /// were added.  Those which have since left the plan are dropped lazily.
+  std::vector<Edge*> planned_;
+
+  /// Edges whose weight may have changed since ComputeCriticalPath() last
+  /// ran: those added to the plan and those given new dependents.
+  std::vector<Edge*> reweigh_;
+
+  /// Edges which ScheduleWork() held back for PrepareQueue().
+  std::vector<Edge*> held_;
 
-  EdgeSet ready_;
+  /// Bumped by Reset() to drop all entries of want_ at once.
+  unsigned generation_;
+
+  EdgePriorityQueue ready_;
+
+  /// Whether edges have been wanted since ComputeCriticalPath() last ran.
+  /// Until it runs again, edges which become ready are held back rather
+  /// than scheduled, as their weights cannot change once queued.
+  bool critical_path_stale_;
+
+  bool scanning_;
 
   Builder* builder_;
 
@@ -128,6 +217,11 @@ private:
 
   /// Total remaining number of wanted edges.
   int wanted_edges_;
+
+  /// The sum and number of the known costs of edges in the plan, whose
+  /// average stands in for unknown ones.
+  int64_t total_cost_;
+  int64_t known_costs_;
 };
 
 /// CommandRunner is an interface that wraps running the build
@@ -143,12 +237,17 @@ struct CommandRunner {
     Result() : edge(NULL) {}
     Edge* edge;
     ExitStatus status;
-    std::string output;
+    CommandOutput output;
+    ResourceUsage usage;
     bool success() const { return status == ExitSuccess; }
   };
   /// Wait for a command to complete, or return false if interrupted.
   virtual bool WaitForCommand(Result* result) = 0;
 
+  /// Like WaitForCommand(), but return false at once if no command has
+  /// finished yet.  An interruption is left for WaitForCommand() to report.
+  virtual bool PollCommand(Result* result) { return false; }
+
   virtual std::vector<Edge*> GetActiveEdges() { return std::vector<Edge*>(); }
   virtual void Abort() {}
 };
@@ -156,7 +255,10 @@ struct CommandRunner {
 /// Options (e.g. verbosity, parallelism) passed to a build.
 struct BuildConfig {
   BuildConfig() : verbosity(NORMAL), dry_run(false), parallelism(1),
-                  failures_allowed(1), max_load_average(-0.0f) {}
+                  failures_allowed(1), max_load_average(-0.0f),
+                  scan_threads(1), pipelined_scan(false),
+                  schedule(SCHEDULE_CRITICAL_PATH), direct_exec(false),
+                  remote_parallelism(0) {}
 
   enum Verbosity {
     QUIET,  // No output -- used when testing.
@@ -171,11 +273,38 @@ struct BuildConfig {
   /// The maximum load average we must not exceed. A negative value
   /// means that we do not have any limit.
   double max_load_average;
+  /// Cpu and memory pressure at which no new commands are started.
+  PressureLimits pressure_limits;
+  /// If enabled, the bounds within which the number of commands run in
+  /// parallel follows cpu use, starting from |parallelism|.
+  AdaptiveJobs adaptive_jobs;
+  /// A jobserver to take a token from for each command but the first.
+  JobserverConfig jobserver;
+  /// Threads used to check the graph for dirty files; see ParallelScan.
+  int scan_threads;
+  /// Whether to start commands while the graph is still being checked for
+  /// dirty files, as soon as everything they depend on has been.
+  bool pipelined_scan;
+  enum SchedulePolicy {
+    SCHEDULE_CRITICAL_PATH,  // The longest chain of commands first.
+    SCHEDULE_FAIL_FAST,  // Whatever is likely to fail first; see FailureLog.
+  };
+  /// Which ready edges to start first.
+  SchedulePolicy schedule;
+  /// Whether to run commands simple enough not to need /bin/sh without
+  /// it, as rules can also ask for with their direct_exec variable.
+  bool direct_exec;
+  /// "HOST:PORT" of the workers to run commands on instead of locally; see
+  /// RemoteCommandRunner.
+  std::vector<std::string> remote_workers;
+  /// How many commands to run on workers at once; 0 means |parallelism|
+  /// per worker.
+  int remote_parallelism;
   DepfileParserOptions depfile_parser_options;
 };
 
 /// Builder wraps the build process: starting commands, updating status.
-struct Builder {
+struct Builder : public ScanObserver {
   Builder(State* state, const BuildConfig& config,
           BuildLog* build_log, DepsLog* deps_log,
           DiskInterface* disk_interface, Status* status,
@@ -187,7 +316,8 @@ struct Builder {
 
   Node* AddTarget(const std::string& name, std::string* err);
 
-  /// Add a target to the build, scanning dependencies.
+  /// Add a target to the build, scanning dependencies.  With
+  /// BuildConfig::pipelined_scan, commands may start before this returns.
   /// @return false on error.
   bool AddTarget(Node* target, std::string* err);
 
@@ -203,6 +333,8 @@ struct Builder {
   /// Update status ninja logs following a command termination.
   /// @return false if the build can not proceed further due to a fatal error.
   bool FinishCommand(CommandRunner::Result* result, std::string* err);
+  bool FinishCommand(CommandRunner::Result* result, int64_t end_time_millis,
+                     std::string* err);
 
   /// Used for tests.
   void SetBuildLog(BuildLog* log) {
@@ -212,6 +344,12 @@ struct Builder {
   /// Load the dyndep information provided by the given node.
   bool LoadDyndeps(Node* node, std::string* err);
 
+  BuildLog* build_log() const { return scan_.build_log(); }
+
+  /// Record the outcome of each command in |log|.
+  void SetFailureLog(FailureLog* log) { failure_log_ = log; }
+  FailureLog* failure_log() const { return failure_log_; }
+
   State* state_;
   const BuildConfig& config_;
   Plan plan_;
@@ -219,9 +357,41 @@ struct Builder {
   Status* status_;
 
  private:
-  bool ExtractDeps(CommandRunner::Result* result, const std::string& deps_type,
-                   const std::string& deps_prefix,
-                   std::vector<Node*>* deps_nodes, std::string* err);
+  /// Set up the command runner, if there is none yet.
+  void CreateCommandRunner();
+
+  /// Add a scanned edge to the plan and start what is ready to run.  Used
+  /// as the ScanObserver with BuildConfig::pipelined_scan.
+  virtual bool EdgeScanned(Edge* edge, std::string* err);
+
+  /// Start as many ready edges as the command runner allows, and collect
+  /// the commands that have finished, while the graph is being scanned.
+  bool StartEdgesWhileScanning(std::string* err);
+
+  /// The next edge to start: one taken by PrepareAhead() if any, else the
+  /// plan's next.
+  Edge* NextEdge();
+
+  /// Before waiting for a command, take up to kPrepareAhead ready edges
+  /// from the plan so that their directories and response files are made
+  /// on the preparer's thread while the command runs.
+  void PrepareAhead();
+  static const size_t kPrepareAhead = 4;
+
+  /// Finish |result|'s command like FinishCommand(), or hand it to the
+  /// completer if that has to read from the disk first.  A failed command
+  /// is counted against |failures_allowed|.
+  bool CommandFinished(CommandRunner::Result* result, int* failures_allowed,
+                       std::string* err);
+
+  /// Work out from |result|'s edge what finishing it takes from the disk,
+  /// for Completer::Read().
+  std::unique_ptr<Completion> StartCompletion(CommandRunner::Result* result,
+                                              int64_t end_time_millis);
+
+  /// The rest of FinishCommand(), once |completion| has been read: check
+  /// the edge off in the plan and record it in the logs.
+  bool FinishCompletion(Completion* completion, std::string* err);
 
   /// Map of running edge to time the edge started running.
   typedef std::map<const Edge*, int> RunningEdgeMap;
@@ -230,8 +400,33 @@ struct Builder {
   /// Time the build started.
   int64_t start_time_millis_;
 
+  /// Number of commands started and not yet finished.
+  int pending_commands_;
+
+  /// Whether commands have started before Build() was called.
+  bool started_while_scanning_;
+
+  /// An edge that finished while the graph was still being scanned.  It is
+  /// only checked off once Build() runs, so that nothing the edge finishing
+  /// entails (such as loading a dyndep file) can disturb the scan.
+  struct EarlyResult {
+    CommandRunner::Result result;
+    int64_t end_time_millis;
+  };
+  std::queue<EarlyResult> early_results_;
+
+  /// Time StartEdgesWhileScanning() last looked for finished commands.
+  int64_t last_poll_millis_;
+
   std::string lock_file_path_;
+
+  /// Edges taken from the plan by PrepareAhead(), not yet started.
+  std::queue<Edge*> prepared_;
+  std::unique_ptr<OutputPreparer> preparer_;
+  std::unique_ptr<Completer> completer_;
+
   DiskInterface* disk_interface_;
+  FailureLog* failure_log_;
   DependencyScan scan_;
 
   // Unimplemented copy ctor and operator= ensure we don't copy the auto_ptr.
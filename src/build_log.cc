@@ -54,7 +54,7 @@ namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
 const int kOldestSupportedVersion = 6;
-const int kCurrentVersion = 6;
+const int kCurrentVersion = 7;
 
 // 64bit MurmurHash2, by Austin Appleby
 #if defined(_MSC_VER)
@@ -142,7 +142,7 @@ bool BuildLog::OpenForWrite(const string& path, const BuildLogUser& user,
 }
 
 bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp mtime) {
+                             TimeStamp mtime, const ResourceUsage& usage) {
   string command = edge->EvaluateCommand(true);
   uint64_t command_hash = LogEntry::HashCommand(command);
   for (vector<Node*>::iterator out = edge->outputs_.begin();
@@ -160,6 +160,7 @@ bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->mtime = mtime;
+    log_entry->usage = usage;
 
     if (!OpenForWriteIfNeeded()) {
       return false;
@@ -352,7 +353,17 @@ LoadStatus BuildLog::Load(const string& path, string* err) {
     entry->end_time = end_time;
     entry->mtime = mtime;
     char c = *end; *end = '\0';
-    entry->command_hash = (uint64_t)strtoull(start, NULL, 16);
+    entry->command_hash = (uint64_t)strtoull(start, &start, 16);
+    // Since v7 the hash is followed by the command's resource usage.
+    entry->usage = ResourceUsage();
+    if (log_version >= 7) {
+      ResourceUsage& usage = entry->usage;
+      usage.user_millis = strtoll(start, &start, 10);
+      usage.system_millis = strtoll(start, &start, 10);
+      usage.max_rss_kb = strtoll(start, &start, 10);
+      usage.read_bytes = strtoll(start, &start, 10);
+      usage.write_bytes = strtoll(start, &start, 10);
+    }
     *end = c;
   }
   fclose(file);
@@ -384,9 +395,13 @@ std::shared_ptr<BuildLog::LogEntry> BuildLog::LookupByOutput(const string& path)
 }
 
 bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  return fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
+  const ResourceUsage& usage = entry.usage;
+  return fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\t%" PRId64
+                 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\n",
           entry.start_time, entry.end_time, entry.mtime,
-          entry.output.c_str(), entry.command_hash) > 0;
+          entry.output.c_str(), entry.command_hash, usage.user_millis,
+          usage.system_millis, usage.max_rss_kb, usage.read_bytes,
+          usage.write_bytes) > 0;
 }
 
 bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
@@ -457,6 +472,11 @@ bool BuildLog::Restat(const StringPiece path,
     fclose(f);
     return false;
   }
+
+  // Stat all the selected outputs in one batch, which lets the disk
+  // interface overlap them instead of waiting on each in turn.
+  std::vector<LogEntry*> restat_entries;
+  std::vector<std::string> restat_paths;
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
     bool skip = output_count > 0;
     for (int j = 0; j < output_count; ++j) {
@@ -466,14 +486,19 @@ bool BuildLog::Restat(const StringPiece path,
       }
     }
     if (!skip) {
-      const TimeStamp mtime = disk_interface.Stat(i->second->output, err);
-      if (mtime == -1) {
-        fclose(f);
-        return false;
-      }
-      i->second->mtime = mtime;
+      restat_entries.push_back(i->second.get());
+      restat_paths.push_back(i->second->output);
     }
+  }
+  std::vector<TimeStamp> mtimes;
+  if (!disk_interface.StatBatch(restat_paths, &mtimes, err)) {
+    fclose(f);
+    return false;
+  }
+  for (size_t i = 0; i < restat_entries.size(); ++i)
+    restat_entries[i]->mtime = mtimes[i];
 
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
     if (!WriteEntry(f, *i->second)) {
       *err = strerror(errno);
       fclose(f);
@@ -21,6 +21,7 @@
 
 #include "hash_map.h"
 #include "load_status.h"
+#include "resource_usage.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
@@ -39,7 +40,8 @@ struct BuildLogUser {
 ///
 /// 1) (hashes of) command lines for existing output files, so we know
 ///    when we need to rebuild due to the command changing
-/// 2) timing information, perhaps for generating reports
+/// 2) timing and resource usage information, perhaps for generating
+///    reports
 /// 3) restat information
 struct BuildLog {
   BuildLog();
@@ -50,7 +52,8 @@ struct BuildLog {
   bool OpenForWrite(const std::string& path, const BuildLogUser& user,
                     std::string* err);
   bool RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp mtime = 0);
+                     TimeStamp mtime = 0,
+                     const ResourceUsage& usage = ResourceUsage());
   void Close();
 
   /// Load the on-disk log.
@@ -62,6 +65,8 @@ struct BuildLog {
     int start_time;
     int end_time;
     TimeStamp mtime;
+    /// What the command used; all 0 in entries from logs before v7.
+    ResourceUsage usage;
 
     static uint64_t HashCommand(StringPiece command);
 
@@ -69,7 +74,7 @@ struct BuildLog {
     bool operator==(const LogEntry& o) {
       return output == o.output && command_hash == o.command_hash &&
           start_time == o.start_time && end_time == o.end_time &&
-          mtime == o.mtime;
+          mtime == o.mtime && usage == o.usage;
     }
 
     explicit LogEntry(const std::string& output);
@@ -72,6 +72,66 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_EQ("out", e1->output);
 }
 
+TEST_F(BuildLogTest, ResourceUsage) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  ResourceUsage usage;
+  usage.user_millis = 1200;
+  usage.system_millis = 300;
+  usage.max_rss_kb = 65536;
+  usage.read_bytes = 5000000000LL;
+  usage.write_bytes = 4096;
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18, 0, usage);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  auto e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_TRUE(usage == e->usage);
+  EXPECT_EQ(5000000000LL, e->usage.read_bytes);
+  e = log2.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_TRUE(ResourceUsage() == e->usage);
+}
+
+TEST_F(BuildLogTest, LoadVersion6) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v6\n");
+  fprintf(f, "123\t456\t789\tout\t%" PRIx64 "\n",
+      BuildLog::LogEntry::HashCommand("command"));
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  auto e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_EQ(789, e->mtime);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
+  EXPECT_TRUE(ResourceUsage() == e->usage);
+
+  // The next write upgrades the log.
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+  ASSERT_EQ("", err);
+  log.Close();
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(0u, contents.find("# ninja log v7\n"));
+  EXPECT_NE(string::npos, contents.find("\t0\t0\t0\t0\t0\n"));
+}
+
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
   const char kExpectedVersion[] = "# ninja log vX\n";
   const size_t kVersionPos = strlen(kExpectedVersion) - 2;  // Points at 'X'.
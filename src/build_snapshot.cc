@@ -0,0 +1,430 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_snapshot.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "depfile_parser.h"
+#include "deps_log.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "state.h"
+#include "util.h"
+
+using namespace std;
+
+// The snapshot is a text file of tab-separated lines:
+//   # ninja snapshot v2
+//   generation <n>
+//   manifest <mtime>
+//   n <mtime> <path>               for each file
+//   d <output> <dep> <dep> ...     for each edge with a depfile
+//   end <n>
+// Backslashes, tabs and newlines in paths are escaped as \\, \t and \n.
+namespace {
+
+const char kFileSignature[] = "# ninja snapshot v2\n";
+const char kSignaturePrefix[] = "# ninja snapshot v";
+
+void SplitLine(const string& line, vector<string>* fields) {
+  fields->clear();
+  size_t start = 0;
+  for (;;) {
+    size_t tab = line.find('\t', start);
+    fields->push_back(line.substr(start, tab - start));
+    if (tab == string::npos)
+      break;
+    start = tab + 1;
+  }
+}
+
+/// Append a tab and |path| to |line|, escaped so that it stays one field.
+void AppendPath(const string& path, string* line) {
+  *line += '\t';
+  for (string::const_iterator c = path.begin(); c != path.end(); ++c) {
+    switch (*c) {
+    case '\\': *line += "\\\\"; break;
+    case '\t': *line += "\\t"; break;
+    case '\n': *line += "\\n"; break;
+    default: *line += *c; break;
+    }
+  }
+}
+
+/// Undo AppendPath()'s escaping of |field| in place.  Return false if it
+/// holds an unknown escape.
+bool UnescapePath(string* field) {
+  if (field->find('\\') == string::npos)
+    return true;
+  string path;
+  for (size_t i = 0; i < field->size(); ++i) {
+    char c = (*field)[i];
+    if (c == '\\') {
+      if (++i == field->size())
+        return false;
+      c = (*field)[i];
+      if (c == 't')
+        c = '\t';
+      else if (c == 'n')
+        c = '\n';
+      else if (c != '\\')
+        return false;
+    }
+    path += c;
+  }
+  field->swap(path);
+  return true;
+}
+
+string Header(int generation) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%sgeneration\t%d\n", kFileSignature, generation);
+  return buf;
+}
+
+/// Whether the discovered dependencies of |edge| come from its depfile
+/// alone, rather than from the deps log.
+bool UsesDepfileOnly(const Edge* edge) {
+  return !edge->GetBinding("depfile").empty() &&
+         edge->GetBinding("deps").empty();
+}
+
+/// Append the dependencies listed in the depfile of |edge| to |deps|, as
+/// by AppendPath().  Return false if the depfile cannot be used; the edge
+/// is then left out of the snapshot's records.
+bool ReadDepfileDeps(Edge* edge, DiskInterface* disk_interface,
+                     string* deps) {
+  string content, err;
+  if (disk_interface->ReadFile(edge->GetUnescapedDepfile(), &content, &err) !=
+      FileReader::Okay)
+    return false;
+  DepfileParser depfile;
+  if (!depfile.Parse(&content, &err))
+    return false;
+  for (vector<StringPiece>::iterator i = depfile.ins_.begin();
+       i != depfile.ins_.end(); ++i) {
+    uint64_t slash_bits;
+    CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits);
+    AppendPath(i->AsString(), deps);
+  }
+  return true;
+}
+
+}  // namespace
+
+LoadStatus BuildSnapshot::Load(const string& path, FileReader* file_reader,
+                               string* err) {
+  string contents;
+  switch (file_reader->ReadFile(path, &contents, err)) {
+  case FileReader::Okay:
+    break;
+  case FileReader::NotFound:
+    err->clear();
+    return LOAD_NOT_FOUND;
+  case FileReader::OtherError:
+    return LOAD_ERROR;
+  }
+
+  if (contents.compare(0, sizeof(kFileSignature) - 1, kFileSignature) != 0) {
+    // A snapshot of another version is not trusted, but is replaced after
+    // the next build like an incomplete one.
+    if (contents.compare(0, sizeof(kSignaturePrefix) - 1,
+                         kSignaturePrefix) == 0)
+      return LOAD_SUCCESS;
+    *err = "bad snapshot signature";
+    return LOAD_ERROR;
+  }
+
+  vector<string> fields;
+  size_t start = sizeof(kFileSignature) - 1;
+  size_t body_start = start;
+  while (start < contents.size()) {
+    size_t end = contents.find('\n', start);
+    if (end == string::npos)
+      break;  // A partly written line; the trailer is missing too.
+    string line = contents.substr(start, end - start);
+    SplitLine(line, &fields);
+    size_t line_start = start;
+    start = end + 1;
+
+    bool ok = true;
+    const string& kind = fields[0];
+    if (kind == "n" && fields.size() == 3) {
+      ok = UnescapePath(&fields[2]);
+      mtimes_[fields[2]] = strtoll(fields[1].c_str(), NULL, 10);
+    } else if (kind == "d" && fields.size() >= 2) {
+      for (vector<string>::iterator i = fields.begin() + 1;
+           i != fields.end(); ++i)
+        ok = ok && UnescapePath(&*i);
+      depfile_deps_[fields[1]].assign(fields.begin() + 2, fields.end());
+    } else if (kind == "generation" && fields.size() == 2) {
+      generation_ = atoi(fields[1].c_str());
+      body_start = start;
+    } else if (kind == "manifest" && fields.size() == 2) {
+      manifest_mtime_ = strtoll(fields[1].c_str(), NULL, 10);
+    } else if (kind == "end" && fields.size() == 2) {
+      complete_ = atoi(fields[1].c_str()) == generation_;
+      if (complete_)
+        body_ = contents.substr(body_start, line_start - body_start);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      *err = "bad snapshot line '" + line + "'";
+      return LOAD_ERROR;
+    }
+  }
+  return LOAD_SUCCESS;
+}
+
+bool BuildSnapshot::Invalidate(const string& path,
+                               DiskInterface* disk_interface,
+                               string* err) {
+  if (!disk_interface->WriteFile(path, Header(generation_))) {
+    *err = "failed to invalidate " + path;
+    return false;
+  }
+  complete_ = false;
+  body_.clear();
+  return true;
+}
+
+bool BuildSnapshot::Write(const string& path, State* state,
+                          TimeStamp manifest_mtime,
+                          DiskInterface* disk_interface, string* err) {
+  // Everything between the generation and the trailer.
+  string contents;
+  char buf[64];
+  snprintf(buf, sizeof(buf), "manifest\t%" PRId64 "\n", manifest_mtime);
+  contents += buf;
+
+  for (State::Paths::iterator i = state->paths_.begin();
+       i != state->paths_.end(); ++i) {
+    Node* node = i->second;
+    Edge* edge = node->in_edge();
+    // Only files whose edge the build has checked are known to be up to
+    // date.  Files of other edges are left out, so that those edges are
+    // checked next time.
+    if (!node->status_known() || (edge && edge->mark_ != Edge::VisitDone))
+      continue;
+    TimeStamp mtime = node->exists() ? node->mtime() : 0;
+    if (node->dirty() && edge && !edge->is_phony()) {
+      // The build has run this edge since the file was stat()ed.
+      mtime = disk_interface->Stat(node->path(), err);
+      if (mtime == -1)
+        return false;
+    }
+    snprintf(buf, sizeof(buf), "n\t%" PRId64, mtime);
+    contents += buf;
+    AppendPath(node->path(), &contents);
+    contents += '\n';
+  }
+
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    if (edge->mark_ != Edge::VisitDone || edge->outputs_.empty() ||
+        !UsesDepfileOnly(edge))
+      continue;
+    const string& output = edge->outputs_[0]->path();
+    if (edge->outputs_[0]->dirty()) {
+      // The build has run this edge, so its depfile is new.
+      string deps;
+      if (ReadDepfileDeps(edge, disk_interface, &deps)) {
+        contents += "d";
+        AppendPath(output, &contents);
+        contents += deps + "\n";
+      }
+      continue;
+    }
+    contents += "d";
+    AppendPath(output, &contents);
+    if (edge->deps_loaded_) {
+      // The depfile's dependencies are among the implicit inputs.
+      vector<Node*>::iterator end = edge->inputs_.end() - edge->order_only_deps_;
+      for (vector<Node*>::iterator i = end - edge->implicit_deps_; i != end;
+           ++i)
+        AppendPath((*i)->path(), &contents);
+    } else {
+      // Apply() marked the edge clean without loading its depfile.
+      vector<string>& deps = depfile_deps_[output];
+      for (vector<string>::iterator i = deps.begin(); i != deps.end(); ++i)
+        AppendPath(*i, &contents);
+    }
+    contents += '\n';
+  }
+
+  // A build that changed nothing, such as a no-op one, keeps the snapshot
+  // on disk as it is.
+  if (complete_ && contents == body_)
+    return true;
+
+  ++generation_;
+  snprintf(buf, sizeof(buf), "end\t%d\n", generation_);
+  if (!disk_interface->WriteFile(path, Header(generation_) + contents + buf)) {
+    *err = "failed to write " + path;
+    return false;
+  }
+  complete_ = true;
+  manifest_mtime_ = manifest_mtime;
+  body_.swap(contents);
+  return true;
+}
+
+bool BuildSnapshot::Apply(State* state, DepsLog* deps_log,
+                          const vector<string>& changed,
+                          TimeStamp manifest_mtime, string* err) {
+  if (!complete_) {
+    *err = "snapshot is incomplete";
+    return false;
+  }
+  if (manifest_mtime != manifest_mtime_) {
+    *err = "manifest changed since snapshot";
+    return false;
+  }
+
+  // Edges not yet loaded from depfiles are unknown to the graph.  Record
+  // them by dependency, creating the nodes the scan would create anyway.
+  unordered_map<Node*, vector<Edge*> > depfile_dependents;
+  for (unordered_map<string, vector<string> >::iterator d =
+           depfile_deps_.begin(); d != depfile_deps_.end(); ++d) {
+    Node* output = state->LookupNode(d->first);
+    if (!output || !output->in_edge())
+      continue;
+    for (vector<string>::iterator i = d->second.begin(); i != d->second.end();
+         ++i)
+      depfile_dependents[state->GetNode(*i, 0)].push_back(output->in_edge());
+  }
+
+  vector<Node*> changed_nodes;
+  for (vector<string>::const_iterator i = changed.begin(); i != changed.end();
+       ++i) {
+    string path = *i;
+    uint64_t slash_bits;
+    CanonicalizePath(&path, &slash_bits);
+    Node* node = state->LookupNode(path);
+    if (!node) {
+      // A file ninja does not know of could be anything, such as a
+      // manifest read with 'include'.  Play safe.
+      *err = "'" + path + "' is not in the build graph";
+      return false;
+    }
+    changed_nodes.push_back(node);
+  }
+
+  // The reverse of the deps log, by node id.
+  vector<vector<Node*> > deps_dependents;
+  if (deps_log) {
+    deps_dependents.resize(deps_log->nodes().size());
+    for (size_t i = 0; i < deps_log->deps().size(); ++i) {
+      DepsLog::Deps* deps = deps_log->deps()[i];
+      if (!deps)
+        continue;
+      for (int j = 0; j < deps->node_count; ++j) {
+        int id = deps->nodes[j]->id();
+        if (id >= 0 && (size_t)id < deps_dependents.size())
+          deps_dependents[id].push_back(deps_log->nodes()[i]);
+      }
+    }
+  }
+
+  // Find every edge downstream of a changed file.
+  vector<bool> affected(state->edges_.size(), false);
+  vector<Node*> queue;
+  auto affect = [&](Edge* edge) {
+    if (affected[edge->id_])
+      return;
+    affected[edge->id_] = true;
+    queue.insert(queue.end(), edge->outputs_.begin(), edge->outputs_.end());
+  };
+
+  for (vector<Node*>::iterator n = changed_nodes.begin();
+       n != changed_nodes.end(); ++n) {
+    // A changed output must be rebuilt, too.
+    if ((*n)->in_edge())
+      affect((*n)->in_edge());
+    queue.push_back(*n);
+  }
+
+  // Edges whose state the snapshot cannot vouch for are checked in full.
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    bool unknown =
+        (edge->is_phony() && edge->inputs_.empty()) || edge->dyndep_ ||
+        !edge->validations_.empty();
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         !unknown && o != edge->outputs_.end(); ++o)
+      unknown = mtimes_.find((*o)->path()) == mtimes_.end();
+    if (!unknown && !edge->is_phony() && !edge->outputs_.empty()) {
+      if (UsesDepfileOnly(edge)) {
+        unknown = depfile_deps_.find(edge->outputs_[0]->path()) ==
+                  depfile_deps_.end();
+      } else if (!edge->GetBinding("deps").empty()) {
+        unknown = !deps_log || !deps_log->GetDeps(edge->outputs_[0]);
+      }
+    }
+    if (unknown)
+      affect(edge);
+  }
+
+  while (!queue.empty()) {
+    Node* node = queue.back();
+    queue.pop_back();
+    for (vector<Edge*>::const_iterator e = node->out_edges().begin();
+         e != node->out_edges().end(); ++e)
+      affect(*e);
+    if (node->id() >= 0 && (size_t)node->id() < deps_dependents.size()) {
+      vector<Node*>& dependents = deps_dependents[node->id()];
+      for (vector<Node*>::iterator i = dependents.begin();
+           i != dependents.end(); ++i) {
+        if ((*i)->in_edge())
+          affect((*i)->in_edge());
+      }
+    }
+    unordered_map<Node*, vector<Edge*> >::iterator d =
+        depfile_dependents.find(node);
+    if (d != depfile_dependents.end()) {
+      for (vector<Edge*>::iterator e = d->second.begin();
+           e != d->second.end(); ++e)
+        affect(*e);
+    }
+  }
+
+  // Everything else is as the snapshot has it.  Phony edges are cheap to
+  // check and their outputs' mtimes derive from their inputs, so they are
+  // always left to the scan.
+  for (State::Paths::iterator i = state->paths_.begin();
+       i != state->paths_.end(); ++i) {
+    unordered_map<string, TimeStamp>::iterator m =
+        mtimes_.find(i->second->path());
+    if (m != mtimes_.end())
+      i->second->MarkStatted(m->second);
+  }
+  for (vector<Node*>::iterator n = changed_nodes.begin();
+       n != changed_nodes.end(); ++n)
+    (*n)->ResetState();
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    if (affected[edge->id_] || edge->is_phony())
+      continue;
+    edge->mark_ = Edge::VisitDone;
+    edge->outputs_ready_ = true;
+  }
+  return true;
+}
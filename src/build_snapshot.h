@@ -0,0 +1,84 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BUILD_SNAPSHOT_H_
+#define NINJA_BUILD_SNAPSHOT_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "load_status.h"
+#include "timestamp.h"
+
+struct DepsLog;
+struct DiskInterface;
+struct FileReader;
+struct State;
+
+/// The state of the graph after a successful build: the mtime of every
+/// file the build checked, and the dependencies read from depfiles.
+///
+/// A later build that is told which files changed since (see Apply()) can
+/// trust the snapshot for everything else, and so check only the edges
+/// downstream of those files rather than stat() the whole graph.
+///
+/// Each snapshot has a generation, one more than the last.  It is written
+/// both first and last in the file; a snapshot without the trailing copy,
+/// as left by Invalidate() or by an interrupted write, is not trusted.
+struct BuildSnapshot {
+  BuildSnapshot() : generation_(0), complete_(false), manifest_mtime_(0) {}
+
+  /// Load the snapshot at |path|.
+  LoadStatus Load(const std::string& path, FileReader* file_reader,
+                  std::string* err);
+
+  /// Replace the snapshot at |path| with one holding only its generation,
+  /// which is not trusted.  Done before a build starts changing files.
+  bool Invalidate(const std::string& path, DiskInterface* disk_interface,
+                  std::string* err);
+
+  /// Write the next generation of the snapshot to |path| after |state| has
+  /// been built successfully.  |manifest_mtime| is the mtime of the
+  /// manifest |state| was loaded from.  A complete snapshot that would be
+  /// written unchanged is left alone.
+  bool Write(const std::string& path, State* state, TimeStamp manifest_mtime,
+             DiskInterface* disk_interface, std::string* err);
+
+  /// Prepare |state|, before it is scanned, for a build in which only the
+  /// files in |changed| differ from the snapshot.  Edges not downstream of
+  /// those files, through the manifest, the deps log or the depfiles in the
+  /// snapshot, are marked clean and their files as stat()ed.
+  /// Return false, with the reason in |err|, if the snapshot cannot be
+  /// trusted for this build; |state| is then left to be scanned as usual.
+  bool Apply(State* state, DepsLog* deps_log,
+             const std::vector<std::string>& changed,
+             TimeStamp manifest_mtime, std::string* err);
+
+  int generation() const { return generation_; }
+  bool complete() const { return complete_; }
+
+ private:
+  int generation_;
+  bool complete_;
+  TimeStamp manifest_mtime_;
+  std::unordered_map<std::string, TimeStamp> mtimes_;
+  /// Dependencies read from depfiles, by the first output of their edge.
+  std::unordered_map<std::string, std::vector<std::string> > depfile_deps_;
+  /// The lines between the generation and the trailer of a complete
+  /// snapshot, as last loaded or written.
+  std::string body_;
+};
+
+#endif  // NINJA_BUILD_SNAPSHOT_H_
@@ -0,0 +1,257 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_snapshot.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+const char kSnapshotPath[] = ".ninja_snapshot";
+const char kManifest[] =
+"build a: cat a.in\n"
+"build b: cat b.in\n"
+"build c: cat a b\n";
+
+struct BuildSnapshotTest : public StateTestWithBuiltinRules {
+  /// Scan |state| for target c and write a snapshot as after a build.
+  void ScanAndWrite(State* state) {
+    DependencyScan scan(state, NULL, NULL, &fs_, NULL);
+    string err;
+    EXPECT_TRUE(scan.RecomputeDirty(state->LookupNode("c"), NULL, &err));
+    ASSERT_EQ("", err);
+    BuildSnapshot snapshot;
+    EXPECT_NE(LOAD_ERROR, snapshot.Load(kSnapshotPath, &fs_, &err));
+    EXPECT_TRUE(snapshot.Write(kSnapshotPath, state, 1, &fs_, &err));
+    ASSERT_EQ("", err);
+  }
+
+  VirtualFileSystem fs_;
+};
+
+TEST_F(BuildSnapshotTest, WriteLoadInvalidate) {
+  fs_.Create("a.in", "");
+  fs_.Create("b.in", "");
+  fs_.Create("a", "");
+  fs_.Create("b", "");
+  fs_.Create("c", "");
+  AssertParse(&state_, kManifest);
+  ScanAndWrite(&state_);
+
+  string err;
+  BuildSnapshot snapshot;
+  EXPECT_EQ(LOAD_SUCCESS, snapshot.Load(kSnapshotPath, &fs_, &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(snapshot.complete());
+  EXPECT_EQ(1, snapshot.generation());
+
+  EXPECT_TRUE(snapshot.Invalidate(kSnapshotPath, &fs_, &err));
+  BuildSnapshot invalid;
+  EXPECT_EQ(LOAD_SUCCESS, invalid.Load(kSnapshotPath, &fs_, &err));
+  EXPECT_FALSE(invalid.complete());
+  EXPECT_EQ(1, invalid.generation());
+  vector<string> changed;
+  EXPECT_FALSE(invalid.Apply(&state_, NULL, changed, 1, &err));
+  EXPECT_EQ("snapshot is incomplete", err);
+
+  // The next snapshot continues the count.
+  ScanAndWrite(&state_);
+  BuildSnapshot next;
+  EXPECT_EQ(LOAD_SUCCESS, next.Load(kSnapshotPath, &fs_, &err));
+  EXPECT_TRUE(next.complete());
+  EXPECT_EQ(2, next.generation());
+}
+
+TEST_F(BuildSnapshotTest, UnchangedSnapshotIsNotRewritten) {
+  fs_.Create("a.in", "");
+  fs_.Create("b.in", "");
+  fs_.Create("a", "");
+  fs_.Create("b", "");
+  fs_.Create("c", "");
+  AssertParse(&state_, kManifest);
+  ScanAndWrite(&state_);
+
+  fs_.files_created_.clear();
+  State state;
+  AddCatRule(&state);
+  AssertParse(&state, kManifest);
+  ScanAndWrite(&state);
+  EXPECT_EQ(0u, fs_.files_created_.count(kSnapshotPath));
+
+  // A file that changed without dirtying anything still makes a new one.
+  fs_.Tick();
+  fs_.Create("a", "");
+  fs_.files_created_.clear();
+  State changed;
+  AddCatRule(&changed);
+  AssertParse(&changed, kManifest);
+  ScanAndWrite(&changed);
+  EXPECT_EQ(1u, fs_.files_created_.count(kSnapshotPath));
+
+  string err;
+  BuildSnapshot snapshot;
+  EXPECT_EQ(LOAD_SUCCESS, snapshot.Load(kSnapshotPath, &fs_, &err));
+  EXPECT_TRUE(snapshot.complete());
+  EXPECT_EQ(2, snapshot.generation());
+}
+
+TEST_F(BuildSnapshotTest, PathsAreEscaped) {
+  const char kOddManifest[] =
+"build a$ b: cat tab\tin back\\slash\n"
+"build c: cat a$ b\n";
+  string tab_path = "tab\tin", back_path = "back\\slash";
+  fs_.Create(tab_path, "");
+  fs_.Create(back_path, "");
+  fs_.Tick();
+  fs_.Create("a b", "");
+  fs_.Create("c", "");
+  AssertParse(&state_, kOddManifest);
+  ScanAndWrite(&state_);
+
+  fs_.Tick();
+  fs_.Create(tab_path, "");
+
+  State state;
+  AddCatRule(&state);
+  AssertParse(&state, kOddManifest);
+  string err;
+  BuildSnapshot snapshot;
+  EXPECT_EQ(LOAD_SUCCESS, snapshot.Load(kSnapshotPath, &fs_, &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(snapshot.complete());
+  vector<string> changed(1, tab_path);
+  EXPECT_TRUE(snapshot.Apply(&state, NULL, changed, 1, &err));
+  EXPECT_EQ("", err);
+
+  DependencyScan scan(&state, NULL, NULL, &fs_, NULL);
+  EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("c"), NULL, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(state.LookupNode("a b")->dirty());
+  EXPECT_EQ(1, state.LookupNode(back_path)->mtime());
+}
+
+TEST_F(BuildSnapshotTest, OtherVersionIsNotTrusted) {
+  fs_.Create(kSnapshotPath, "# ninja snapshot v1\ngeneration\t3\n"
+                            "manifest\t1\nend\t3\n");
+  string err;
+  BuildSnapshot snapshot;
+  EXPECT_EQ(LOAD_SUCCESS, snapshot.Load(kSnapshotPath, &fs_, &err));
+  EXPECT_EQ("", err);
+  EXPECT_FALSE(snapshot.complete());
+}
+
+TEST_F(BuildSnapshotTest, ApplyChecksOnlyDownstream) {
+  fs_.Create("a.in", "");
+  fs_.Create("b.in", "");
+  fs_.Tick();
+  fs_.Create("a", "");
+  fs_.Create("b", "");
+  fs_.Create("c", "");
+  AssertParse(&state_, kManifest);
+  ScanAndWrite(&state_);
+
+  // Both inputs change, but only b.in is reported: a.in is not stat()ed.
+  fs_.Tick();
+  fs_.Create("a.in", "");
+  fs_.Create("b.in", "");
+
+  State state;
+  AddCatRule(&state);
+  AssertParse(&state, kManifest);
+  string err;
+  BuildSnapshot snapshot;
+  EXPECT_EQ(LOAD_SUCCESS, snapshot.Load(kSnapshotPath, &fs_, &err));
+  vector<string> changed(1, "b.in");
+  EXPECT_TRUE(snapshot.Apply(&state, NULL, changed, 1, &err));
+  EXPECT_EQ("", err);
+
+  DependencyScan scan(&state, NULL, NULL, &fs_, NULL);
+  EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("c"), NULL, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(state.LookupNode("a")->dirty());
+  EXPECT_TRUE(state.LookupNode("b")->dirty());
+  EXPECT_TRUE(state.LookupNode("c")->dirty());
+  EXPECT_EQ(1, state.LookupNode("a.in")->mtime());
+  EXPECT_EQ(3, state.LookupNode("b.in")->mtime());
+}
+
+TEST_F(BuildSnapshotTest, ApplyRefusesUnknownFileOrManifestChange) {
+  fs_.Create("a.in", "");
+  fs_.Create("b.in", "");
+  AssertParse(&state_, kManifest);
+  ScanAndWrite(&state_);
+
+  string err;
+  BuildSnapshot snapshot;
+  EXPECT_EQ(LOAD_SUCCESS, snapshot.Load(kSnapshotPath, &fs_, &err));
+  vector<string> changed(1, "sub.ninja");
+  EXPECT_FALSE(snapshot.Apply(&state_, NULL, changed, 1, &err));
+  EXPECT_EQ("'sub.ninja' is not in the build graph", err);
+
+  changed.clear();
+  EXPECT_FALSE(snapshot.Apply(&state_, NULL, changed, 2, &err));
+  EXPECT_EQ("manifest changed since snapshot", err);
+}
+
+TEST_F(BuildSnapshotTest, DepfileDependencies) {
+  const char kDepfileManifest[] =
+"rule cc\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"build a.o: cc a.c\n"
+"build b.o: cc b.c\n"
+"build c: cat a.o b.o\n";
+  fs_.Create("a.c", "");
+  fs_.Create("b.c", "");
+  fs_.Create("a.h", "");
+  fs_.Tick();
+  fs_.Create("a.o", "");
+  fs_.Create("a.o.d", "a.o: a.c a.h\n");
+  fs_.Create("b.o", "");
+  fs_.Create("b.o.d", "b.o: b.c\n");
+  fs_.Create("c", "");
+  AssertParse(&state_, kDepfileManifest);
+  ScanAndWrite(&state_);
+
+  // The header is known only from the depfile, which is not read again.
+  fs_.Tick();
+  fs_.Create("a.h", "");
+  fs_.files_read_.clear();
+
+  State state;
+  AddCatRule(&state);
+  AssertParse(&state, kDepfileManifest);
+  string err;
+  BuildSnapshot snapshot;
+  EXPECT_EQ(LOAD_SUCCESS, snapshot.Load(kSnapshotPath, &fs_, &err));
+  vector<string> changed(1, "a.h");
+  EXPECT_TRUE(snapshot.Apply(&state, NULL, changed, 1, &err));
+  EXPECT_EQ("", err);
+
+  DependencyScan scan(&state, NULL, NULL, &fs_, NULL);
+  EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("c"), NULL, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(state.LookupNode("a.o")->dirty());
+  EXPECT_FALSE(state.LookupNode("b.o")->dirty());
+  EXPECT_TRUE(state.LookupNode("c")->dirty());
+  ASSERT_EQ(2u, fs_.files_read_.size());
+  EXPECT_EQ(kSnapshotPath, fs_.files_read_[0]);
+  EXPECT_EQ("a.o.d", fs_.files_read_[1]);
+}
+
+}  // namespace
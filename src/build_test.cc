@@ -16,8 +16,12 @@
 
 #include <assert.h>
 
+#include <atomic>
+#include <thread>
+
 #include "build_log.h"
 #include "deps_log.h"
+#include "failure_log.h"
 #include "graph.h"
 #include "status.h"
 #include "test.h"
@@ -200,6 +204,34 @@ TEST_F(PlanTest, DoubleDependent) {
   ASSERT_FALSE(edge);  // done
 }
 
+// Test that an edge naming one input twice, next to a source file, is
+// ready once the input's edge finishes.
+TEST_F(PlanTest, RepeatedInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat mid in mid\n"
+"build mid: cat in\n"));
+  GetNode("mid")->MarkDirty();
+  GetNode("out")->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  ASSERT_EQ("mid", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  ASSERT_EQ("out", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
 void PlanTest::TestPoolWithDepthOne(const char* test_case) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, test_case));
   GetNode("out1")->MarkDirty();
@@ -339,6 +371,71 @@ TEST_F(PlanTest, PoolsWithDepthTwo) {
   ASSERT_FALSE(plan_.FindWork());
 }
 
+TEST_F(PlanTest, PoolWithResources) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool res\n"
+"  depth = 2\n"
+"  mem = 10\n"
+"  cpu = 4\n"
+"rule link\n"
+"  command = cat $in > $out\n"
+"  pool = res\n"
+"  resources = mem=6\n"
+"rule cc\n"
+"  command = cat $in > $out\n"
+"  pool = res\n"
+"  resources = mem=3\n"
+"rule stamp\n"
+"  command = touch $out\n"
+"  pool = res\n"
+"  weight = 0\n"
+"  resources = cpu=1\n"
+"build l1: link in\n"
+"build c1: cc in\n"
+"build l2: link in\n"
+"build c2: cc in\n"
+"build x: stamp in\n"
+"build out: cat l1 c1 l2 c2 x\n"));
+  GetNode("l1")->MarkDirty();
+  GetNode("c1")->MarkDirty();
+  GetNode("l2")->MarkDirty();
+  GetNode("c2")->MarkDirty();
+  GetNode("x")->MarkDirty();
+  GetNode("out")->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  // l2 fits neither the depth nor the memory left, and holds c2 back with
+  // it; x only needs a cpu, so it is packed in after them.
+  deque<Edge*> edges;
+  FindWorkSorted(&edges, 3);
+  ASSERT_EQ("c1", edges[0]->outputs_[0]->path());
+  ASSERT_EQ("l1", edges[1]->outputs_[0]->path());
+  ASSERT_EQ("x", edges[2]->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+  Pool* pool = state_.LookupPool("res");
+  EXPECT_EQ(2, pool->current_use());
+  EXPECT_EQ(9, pool->resources()[0].current_use);
+
+  // c2 would fit in the memory c1 frees up, but l2 is waiting for it.
+  plan_.EdgeFinished(edges[0], Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  ASSERT_FALSE(plan_.FindWork());
+
+  plan_.EdgeFinished(edges[1], Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("l2", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("c2", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+  EXPECT_EQ(2, pool->current_use());
+  EXPECT_EQ(9, pool->resources()[0].current_use);
+}
+
 TEST_F(PlanTest, PoolWithRedundantEdges) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
     "pool compile\n"
@@ -467,6 +564,84 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   ASSERT_EQ(0, edge);
 }
 
+TEST_F(PlanTest, CriticalPathFirst) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a0: cat in\n"
+"build b0: cat in\n"
+"build b1: cat b0\n"
+"build b2: cat b1\n"
+"build out: cat a0 b2\n"));
+  GetNode("a0")->MarkDirty();
+  GetNode("b0")->MarkDirty();
+  GetNode("b1")->MarkDirty();
+  GetNode("b2")->MarkDirty();
+  GetNode("out")->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  // b0 heads the longer chain, so it goes first despite coming later.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b0", edge->outputs_[0]->path());
+  EXPECT_EQ(4, edge->critical_path_weight());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a0", edge->outputs_[0]->path());
+  EXPECT_EQ(2, edge->critical_path_weight());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
+TEST_F(PlanTest, PriorityFirst) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool one\n"
+"  depth = 1\n"
+"rule late\n"
+"  command = cat $in > $out\n"
+"  priority = -1\n"
+"build a0: cat in\n"
+"  priority = 1\n"
+"build b0: cat in\n"
+"build b1: cat b0\n"
+"build p1: late in\n"
+"  pool = one\n"
+"build p2: cat in\n"
+"  pool = one\n"
+"build p3: cat in\n"
+"  pool = one\n"
+"  priority = 2\n"
+"build out: cat a0 b1 p1 p2 p3\n"));
+  const char* outputs[] = { "a0", "b0", "b1", "p1", "p2", "p3", "out" };
+  for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); ++i)
+    GetNode(outputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(-1, GetNode("p1")->in_edge()->priority());
+
+  // The pool lets p3 go first for its priority; a0 beats the longer chain
+  // of b0 for its.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("p3", edge->outputs_[0]->path());
+  Edge* p3 = edge;
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("a0", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b0", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+
+  // p2 comes before p1, which the rule marks to go last.
+  plan_.EdgeFinished(p3, Plan::kEdgeSucceeded, &err);
+  ASSERT_EQ("", err);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("p2", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
 /// Fake implementation of CommandRunner, useful for tests.
 struct FakeCommandRunner : public CommandRunner {
   explicit FakeCommandRunner(VirtualFileSystem* fs) :
@@ -476,6 +651,7 @@ struct FakeCommandRunner : public CommandRunner {
   virtual bool CanRunMore() const;
   virtual bool StartCommand(Edge* edge);
   virtual bool WaitForCommand(Result* result);
+  virtual bool PollCommand(Result* result) { return WaitForCommand(result); }
   virtual vector<Edge*> GetActiveEdges();
   virtual void Abort();
 
@@ -700,7 +876,7 @@ bool FakeCommandRunner::WaitForCommand(Result* result) {
     const std::string prefix = edge->GetBinding("msvc_deps_prefix");
     for (std::vector<Node*>::iterator in = edge->inputs_.begin();
          in != edge->inputs_.end(); ++in) {
-      result->output += prefix + (*in)->path() + '\n';
+      result->output.Append(prefix + (*in)->path() + '\n');
     }
   }
 
@@ -913,6 +1089,78 @@ TEST_F(BuildTest, Chain) {
   ASSERT_EQ(2u, command_runner_.commands_ran_.size());  // 3->4, 4->5
 }
 
+TEST_F(BuildTest, PipelinedScan) {
+  config_.pipelined_scan = true;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build mid1: cat in1\n"
+"build mid2: cat in2\n"
+"build out: cat mid1 mid2\n"));
+
+  // Both inputs of out are built while out is being scanned, the second
+  // once the first has finished.
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat in1 > mid1", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("cat in2 > mid2", command_runner_.commands_ran_[1]);
+
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat mid1 mid2 > out", command_runner_.commands_ran_[2]);
+  EXPECT_TRUE(GetNode("out")->in_edge()->outputs_ready());
+}
+
+TEST_F(BuildTest, PipelinedScanFailure) {
+  config_.pipelined_scan = true;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule fail\n"
+"  command = fail\n"
+"build mid1: fail in1\n"
+"build mid2: cat in2\n"
+"build out: cat mid1 mid2\n"));
+
+  // The failure is only noticed once the build runs.
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  EXPECT_EQ(2u, command_runner_.commands_ran_.size());
+}
+
+TEST_F(BuildTest, ScheduleFailFast) {
+  config_.schedule = BuildConfig::SCHEDULE_FAIL_FAST;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a: cat a.in\n"
+"build b: cat b.in\n"
+"build c: cat c.in\n"
+"build all: phony a b c\n"));
+  fs_.Create("a.in", "");
+  fs_.Create("c.in", "");
+  fs_.Tick();
+  fs_.Create("b.in", "");
+  fs_.Create(".ninja_failures", "# ninja failures v1\nc\n");
+  string err;
+  FailureLog failure_log;
+  ASSERT_EQ(LOAD_SUCCESS, failure_log.Load(".ninja_failures", &fs_, &err));
+  builder_.SetFailureLog(&failure_log);
+
+  // c failed last time, and b has the newest input.
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat c.in > c", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("cat b.in > b", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("cat a.in > a", command_runner_.commands_ran_[2]);
+  EXPECT_EQ(0u, failure_log.size());
+}
+
 TEST_F(BuildTest, MissingInput) {
   // Input is referenced by build file, but no rule for it.
   string err;
@@ -1482,6 +1730,59 @@ struct BuildWithLogTest : public BuildTest {
   BuildLog build_log_;
 };
 
+TEST_F(BuildWithLogTest, CriticalPathUsesDurations) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a0: cat in\n"
+"build b0: cat in\n"
+"build b1: cat b0\n"
+"build out: cat a0 b1\n"));
+  fs_.Create("in", "");
+  // a0 took much longer last time than the chain of b0 and b1.
+  build_log_.RecordCommand(GetNode("a0")->in_edge(), 0, 500);
+  build_log_.RecordCommand(GetNode("b0")->in_edge(), 0, 10);
+  build_log_.RecordCommand(GetNode("b1")->in_edge(), 0, 10);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(4u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cat in > a0", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("cat in > b0", command_runner_.commands_ran_[1]);
+  // out was never built, so it is taken to cost the average of the others.
+  EXPECT_EQ(673, GetNode("a0")->in_edge()->critical_path_weight());
+}
+
+TEST_F(BuildWithLogTest, CriticalPathWeighsDyndepInputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"rule cp\n"
+"  command = cp $in $out\n"
+"build dd: cp dd-in\n"
+"build in: touch\n"
+"build out: touch || dd\n"
+"  dyndep = dd\n"));
+  fs_.Create("dd-in",
+"ninja_dyndep_version = 1\n"
+"build out: dyndep | in\n");
+  build_log_.RecordCommand(GetNode("dd")->in_edge(), 0, 10);
+  build_log_.RecordCommand(GetNode("in")->in_edge(), 0, 100);
+  build_log_.RecordCommand(GetNode("out")->in_edge(), 0, 1000);
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  // The input found by the dyndep file is weighed by the edge it feeds.
+  EXPECT_EQ(1010, GetNode("dd")->in_edge()->critical_path_weight());
+  EXPECT_EQ(1100, GetNode("in")->in_edge()->critical_path_weight());
+  EXPECT_EQ(1000, GetNode("out")->in_edge()->critical_path_weight());
+}
+
 TEST_F(BuildWithLogTest, ImplicitGeneratedOutOfDate) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "rule touch\n"
@@ -4293,3 +4594,356 @@ TEST_F(BuildTest, ValidationWithCircularDependency) {
   EXPECT_FALSE(builder_.AddTarget("out", &err));
   EXPECT_EQ("dependency cycle: validate -> validate_in -> validate", err);
 }
+
+#ifndef _WIN32
+/// The real disk, keeping a list of the files written and removed.
+struct RecordingDisk : public RealDiskInterface {
+  virtual bool WriteFile(const string& path, const string& contents) {
+    written_.insert(path);
+    return RealDiskInterface::WriteFile(path, contents);
+  }
+
+  virtual int RemoveFile(const string& path) {
+    removed_.insert(path);
+    return RealDiskInterface::RemoveFile(path);
+  }
+
+  set<string> written_;
+  set<string> removed_;
+};
+
+/// Builds with the real command runner, in a temporary directory.
+struct BuildBatchTest : public StateTestWithBuiltinRules {
+  BuildBatchTest() : status_(config_) {
+    config_.verbosity = BuildConfig::QUIET;
+  }
+
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("BuildBatchTest");
+    AssertParse(&state_,
+"rule copy\n"
+"  command = cp $in $out\n"
+"  batch = 3\n"
+"  batch_command = while read in out; do cp $$in $$out; "
+"test $$in != in2; echo $$? >> $batch_status; done < $batch_rspfile; "
+"echo batch >> batches\n");
+    for (int i = 1; i <= 5; ++i) {
+      string in = "in" + to_string(i);
+      ASSERT_TRUE(disk_.WriteFile(in, ""));
+    }
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  bool Build(const vector<string>& targets, string* err) {
+    Builder builder(&state_, config_, NULL, NULL, &disk_, &status_, 0);
+    for (vector<string>::const_iterator t = targets.begin();
+         t != targets.end(); ++t) {
+      if (!builder.AddTarget(*t, err))
+        return false;
+    }
+    return builder.Build(err);
+  }
+
+  bool Exists(const string& path) {
+    string err;
+    return disk_.Stat(path, &err) > 0;
+  }
+
+  BuildConfig config_;
+  StatusPrinter status_;
+  RecordingDisk disk_;
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(BuildBatchTest, Batches) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out1: copy in1\n"
+"build out3: copy in3\n"
+"build out4: copy in4\n"
+"build out5: copy in5\n"));
+
+  vector<string> targets;
+  targets.push_back("out1");
+  targets.push_back("out3");
+  targets.push_back("out4");
+  targets.push_back("out5");
+  string err;
+  EXPECT_TRUE(Build(targets, &err));
+  EXPECT_EQ("", err);
+  for (size_t i = 0; i < targets.size(); ++i)
+    EXPECT_TRUE(Exists(targets[i]));
+
+  // Three edges in one batch, then the one left with its own command.
+  string batches;
+  ASSERT_EQ(0, ::ReadFile("batches", &batches, &err));
+  EXPECT_EQ("batch\n", batches);
+  EXPECT_FALSE(Exists("out1.batch.rsp"));
+  EXPECT_FALSE(Exists("out1.batch.status"));
+  // Both went through the Builder's disk interface.
+  EXPECT_EQ(1u, disk_.written_.count("out1.batch.rsp"));
+  EXPECT_EQ(1u, disk_.removed_.count("out1.batch.rsp"));
+  EXPECT_EQ(1u, disk_.removed_.count("out1.batch.status"));
+}
+
+TEST_F(BuildBatchTest, FailurePerEdge) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out1: copy in1\n"
+"build out2: copy in2\n"
+"build out3: copy in3\n"
+"build use1: copy out1\n"
+"build use2: copy out2\n"
+"build use3: copy out3\n"));
+  config_.failures_allowed = 10;
+
+  vector<string> targets;
+  targets.push_back("use1");
+  targets.push_back("use2");
+  targets.push_back("use3");
+  string err;
+  EXPECT_FALSE(Build(targets, &err));
+  EXPECT_EQ("cannot make progress due to previous errors", err);
+
+  // Only the edge the status file reported as failed holds back its
+  // dependent.
+  EXPECT_TRUE(Exists("use1"));
+  EXPECT_FALSE(Exists("use2"));
+  EXPECT_TRUE(Exists("use3"));
+}
+
+/// Builds on the real disk, where directories and response files are made
+/// on the preparer's thread ahead of starting commands.
+struct BuildPrepareTest : public BuildBatchTest {
+  virtual void SetUp() {
+    BuildBatchTest::SetUp();
+    AssertParse(&state_,
+"rule rsp\n"
+"  command = cat $rspfile > $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in\n"
+"rule fail\n"
+"  command = false\n"
+"build sub/dir/out1: rsp in1\n"
+"build sub/dir/out2: rsp in2\n"
+"build sub/other/out3: rsp in3\n");
+  }
+};
+
+TEST_F(BuildPrepareTest, Outputs) {
+  vector<string> targets;
+  targets.push_back("sub/dir/out1");
+  targets.push_back("sub/dir/out2");
+  targets.push_back("sub/other/out3");
+  string err;
+  EXPECT_TRUE(Build(targets, &err));
+  EXPECT_EQ("", err);
+  for (size_t i = 0; i < targets.size(); ++i) {
+    string contents;
+    ASSERT_EQ(0, ::ReadFile(targets[i], &contents, &err));
+    EXPECT_EQ("in" + to_string(i + 1), contents);
+    EXPECT_FALSE(Exists(targets[i] + ".rsp"));
+  }
+}
+
+/// A disk which allows other threads only once told to, and counts the
+/// files written and read from them.
+struct ThreadCheckingDisk : public RealDiskInterface {
+  ThreadCheckingDisk()
+      : thread_safe_(false), main_(std::this_thread::get_id()),
+        other_thread_writes_(0), other_thread_reads_(0) {}
+
+  virtual bool ThreadSafe() const { return thread_safe_; }
+
+  virtual bool WriteFile(const string& path, const string& contents) {
+    if (std::this_thread::get_id() != main_)
+      ++other_thread_writes_;
+    return RealDiskInterface::WriteFile(path, contents);
+  }
+
+  virtual Status ReadFile(const string& path, string* contents,
+                          string* err) {
+    if (std::this_thread::get_id() != main_)
+      ++other_thread_reads_;
+    return RealDiskInterface::ReadFile(path, contents, err);
+  }
+
+  bool thread_safe_;
+  std::thread::id main_;
+  std::atomic<int> other_thread_writes_;
+  std::atomic<int> other_thread_reads_;
+};
+
+TEST_F(BuildPrepareTest, SecondBuildOfChainDoesNothing) {
+  // Each edge's recorded start time must not be older than the input the
+  // edge before it has just written.
+  string manifest = "rule cp\n  command = cp $in $out\n"
+                    "build c0: cp in1\n";
+  for (int i = 1; i < 100; ++i)
+    manifest += "build c" + to_string(i) + ": cp c" + to_string(i - 1) + "\n";
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, manifest.c_str()));
+  config_.parallelism = 4;
+  BuildLog build_log;
+  string err;
+  {
+    Builder builder(&state_, config_, &build_log, NULL, &disk_, &status_, 0);
+    EXPECT_TRUE(builder.AddTarget("c99", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+  }
+
+  state_.Reset();
+  Builder builder(&state_, config_, &build_log, NULL, &disk_, &status_, 0);
+  EXPECT_TRUE(builder.AddTarget("c99", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.AlreadyUpToDate());
+}
+
+TEST_F(BuildPrepareTest, ThreadedOnceBuildStarts) {
+  // Like ninja's stat cache, the disk only allows other threads after the
+  // Builder is made.
+  ThreadCheckingDisk disk;
+  Builder builder(&state_, config_, NULL, NULL, &disk, &status_, 0);
+  string err;
+  EXPECT_TRUE(builder.AddTarget("sub/dir/out1", &err));
+  EXPECT_TRUE(builder.AddTarget("sub/dir/out2", &err));
+  EXPECT_TRUE(builder.AddTarget("sub/other/out3", &err));
+  ASSERT_EQ("", err);
+  disk.thread_safe_ = true;
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  EXPECT_LT(0, disk.other_thread_writes_.load());
+}
+
+TEST_F(BuildPrepareTest, OutputDirectoryReplaced) {
+  // gen is made afresh after gen/y/first was built in it, so gen/y has to
+  // be made again for gen/y/second.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule regen\n"
+"  command = rm -rf $out && mkdir $out\n"
+"build gen/y/first: rsp in1\n"
+"build gen: regen gen/y/first\n"
+"build gen/y/second: rsp in2 || gen\n"));
+  vector<string> targets(1, "gen/y/second");
+  string err;
+  EXPECT_TRUE(Build(targets, &err));
+  EXPECT_EQ("", err);
+  EXPECT_FALSE(Exists("gen/y/first"));
+  EXPECT_TRUE(Exists("gen/y/second"));
+}
+
+TEST_F(BuildPrepareTest, Failure) {
+  // "bad" starts first, being on the longest path; the others are
+  // prepared while it runs but never start.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build bad: fail in4\n"
+"build top: rsp bad\n"));
+  vector<string> targets;
+  targets.push_back("sub/dir/out1");
+  targets.push_back("sub/dir/out2");
+  targets.push_back("sub/other/out3");
+  targets.push_back("top");
+  string err;
+  EXPECT_FALSE(Build(targets, &err));
+  EXPECT_EQ("subcommand failed", err);
+  EXPECT_FALSE(Exists("sub/dir/out1"));
+  EXPECT_FALSE(Exists("sub/dir/out1.rsp"));
+  EXPECT_FALSE(Exists("sub/dir/out2.rsp"));
+  EXPECT_FALSE(Exists("sub/other/out3.rsp"));
+}
+
+/// Builds on the real disk, where depfiles are read and outputs restat()ed
+/// on the completer's threads.
+struct BuildCompletionTest : public BuildBatchTest {
+  virtual void SetUp() {
+    BuildBatchTest::SetUp();
+    config_.parallelism = 3;
+    AssertParse(&state_,
+"hdr = hdr\n"
+"rule cc\n"
+"  command = echo \"$out: $in $hdr\" > $out.d; cp $in $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out1: cc in1\n"
+"build out2: cc in2\n"
+"build out3: cc in3\n"
+"rule bad\n"
+"  command = echo broken > $out.d; cp $in $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out4: bad in4\n"
+"build use4: cc out4\n");
+  }
+
+  bool BuildWithDeps(const vector<string>& targets, string* err) {
+    if (!deps_log_.OpenForWrite("ninja_deps", err))
+      return false;
+    Builder builder(&state_, config_, NULL, &deps_log_, &disk_, &status_, 0);
+    for (vector<string>::const_iterator t = targets.begin();
+         t != targets.end(); ++t) {
+      if (!builder.AddTarget(*t, err))
+        return false;
+    }
+    bool built = builder.Build(err);
+    deps_log_.Close();
+    return built;
+  }
+
+  DepsLog deps_log_;
+};
+
+TEST_F(BuildCompletionTest, Deps) {
+  vector<string> targets;
+  targets.push_back("out1");
+  targets.push_back("out2");
+  targets.push_back("out3");
+  string err;
+  EXPECT_TRUE(BuildWithDeps(targets, &err));
+  EXPECT_EQ("", err);
+  for (size_t i = 0; i < targets.size(); ++i) {
+    Node* out = state_.LookupNode(targets[i]);
+    EXPECT_TRUE(Exists(targets[i]));
+    EXPECT_FALSE(Exists(targets[i] + ".d"));
+    DepsLog::Deps* deps = deps_log_.GetDeps(out);
+    ASSERT_TRUE(deps != NULL);
+    ASSERT_EQ(2, deps->node_count);
+    EXPECT_EQ("in" + to_string(i + 1), deps->nodes[0]->path());
+    EXPECT_EQ("hdr", deps->nodes[1]->path());
+  }
+}
+
+TEST_F(BuildCompletionTest, ThreadedOnceBuildStarts) {
+  // Like ninja's stat cache, the disk only allows other threads after the
+  // Builder is made.
+  ThreadCheckingDisk disk;
+  string err;
+  ASSERT_TRUE(deps_log_.OpenForWrite("ninja_deps", &err));
+  Builder builder(&state_, config_, NULL, &deps_log_, &disk, &status_, 0);
+  EXPECT_TRUE(builder.AddTarget("out1", &err));
+  EXPECT_TRUE(builder.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  disk.thread_safe_ = true;
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  deps_log_.Close();
+  // The depfiles were read on the completer's threads.
+  EXPECT_EQ(2, disk.other_thread_reads_.load());
+}
+
+TEST_F(BuildCompletionTest, BadDepfile) {
+  // out4's command succeeds, but its depfile does not parse, which fails
+  // the edge and holds back its dependent.
+  config_.failures_allowed = 10;
+  vector<string> targets;
+  targets.push_back("out1");
+  targets.push_back("use4");
+  string err;
+  EXPECT_FALSE(BuildWithDeps(targets, &err));
+  EXPECT_EQ("cannot make progress due to previous errors", err);
+  EXPECT_TRUE(Exists("out1"));
+  EXPECT_TRUE(Exists("out4"));
+  EXPECT_FALSE(Exists("use4"));
+}
+#endif  // _WIN32
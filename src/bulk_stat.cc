@@ -0,0 +1,350 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bulk_stat.h"
+
+#include <algorithm>
+#include <mutex>
+
+#include <errno.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+// IORING_OP_STATX arrived in Linux 5.6, together with IORING_FEAT_FAST_POLL.
+#if defined(IORING_FEAT_FAST_POLL) && defined(STATX_MTIME) && \
+    defined(__NR_io_uring_setup)
+#define NINJA_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#include "thread_pool.h"
+#include "util.h"
+
+using namespace std;
+
+namespace {
+
+/// Stats paths from a ThreadPool, each worker taking a contiguous chunk.
+struct ThreadedBulkStat : public BulkStat {
+  explicit ThreadedBulkStat(int num_threads) : pool_(num_threads) {}
+
+  virtual bool Stat(const vector<string>& paths, vector<TimeStamp>* mtimes,
+                    string* err);
+  virtual const char* name() const { return "threads"; }
+
+ private:
+  ThreadPool pool_;
+};
+
+bool ThreadedBulkStat::Stat(const vector<string>& paths,
+                            vector<TimeStamp>* mtimes, string* err) {
+  mtimes->resize(paths.size());
+  // A few chunks per thread keeps the workers busy when some directories
+  // are slower to stat than others.
+  size_t chunk = max((size_t)64, paths.size() / (pool_.size() * 4) + 1);
+
+  mutex err_mutex;
+  size_t err_index = paths.size();
+  for (size_t begin = 0; begin < paths.size(); begin += chunk) {
+    size_t end = min(paths.size(), begin + chunk);
+    pool_.Post([&, begin, end]() {
+      for (size_t i = begin; i < end; ++i) {
+        string stat_err;
+        TimeStamp mtime = StatSingleFile(paths[i], &stat_err);
+        (*mtimes)[i] = mtime;
+        if (mtime == -1) {
+          // Report the earliest failing path, as a serial loop would.
+          lock_guard<mutex> lock(err_mutex);
+          if (i < err_index) {
+            err_index = i;
+            *err = stat_err;
+          }
+        }
+      }
+    });
+  }
+  pool_.Wait();
+  return err_index == paths.size();
+}
+
+#ifdef NINJA_HAVE_IO_URING
+
+int io_uring_setup(unsigned entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+/// Submits statx() requests through an io_uring.  The kernel runs them on
+/// its own worker threads, so a single submitting thread keeps many stats
+/// in flight without paying a syscall per path.
+struct UringBulkStat : public BulkStat {
+  UringBulkStat();
+  virtual ~UringBulkStat();
+
+  /// Map the ring and check that the kernel accepts IORING_OP_STATX.
+  bool Init();
+
+  virtual bool Stat(const vector<string>& paths, vector<TimeStamp>* mtimes,
+                    string* err);
+  virtual const char* name() const { return "io_uring"; }
+
+ private:
+  /// Number of submission queue entries, and so of requests in flight.
+  static const unsigned kEntries = 256;
+
+  /// Queue a statx() of |path| into |slot|'s buffer, tagged with |index|.
+  void Prepare(const string& path, size_t index, unsigned slot);
+
+  /// Convert a completion into a Stat()-style mtime.
+  TimeStamp Complete(const string& path, const struct io_uring_cqe& cqe,
+                     string* err);
+
+  int ring_fd_;
+  void* sq_ptr_;
+  size_t sq_size_;
+  void* cq_ptr_;
+  size_t cq_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe* cqes_;
+
+  /// Local copy of the submission tail; published with a release store.
+  unsigned sq_local_tail_;
+
+  /// One statx buffer per in-flight request.
+  vector<struct statx> buffers_;
+
+  /// Whether io_uring_enter() failed with requests still in flight.  Their
+  /// completions would be taken for those of a later batch, so the ring is
+  /// not used again.
+  bool broken_;
+};
+
+UringBulkStat::UringBulkStat()
+    : ring_fd_(-1), sq_ptr_(MAP_FAILED), sq_size_(0), cq_ptr_(MAP_FAILED),
+      cq_size_(0), sqes_(NULL), sqes_size_(0), sq_tail_(NULL), sq_mask_(0),
+      cq_head_(NULL), cq_tail_(NULL), cq_mask_(0), cqes_(NULL),
+      sq_local_tail_(0), broken_(false) {}
+
+UringBulkStat::~UringBulkStat() {
+  if (sqes_)
+    munmap(sqes_, sqes_size_);
+  if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+    munmap(cq_ptr_, cq_size_);
+  if (sq_ptr_ != MAP_FAILED)
+    munmap(sq_ptr_, sq_size_);
+  if (ring_fd_ >= 0)
+    close(ring_fd_);
+}
+
+bool UringBulkStat::Init() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd_ = io_uring_setup(kEntries, &p);
+  if (ring_fd_ < 0)
+    return false;  // ENOSYS, EPERM under seccomp, ENOMEM from memlock...
+  SetCloseOnExec(ring_fd_);
+
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size_ = cq_size_ = max(sq_size_, cq_size_);
+
+  sq_ptr_ = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED)
+    return false;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(NULL, cq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED)
+      return false;
+  }
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+  sqes_ = (struct io_uring_sqe*)sqes;
+
+  char* sq = (char*)sq_ptr_;
+  char* cq = (char*)cq_ptr_;
+  sq_tail_ = (unsigned*)(sq + p.sq_off.tail);
+  sq_mask_ = *(unsigned*)(sq + p.sq_off.ring_mask);
+  cq_head_ = (unsigned*)(cq + p.cq_off.head);
+  cq_tail_ = (unsigned*)(cq + p.cq_off.tail);
+  cq_mask_ = *(unsigned*)(cq + p.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  sq_local_tail_ = *sq_tail_;
+
+  // Submission entries are always used in ring order, so the indirection
+  // array can be set up once as the identity.
+  unsigned* array = (unsigned*)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; ++i)
+    array[i] = i;
+
+  buffers_.resize(min((unsigned)kEntries, p.sq_entries));
+
+  // Kernels before 5.6 reject the opcode with EINVAL; find out now rather
+  // than on the first real batch.
+  vector<string> probe(1, ".");
+  vector<TimeStamp> mtimes;
+  string err;
+  return Stat(probe, &mtimes, &err) && mtimes[0] > 0;
+}
+
+void UringBulkStat::Prepare(const string& path, size_t index, unsigned slot) {
+  struct io_uring_sqe* sqe = &sqes_[sq_local_tail_ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)path.c_str();
+  sqe->len = STATX_MTIME;
+  sqe->off = (uint64_t)(uintptr_t)&buffers_[slot];
+  sqe->statx_flags = AT_STATX_DONT_SYNC;
+  sqe->user_data = ((uint64_t)index << 32) | slot;
+  ++sq_local_tail_;
+}
+
+TimeStamp UringBulkStat::Complete(const string& path,
+                                  const struct io_uring_cqe& cqe,
+                                  string* err) {
+  if (cqe.res < 0) {
+    if (cqe.res == -ENOENT || cqe.res == -ENOTDIR)
+      return 0;
+    *err = "statx(" + path + "): " + strerror(-cqe.res);
+    return -1;
+  }
+  const struct statx& st = buffers_[(unsigned)cqe.user_data];
+  // A filesystem may decline to report mtime; ask the slow way.
+  if (!(st.stx_mask & STATX_MTIME))
+    return StatSingleFile(path, err);
+  // See StatSingleFile() for why 0 is mapped to 1.
+  if (st.stx_mtime.tv_sec == 0)
+    return 1;
+  return (int64_t)st.stx_mtime.tv_sec * 1000000000LL + st.stx_mtime.tv_nsec;
+}
+
+bool UringBulkStat::Stat(const vector<string>& paths,
+                         vector<TimeStamp>* mtimes, string* err) {
+  mtimes->resize(paths.size());
+  if (broken_) {
+    *err = "io_uring: ring unusable after an earlier error";
+    return false;
+  }
+  // Requests carry their index in the top half of user_data.
+  if ((uint64_t)paths.size() >= (1ULL << 32)) {
+    *err = "io_uring: too many paths in one batch";
+    return false;
+  }
+
+  vector<unsigned> free_slots;
+  for (unsigned i = (unsigned)buffers_.size(); i > 0; --i)
+    free_slots.push_back(i - 1);
+
+  size_t err_index = paths.size();
+  size_t next = 0;
+  unsigned in_flight = 0;   // Submitted, not yet reaped.
+  unsigned unsubmitted = 0; // Published in the ring, not yet consumed.
+  while (next < paths.size() || in_flight > 0 || unsubmitted > 0) {
+    while (next < paths.size() && !free_slots.empty()) {
+      unsigned slot = free_slots.back();
+      free_slots.pop_back();
+      Prepare(paths[next], next, slot);
+      ++next;
+      ++unsubmitted;
+    }
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+
+    int ret = io_uring_enter(ring_fd_, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      // Requests still in flight write into buffers_, which outlives this
+      // call, but nothing may reap them.
+      *err = string("io_uring_enter: ") + strerror(errno);
+      broken_ = true;
+      return false;
+    }
+    unsubmitted -= ret;
+    in_flight += ret;
+
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      size_t index = (size_t)(cqe.user_data >> 32);
+      string stat_err;
+      TimeStamp mtime = Complete(paths[index], cqe, &stat_err);
+      (*mtimes)[index] = mtime;
+      // Report the earliest failing path, as a serial loop would, rather
+      // than whichever completes first.
+      if (mtime == -1 && index < err_index) {
+        err_index = index;
+        *err = stat_err;
+      }
+      free_slots.push_back((unsigned)cqe.user_data);
+      --in_flight;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  return err_index == paths.size();
+}
+
+#endif  // NINJA_HAVE_IO_URING
+
+}  // namespace
+
+unique_ptr<BulkStat> BulkStat::Create() {
+  // io_uring measured slower than threads (and than plain stat()) in
+  // disk_interface_perftest, so it is only used where asked for.
+  // stat() mostly waits on the kernel, so oversubscribing the CPUs helps,
+  // but past a point the threads just contend on directory locks.
+  int num_threads = min(max(GetProcessorCount(), 2), 16);
+  return CreateThreaded(num_threads);
+}
+
+unique_ptr<BulkStat> BulkStat::CreateUring() {
+#ifdef NINJA_HAVE_IO_URING
+  unique_ptr<UringBulkStat> uring(new UringBulkStat);
+  if (uring->Init())
+    return unique_ptr<BulkStat>(uring.release());
+#endif
+  return unique_ptr<BulkStat>();
+}
+
+unique_ptr<BulkStat> BulkStat::CreateThreaded(int num_threads) {
+  return unique_ptr<BulkStat>(new ThreadedBulkStat(num_threads));
+}
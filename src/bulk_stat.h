@@ -0,0 +1,60 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BULK_STAT_H_
+#define NINJA_BULK_STAT_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "timestamp.h"
+
+/// BulkStat stat()s many paths in one call.  RealDiskInterface::StatBatch
+/// uses it when enough paths are requested together to pay for the setup.
+///
+/// The default backend is a pool of threads calling stat().  On Linux,
+/// another submits statx() requests (mtime only, AT_STATX_DONT_SYNC)
+/// through io_uring; it did not beat the threads in
+/// disk_interface_perftest, so nothing uses it by default.
+struct BulkStat {
+  virtual ~BulkStat() {}
+
+  /// Stat each of |paths|, storing into |mtimes| (resized to match) using
+  /// the same convention as DiskInterface::Stat().  Returns false and fills
+  /// |err| with the error of the first path, in the order of |paths|, that
+  /// could not be stat()ed.
+  virtual bool Stat(const std::vector<std::string>& paths,
+                    std::vector<TimeStamp>* mtimes, std::string* err) = 0;
+
+  /// Short name of the backend, for diagnostics and benchmarks.
+  virtual const char* name() const = 0;
+
+  /// Create the default backend.
+  static std::unique_ptr<BulkStat> Create();
+
+  /// Create an io_uring backend, or return NULL if io_uring or its statx
+  /// operation is unavailable at runtime.
+  static std::unique_ptr<BulkStat> CreateUring();
+
+  /// Create a backend that stat()s paths from |num_threads| worker threads.
+  static std::unique_ptr<BulkStat> CreateThreaded(int num_threads);
+};
+
+/// stat() a single path without consulting any cache, using the same
+/// convention as DiskInterface::Stat().  Safe to call from any thread.
+/// Defined in disk_interface.cc.
+TimeStamp StatSingleFile(const std::string& path, std::string* err);
+
+#endif  // NINJA_BULK_STAT_H_
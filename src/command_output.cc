@@ -0,0 +1,211 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "command_output.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include "util.h"
+
+using namespace std;
+
+namespace {
+
+#ifdef __linux__
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+#endif
+
+#ifndef _WIN32
+/// Open an anonymous file that goes away once closed, or return -1.
+int OpenAnonymousFile() {
+#if defined(__linux__) && defined(SYS_memfd_create)
+  int memfd = (int)syscall(SYS_memfd_create, "ninja output", MFD_CLOEXEC);
+  if (memfd >= 0)
+    return memfd;
+#endif
+  const char* tmpdir = getenv("TMPDIR");
+  string path = string(tmpdir && *tmpdir ? tmpdir : "/tmp") +
+                "/ninja-output-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
+    return -1;
+  unlink(path.c_str());
+  SetCloseOnExec(fd);
+  return fd;
+}
+#endif  // !_WIN32
+
+}  // anonymous namespace
+
+CommandOutput::CommandOutput(size_t spill_size)
+    : spill_size_(spill_size), fd_(-1), spill_failed_(false), size_(0),
+      back_(0) {}
+
+CommandOutput::~CommandOutput() {
+  Clear();
+}
+
+CommandOutput::CommandOutput(CommandOutput&& other)
+    : spill_size_(other.spill_size_), fd_(-1), spill_failed_(false),
+      size_(0), back_(0) {
+  *this = std::move(other);
+}
+
+CommandOutput& CommandOutput::operator=(CommandOutput&& other) {
+  if (this != &other) {
+    Clear();
+    spill_size_ = other.spill_size_;
+    data_.swap(other.data_);
+    fd_ = other.fd_;
+    spill_failed_ = other.spill_failed_;
+    size_ = other.size_;
+    back_ = other.back_;
+    other.fd_ = -1;
+    other.Clear();
+  }
+  return *this;
+}
+
+void CommandOutput::Append(const char* data, size_t size) {
+  if (size == 0)
+    return;
+  size_ += size;
+  back_ = data[size - 1];
+#ifndef _WIN32
+  if (fd_ < 0 && size_ > spill_size_ && !spill_failed_)
+    spill_failed_ = !Spill();
+  if (fd_ >= 0) {
+    while (size > 0) {
+      ssize_t written = write(fd_, data, size);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        Fatal("write: %s", strerror(errno));
+      }
+      data += written;
+      size -= written;
+    }
+    return;
+  }
+#endif
+  data_.append(data, size);
+}
+
+void CommandOutput::Assign(const string& data) {
+  Clear();
+  Append(data);
+}
+
+void CommandOutput::Clear() {
+  string().swap(data_);
+#ifndef _WIN32
+  if (fd_ >= 0)
+    close(fd_);
+#endif
+  fd_ = -1;
+  spill_failed_ = false;
+  size_ = 0;
+  back_ = 0;
+}
+
+bool CommandOutput::Spill() {
+#ifdef _WIN32
+  return false;
+#else
+  fd_ = OpenAnonymousFile();
+  if (fd_ < 0)
+    return false;
+  // Append() sets these for the data it is moving, which the caller's
+  // has already come after.
+  string data;
+  data.swap(data_);
+  size_t size = size_;
+  char back = back_;
+  size_ = 0;
+  Append(data.data(), data.size());
+  size_ = size;
+  back_ = back;
+  return true;
+#endif
+}
+
+size_t CommandOutput::Read(size_t offset, char* buf, size_t size) const {
+  if (offset >= size_)
+    return 0;
+  if (size > size_ - offset)
+    size = size_ - offset;
+#ifndef _WIN32
+  if (fd_ >= 0) {
+    size_t done = 0;
+    while (done < size) {
+      ssize_t len = pread(fd_, buf + done, size - done, offset + done);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        Fatal("pread: %s", len < 0 ? strerror(errno) : "unexpected end");
+      done += len;
+    }
+    return done;
+  }
+#endif
+  memcpy(buf, data_.data() + offset, size);
+  return size;
+}
+
+string CommandOutput::ToString() const {
+  if (fd_ < 0)
+    return data_;
+  string result(size_, '\0');
+  Read(0, &result[0], size_);
+  return result;
+}
+
+bool CommandOutput::WriteTo(FILE* out) const {
+  if (fd_ < 0)
+    return fwrite(data_.data(), 1, data_.size(), out) == data_.size();
+  if (fflush(out) != 0)
+    return false;
+  size_t offset = 0;
+#ifdef __linux__
+  off_t file_offset = 0;
+  while (offset < size_) {
+    ssize_t len = sendfile(fileno(out), fd_, &file_offset, size_ - offset);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      break;  // Fall back to copying what is left.
+    offset += len;
+  }
+#endif
+  char buf[64 << 10];
+  while (offset < size_) {
+    size_t len = Read(offset, buf, sizeof(buf));
+    if (fwrite(buf, 1, len, out) != len)
+      return false;
+    offset += len;
+  }
+  return fflush(out) == 0;
+}
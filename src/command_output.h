@@ -0,0 +1,79 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_COMMAND_OUTPUT_H_
+#define NINJA_COMMAND_OUTPUT_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <string>
+
+/// The output of a command.  It is kept in memory while it is small; past
+/// a threshold it moves to an anonymous file (a memfd on Linux), so that a
+/// few commands spewing hundreds of megabytes don't blow up ninja's memory.
+/// Windows keeps it all in memory.
+struct CommandOutput {
+  /// The size beyond which output is spilled by default.
+  static const size_t kSpillSize = 256 << 10;
+
+  explicit CommandOutput(size_t spill_size = kSpillSize);
+  ~CommandOutput();
+
+  CommandOutput(CommandOutput&& other);
+  CommandOutput& operator=(CommandOutput&& other);
+
+  void Append(const char* data, size_t size);
+  void Append(const std::string& data) { Append(data.data(), data.size()); }
+  /// Replace the output with |data|.
+  void Assign(const std::string& data);
+  void Clear();
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  /// The last byte of a non-empty output.
+  char back() const { return back_; }
+
+  /// Whether the output moved out of memory.
+  bool spilled() const { return fd_ >= 0; }
+  /// The output, unless spilled().
+  const std::string& data() const { return data_; }
+
+  /// Copy up to |size| bytes at |offset| to |buf|; return how many were.
+  size_t Read(size_t offset, char* buf, size_t size) const;
+  /// The whole output, read into memory.
+  std::string ToString() const;
+  /// Write the output to |out|.  A spilled one goes from file to file in
+  /// the kernel where possible, without passing through memory.
+  bool WriteTo(FILE* out) const;
+
+ private:
+  CommandOutput(const CommandOutput&);
+  void operator=(const CommandOutput&);
+
+  /// Move data_ to a new anonymous file; returns false if there is none.
+  bool Spill();
+
+  size_t spill_size_;
+  /// The output while it is in memory.
+  std::string data_;
+  /// The anonymous file it spilled to, or -1.
+  int fd_;
+  /// Whether Spill() failed, so that it isn't tried for every Append().
+  bool spill_failed_;
+  size_t size_;
+  char back_;
+};
+
+#endif  // NINJA_COMMAND_OUTPUT_H_
@@ -0,0 +1,109 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "command_output.h"
+
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+TEST(CommandOutputTest, Inline) {
+  CommandOutput output(16);
+  EXPECT_TRUE(output.empty());
+  output.Append("hello ");
+  output.Append("world\n");
+  EXPECT_FALSE(output.spilled());
+  EXPECT_EQ(12u, output.size());
+  EXPECT_EQ('\n', output.back());
+  EXPECT_EQ("hello world\n", output.data());
+  EXPECT_EQ("hello world\n", output.ToString());
+
+  char buf[8];
+  ASSERT_EQ(6u, output.Read(6, buf, sizeof(buf)));
+  EXPECT_EQ("world\n", string(buf, 6));
+  EXPECT_EQ(0u, output.Read(12, buf, sizeof(buf)));
+
+  output.Assign("bye");
+  EXPECT_EQ("bye", output.ToString());
+  output.Clear();
+  EXPECT_TRUE(output.empty());
+}
+
+TEST(CommandOutputTest, Spill) {
+  CommandOutput output(16);
+  string expected;
+  for (int i = 0; i < 1000; ++i) {
+    string line = "line " + to_string(i) + "\n";
+    output.Append(line);
+    expected += line;
+  }
+#ifndef _WIN32
+  EXPECT_TRUE(output.spilled());
+  EXPECT_EQ("", output.data());
+#endif
+  EXPECT_EQ(expected.size(), output.size());
+  EXPECT_EQ(expected, output.ToString());
+
+  char buf[10];
+  ASSERT_EQ(10u, output.Read(7, buf, sizeof(buf)));
+  EXPECT_EQ(expected.substr(7, 10), string(buf, 10));
+
+  // Moving it takes the file along.
+  CommandOutput moved(std::move(output));
+  EXPECT_TRUE(output.empty());
+  EXPECT_EQ(expected, moved.ToString());
+  output = std::move(moved);
+  EXPECT_EQ(expected, output.ToString());
+
+  // The last byte is that of the append which spilled, not of the data
+  // already there.
+  CommandOutput last(8);
+  last.Append("aaa\n");
+  last.Append("bbbbbbbbX");
+#ifndef _WIN32
+  EXPECT_TRUE(last.spilled());
+#endif
+  EXPECT_EQ('X', last.back());
+  EXPECT_EQ("aaa\nbbbbbbbbX", last.ToString());
+}
+
+TEST(CommandOutputTest, WriteTo) {
+  CommandOutput output(16);
+  string expected;
+  for (int i = 0; i < 100000; ++i) {
+    string line = "line " + to_string(i) + "\n";
+    output.Append(line);
+    expected += line;
+  }
+
+  FILE* file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  fputs("before\n", file);
+  ASSERT_TRUE(output.WriteTo(file));
+  fputs("after\n", file);
+  fflush(file);
+
+  rewind(file);
+  string contents;
+  char buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+    contents.append(buf, len);
+  fclose(file);
+  EXPECT_EQ("before\n" + expected + "after\n", contents);
+}
+
+}  // anonymous namespace
@@ -18,4 +18,12 @@ bool g_keep_depfile = false;
 
 bool g_keep_rsp = false;
 
+// The Linux cache lists and stat()s whole directories, which is not
+// known to pay off yet, so it is opt-in there.
+#ifdef _WIN32
 bool g_experimental_statcache = true;
+#else
+bool g_experimental_statcache = false;
+#endif
+
+bool g_debug_jobs = false;
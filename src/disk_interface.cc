@@ -27,16 +27,19 @@
 #include <windows.h>
 #include <direct.h>  // _mkdir
 #else
+#include <fcntl.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
+#include "bulk_stat.h"
 #include "metrics.h"
 #include "util.h"
 
 using namespace std;
 
-namespace {
-
 string DirName(const string& path) {
 #ifdef _WIN32
   static const char kPathSeparators[] = "\\/";
@@ -54,6 +57,8 @@ string DirName(const string& path) {
   return path.substr(0, slash_pos);
 }
 
+namespace {
+
 int MakeDir(const string& path) {
 #ifdef _WIN32
   return _mkdir(path.c_str());
@@ -73,18 +78,6 @@ TimeStamp TimeStampFromFileTime(const FILETIME& filetime) {
   return (TimeStamp)mtime - 12622770400LL * (1000000000LL / 100);
 }
 
-TimeStamp StatSingleFile(const string& path, string* err) {
-  WIN32_FILE_ATTRIBUTE_DATA attrs;
-  if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attrs)) {
-    DWORD win_err = GetLastError();
-    if (win_err == ERROR_FILE_NOT_FOUND || win_err == ERROR_PATH_NOT_FOUND)
-      return 0;
-    *err = "GetFileAttributesEx(" + path + "): " + GetLastErrorString();
-    return -1;
-  }
-  return TimeStampFromFileTime(attrs.ftLastWriteTime);
-}
-
 bool IsWindows7OrLater() {
   OSVERSIONINFOEX version_info =
       { sizeof(OSVERSIONINFOEX), 6, 1, 0, 0, {0}, 0, 0, 0, 0, 0};
@@ -132,8 +125,132 @@ bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
 }
 #endif  // _WIN32
 
+#ifndef _WIN32
+/// Convert the mtime of a struct stat (or stat64) to a TimeStamp.
+template <typename StatT>
+TimeStamp TimeStampFromStat(const StatT& st) {
+  // Some users (Flatpak) set mtime to 0, this should be harmless
+  // and avoids conflicting with our return value of 0 meaning
+  // that it doesn't exist.
+  if (st.st_mtime == 0)
+    return 1;
+#if defined(_AIX)
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
+#elif defined(__APPLE__)
+  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
+          st.st_mtimespec.tv_nsec);
+#elif defined(st_mtime) // A macro, so we're likely on modern POSIX.
+  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
+#endif
+}
+#endif  // !_WIN32
+
+#ifdef __linux__
+/// Record layout returned by the getdents64 system call.
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+/// List |dir| with getdents64 and fstatat() each entry relative to the
+/// directory fd, which spares the kernel walking the full path every time.
+bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
+                       string* err) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return true;
+    *err = "open(" + dir + "): " + strerror(errno);
+    return false;
+  }
+  // Aligned for the dirent records the kernel writes into it.
+  uint64_t buf[4096];
+  for (;;) {
+    long len = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if (len < 0) {
+      *err = "getdents64(" + dir + "): " + strerror(errno);
+      close(fd);
+      return false;
+    }
+    if (len == 0)
+      break;
+    for (long pos = 0; pos < len;) {
+      const LinuxDirent64* ent = (const LinuxDirent64*)((char*)buf + pos);
+      pos += ent->d_reclen;
+      const char* name = ent->d_name;
+      // Stat() never looks up "." or "..".
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+#ifdef __USE_LARGEFILE64
+      struct stat64 st;
+      int ret = fstatat64(fd, name, &st, 0);
+#else
+      struct stat st;
+      int ret = fstatat(fd, name, &st, 0);
+#endif
+      if (ret < 0) {
+        // A dangling symlink, or an entry removed since it was listed, is
+        // missing; leave any other error for a stat() of the full path to
+        // report.
+        if (errno != ENOENT)
+          stamps->insert(make_pair(string(name), (TimeStamp)-1));
+        continue;
+      }
+      stamps->insert(make_pair(string(name), TimeStampFromStat(st)));
+    }
+  }
+  close(fd);
+  return true;
+}
+#endif  // __linux__
+
+/// Directory names key the stat cache case-insensitively on Windows.
+string StatCacheKey(const string& path) {
+#ifdef _WIN32
+  string key = path;
+  transform(key.begin(), key.end(), key.begin(), ::tolower);
+  return key;
+#else
+  return path;
+#endif
+}
+
 }  // namespace
 
+TimeStamp StatSingleFile(const string& path, string* err) {
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attrs;
+  if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attrs)) {
+    DWORD win_err = GetLastError();
+    if (win_err == ERROR_FILE_NOT_FOUND || win_err == ERROR_PATH_NOT_FOUND)
+      return 0;
+    *err = "GetFileAttributesEx(" + path + "): " + GetLastErrorString();
+    return -1;
+  }
+  return TimeStampFromFileTime(attrs.ftLastWriteTime);
+#else
+#ifdef __USE_LARGEFILE64
+  struct stat64 st;
+  if (stat64(path.c_str(), &st) < 0) {
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+#endif
+    if (errno == ENOENT || errno == ENOTDIR)
+      return 0;
+    *err = "stat(" + path + "): " + strerror(errno);
+    return -1;
+  }
+  return TimeStampFromStat(st);
+#endif
+}
+
 // DiskInterface ---------------------------------------------------------------
 
 bool DiskInterface::MakeDirs(const string& path) {
@@ -156,8 +273,23 @@ bool DiskInterface::MakeDirs(const string& path) {
   return MakeDir(dir);
 }
 
+bool DiskInterface::StatBatch(const vector<string>& paths,
+                              vector<TimeStamp>* mtimes, string* err) const {
+  mtimes->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    (*mtimes)[i] = Stat(paths[i], err);
+    if ((*mtimes)[i] == -1)
+      return false;
+  }
+  return true;
+}
+
 // RealDiskInterface -----------------------------------------------------------
 
+RealDiskInterface::RealDiskInterface() : use_cache_(false) {}
+
+RealDiskInterface::~RealDiskInterface() {}
+
 TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
   METRIC_RECORD("node stat");
 #ifdef _WIN32
@@ -170,63 +302,73 @@ TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
     *err = err_stream.str();
     return -1;
   }
+#endif
   if (!use_cache_)
     return StatSingleFile(path, err);
 
   string dir = DirName(path);
   string base(path.substr(dir.size() ? dir.size() + 1 : 0));
+#ifdef _WIN32
   if (base == "..") {
     // StatAllFilesInDir does not report any information for base = "..".
     base = ".";
     dir = path;
   }
-
-  string dir_lowercase = dir;
-  transform(dir.begin(), dir.end(), dir_lowercase.begin(), ::tolower);
   transform(base.begin(), base.end(), base.begin(), ::tolower);
+#else
+  // Leave what a single directory listing can't answer (".", "..", "a//b",
+  // "/a", "a/") to stat().
+  if (base.empty() || base == "." || base == ".." ||
+      base.find('/') != string::npos)
+    return StatSingleFile(path, err);
+#endif
 
-  Cache::iterator ci = cache_.find(dir_lowercase);
+  string dir_key = StatCacheKey(dir);
+  Cache::iterator ci = cache_.find(dir_key);
   if (ci == cache_.end()) {
-    ci = cache_.insert(make_pair(dir_lowercase, DirCache())).first;
+    ci = cache_.insert(make_pair(dir_key, DirCache())).first;
     if (!StatAllFilesInDir(dir.empty() ? "." : dir, &ci->second, err)) {
       cache_.erase(ci);
+#ifdef _WIN32
       return -1;
+#else
+      // A directory may be searchable without being readable.
+      err->clear();
+      return StatSingleFile(path, err);
+#endif
     }
   }
   DirCache::iterator di = ci->second.find(base);
-  return di != ci->second.end() ? di->second : 0;
-#else
-#ifdef __USE_LARGEFILE64
-  struct stat64 st;
-  if (stat64(path.c_str(), &st) < 0) {
-#else
-  struct stat st;
-  if (stat(path.c_str(), &st) < 0) {
-#endif
-    if (errno == ENOENT || errno == ENOTDIR)
-      return 0;
-    *err = "stat(" + path + "): " + strerror(errno);
-    return -1;
+  if (di == ci->second.end())
+    return 0;
+  if (di->second == -1) {
+    TimeStamp mtime = StatSingleFile(path, err);
+    if (mtime != -1)
+      di->second = mtime;
+    return mtime;
   }
-  // Some users (Flatpak) set mtime to 0, this should be harmless
-  // and avoids conflicting with our return value of 0 meaning
-  // that it doesn't exist.
-  if (st.st_mtime == 0)
-    return 1;
-#if defined(_AIX)
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
-#elif defined(__APPLE__)
-  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
-          st.st_mtimespec.tv_nsec);
-#elif defined(st_mtime) // A macro, so we're likely on modern POSIX.
-  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
-#else
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
-#endif
-#endif
+  return di->second;
+}
+
+bool RealDiskInterface::StatBatch(const vector<string>& paths,
+                                  vector<TimeStamp>* mtimes,
+                                  string* err) const {
+  // Below this many paths, handing the work off costs more than it saves.
+  static const size_t kMinBulkStat = 16;
+  // The stat cache already reads whole directories at a time.
+  if (use_cache_)
+    return DiskInterface::StatBatch(paths, mtimes, err);
+  if (paths.size() < kMinBulkStat)
+    return DiskInterface::StatBatch(paths, mtimes, err);
+
+  METRIC_RECORD("node stat batch");
+  if (!bulk_stat_)
+    bulk_stat_ = BulkStat::Create();
+  return bulk_stat_->Stat(paths, mtimes, err);
 }
 
 bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
+  InvalidateStatCache(path);
   FILE* fp = fopen(path.c_str(), "w");
   if (fp == NULL) {
     Error("WriteFile(%s): Unable to create file. %s",
@@ -251,6 +393,7 @@ bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
 }
 
 bool RealDiskInterface::MakeDir(const string& path) {
+  InvalidateStatCache(path);
   if (::MakeDir(path) < 0) {
     if (errno == EEXIST) {
       return true;
@@ -272,6 +415,7 @@ FileReader::Status RealDiskInterface::ReadFile(const string& path,
 }
 
 int RealDiskInterface::RemoveFile(const string& path) {
+  InvalidateStatCache(path);
 #ifdef _WIN32
   DWORD attributes = GetFileAttributesA(path.c_str());
   if (attributes == INVALID_FILE_ATTRIBUTES) {
@@ -327,9 +471,110 @@ int RealDiskInterface::RemoveFile(const string& path) {
 }
 
 void RealDiskInterface::AllowStatCache(bool allow) {
-#ifdef _WIN32
+#if defined(_WIN32) || defined(__linux__)
   use_cache_ = allow;
   if (!use_cache_)
     cache_.clear();
 #endif
 }
+
+void RealDiskInterface::InvalidateStatCache(const string& path) {
+  if (!use_cache_)
+    return;
+  // |path| may be a directory whose listing is cached.
+  cache_.erase(StatCacheKey(path));
+  string dir = DirName(path);
+  Cache::iterator ci = cache_.find(StatCacheKey(dir));
+  if (ci == cache_.end())
+    return;
+  string base = StatCacheKey(path.substr(dir.size() ? dir.size() + 1 : 0));
+  // Stat the entry afresh next time it is looked up.
+  ci->second[base] = -1;
+}
+
+// SnapshotDiskInterface -------------------------------------------------------
+
+TimeStamp SnapshotDiskInterface::Stat(const string& path, string* err) const {
+  if (!stats_.empty()) {
+    unordered_map<string, TimeStamp>::const_iterator i = stats_.find(path);
+    if (i != stats_.end())
+      return i->second;
+  }
+  return disk_->Stat(path, err);
+}
+
+bool SnapshotDiskInterface::StatBatch(const vector<string>& paths,
+                                      vector<TimeStamp>* mtimes,
+                                      string* err) const {
+  if (stats_.empty())
+    return disk_->StatBatch(paths, mtimes, err);
+
+  // Forward whatever the snapshot lacks as one batch.
+  mtimes->resize(paths.size());
+  vector<string> missing_paths;
+  vector<size_t> missing_indices;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    unordered_map<string, TimeStamp>::const_iterator s = stats_.find(paths[i]);
+    if (s != stats_.end()) {
+      (*mtimes)[i] = s->second;
+    } else {
+      missing_paths.push_back(paths[i]);
+      missing_indices.push_back(i);
+    }
+  }
+  if (missing_paths.empty())
+    return true;
+  vector<TimeStamp> missing_mtimes;
+  if (!disk_->StatBatch(missing_paths, &missing_mtimes, err))
+    return false;
+  for (size_t i = 0; i < missing_indices.size(); ++i)
+    (*mtimes)[missing_indices[i]] = missing_mtimes[i];
+  return true;
+}
+
+bool SnapshotDiskInterface::MakeDir(const string& path) {
+  Invalidate(path);
+  return disk_->MakeDir(path);
+}
+
+bool SnapshotDiskInterface::WriteFile(const string& path,
+                                      const string& contents) {
+  Invalidate(path);
+  return disk_->WriteFile(path, contents);
+}
+
+FileReader::Status SnapshotDiskInterface::ReadFile(const string& path,
+                                                   string* contents,
+                                                   string* err) {
+  if (!files_.empty()) {
+    unordered_map<string, pair<Status, string> >::iterator i =
+        files_.find(path);
+    if (i != files_.end()) {
+      *contents = i->second.second;
+      return i->second.first;
+    }
+  }
+  return disk_->ReadFile(path, contents, err);
+}
+
+int SnapshotDiskInterface::RemoveFile(const string& path) {
+  Invalidate(path);
+  return disk_->RemoveFile(path);
+}
+
+void SnapshotDiskInterface::AddFile(const string& path, Status status,
+                                    string* contents) {
+  pair<Status, string>& file = files_[path];
+  file.first = status;
+  file.second.swap(*contents);
+}
+
+void SnapshotDiskInterface::Clear() {
+  stats_.clear();
+  files_.clear();
+}
+
+void SnapshotDiskInterface::Invalidate(const string& path) {
+  stats_.erase(path);
+  files_.erase(path);
+}
@@ -16,10 +16,18 @@
 #define NINJA_DISK_INTERFACE_H_
 
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "timestamp.h"
 
+struct BulkStat;
+
+/// The directory |path| is in, or an empty string if it has none.
+std::string DirName(const std::string& path);
+
 /// Interface for reading files from disk.  See DiskInterface for details.
 /// This base offers the minimum interface needed just to read files.
 struct FileReader {
@@ -47,6 +55,14 @@ struct DiskInterface: public FileReader {
   /// other errors.
   virtual TimeStamp Stat(const std::string& path, std::string* err) const = 0;
 
+  /// stat() many files at once, storing one mtime per entry of |paths| into
+  /// |mtimes| with the same convention as Stat().  Returns false and fills
+  /// |err| if any path could not be stat()ed.  The default implementation
+  /// calls Stat() for each path in turn.
+  virtual bool StatBatch(const std::vector<std::string>& paths,
+                         std::vector<TimeStamp>* mtimes,
+                         std::string* err) const;
+
   /// Create a directory, returning false on failure.
   virtual bool MakeDir(const std::string& path) = 0;
 
@@ -65,37 +81,91 @@ struct DiskInterface: public FileReader {
   /// Create all the parent directories for path; like mkdir -p
   /// `basename path`.
   bool MakeDirs(const std::string& path);
+
+  /// Whether everything but StatBatch() may be called from other threads
+  /// while this one keeps using the interface.
+  virtual bool ThreadSafe() const { return false; }
 };
 
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
-  RealDiskInterface()
-#ifdef _WIN32
-                      : use_cache_(false)
-#endif
-                      {}
-  virtual ~RealDiskInterface() {}
+  RealDiskInterface();
+  virtual ~RealDiskInterface();
   virtual TimeStamp Stat(const std::string& path, std::string* err) const;
+  /// Large batches go through a BulkStat backend (io_uring on Linux).
+  virtual bool StatBatch(const std::vector<std::string>& paths,
+                         std::vector<TimeStamp>* mtimes,
+                         std::string* err) const;
   virtual bool MakeDir(const std::string& path);
   virtual bool WriteFile(const std::string& path, const std::string& contents);
   virtual Status ReadFile(const std::string& path, std::string* contents,
                           std::string* err);
   virtual int RemoveFile(const std::string& path);
+  /// Only while the stat cache is off.
+  virtual bool ThreadSafe() const { return !use_cache_; }
 
-  /// Whether stat information can be cached.  Only has an effect on Windows.
+  /// Whether stat information can be cached.  Only has an effect on Windows
+  /// and Linux, where a directory is listed once and the mtimes of all its
+  /// entries are kept.
   void AllowStatCache(bool allow);
 
  private:
-#ifdef _WIN32
+  /// Forget what the stat cache knows about |path|, after ninja itself
+  /// created, wrote or removed it.
+  void InvalidateStatCache(const std::string& path);
+
+  /// Created on the first large StatBatch() call.
+  mutable std::unique_ptr<BulkStat> bulk_stat_;
+
   /// Whether stat information can be cached.
   bool use_cache_;
 
+  /// Maps a directory entry name to its mtime, or to -1 if the entry must
+  /// be stat()ed individually (see InvalidateStatCache()).
   typedef std::map<std::string, TimeStamp> DirCache;
   // TODO: Neither a map nor a hashmap seems ideal here.  If the statcache
   // works out, come up with a better data structure.
   typedef std::map<std::string, DirCache> Cache;
   mutable Cache cache_;
-#endif
+};
+
+/// A DiskInterface that answers Stat() and ReadFile() from a snapshot of
+/// results gathered ahead of time, such as by ParallelScan, and forwards
+/// everything else to another DiskInterface.  With an empty snapshot it is
+/// a plain pass-through.
+struct SnapshotDiskInterface : public DiskInterface {
+  explicit SnapshotDiskInterface(DiskInterface* disk) : disk_(disk) {}
+
+  virtual TimeStamp Stat(const std::string& path, std::string* err) const;
+  virtual bool StatBatch(const std::vector<std::string>& paths,
+                         std::vector<TimeStamp>* mtimes,
+                         std::string* err) const;
+  virtual bool MakeDir(const std::string& path);
+  virtual bool WriteFile(const std::string& path, const std::string& contents);
+  virtual Status ReadFile(const std::string& path, std::string* contents,
+                          std::string* err);
+  virtual int RemoveFile(const std::string& path);
+
+  /// Record the result of stat()ing |path|.
+  void AddStat(const std::string& path, TimeStamp mtime) {
+    stats_[path] = mtime;
+  }
+
+  /// Record the result of reading |path|; |contents| is moved from.
+  void AddFile(const std::string& path, Status status, std::string* contents);
+
+  /// Forget the snapshot, so that everything is forwarded.
+  void Clear();
+
+  DiskInterface* disk() const { return disk_; }
+
+ private:
+  /// Drop anything recorded for |path| once ninja itself changes it.
+  void Invalidate(const std::string& path);
+
+  DiskInterface* disk_;
+  std::unordered_map<std::string, TimeStamp> stats_;
+  std::unordered_map<std::string, std::pair<Status, std::string> > files_;
 };
 
 #endif  // NINJA_DISK_INTERFACE_H_
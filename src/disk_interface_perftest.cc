@@ -0,0 +1,154 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares stat()ing many files one call at a time against the BulkStat
+// backends used by RealDiskInterface::StatBatch.
+//
+// Usage: disk_interface_perftest [number of files, default 1000000]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bulk_stat.h"
+#include "disk_interface.h"
+#include "metrics.h"
+#include "util.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+const char kTestDir[] = "DiskInterfacePerfTest-tempdir";
+
+/// Files are spread over directories of this many, like a source tree.
+const int kFilesPerDir = 1000;
+
+/// Create |count| empty files under kTestDir, returning their paths plus a
+/// missing sibling for every tenth file.
+bool CreateTestFiles(int count, vector<string>* paths) {
+  RealDiskInterface disk;
+  if (!disk.MakeDir(kTestDir))
+    return false;
+  char buf[128];
+  for (int i = 0; i < count; ++i) {
+    if (i % kFilesPerDir == 0) {
+      snprintf(buf, sizeof(buf), "%s/dir%d", kTestDir, i / kFilesPerDir);
+      if (!disk.MakeDir(buf))
+        return false;
+    }
+    snprintf(buf, sizeof(buf), "%s/dir%d/file%d.h", kTestDir,
+             i / kFilesPerDir, i);
+    if (!disk.WriteFile(buf, ""))
+      return false;
+    paths->push_back(buf);
+    if (i % 10 == 0) {
+      snprintf(buf, sizeof(buf), "%s/dir%d/missing%d.h", kTestDir,
+               i / kFilesPerDir, i);
+      paths->push_back(buf);
+    }
+  }
+  return true;
+}
+
+void RemoveTestFiles(const vector<string>& paths, int count) {
+  RealDiskInterface disk;
+  for (size_t i = 0; i < paths.size(); ++i)
+    disk.RemoveFile(paths[i]);
+  char buf[128];
+  for (int i = 0; i < count; i += kFilesPerDir) {
+    snprintf(buf, sizeof(buf), "%s/dir%d", kTestDir, i / kFilesPerDir);
+    disk.RemoveFile(buf);
+  }
+  disk.RemoveFile(kTestDir);
+}
+
+/// Run |stat_all| a few times and print min/avg timings under |name|.
+template <typename F>
+bool Measure(const char* name, const vector<string>& paths, F stat_all) {
+  const int kNumRepetitions = 5;
+  int min = 0;
+  float total = 0;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    vector<TimeStamp> mtimes;
+    string err;
+    int64_t start = GetTimeMillis();
+    if (!stat_all(&mtimes, &err)) {
+      fprintf(stderr, "%s: %s\n", name, err.c_str());
+      return false;
+    }
+    int delta = (int)(GetTimeMillis() - start);
+    if (i == 0 || delta < min)
+      min = delta;
+    total += delta;
+  }
+  printf("%-10s min %5dms  avg %7.1fms  (%.0f stats/s)\n", name, min,
+         total / kNumRepetitions, paths.size() * 1000.0 / (min ? min : 1));
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int count = 1000000;
+  if (argc > 1)
+    count = atoi(argv[1]);
+  if (count <= 0) {
+    fprintf(stderr, "usage: %s [number of files]\n", argv[0]);
+    return 1;
+  }
+
+  vector<string> paths;
+  printf("Creating %d files...\n", count);
+  if (!CreateTestFiles(count, &paths)) {
+    fprintf(stderr, "Failed to create test files\n");
+    RemoveTestFiles(paths, count);
+    return 1;
+  }
+  printf("Statting %zu paths\n", paths.size());
+
+  RealDiskInterface disk;
+  bool success = Measure("stat()", paths,
+                         [&](vector<TimeStamp>* mtimes, string* err) {
+    mtimes->resize(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+      if (((*mtimes)[i] = disk.Stat(paths[i], err)) == -1)
+        return false;
+    return true;
+  });
+
+  unique_ptr<BulkStat> backends[] = {
+    BulkStat::CreateThreaded(min(max(GetProcessorCount(), 2), 16)),
+    BulkStat::CreateUring(),
+  };
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    BulkStat* backend = backends[i].get();
+    if (!backend) {
+      printf("io_uring   unavailable\n");
+      continue;
+    }
+    success = success && Measure(backend->name(), paths,
+                                 [&](vector<TimeStamp>* mtimes, string* err) {
+      return backend->Stat(paths, mtimes, err);
+    });
+  }
+
+  RemoveTestFiles(paths, count);
+  return success ? 0 : 1;
+}
@@ -17,8 +17,11 @@
 #ifdef _WIN32
 #include <io.h>
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
+#include "bulk_stat.h"
 #include "disk_interface.h"
 #include "graph.h"
 #include "test.h"
@@ -179,6 +182,166 @@ TEST_F(DiskInterfaceTest, StatCache) {
 }
 #endif
 
+TEST_F(DiskInterfaceTest, StatBatch) {
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(Touch("notadir"));
+  // Enough paths that RealDiskInterface hands them to a BulkStat backend.
+  vector<string> paths;
+  for (int i = 0; i < 40; ++i) {
+    char buf[32];
+    sprintf(buf, "subdir/file%d", i);
+    if (i % 3 != 0)
+      ASSERT_TRUE(Touch(buf));
+    paths.push_back(buf);
+  }
+  paths.push_back("subdir");
+  paths.push_back("notadir/nosuchfile");
+  paths.push_back("nosuchdir/nosuchfile");
+
+  vector<TimeStamp> expected;
+  string err;
+  for (size_t i = 0; i < paths.size(); ++i)
+    expected.push_back(disk_.Stat(paths[i], &err));
+  EXPECT_EQ("", err);
+
+  vector<TimeStamp> mtimes;
+  EXPECT_TRUE(disk_.StatBatch(paths, &mtimes, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(expected, mtimes);
+
+  unique_ptr<BulkStat> backends[] = {
+    BulkStat::CreateThreaded(3),
+    BulkStat::CreateUring(),  // NULL if unavailable.
+  };
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    if (!backends[i])
+      continue;
+    mtimes.clear();
+    EXPECT_TRUE(backends[i]->Stat(paths, &mtimes, &err));
+    EXPECT_EQ("", err);
+    EXPECT_EQ(expected, mtimes);
+  }
+}
+
+TEST_F(DiskInterfaceTest, StatBatchBadPath) {
+  vector<string> paths(20, "file");
+  ASSERT_TRUE(Touch("file"));
+#ifdef _WIN32
+  paths[7] = "cc:\\foo";
+#else
+  paths[7] = string(512, 'x');
+#endif
+  vector<TimeStamp> mtimes;
+  string err;
+  EXPECT_FALSE(disk_.StatBatch(paths, &mtimes, &err));
+  EXPECT_NE("", err);
+
+  err.clear();
+  EXPECT_FALSE(BulkStat::CreateThreaded(2)->Stat(paths, &mtimes, &err));
+  EXPECT_NE("", err);
+  EXPECT_EQ(-1, mtimes[7]);
+}
+
+#ifndef _WIN32
+TEST_F(DiskInterfaceTest, StatBatchFirstError) {
+  // Whichever stat() finishes first, the error is the first path's.
+  vector<string> paths(200, "file");
+  ASSERT_TRUE(Touch("file"));
+  paths[7] = string(512, 'x');
+  for (size_t i = 8; i < paths.size(); i += 8)
+    paths[i] = string(512, 'y');
+
+  unique_ptr<BulkStat> backends[] = {
+    BulkStat::CreateThreaded(4),
+    BulkStat::CreateUring(),  // NULL if unavailable.
+  };
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    if (!backends[i])
+      continue;
+    vector<TimeStamp> mtimes;
+    string err;
+    EXPECT_FALSE(backends[i]->Stat(paths, &mtimes, &err));
+    EXPECT_NE(string::npos, err.find(paths[7]));
+    EXPECT_EQ(string::npos, err.find(paths[8]));
+  }
+}
+#endif
+
+#ifdef __linux__
+TEST_F(DiskInterfaceTest, StatCache) {
+  string err;
+
+  ASSERT_TRUE(Touch("file1"));
+  ASSERT_TRUE(Touch("File2"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(disk_.MakeDir("subdir/subsubdir"));
+  ASSERT_TRUE(Touch("subdir/subfile1"));
+  ASSERT_TRUE(symlink("nosuchfile", "subdir/dangling") == 0);
+
+  TimeStamp subdir_uncached = disk_.Stat("subdir", &err);
+  TimeStamp subfile1_uncached = disk_.Stat("subdir/subfile1", &err);
+  disk_.AllowStatCache(true);
+
+  EXPECT_GT(disk_.Stat("file1", &err), 1);
+  EXPECT_EQ("", err);
+  EXPECT_GT(disk_.Stat("File2", &err), 1);
+  EXPECT_EQ("", err);
+  // Unlike on Windows, names are case-sensitive.
+  EXPECT_EQ(0, disk_.Stat("file2", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_EQ(subfile1_uncached, disk_.Stat("subdir/subfile1", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(subdir_uncached, disk_.Stat("subdir", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("subdir/dangling", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_GT(disk_.Stat("..", &err), 1);
+  EXPECT_EQ("", err);
+  EXPECT_GT(disk_.Stat(".", &err), 1);
+  EXPECT_EQ("", err);
+  EXPECT_EQ(disk_.Stat("subdir", &err),
+            disk_.Stat("subdir/subsubdir/..", &err));
+  EXPECT_EQ(disk_.Stat("subdir/subsubdir", &err),
+            disk_.Stat("subdir/subsubdir/.", &err));
+  EXPECT_EQ("", err);
+
+  EXPECT_EQ(0, disk_.Stat("nosuchfile", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("nosuchdir/nosuchfile", &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("file1/nosuchfile", &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(DiskInterfaceTest, StatCacheInvalidation) {
+  string err;
+  disk_.AllowStatCache(true);
+
+  // Cache the listings of "." and "newdir" while both are missing.
+  EXPECT_EQ(0, disk_.Stat("newfile", &err));
+  EXPECT_EQ(0, disk_.Stat("newdir", &err));
+  EXPECT_EQ(0, disk_.Stat("newdir/file", &err));
+
+  ASSERT_TRUE(disk_.WriteFile("newfile", ""));
+  EXPECT_GT(disk_.Stat("newfile", &err), 1);
+  EXPECT_EQ("", err);
+
+  ASSERT_TRUE(disk_.MakeDir("newdir"));
+  EXPECT_GT(disk_.Stat("newdir", &err), 1);
+  ASSERT_TRUE(disk_.WriteFile("newdir/file", ""));
+  EXPECT_GT(disk_.Stat("newdir/file", &err), 1);
+  EXPECT_EQ("", err);
+
+  EXPECT_EQ(0, disk_.RemoveFile("newfile"));
+  EXPECT_EQ(0, disk_.Stat("newfile", &err));
+  EXPECT_EQ(0, disk_.RemoveFile("newdir/file"));
+  EXPECT_EQ(0, disk_.Stat("newdir/file", &err));
+  EXPECT_EQ("", err);
+}
+#endif
+
 TEST_F(DiskInterfaceTest, ReadFile) {
   string err;
   std::string content;
@@ -238,6 +401,95 @@ TEST_F(DiskInterfaceTest, RemoveDirectory) {
   EXPECT_EQ(1, disk_.RemoveFile("does not exist"));
 }
 
+TEST_F(DiskInterfaceTest, SnapshotDiskInterface) {
+  ASSERT_TRUE(Touch("file1"));
+  ASSERT_TRUE(disk_.WriteFile("file2", "contents"));
+  SnapshotDiskInterface snapshot(&disk_);
+
+  string err, contents;
+  snapshot.AddStat("file1", 42);
+  EXPECT_EQ(42, snapshot.Stat("file1", &err));
+  EXPECT_GT(snapshot.Stat("file2", &err), 1);
+  EXPECT_EQ("", err);
+
+  vector<string> paths;
+  paths.push_back("file1");
+  paths.push_back("file2");
+  paths.push_back("nosuchfile");
+  vector<TimeStamp> mtimes;
+  EXPECT_TRUE(snapshot.StatBatch(paths, &mtimes, &err));
+  ASSERT_EQ(3u, mtimes.size());
+  EXPECT_EQ(42, mtimes[0]);
+  EXPECT_GT(mtimes[1], 1);
+  EXPECT_EQ(0, mtimes[2]);
+
+  contents = "cached";
+  snapshot.AddFile("file2", FileReader::Okay, &contents);
+  EXPECT_EQ(FileReader::Okay, snapshot.ReadFile("file2", &contents, &err));
+  EXPECT_EQ("cached", contents);
+
+  // Changes made through the snapshot are not hidden by it.
+  EXPECT_TRUE(snapshot.WriteFile("file2", "new"));
+  contents.clear();
+  EXPECT_EQ(FileReader::Okay, snapshot.ReadFile("file2", &contents, &err));
+  EXPECT_EQ("new", contents);
+  EXPECT_EQ(0, snapshot.RemoveFile("file1"));
+  EXPECT_EQ(0, snapshot.Stat("file1", &err));
+
+  snapshot.AddStat("file2", 42);
+  snapshot.Clear();
+  EXPECT_GT(snapshot.Stat("file2", &err), 42);
+}
+
+TEST_F(DiskInterfaceTest, ParallelScan) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"build a.o: cc a.c\n"
+"build b.o: cc b.c\n"
+"build c.o: cc c.c\n"
+"build lib: cc a.o b.o c.o\n"
+"build all: phony lib\n";
+  // a.o depends on a missing header, c.o is missing: both are dirty.
+  ASSERT_TRUE(Touch("a.c"));
+  ASSERT_TRUE(Touch("b.c"));
+  ASSERT_TRUE(Touch("c.c"));
+  ASSERT_TRUE(Touch("b.h"));
+  ASSERT_TRUE(disk_.WriteFile("a.o.d", "a.o: a.c a.h\n"));
+  ASSERT_TRUE(disk_.WriteFile("b.o.d", "b.o: b.c b.h\n"));
+  ASSERT_TRUE(Touch("a.o"));
+  ASSERT_TRUE(Touch("b.o"));
+
+  const char* kNodes[] = { "a.h", "a.o", "b.h", "b.o", "c.o", "lib", "all" };
+  const size_t kNodeCount = sizeof(kNodes) / sizeof(kNodes[0]);
+  vector<bool> serial_dirty;
+  for (int threads = 1; threads <= 4; threads += 3) {
+    State state;
+    AssertParse(&state, kManifest);
+    DependencyScan scan(&state, NULL, NULL, &disk_, NULL);
+    scan.set_scan_threads(threads);
+
+    string err;
+    EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("all"), NULL, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(state.LookupNode("a.o")->dirty());
+    EXPECT_FALSE(state.LookupNode("b.o")->dirty());
+    EXPECT_TRUE(state.LookupNode("c.o")->dirty());
+
+    vector<bool> dirty;
+    for (size_t i = 0; i < kNodeCount; ++i) {
+      Node* node = state.LookupNode(kNodes[i]);
+      ASSERT_TRUE(node);
+      dirty.push_back(node->dirty());
+    }
+    if (threads == 1)
+      serial_dirty = dirty;
+    else
+      EXPECT_EQ(serial_dirty, dirty);
+  }
+}
+
 struct StatTest : public StateTestWithBuiltinRules,
                   public DiskInterface {
   StatTest() : scan_(&state_, NULL, NULL, this, NULL) {}
@@ -346,4 +598,32 @@ TEST_F(StatTest, Middle) {
   ASSERT_TRUE(GetNode("out")->dirty());
 }
 
+TEST_F(StatTest, BatchedSourceInputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat mid in1 in2 in3\n"
+"build mid: cat in1\n"));
+
+  mtimes_["in1"] = 1;
+  mtimes_["in3"] = 1;  // in2 is missing
+  mtimes_["mid"] = 1;
+  mtimes_["out"] = 1;
+
+  Node* out = GetNode("out");
+  string err;
+  EXPECT_TRUE(out->Stat(this, &err));
+  EXPECT_EQ("", err);
+  scan_.RecomputeDirty(out, NULL, NULL);
+  // Source inputs are stat()ed together, before the generated input's edge
+  // is visited, and each is stat()ed only once.
+  ASSERT_EQ(5u, stats_.size());
+  EXPECT_EQ("in1", stats_[1]);
+  EXPECT_EQ("in2", stats_[2]);
+  EXPECT_EQ("in3", stats_[3]);
+  EXPECT_EQ("mid", stats_[4]);
+  EXPECT_FALSE(GetNode("in1")->dirty());
+  EXPECT_TRUE(GetNode("in2")->dirty());
+  EXPECT_FALSE(GetNode("in3")->dirty());
+  EXPECT_TRUE(GetNode("out")->dirty());
+}
+
 }  // namespace
@@ -73,17 +73,24 @@ const EvalString* Rule::GetBinding(const string& key) const {
 
 // static
 bool Rule::IsReservedBinding(const string& var) {
-  return var == "command" ||
+  return var == "batch" ||
+      var == "batch_command" ||
+      var == "command" ||
       var == "depfile" ||
       var == "dyndep" ||
       var == "description" ||
       var == "deps" ||
+      var == "direct_exec" ||
       var == "generator" ||
       var == "pool" ||
+      var == "priority" ||
+      var == "resources" ||
       var == "restat" ||
       var == "rspfile" ||
       var == "rspfile_content" ||
       var == "msvc_deps_prefix" ||
+      var == "weight" ||
+      var == "worker" ||
       var == "symlink_outputs"; // From android platform
 }
 
@@ -0,0 +1,97 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "failure_log.h"
+
+#include "disk_interface.h"
+#include "graph.h"
+
+using namespace std;
+
+// The log is a text file with the first output of each failed edge on a
+// line of its own, after a signature line.
+namespace {
+
+const char kFileSignature[] = "# ninja failures v1\n";
+
+}  // anonymous namespace
+
+LoadStatus FailureLog::Load(const string& path, FileReader* file_reader,
+                            string* err) {
+  failed_.clear();
+  changed_ = false;
+  string contents;
+  switch (file_reader->ReadFile(path, &contents, err)) {
+  case FileReader::Okay:
+    break;
+  case FileReader::NotFound:
+    err->clear();
+    return LOAD_NOT_FOUND;
+  case FileReader::OtherError:
+    return LOAD_ERROR;
+  }
+
+  if (contents.compare(0, sizeof(kFileSignature) - 1, kFileSignature) != 0) {
+    *err = "bad failure log signature";
+    return LOAD_ERROR;
+  }
+
+  size_t start = sizeof(kFileSignature) - 1;
+  while (start < contents.size()) {
+    size_t end = contents.find('\n', start);
+    if (end == string::npos)
+      break;  // A partly written line.
+    if (end > start)
+      failed_.insert(contents.substr(start, end - start));
+    start = end + 1;
+  }
+  return LOAD_SUCCESS;
+}
+
+bool FailureLog::Write(const string& path, DiskInterface* disk_interface,
+                       string* err) {
+  if (!changed_)
+    return true;
+  changed_ = false;
+  if (failed_.empty()) {
+    if (disk_interface->RemoveFile(path) < 0) {
+      *err = "failed to remove " + path;
+      return false;
+    }
+    return true;
+  }
+
+  string contents = kFileSignature;
+  for (set<string>::iterator i = failed_.begin(); i != failed_.end(); ++i) {
+    contents += *i;
+    contents += '\n';
+  }
+  if (!disk_interface->WriteFile(path, contents)) {
+    *err = "failed to write " + path;
+    return false;
+  }
+  return true;
+}
+
+void FailureLog::RecordResult(const Edge* edge, bool success) {
+  const string& path = edge->outputs_[0]->path();
+  if (success)
+    changed_ |= failed_.erase(path) != 0;
+  else
+    changed_ |= failed_.insert(path).second;
+}
+
+bool FailureLog::Failed(const Edge* edge) const {
+  return !failed_.empty() && failed_.count(edge->outputs_[0]->path()) != 0;
+}
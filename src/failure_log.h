@@ -0,0 +1,55 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_FAILURE_LOG_H_
+#define NINJA_FAILURE_LOG_H_
+
+#include <set>
+#include <string>
+
+#include "load_status.h"
+
+struct DiskInterface;
+struct Edge;
+struct FileReader;
+
+/// The edges whose command failed the last time it ran, by their first
+/// output.  An edge stays in the log until its command succeeds, so that
+/// later builds can run it first (see BuildConfig::SCHEDULE_FAIL_FAST).
+struct FailureLog {
+  FailureLog() : changed_(false) {}
+
+  /// Load the log at |path|.
+  LoadStatus Load(const std::string& path, FileReader* file_reader,
+                  std::string* err);
+
+  /// Write the log to |path| if it changed since it was loaded.  The file
+  /// is removed once no edge is failing.
+  bool Write(const std::string& path, DiskInterface* disk_interface,
+             std::string* err);
+
+  /// Record whether the command of |edge| succeeded.
+  void RecordResult(const Edge* edge, bool success);
+
+  /// Whether the command of |edge| failed the last time it ran.
+  bool Failed(const Edge* edge) const;
+
+  size_t size() const { return failed_.size(); }
+
+ private:
+  std::set<std::string> failed_;
+  bool changed_;
+};
+
+#endif  // NINJA_FAILURE_LOG_H_
@@ -0,0 +1,78 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "failure_log.h"
+
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+const char kFailuresPath[] = ".ninja_failures";
+
+struct FailureLogTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    StateTestWithBuiltinRules::SetUp();
+    AssertParse(&state_,
+"build a: cat a.in\n"
+"build b: cat b.in\n");
+  }
+
+  Edge* GetEdge(const char* output) { return GetNode(output)->in_edge(); }
+
+  VirtualFileSystem fs_;
+};
+
+TEST_F(FailureLogTest, WriteLoad) {
+  string err;
+  FailureLog log;
+  EXPECT_EQ(LOAD_NOT_FOUND, log.Load(kFailuresPath, &fs_, &err));
+  EXPECT_EQ("", err);
+
+  log.RecordResult(GetEdge("a"), false);
+  log.RecordResult(GetEdge("b"), true);
+  EXPECT_TRUE(log.Failed(GetEdge("a")));
+  EXPECT_FALSE(log.Failed(GetEdge("b")));
+  EXPECT_TRUE(log.Write(kFailuresPath, &fs_, &err));
+  EXPECT_EQ("# ninja failures v1\na\n", fs_.files_[kFailuresPath].contents);
+
+  FailureLog loaded;
+  EXPECT_EQ(LOAD_SUCCESS, loaded.Load(kFailuresPath, &fs_, &err));
+  EXPECT_EQ(1u, loaded.size());
+  EXPECT_TRUE(loaded.Failed(GetEdge("a")));
+
+  // An unchanged log is not written again.
+  fs_.files_created_.clear();
+  loaded.RecordResult(GetEdge("a"), false);
+  EXPECT_TRUE(loaded.Write(kFailuresPath, &fs_, &err));
+  EXPECT_TRUE(fs_.files_created_.empty());
+
+  // Once nothing fails the file goes away.
+  loaded.RecordResult(GetEdge("a"), true);
+  EXPECT_TRUE(loaded.Write(kFailuresPath, &fs_, &err));
+  EXPECT_EQ(1u, fs_.files_removed_.count(kFailuresPath));
+}
+
+TEST_F(FailureLogTest, BadSignature) {
+  fs_.Create(kFailuresPath, "a\n");
+  string err;
+  FailureLog log;
+  EXPECT_EQ(LOAD_ERROR, log.Load(kFailuresPath, &fs_, &err));
+  EXPECT_EQ("bad failure log signature", err);
+}
+
+}  // anonymous namespace
@@ -26,6 +26,7 @@
 #include "disk_interface.h"
 #include "manifest_parser.h"
 #include "metrics.h"
+#include "parallel_scan.h"
 #include "state.h"
 #include "util.h"
 
@@ -41,6 +42,34 @@ bool Node::Stat(DiskInterface* disk_interface, string* err) {
   return true;
 }
 
+bool Node::StatAllIfNecessary(DiskInterface* disk_interface,
+                              const vector<Node*>& nodes, string* err) {
+  vector<string> paths;
+  vector<Node*> unknown;
+  for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end(); ++n) {
+    if ((*n)->status_known())
+      continue;
+    paths.push_back((*n)->path());
+    unknown.push_back(*n);
+  }
+  if (unknown.empty())
+    return true;
+  if (unknown.size() == 1)
+    return unknown[0]->Stat(disk_interface, err);
+
+  METRIC_RECORD("node stat");
+  vector<TimeStamp> mtimes;
+  if (!disk_interface->StatBatch(paths, &mtimes, err))
+    return false;
+  for (size_t i = 0; i < unknown.size(); ++i) {
+    Node* node = unknown[i];
+    node->mtime_ = mtimes[i];
+    node->exists_ =
+        (mtimes[i] != 0) ? ExistenceStatusExists : ExistenceStatusMissing;
+  }
+  return true;
+}
+
 void Node::UpdatePhonyMtime(TimeStamp mtime) {
   if (!exists()) {
     mtime_ = std::max(mtime_, mtime);
@@ -64,7 +93,12 @@ bool DependencyScan::RecomputeDirty(Node* initial_node,
     stack.clear();
     new_validation_nodes.clear();
 
-    if (!RecomputeNodeDirty(node, &stack, &new_validation_nodes, err))
+    if (parallel_scan_)
+      parallel_scan_->Prefetch(node);
+    bool ok = RecomputeNodeDirty(node, &stack, &new_validation_nodes, err);
+    // The snapshot is only good until the build starts changing files.
+    snapshot_disk_.Clear();
+    if (!ok)
       return false;
     nodes.insert(nodes.end(), new_validation_nodes.begin(),
                               new_validation_nodes.end());
@@ -80,55 +114,111 @@ bool DependencyScan::RecomputeDirty(Node* initial_node,
   return true;
 }
 
+namespace {
+
+/// An edge being visited by DependencyScan::RecomputeNodeDirty(), which
+/// walks the graph depth-first with an explicit stack of these rather than
+/// by recursion, so long dependency chains cannot overflow the call stack.
+struct DirtyScanFrame {
+  explicit DirtyScanFrame(Node* node)
+      : node(node), phase(kStart), next_input(0), input_visited(false),
+        most_recent_input(NULL), dirty(false) {}
+
+  /// How far the visit of the in-edge of |node| has got.
+  enum Phase {
+    /// Nothing done yet.
+    kStart,
+    /// The pending dyndep file has been visited and may be loaded.
+    kDyndepVisited,
+    /// Ready to load outputs and discovered deps.
+    kLoadDeps,
+    /// Visiting inputs_[next_input].
+    kInputs
+  };
+
+  Node* node;
+  Phase phase;
+  size_t next_input;
+  /// Whether inputs_[next_input] has been visited already.
+  bool input_visited;
+  Node* most_recent_input;
+  bool dirty;
+};
+
+}  // namespace
+
 bool DependencyScan::RecomputeNodeDirty(Node* node, std::vector<Node*>* stack,
                                         std::vector<Node*>* validation_nodes,
                                         string* err) {
-  Edge* edge = node->in_edge();
-  if (!edge) {
-    // If we already visited this leaf node then we are done.
-    if (node->status_known())
+  vector<DirtyScanFrame> frames;
+
+  // Start visiting |n|.  Leaves and finished edges are dealt with at once;
+  // otherwise a frame is pushed to visit the in-edge of |n|.
+  auto begin_visit = [&](Node* n) -> bool {
+    Edge* edge = n->in_edge();
+    if (!edge) {
+      // If we already visited this leaf node then we are done.
+      if (n->status_known())
+        return true;
+      // This node has no in-edge; it is dirty if it is missing.
+      if (!n->StatIfNecessary(disk_interface_, err))
+        return false;
+      RecomputeLeafDirty(n);
+      return true;
+    }
+
+    // If we already finished this edge then we are done.
+    if (edge->mark_ == Edge::VisitDone)
       return true;
-    // This node has no in-edge; it is dirty if it is missing.
-    if (!node->StatIfNecessary(disk_interface_, err))
+
+    // If we encountered this edge earlier in the walk we have a cycle.
+    if (!VerifyDAG(n, stack, err))
       return false;
-    if (!node->exists())
-      EXPLAIN("%s has no in-edge and is missing", node->path().c_str());
-    node->set_dirty(!node->exists());
-    return true;
-  }
 
-  // If we already finished this edge then we are done.
-  if (edge->mark_ == Edge::VisitDone)
+    // Mark the edge temporarily while it is on the stack.
+    edge->mark_ = Edge::VisitInStack;
+    stack->push_back(n);
+
+    edge->outputs_ready_ = true;
+    edge->deps_missing_ = false;
+    frames.push_back(DirtyScanFrame(n));
     return true;
+  };
 
-  // If we encountered this edge earlier in the call stack we have a cycle.
-  if (!VerifyDAG(node, stack, err))
+  if (!begin_visit(node))
     return false;
 
-  // Mark the edge temporarily while in the call stack.
-  edge->mark_ = Edge::VisitInStack;
-  stack->push_back(node);
-
-  bool dirty = false;
-  edge->outputs_ready_ = true;
-  edge->deps_missing_ = false;
-
-  if (!edge->deps_loaded_) {
-    // This is our first encounter with this edge.
-    // If there is a pending dyndep file, visit it now:
-    // * If the dyndep file is ready then load it now to get any
-    //   additional inputs and outputs for this and other edges.
-    //   Once the dyndep file is loaded it will no longer be pending
-    //   if any other edges encounter it, but they will already have
-    //   been updated.
-    // * If the dyndep file is not ready then since is known to be an
-    //   input to this edge, the edge will not be considered ready below.
-    //   Later during the build the dyndep file will become ready and be
-    //   loaded to update this edge before it can possibly be scheduled.
-    if (edge->dyndep_ && edge->dyndep_->dyndep_pending()) {
-      if (!RecomputeNodeDirty(edge->dyndep_, stack, validation_nodes, err))
-        return false;
+  while (!frames.empty()) {
+    // Pushing a frame invalidates |frame|, so every push is followed by
+    // going back around the loop.
+    const size_t depth = frames.size();
+    DirtyScanFrame* frame = &frames.back();
+    Edge* edge = frame->node->in_edge();
+
+    if (frame->phase == DirtyScanFrame::kStart) {
+      frame->phase = DirtyScanFrame::kLoadDeps;
+      // This is our first encounter with this edge.
+      // If there is a pending dyndep file, visit it now:
+      // * If the dyndep file is ready then load it now to get any
+      //   additional inputs and outputs for this and other edges.
+      //   Once the dyndep file is loaded it will no longer be pending
+      //   if any other edges encounter it, but they will already have
+      //   been updated.
+      // * If the dyndep file is not ready then since is known to be an
+      //   input to this edge, the edge will not be considered ready below.
+      //   Later during the build the dyndep file will become ready and be
+      //   loaded to update this edge before it can possibly be scheduled.
+      if (!edge->deps_loaded_ && edge->dyndep_ &&
+          edge->dyndep_->dyndep_pending()) {
+        frame->phase = DirtyScanFrame::kDyndepVisited;
+        if (!begin_visit(edge->dyndep_))
+          return false;
+        continue;
+      }
+    }
 
+    if (frame->phase == DirtyScanFrame::kDyndepVisited) {
+      frame->phase = DirtyScanFrame::kLoadDeps;
       if (!edge->dyndep_->in_edge() ||
           edge->dyndep_->in_edge()->outputs_ready()) {
         // The dyndep file is ready, so load it now.
@@ -136,90 +226,142 @@ bool DependencyScan::RecomputeNodeDirty(Node* node, std::vector<Node*>* stack,
           return false;
       }
     }
-  }
 
-  // Load output mtimes so we can compare them to the most recent input below.
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
-       o != edge->outputs_.end(); ++o) {
-    if (!(*o)->StatIfNecessary(disk_interface_, err))
-      return false;
-  }
+    if (frame->phase == DirtyScanFrame::kLoadDeps) {
+      frame->phase = DirtyScanFrame::kInputs;
 
-  if (!edge->deps_loaded_) {
-    // This is our first encounter with this edge.  Load discovered deps.
-    edge->deps_loaded_ = true;
-    if (!dep_loader_.LoadDeps(edge, err)) {
-      if (!err->empty())
+      // Load output mtimes so we can compare them to the most recent input
+      // below.
+      if (!Node::StatAllIfNecessary(disk_interface_, edge->outputs_, err))
         return false;
-      // Failed to load dependency info: rebuild to regenerate it.
-      // LoadDeps() did EXPLAIN() already, no need to do it here.
-      dirty = edge->deps_missing_ = true;
-    }
-  }
 
-  // Store any validation nodes from the edge for adding to the initial
-  // nodes.  Don't recurse into them, that would trigger the dependency
-  // cycle detector if the validation node depends on this node.
-  // RecomputeDirty will add the validation nodes to the initial nodes
-  // and recurse into them.
-  validation_nodes->insert(validation_nodes->end(),
-      edge->validations_.begin(), edge->validations_.end());
+      if (!edge->deps_loaded_) {
+        // This is our first encounter with this edge.  Load discovered deps.
+        edge->deps_loaded_ = true;
+        if (!dep_loader_.LoadDeps(edge, err)) {
+          if (!err->empty())
+            return false;
+          // Failed to load dependency info: rebuild to regenerate it.
+          // LoadDeps() did EXPLAIN() already, no need to do it here.
+          frame->dirty = edge->deps_missing_ = true;
+        }
+      }
 
-  // Visit all inputs; we're dirty if any of the inputs are dirty.
-  Node* most_recent_input = NULL;
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
-       i != edge->inputs_.end(); ++i) {
-    // Visit this input.
-    if (!RecomputeNodeDirty(*i, stack, validation_nodes, err))
-      return false;
+      // Store any validation nodes from the edge for adding to the initial
+      // nodes.  Don't recurse into them, that would trigger the dependency
+      // cycle detector if the validation node depends on this node.
+      // RecomputeDirty will add the validation nodes to the initial nodes
+      // and recurse into them.
+      validation_nodes->insert(validation_nodes->end(),
+          edge->validations_.begin(), edge->validations_.end());
 
-    // If an input is not ready, neither are our outputs.
-    if (Edge* in_edge = (*i)->in_edge()) {
-      if (!in_edge->outputs_ready_)
-        edge->outputs_ready_ = false;
+      if (!StatInputs(edge, err))
+        return false;
     }
 
-    if (!edge->is_order_only(i - edge->inputs_.begin())) {
-      // If a regular input is dirty (or missing), we're dirty.
-      // Otherwise consider mtime.
-      if ((*i)->dirty()) {
-        EXPLAIN("%s is dirty", (*i)->path().c_str());
-        dirty = true;
-      } else {
-        if (!most_recent_input || (*i)->mtime() > most_recent_input->mtime()) {
-          most_recent_input = *i;
+    // Visit all inputs; we're dirty if any of the inputs are dirty.
+    // Inputs are indexed rather than iterated: loading a dyndep file while
+    // visiting one may add more.
+    while (frame->next_input < edge->inputs_.size()) {
+      Node* input = edge->inputs_[frame->next_input];
+      if (!frame->input_visited) {
+        frame->input_visited = true;
+        if (!begin_visit(input))
+          return false;
+        if (frames.size() > depth)
+          break;  // Visit the input's in-edge first.
+      }
+
+      // If an input is not ready, neither are our outputs.
+      if (Edge* in_edge = input->in_edge()) {
+        if (!in_edge->outputs_ready_)
+          edge->outputs_ready_ = false;
+      }
+
+      if (!edge->is_order_only(frame->next_input)) {
+        // If a regular input is dirty (or missing), we're dirty.
+        // Otherwise consider mtime.
+        if (input->dirty()) {
+          EXPLAIN("%s is dirty", input->path().c_str());
+          frame->dirty = true;
+        } else {
+          if (!frame->most_recent_input ||
+              input->mtime() > frame->most_recent_input->mtime()) {
+            frame->most_recent_input = input;
+          }
         }
       }
+
+      frame->input_visited = false;
+      ++frame->next_input;
     }
-  }
+    if (frames.size() > depth)
+      continue;
+
+    // We may also be dirty due to output state: missing outputs, out of
+    // date outputs, etc.  Visit all outputs and determine whether they're
+    // dirty.
+    bool dirty = frame->dirty;
+    if (!dirty)
+      if (!RecomputeOutputsDirty(edge, frame->most_recent_input, &dirty, err))
+        return false;
 
-  // We may also be dirty due to output state: missing outputs, out of
-  // date outputs, etc.  Visit all outputs and determine whether they're dirty.
-  if (!dirty)
-    if (!RecomputeOutputsDirty(edge, most_recent_input, &dirty, err))
-      return false;
+    // Finally, visit each output and update their dirty state if necessary.
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      if (dirty)
+        (*o)->MarkDirty();
+    }
 
-  // Finally, visit each output and update their dirty state if necessary.
-  for (vector<Node*>::iterator o = edge->outputs_.begin();
-       o != edge->outputs_.end(); ++o) {
-    if (dirty)
-      (*o)->MarkDirty();
+    // If an edge is dirty, its outputs are normally not ready.  (It's
+    // possible to be clean but still not be ready in the presence of
+    // order-only inputs.)
+    // But phony edges with no inputs have nothing to do, so are always
+    // ready.
+    if (dirty && !(edge->is_phony() && edge->inputs_.empty()))
+      edge->outputs_ready_ = false;
+
+    // Mark the edge as finished during this walk now that it will no longer
+    // be on the stack.
+    edge->mark_ = Edge::VisitDone;
+    assert(stack->back() == frame->node);
+    stack->pop_back();
+    frames.pop_back();
+    if (observer_ && !observer_->EdgeScanned(edge, err))
+      return false;
   }
 
-  // If an edge is dirty, its outputs are normally not ready.  (It's
-  // possible to be clean but still not be ready in the presence of
-  // order-only inputs.)
-  // But phony edges with no inputs have nothing to do, so are always
-  // ready.
-  if (dirty && !(edge->is_phony() && edge->inputs_.empty()))
-    edge->outputs_ready_ = false;
+  return true;
+}
 
-  // Mark the edge as finished during this walk now that it will no longer
-  // be in the call stack.
-  edge->mark_ = Edge::VisitDone;
-  assert(stack->back() == node);
-  stack->pop_back();
+void DependencyScan::RecomputeLeafDirty(Node* node) {
+  if (!node->exists())
+    EXPLAIN("%s has no in-edge and is missing", node->path().c_str());
+  node->set_dirty(!node->exists());
+}
 
+bool DependencyScan::StatInputs(Edge* edge, string* err) {
+  // Only take inputs that are sources: files with no in-edge, or with just
+  // the phony in-edge ImplicitDepLoader gives discovered dependencies.
+  // Generated inputs are stat()ed when their own edge is visited, keeping
+  // the walk depth-first.
+  vector<Node*> sources;
+  vector<Node*> leaves;
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (in_edge && !in_edge->generated_by_dep_loader_)
+      continue;
+    sources.push_back(*i);
+    if (!in_edge && !(*i)->status_known())
+      leaves.push_back(*i);
+  }
+  if (!Node::StatAllIfNecessary(disk_interface_, sources, err))
+    return false;
+  // Visiting these leaves later will find their status already known, so
+  // settle their dirty state now.
+  for (vector<Node*>::iterator i = leaves.begin(); i != leaves.end(); ++i)
+    RecomputeLeafDirty(*i);
   return true;
 }
 
@@ -262,12 +404,41 @@ bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
   return false;
 }
 
+DependencyScan::DependencyScan(
+    State* state, BuildLog* build_log, DepsLog* deps_log,
+    DiskInterface* disk_interface,
+    DepfileParserOptions const* depfile_parser_options)
+    : state_(state),
+      build_log_(build_log),
+      snapshot_disk_(disk_interface),
+      disk_interface_(&snapshot_disk_),
+      depfile_parser_options_(depfile_parser_options),
+      observer_(NULL),
+      dep_loader_(state, deps_log, &snapshot_disk_, depfile_parser_options),
+      dyndep_loader_(state, &snapshot_disk_) {}
+
+DependencyScan::~DependencyScan() {}
+
+void DependencyScan::set_scan_threads(int threads) {
+  if (threads <= 1) {
+    parallel_scan_.reset();
+    return;
+  }
+  parallel_scan_.reset(new ParallelScan(state_, dep_loader_.deps_log(),
+                                        depfile_parser_options_,
+                                        &snapshot_disk_, threads));
+}
+
 bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
                                            bool* outputs_dirty, string* err) {
-  string command = edge->EvaluateCommand(/*incl_rsp_file=*/true);
+  uint64_t command_hash;
+  if (!parallel_scan_ || !parallel_scan_->CommandHash(edge, &command_hash)) {
+    command_hash = BuildLog::LogEntry::HashCommand(
+        edge->EvaluateCommand(/*incl_rsp_file=*/true));
+  }
   for (vector<Node*>::iterator o = edge->outputs_.begin();
        o != edge->outputs_.end(); ++o) {
-    if (RecomputeOutputDirty(edge, most_recent_input, command, *o)) {
+    if (RecomputeOutputDirty(edge, most_recent_input, command_hash, *o)) {
       *outputs_dirty = true;
       return true;
     }
@@ -277,7 +448,7 @@ bool DependencyScan::RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
 
 bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
                                           const Node* most_recent_input,
-                                          const string& command,
+                                          uint64_t command_hash,
                                           Node* output) {
   if (edge->is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
@@ -332,7 +503,7 @@ bool DependencyScan::RecomputeOutputDirty(const Edge* edge,
     bool generator = edge->GetBindingBool("generator");
     if (entry || (entry = build_log()->LookupByOutput(output->path()))) {
       if (!generator &&
-          BuildLog::LogEntry::HashCommand(command) != entry->command_hash) {
+          command_hash != entry->command_hash) {
         // May also be dirty due to the command changing since the last build.
         // But if this is a generator rule, the command changing does not make us
         // dirty.
@@ -16,10 +16,13 @@
 #define NINJA_GRAPH_H_
 
 #include <algorithm>
+#include <memory>
+#include <queue>
 #include <set>
 #include <string>
 #include <vector>
 
+#include "disk_interface.h"
 #include "dyndep.h"
 #include "eval_env.h"
 #include "timestamp.h"
@@ -31,6 +34,7 @@ struct DiskInterface;
 struct DepsLog;
 struct Edge;
 struct Node;
+struct ParallelScan;
 struct Pool;
 struct State;
 
@@ -60,6 +64,12 @@ struct Node {
     return Stat(disk_interface, err);
   }
 
+  /// Stat every node in |nodes| whose status is not yet known, with a single
+  /// DiskInterface::StatBatch() call.  Return false on error.
+  static bool StatAllIfNecessary(DiskInterface* disk_interface,
+                                 const std::vector<Node*>& nodes,
+                                 std::string* err);
+
   /// Mark as not-yet-stat()ed and not dirty.
   void ResetState() {
     mtime_ = -1;
@@ -75,6 +85,13 @@ struct Node {
     exists_ = ExistenceStatusMissing;
   }
 
+  /// Mark the Node as already-stat()ed, with the given result.
+  void MarkStatted(TimeStamp mtime) {
+    mtime_ = mtime;
+    exists_ = mtime != 0 ? ExistenceStatusExists : ExistenceStatusMissing;
+    dirty_ = false;
+  }
+
   bool exists() const {
     return exists_ == ExistenceStatusExists;
   }
@@ -170,10 +187,12 @@ struct Edge {
 
   Edge()
       : rule_(NULL), pool_(NULL), dyndep_(NULL), env_(NULL), mark_(VisitNone),
-        id_(0), outputs_ready_(false), deps_loaded_(false),
-        deps_missing_(false), generated_by_dep_loader_(false),
-        command_start_time_(0), implicit_deps_(0), order_only_deps_(0),
-        implicit_outs_(0) {}
+        id_(0), weight_(1), priority_(0), pending_inputs_(0), outputs_ready_(false),
+        deps_loaded_(false), deps_missing_(false),
+        generated_by_dep_loader_(false),
+        command_start_time_(0), critical_path_weight_(0), urgency_(0),
+        implicit_deps_(0),
+        order_only_deps_(0), implicit_outs_(0) {}
 
   /// Return true if all inputs' in-edges are ready.
   bool AllInputsReady() const;
@@ -208,6 +227,12 @@ struct Edge {
   std::shared_ptr<BindingEnv> env_;
   VisitMark mark_;
   size_t id_;
+  int weight_;
+  int priority_;
+  /// The number of inputs whose in-edge a Plan has yet to finish; the edge
+  /// is ready to run when this reaches 0.  Only kept up to date for the
+  /// edges in a Plan.
+  int pending_inputs_;
   bool outputs_ready_;
   bool deps_loaded_;
   bool deps_missing_;
@@ -216,9 +241,30 @@ struct Edge {
 
   const Rule& rule() const { return *rule_; }
   Pool* pool() const { return pool_; }
-  int weight() const { return 1; }
+
+  /// How much of its pool's depth this edge takes up while it runs.
+  int weight() const { return weight_; }
+  /// The manifest's hint for when to start this edge; edges with a higher
+  /// priority start before the others that are ready to run.
+  int priority() const { return priority_; }
   bool outputs_ready() const { return outputs_ready_; }
 
+  /// The estimated time, in milliseconds, of the longest chain of commands
+  /// from this edge to the end of the build, this edge's own included.
+  /// Plan starts the edges with the longest chains first.
+  int64_t critical_path_weight() const { return critical_path_weight_; }
+  void set_critical_path_weight(int64_t weight) {
+    critical_path_weight_ = weight;
+  }
+  int64_t critical_path_weight_;
+
+  /// Compared before the critical path weight to pick the edge to start
+  /// next, the higher first.  Set when a Plan wants the edge, according to
+  /// its scheduling policy (see BuildConfig::schedule).
+  int64_t urgency() const { return urgency_; }
+  void set_urgency(int64_t urgency) { urgency_ = urgency; }
+  int64_t urgency_;
+
   // There are three types of inputs.
   // 1) explicit deps, which show up as $in on the command line;
   // 2) implicit deps, which the target depends on implicitly (e.g. C headers),
@@ -229,11 +275,11 @@ struct Edge {
   // #2 and #3 when we need to access the various subsets.
   int implicit_deps_;
   int order_only_deps_;
-  bool is_implicit(size_t index) {
+  bool is_implicit(size_t index) const {
     return index >= inputs_.size() - order_only_deps_ - implicit_deps_ &&
         !is_order_only(index);
   }
-  bool is_order_only(size_t index) {
+  bool is_order_only(size_t index) const {
     return index >= inputs_.size() - order_only_deps_;
   }
 
@@ -260,6 +306,36 @@ struct EdgeCmp {
 
 typedef std::set<Edge*, EdgeCmp> EdgeSet;
 
+/// Orders edges by the manifest's priority, then urgency, then critical path
+/// weight, then by id so that edges of equal weight run in manifest order:
+/// of two edges, the one which should run first is the greater.
+struct EdgePriorityLess {
+  bool operator()(const Edge* a, const Edge* b) const {
+    if (a->priority() != b->priority())
+      return a->priority() < b->priority();
+    if (a->urgency() != b->urgency())
+      return a->urgency() < b->urgency();
+    if (a->critical_path_weight() != b->critical_path_weight())
+      return a->critical_path_weight() < b->critical_path_weight();
+    return a->id_ > b->id_;
+  }
+};
+
+/// The reverse of EdgePriorityLess, for sorting edges to run first first.
+struct EdgePriorityGreater {
+  bool operator()(const Edge* a, const Edge* b) const {
+    return EdgePriorityLess()(b, a);
+  }
+};
+
+/// A queue of edges ready to run, the edge which should run first on top.
+/// An edge's urgency and critical path weight must not change while it is
+/// queued.
+struct EdgePriorityQueue
+    : public std::priority_queue<Edge*, std::vector<Edge*>, EdgePriorityLess> {
+  void clear() { c.clear(); }
+};
+
 /// ImplicitDepLoader loads implicit dependencies, as referenced via the
 /// "depfile" attribute in build files.
 struct ImplicitDepLoader {
@@ -309,16 +385,21 @@ struct ImplicitDepLoader {
 };
 
 
+/// Told about each edge a DependencyScan finishes checking, which it does
+/// only after all the edges that edge depends on.
+struct ScanObserver {
+  virtual ~ScanObserver() {}
+  /// Returns false, filling in |err|, to stop the scan.
+  virtual bool EdgeScanned(Edge* edge, std::string* err) = 0;
+};
+
 /// DependencyScan manages the process of scanning the files in a graph
 /// and updating the dirty/outputs_ready state of all the nodes and edges.
 struct DependencyScan {
   DependencyScan(State* state, BuildLog* build_log, DepsLog* deps_log,
                  DiskInterface* disk_interface,
-                 DepfileParserOptions const* depfile_parser_options)
-      : build_log_(build_log),
-        disk_interface_(disk_interface),
-        dep_loader_(state, deps_log, disk_interface, depfile_parser_options),
-        dyndep_loader_(state, disk_interface) {}
+                 DepfileParserOptions const* depfile_parser_options);
+  ~DependencyScan();
 
   /// Update the |dirty_| state of the given nodes by transitively inspecting
   /// their input edges.
@@ -352,18 +433,47 @@ struct DependencyScan {
   bool LoadDyndeps(Node* node, std::string* err) const;
   bool LoadDyndeps(Node* node, DyndepFile* ddf, std::string* err) const;
 
+  /// Use |threads| threads to prefetch file state before each scan (see
+  /// ParallelScan).  The DiskInterface must then have a thread-safe
+  /// ReadFile().  A count of 1 or less scans serially, the default.
+  void set_scan_threads(int threads);
+
+  /// Tell |observer| about each edge RecomputeDirty() finishes, or stop
+  /// telling anybody if it is NULL.
+  void set_observer(ScanObserver* observer) { observer_ = observer; }
+
  private:
+  /// Walk the graph below |node| depth-first, updating dirty state.  The
+  /// walk uses an explicit stack, so it is not limited by the depth of the
+  /// graph.  |stack| holds the nodes whose in-edges are being visited, for
+  /// reporting cycles.
   bool RecomputeNodeDirty(Node* node, std::vector<Node*>* stack,
                           std::vector<Node*>* validation_nodes, std::string* err);
   bool VerifyDAG(Node* node, std::vector<Node*>* stack, std::string* err);
 
+  /// Update the dirty state of a node with no in-edge, whose status must be
+  /// known: it is dirty if it is missing.
+  void RecomputeLeafDirty(Node* node);
+
+  /// Stat the not yet stat()ed inputs of |edge| together, which is much
+  /// cheaper than one at a time when an edge has many inputs.  Leaf inputs
+  /// have their dirty state computed too.  Returns false on failure.
+  bool StatInputs(Edge* edge, std::string* err);
+
   /// Recompute whether a given single output should be marked dirty.
   /// Returns true if so.
   bool RecomputeOutputDirty(const Edge* edge, const Node* most_recent_input,
-                            const std::string& command, Node* output);
+                            uint64_t command_hash, Node* output);
 
+  State* state_;
   BuildLog* build_log_;
+  /// Serves whatever |parallel_scan_| prefetched; otherwise a pass-through
+  /// to the DiskInterface given at construction.
+  SnapshotDiskInterface snapshot_disk_;
   DiskInterface* disk_interface_;
+  DepfileParserOptions const* depfile_parser_options_;
+  std::unique_ptr<ParallelScan> parallel_scan_;
+  ScanObserver* observer_;
   ImplicitDepLoader dep_loader_;
   DyndepLoader dyndep_loader_;
 };
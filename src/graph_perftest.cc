@@ -0,0 +1,140 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Stress-tests DependencyScan::RecomputeDirty on a single chain of edges,
+// like a long code generation pipeline, and on a wide graph of the same
+// size for comparison.
+//
+// Usage: graph_perftest [number of edges, default 200000] [scan threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <string>
+
+#include "disk_interface.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+using namespace std;
+
+/// A DiskInterface where every file exists, older than the file it is
+/// built into, so that nothing is dirty and the whole graph is walked.
+struct FakeDiskInterface : public DiskInterface {
+  virtual TimeStamp Stat(const string& path, string* err) const {
+    map<string, TimeStamp>::const_iterator i = mtimes_.find(path);
+    return i == mtimes_.end() ? 1 : i->second;
+  }
+  virtual bool WriteFile(const string& path, const string& contents) {
+    return false;
+  }
+  virtual bool MakeDir(const string& path) { return false; }
+  virtual Status ReadFile(const string& path, string* contents, string* err) {
+    return NotFound;
+  }
+  virtual int RemoveFile(const string& path) { return 1; }
+
+  map<string, TimeStamp> mtimes_;
+};
+
+/// Build a graph of |count| edges.  A chain has each edge read the
+/// previous one's output; otherwise all edges read one source file and a
+/// final edge reads all their outputs.  The graph is built directly rather
+/// than parsed, to keep the benchmark about the scan.
+void CreateGraph(State* state, const Rule* rule, FakeDiskInterface* disk,
+                 int count, bool chain) {
+  char buf[64];
+  for (int i = 1; i <= count; ++i) {
+    Edge* edge = state->AddEdge(rule);
+    if (chain)
+      snprintf(buf, sizeof(buf), "gen/out%d", i - 1);
+    else
+      snprintf(buf, sizeof(buf), "src/in");
+    state->AddIn(edge, buf, 0);
+    snprintf(buf, sizeof(buf), "gen/out%d", i);
+    state->AddOut(edge, buf, 0);
+    disk->mtimes_[buf] = i + 1;
+  }
+  if (!chain) {
+    Edge* edge = state->AddEdge(rule);
+    for (int i = 1; i <= count; ++i) {
+      snprintf(buf, sizeof(buf), "gen/out%d", i);
+      state->AddIn(edge, buf, 0);
+    }
+    state->AddOut(edge, "gen/all", 0);
+    disk->mtimes_["gen/all"] = count + 2;
+  }
+}
+
+bool Run(const char* name, int count, bool chain, int threads) {
+  Rule rule("cat");
+  EvalString command;
+  command.AddText("cat ");
+  command.AddSpecial("in");
+  command.AddText(" > ");
+  command.AddSpecial("out");
+  rule.AddBinding("command", command);
+
+  State state;
+  FakeDiskInterface disk;
+  CreateGraph(&state, &rule, &disk, count, chain);
+  Node* target = state.edges_.back()->outputs_[0];
+  string err;
+
+  const int kNumRepetitions = 5;
+  int min = 0;
+  float total = 0;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    state.Reset();
+    DependencyScan scan(&state, NULL, NULL, &disk, NULL);
+    scan.set_scan_threads(threads);
+    int64_t start = GetTimeMillis();
+    if (!scan.RecomputeDirty(target, NULL, &err)) {
+      fprintf(stderr, "%s: %s\n", name, err.c_str());
+      return false;
+    }
+    int delta = (int)(GetTimeMillis() - start);
+    if (target->dirty()) {
+      fprintf(stderr, "%s: target unexpectedly dirty\n", name);
+      return false;
+    }
+    if (i == 0 || delta < min)
+      min = delta;
+    total += delta;
+  }
+  printf("%-6s %d edges, %d threads: min %dms  avg %.1fms\n", name, count,
+         threads, min, total / kNumRepetitions);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int count = 200000;
+  int threads = 1;
+  if (argc > 1)
+    count = atoi(argv[1]);
+  if (argc > 2)
+    threads = atoi(argv[2]);
+  if (count <= 0 || threads <= 0) {
+    fprintf(stderr, "usage: %s [number of edges] [scan threads]\n", argv[0]);
+    return 1;
+  }
+  if (!Run("chain", count, true, threads) ||
+      !Run("wide", count, false, threads))
+    return 1;
+  return 0;
+}
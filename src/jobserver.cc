@@ -0,0 +1,267 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include "string_piece_util.h"
+
+using namespace std;
+
+bool JobserverConfig::Parse(const string& makeflags, string* err) {
+  // The last --jobserver-auth wins; older makes call it --jobserver-fds.
+  string value;
+  vector<StringPiece> words = SplitStringPiece(makeflags, ' ');
+  for (size_t i = 0; i < words.size(); ++i) {
+    string word = words[i].AsString();
+    if (word.compare(0, 17, "--jobserver-auth=") == 0)
+      value = word.substr(17);
+    else if (word.compare(0, 16, "--jobserver-fds=") == 0)
+      value = word.substr(16);
+  }
+  mode = kModeNone;
+  if (value.empty())
+    return true;
+
+  if (value.compare(0, 5, "fifo:") == 0) {
+    path = value.substr(5);
+    if (path.empty()) {
+      *err = "empty jobserver fifo path";
+      return false;
+    }
+#ifndef _WIN32
+    if (access(path.c_str(), R_OK | W_OK) < 0) {
+      *err = "jobserver fifo " + path + ": " + strerror(errno);
+      return false;
+    }
+#endif
+    mode = kModeFifo;
+    return true;
+  }
+
+  char* end;
+  long r = strtol(value.c_str(), &end, 10);
+  long w = -1;
+  if (*end == ',')
+    w = strtol(end + 1, &end, 10);
+  if (end == value.c_str() || *end != '\0') {
+    // e.g. the semaphore names of make on Windows.
+    *err = "unsupported jobserver '" + value + "'";
+    return false;
+  }
+  // make passes negative fds when it has no jobserver for us.
+  if (r < 0 || w < 0)
+    return true;
+#ifdef _WIN32
+  *err = "unsupported jobserver '" + value + "'";
+  return false;
+#else
+  if (fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0) {
+    *err = "jobserver pipe " + value + " is not open to this process "
+           "(does the make rule lack a '+' prefix?)";
+    return false;
+  }
+  mode = kModePipe;
+  read_fd = (int)r;
+  write_fd = (int)w;
+  return true;
+#endif
+}
+
+JobserverClient::~JobserverClient() {
+  Release(0);
+#ifndef _WIN32
+  if (owns_read_fd_)
+    close(read_fd_);
+  if (owns_write_fd_)
+    close(write_fd_);
+#endif
+}
+
+bool JobserverClient::Connect(const JobserverConfig& config, string* err) {
+#ifdef _WIN32
+  *err = "jobserver is not supported on Windows";
+  return false;
+#else
+  if (config.mode == JobserverConfig::kModeFifo) {
+    int fd = open(config.path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      *err = "open jobserver fifo " + config.path + ": " + strerror(errno);
+      return false;
+    }
+    read_fd_ = write_fd_ = fd;
+    owns_read_fd_ = true;
+    return true;
+  }
+  if (config.mode != JobserverConfig::kModePipe) {
+    *err = "no jobserver";
+    return false;
+  }
+  // The pipe is shared with make and its other children, so we must not
+  // make it non-blocking for them.  On Linux reopening it through /proc
+  // gives us a non-blocking end of our own.
+  char proc_path[64];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", config.read_fd);
+  read_fd_ = open(proc_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  owns_read_fd_ = read_fd_ >= 0;
+  if (read_fd_ < 0)
+    read_fd_ = config.read_fd;
+  write_fd_ = config.write_fd;
+  return true;
+#endif
+}
+
+bool JobserverClient::ReadToken(char* token) {
+#ifdef _WIN32
+  return false;
+#else
+  if (!owns_read_fd_) {
+    // Without a non-blocking end, check that there is a token before
+    // reading; another client may still beat us to it.
+    pollfd pfd = { read_fd_, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+      return false;
+  }
+  for (;;) {
+    ssize_t n = read(read_fd_, token, 1);
+    if (n == 1)
+      return true;
+    if (n < 0 && errno == EINTR)
+      continue;
+    return false;
+  }
+#endif
+}
+
+bool JobserverClient::Acquire(size_t jobs) {
+  if (read_fd_ < 0)
+    return true;
+  // The first job runs on the slot this process itself was started with.
+  while (tokens_.size() + 1 < jobs) {
+    char token;
+    if (!ReadToken(&token))
+      return false;
+    tokens_.push_back(token);
+  }
+  return true;
+}
+
+void JobserverClient::Release(size_t jobs) {
+#ifndef _WIN32
+  size_t keep = jobs > 0 ? jobs - 1 : 0;
+  while (tokens_.size() > keep) {
+    char token = tokens_.back();
+    ssize_t n = write(write_fd_, &token, 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    // A failed write loses the token for the rest of this build, which is
+    // all we can do about it.
+    tokens_.pop_back();
+  }
+#endif
+}
+
+namespace {
+
+/// The fifos to remove when the process exits.
+vector<string>* g_jobserver_fifos = NULL;
+
+void RemoveJobserverFifos() {
+#ifndef _WIN32
+  for (size_t i = 0; i < g_jobserver_fifos->size(); ++i)
+    unlink((*g_jobserver_fifos)[i].c_str());
+#endif
+}
+
+}  // anonymous namespace
+
+JobserverServer::~JobserverServer() {
+#ifndef _WIN32
+  if (fd_ >= 0)
+    close(fd_);
+  if (!path_.empty()) {
+    unlink(path_.c_str());
+    g_jobserver_fifos->erase(find(g_jobserver_fifos->begin(),
+                                  g_jobserver_fifos->end(), path_));
+  }
+#endif
+}
+
+bool JobserverServer::Start(int slots, JobserverConfig* config, string* err) {
+#ifdef _WIN32
+  *err = "jobserver is not supported on Windows";
+  return false;
+#else
+  // All tokens go in the fifo up front, so they have to fit in its buffer.
+  if (slots < 1 || slots > 4096) {
+    *err = "a jobserver needs a -j between 1 and 4096";
+    return false;
+  }
+  static int count = 0;
+  const char* tmpdir = getenv("TMPDIR");
+  char name[64];
+  snprintf(name, sizeof(name), "/ninja-jobserver-%d-%d", (int)getpid(),
+           count++);
+  string path = string(tmpdir && *tmpdir ? tmpdir : "/tmp") + name;
+  if (mkfifo(path.c_str(), 0600) < 0) {
+    *err = "mkfifo " + path + ": " + strerror(errno);
+    return false;
+  }
+  if (!g_jobserver_fifos) {
+    g_jobserver_fifos = new vector<string>;
+    atexit(RemoveJobserverFifos);
+  }
+  g_jobserver_fifos->push_back(path);
+  path_ = path;
+
+  // Keep the fifo open for as long as we serve it, so that it never reads
+  // as end of file.
+  fd_ = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd_ < 0) {
+    *err = "open " + path + ": " + strerror(errno);
+    return false;
+  }
+  string tokens(slots - 1, '+');
+  if (!tokens.empty() &&
+      write(fd_, tokens.data(), tokens.size()) != (ssize_t)tokens.size()) {
+    *err = "fill jobserver fifo: " + string(strerror(errno));
+    return false;
+  }
+
+  char flags[32];
+  snprintf(flags, sizeof(flags), "-j%d", slots);
+  string makeflags;
+  if (const char* old = getenv("MAKEFLAGS"))
+    makeflags = string(old) + " ";
+  makeflags += string(flags) + " --jobserver-auth=fifo:" + path;
+  setenv("MAKEFLAGS", makeflags.c_str(), 1);
+
+  config->mode = JobserverConfig::kModeFifo;
+  config->path = path;
+  return true;
+#endif
+}
@@ -0,0 +1,90 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_JOBSERVER_H_
+#define NINJA_JOBSERVER_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+/// Where to find a GNU make jobserver, as passed down in MAKEFLAGS with
+/// --jobserver-auth=fifo:PATH or --jobserver-auth=R,W.
+struct JobserverConfig {
+  enum Mode {
+    kModeNone,
+    kModePipe,
+    kModeFifo,
+  };
+
+  JobserverConfig() : mode(kModeNone), read_fd(-1), write_fd(-1) {}
+
+  /// Parse the jobserver settings out of a MAKEFLAGS value.  Leaves the mode
+  /// at kModeNone if there are none, and fails if they are unusable.
+  bool Parse(const std::string& makeflags, std::string* err);
+
+  Mode mode;
+  int read_fd;
+  int write_fd;
+  std::string path;
+};
+
+/// Takes job tokens from a jobserver.  Like every jobserver client, this
+/// process may always run one job without a token.
+struct JobserverClient {
+  JobserverClient() : read_fd_(-1), write_fd_(-1), owns_read_fd_(false),
+                      owns_write_fd_(false) {}
+  ~JobserverClient();
+
+  bool Connect(const JobserverConfig& config, std::string* err);
+
+  /// Make sure there are tokens to run |jobs| jobs at once, without
+  /// waiting for any.  Returns false if the jobserver has none to spare.
+  bool Acquire(size_t jobs);
+
+  /// Hand back the tokens that are not needed to run |jobs| jobs.
+  void Release(size_t jobs);
+
+  size_t tokens() const { return tokens_.size(); }
+
+ private:
+  bool ReadToken(char* token);
+
+  int read_fd_;
+  int write_fd_;
+  bool owns_read_fd_;
+  bool owns_write_fd_;
+  /// The tokens read, to be written back as they were.
+  std::vector<char> tokens_;
+};
+
+/// Serves a jobserver to the commands this process runs, through a fifo
+/// named in the MAKEFLAGS of their environment.
+struct JobserverServer {
+  JobserverServer() : fd_(-1) {}
+  ~JobserverServer();
+
+  /// Create a jobserver for |slots| jobs at once, export it through
+  /// MAKEFLAGS, and fill in |config| so that this process can use it too.
+  bool Start(int slots, JobserverConfig* config, std::string* err);
+
+  const std::string& path() const { return path_; }
+
+ private:
+  int fd_;
+  std::string path_;
+};
+
+#endif  // NINJA_JOBSERVER_H_
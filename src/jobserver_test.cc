@@ -0,0 +1,152 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+TEST(JobserverTest, ParseMakeflags) {
+  JobserverConfig config;
+  string err;
+  EXPECT_TRUE(config.Parse("", &err));
+  EXPECT_EQ(JobserverConfig::kModeNone, config.mode);
+  EXPECT_TRUE(config.Parse("kw -j4", &err));
+  EXPECT_EQ(JobserverConfig::kModeNone, config.mode);
+  // make -j without a jobserver for this command.
+  EXPECT_TRUE(config.Parse(" -j4 --jobserver-auth=-2,-2", &err));
+  EXPECT_EQ(JobserverConfig::kModeNone, config.mode);
+
+  EXPECT_FALSE(config.Parse("--jobserver-auth=fifo:", &err));
+  EXPECT_EQ("empty jobserver fifo path", err);
+  EXPECT_FALSE(config.Parse("--jobserver-auth=gmake_semaphore_1234", &err));
+  EXPECT_EQ("unsupported jobserver 'gmake_semaphore_1234'", err);
+}
+
+#ifndef _WIN32
+
+TEST(JobserverTest, ParsePipe) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  char makeflags[64];
+  // Older makes say --jobserver-fds, and the last setting wins.
+  snprintf(makeflags, sizeof(makeflags),
+           " -j4 --jobserver-auth=98,99 --jobserver-fds=%d,%d", fds[0],
+           fds[1]);
+  JobserverConfig config;
+  string err;
+  EXPECT_TRUE(config.Parse(makeflags, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(JobserverConfig::kModePipe, config.mode);
+  EXPECT_EQ(fds[0], config.read_fd);
+  EXPECT_EQ(fds[1], config.write_fd);
+  close(fds[0]);
+  close(fds[1]);
+
+  // A rule without make's '+' prefix doesn't get the pipe.
+  EXPECT_FALSE(config.Parse(makeflags, &err));
+}
+
+TEST(JobserverTest, PipeClient) {
+  // A fake make: a pipe holding two tokens.
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_EQ(2, write(fds[1], "ab", 2));
+  JobserverConfig config;
+  config.mode = JobserverConfig::kModePipe;
+  config.read_fd = fds[0];
+  config.write_fd = fds[1];
+
+  {
+    JobserverClient client;
+    string err;
+    ASSERT_TRUE(client.Connect(config, &err));
+
+    // The first job needs no token.
+    EXPECT_TRUE(client.Acquire(1));
+    EXPECT_EQ(0u, client.tokens());
+    EXPECT_TRUE(client.Acquire(3));
+    EXPECT_EQ(2u, client.tokens());
+    EXPECT_FALSE(client.Acquire(4));
+
+    client.Release(2);
+    EXPECT_EQ(1u, client.tokens());
+    // The client leaves the pipe blocking for everybody else.
+    EXPECT_EQ(0, (fcntl(fds[0], F_GETFL) & O_NONBLOCK));
+  }
+
+  // All tokens are back in the pipe, as they were.
+  char tokens[3];
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  EXPECT_EQ(2, read(fds[0], tokens, sizeof(tokens)));
+  EXPECT_EQ('b', tokens[0]);
+  EXPECT_EQ('a', tokens[1]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(JobserverTest, Server) {
+  const char* old = getenv("MAKEFLAGS");
+  string old_makeflags = old ? old : "";
+  setenv("MAKEFLAGS", "k", 1);
+
+  string path;
+  {
+    JobserverServer server;
+    JobserverConfig config;
+    string err;
+    ASSERT_TRUE(server.Start(3, &config, &err));
+    path = server.path();
+    EXPECT_EQ(JobserverConfig::kModeFifo, config.mode);
+    EXPECT_EQ(path, config.path);
+
+    // Commands find the jobserver through MAKEFLAGS.
+    EXPECT_EQ("k -j3 --jobserver-auth=fifo:" + path,
+              string(getenv("MAKEFLAGS")));
+    JobserverConfig child;
+    EXPECT_TRUE(child.Parse(getenv("MAKEFLAGS"), &err));
+    EXPECT_EQ(JobserverConfig::kModeFifo, child.mode);
+
+    // Two clients share the 3 jobs.
+    JobserverClient a, b;
+    ASSERT_TRUE(a.Connect(config, &err));
+    ASSERT_TRUE(b.Connect(child, &err));
+    EXPECT_TRUE(a.Acquire(2));
+    EXPECT_TRUE(b.Acquire(2));
+    EXPECT_FALSE(a.Acquire(3));
+    b.Release(1);
+    EXPECT_TRUE(a.Acquire(3));
+    EXPECT_EQ(2u, a.tokens());
+  }
+  // The fifo goes away with the server.
+  EXPECT_NE(0, access(path.c_str(), F_OK));
+
+  if (old)
+    setenv("MAKEFLAGS", old_makeflags.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+}
+
+#endif  // _WIN32
+
+}  // anonymous namespace
@@ -28,6 +28,7 @@
 #include <sys/time.h>
 #endif
 
+#include "command_output.h"
 #include "util.h"
 
 using namespace std;
@@ -147,6 +148,40 @@ void LinePrinter::PrintOnNewLine(const string& to_print) {
   have_blank_line_ = to_print.empty() || *to_print.rbegin() == '\n';
 }
 
+void LinePrinter::PrintOnNewLine(const CommandOutput& output,
+                                 bool strip_ansi) {
+  if (!output.spilled()) {
+    PrintOnNewLine(strip_ansi ? StripAnsiEscapeCodes(output.data())
+                              : output.data());
+    return;
+  }
+
+  PrintOnNewLine("");
+  if (!strip_ansi && !console_locked_) {
+    output.WriteTo(stdout);
+  } else {
+    // Escape codes don't span lines, so strip them a few lines at a time.
+    string chunk(256 << 10, '\0');
+    string pending;
+    size_t offset = 0;
+    while (offset < output.size()) {
+      size_t len = output.Read(offset, &chunk[0], chunk.size());
+      offset += len;
+      pending.append(chunk, 0, len);
+      size_t end = offset < output.size() ? pending.rfind('\n') + 1
+                                          : pending.size();
+      if (end == 0)
+        continue;
+      string lines = strip_ansi
+                         ? StripAnsiEscapeCodes(pending.substr(0, end))
+                         : pending.substr(0, end);
+      PrintOrBuffer(lines.data(), lines.size());
+      pending.erase(0, end);
+    }
+  }
+  have_blank_line_ = output.back() == '\n';
+}
+
 void LinePrinter::SetConsoleLocked(bool locked) {
   if (locked == console_locked_)
     return;
@@ -18,6 +18,8 @@
 #include <stddef.h>
 #include <string>
 
+struct CommandOutput;
+
 /// Prints lines of text, possibly overprinting previously printed lines
 /// if the terminal supports it.
 struct LinePrinter {
@@ -39,6 +41,10 @@ struct LinePrinter {
   /// Prints a string on a new line, not overprinting previous output.
   void PrintOnNewLine(const std::string& to_print);
 
+  /// Prints the output of a command on a new line, streaming it if it
+  /// spilled out of memory.  Optionally strips ANSI escape codes from it.
+  void PrintOnNewLine(const CommandOutput& output, bool strip_ansi);
+
   /// Lock or unlock the console.  Any output sent to the LinePrinter while the
   /// console is locked will not be printed until it is unlocked.
   void SetConsoleLocked(bool locked);
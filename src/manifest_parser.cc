@@ -15,6 +15,8 @@
 #include "manifest_parser.h"
 #include "manifest_to_bin_parser.h"
 
+#include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <vector>
 
@@ -188,7 +190,93 @@ bool ManifestParser::ParsePool(string* err) {
   if (depth < 0)
     return lexer_.Error("invalid pool depth", err, node->depth_position);
 
-  state_->AddPool(new Pool(name, depth));
+  Pool* pool = new Pool(name, depth);
+  auto resources = node->resources.elements(in_->buffer);
+  for (size_t i = 0; i < resources.size(); ++i) {
+    string resource = resources[i].name.c_str(in_->buffer);
+    auto position = node->resource_positions.elements(in_->buffer)[i];
+    auto capacity_str = Evaluate(env_.get(),
+                                 resources[i].value.elements(in_->buffer));
+    char* end;
+    long capacity = strtol(capacity_str.c_str(), &end, 10);
+    if (capacity_str.empty() || *end != '\0' || capacity < 0 ||
+        capacity > INT_MAX) {
+      delete pool;
+      return lexer_.Error("invalid capacity for resource '" + resource + "'",
+                          err, position);
+    }
+    if (!pool->AddResource(resource, (int)capacity)) {
+      delete pool;
+      return lexer_.Error("duplicate resource '" + resource + "'", err,
+                          position);
+    }
+  }
+
+  state_->AddPool(pool);
+  return true;
+}
+
+bool ManifestParser::ParseEdgeScheduling(Edge* edge, string* err) {
+  Pool* pool = edge->pool();
+  string weight = edge->GetBinding("weight");
+  if (!weight.empty()) {
+    char* end;
+    long value = strtol(weight.c_str(), &end, 10);
+    if (*end != '\0' || value < 0 || value > INT_MAX) {
+      *err = "invalid weight '" + weight + "'";
+      return false;
+    }
+    if (pool->depth() != 0 && value > pool->depth()) {
+      *err = "weight " + weight + " exceeds depth of pool '" + pool->name() +
+             "'";
+      return false;
+    }
+    edge->weight_ = (int)value;
+  }
+
+  // resources = name=amount [name=amount ...]
+  string resources = edge->GetBinding("resources");
+  size_t pos = 0;
+  while ((pos = resources.find_first_not_of(' ', pos)) != string::npos) {
+    size_t next = resources.find(' ', pos);
+    string item = resources.substr(pos, next - pos);
+    pos = next;
+
+    size_t eq = item.find('=');
+    char* end = NULL;
+    long amount = 0;
+    if (eq != string::npos && eq != item.size() - 1)
+      amount = strtol(item.c_str() + eq + 1, &end, 10);
+    if (eq == 0 || !end || *end != '\0' || amount < 0 || amount > INT_MAX) {
+      *err = "invalid resource use '" + item + "'";
+      return false;
+    }
+    string name = item.substr(0, eq);
+    int index = pool->FindResource(name);
+    if (index < 0) {
+      *err = "unknown resource '" + name + "' in pool '" + pool->name() + "'";
+      return false;
+    }
+    if (amount > pool->resources()[index].capacity) {
+      *err = "use of resource '" + name + "' exceeds capacity of pool '" +
+             pool->name() + "'";
+      return false;
+    }
+    pool->SetResourceUse(*edge, index, (int)amount);
+  }
+
+  string priority = edge->GetBinding("priority");
+  if (!priority.empty()) {
+    char* end;
+    errno = 0;
+    long value = strtol(priority.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || value < INT_MIN ||
+        value > INT_MAX) {
+      *err = "invalid priority '" + priority + "'";
+      return false;
+    }
+    edge->priority_ = (int)value;
+  }
   return true;
 }
 
@@ -262,6 +350,10 @@ bool ManifestParser::ParseEdge(string* err) {
     edge->pool_ = pool;
   }
 
+  string scheduling_err;
+  if (!ParseEdgeScheduling(edge, &scheduling_err))
+    return lexer_.Error(scheduling_err, err, node->final_position);
+
   edge->outputs_.reserve(outs.size());
   for (size_t i = 0, e = outs.size(); i != e; ++i) {
     string path = outs[i].Evaluate(env.get());
@@ -20,6 +20,7 @@
 #include <memory>
 
 struct BindingEnv;
+struct Edge;
 struct EvalString;
 class manifest_istream;
 
@@ -43,6 +44,9 @@ private:
   bool ParsePool(std::string* err);
   bool ParseRule(std::string* err);
   bool ParseEdge(std::string* err);
+  /// Set the pool weight, resource use and priority of |edge| from its
+  /// bindings.
+  bool ParseEdgeScheduling(Edge* edge, std::string* err);
   bool ParseDefault(std::string* err);
 
   /// Parse either a 'subninja' or 'include' line.
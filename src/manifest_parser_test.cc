@@ -72,6 +72,53 @@ TEST_F(ParserTest, RuleAttributes) {
 ));
 }
 
+TEST_F(ParserTest, PoolResources) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link_pool\n"
+"  depth = 4\n"
+"  mem = 64000\n"
+"  cpu = 16\n"
+"rule link\n"
+"  command = ld $in -o $out\n"
+"  pool = link_pool\n"
+"  weight = 2\n"
+"  resources = mem=30000 cpu=8\n"
+"build a: link a.o\n"
+"build b: link b.o\n"
+"  resources = cpu=1\n"));
+
+  Pool* pool = state.LookupPool("link_pool");
+  ASSERT_TRUE(pool);
+  ASSERT_EQ(2u, pool->resources().size());
+  EXPECT_EQ("mem", pool->resources()[0].name);
+  EXPECT_EQ(64000, pool->resources()[0].capacity);
+  EXPECT_EQ(16, pool->resources()[1].capacity);
+
+  Edge* a = state.LookupNode("a")->in_edge();
+  EXPECT_EQ(2, a->weight());
+  EXPECT_EQ(30000, pool->ResourceUse(*a, 0));
+  EXPECT_EQ(8, pool->ResourceUse(*a, 1));
+  Edge* b = state.LookupNode("b")->in_edge();
+  EXPECT_EQ(0, pool->ResourceUse(*b, 0));
+  EXPECT_EQ(1, pool->ResourceUse(*b, 1));
+}
+
+TEST_F(ParserTest, Priority) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule pack\n"
+"  command = tar cf $out $in\n"
+"  priority = -10\n"
+"build a: pack a.in\n"
+"build b: pack b.in\n"
+"  priority = 5\n"
+"build c: pack c.in\n"
+"  priority = 0\n"));
+
+  EXPECT_EQ(-10, state.LookupNode("a")->in_edge()->priority());
+  EXPECT_EQ(5, state.LookupNode("b")->in_edge()->priority());
+  EXPECT_EQ(0, state.LookupNode("c")->in_edge()->priority());
+}
+
 TEST_F(ParserTest, IgnoreIndentedComments) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(
 "  #indented comment\n"
@@ -818,13 +865,70 @@ TEST_F(ParserTest, Errors) {
     ManifestParser parser(&local_state, NULL);
     string err;
     EXPECT_FALSE(parser.ParseTest("pool foo\n"
-                                  "  bar = 1\n", &err));
-    EXPECT_EQ("input:2: unexpected variable 'bar'\n"
-              "  bar = 1\n"
-              "         ^ near here"
+                                  "  depth = 1\n"
+                                  "  mem = lots\n", &err));
+    EXPECT_EQ("input:3: invalid capacity for resource 'mem'\n"
+              "  mem = lots\n"
+              "            ^ near here"
               , err);
   }
 
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 2\n"
+                                  "rule run\n"
+                                  "  command = echo\n"
+                                  "  pool = foo\n"
+                                  "  weight = 3\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:8: weight 3 exceeds depth of pool 'foo'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "  priority = high\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:5: invalid priority 'high'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 2\n"
+                                  "  mem = 8\n"
+                                  "rule run\n"
+                                  "  command = echo\n"
+                                  "  pool = foo\n"
+                                  "build out: run in\n"
+                                  "  resources = cpu=1\n", &err));
+    EXPECT_EQ("input:9: unknown resource 'cpu' in pool 'foo'\n", err);
+  }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 2\n"
+                                  "  mem = 8\n"
+                                  "rule run\n"
+                                  "  command = echo\n"
+                                  "  pool = foo\n"
+                                  "build out: run in\n"
+                                  "  resources = mem=9\n", &err));
+    EXPECT_EQ("input:9: use of resource 'mem' exceeds capacity of pool 'foo'\n",
+              err);
+  }
+
   {
     State local_state;
     ManifestParser parser(&local_state, NULL);
@@ -148,11 +148,13 @@ struct __attribute__((packed)) DefaultNode : man_node {
 struct __attribute__((packed)) PoolNode : man_node {
   man_string name;
   man_eval_string depth;
+  man_vector<man_binding> resources;
+  man_vector<uint64_t> resource_positions;
   uint64_t pool_position;
   uint64_t depth_position;
 };
 
-const uint16_t MANIFEST_SCHEMA_VERSION = 1;
+const uint16_t MANIFEST_SCHEMA_VERSION = 2;
 const uint16_t MANIFEST_SCHEMA_CHECKSUM = sizeof(PoolNode)
     + sizeof(DefaultNode)
     + sizeof(BindingNode)
@@ -328,6 +330,8 @@ class manifest_ostream
   void WritePool(
       const std::string & name,
       man_eval_string depth,
+      const std::vector<man_binding>& resources,
+      const std::vector<uint64_t>& resource_positions,
       uint64_t pool_position,
       uint64_t depth_position,
       uint64_t final_position) {
@@ -336,6 +340,8 @@ class manifest_ostream
     data.size = sizeof(data);
     data.name = String(name);
     data.depth = depth;
+    data.resources = Vector<man_binding>(resources);
+    data.resource_positions = Vector<uint64_t>(resource_positions);
     data.pool_position = pool_position;
     data.depth_position = depth_position;
     out_.write(reinterpret_cast<const char*>(&data), data.size);
@@ -98,16 +98,23 @@ bool ManifestToBinParser::ParsePool(string* err) {
 
   EvalString depth_value;
   size_t depth_position = SIZE_MAX;
+  vector<man_binding> resources;
+  vector<uint64_t> resource_positions;
 
   while (lexer_.PeekToken(Lexer::INDENT)) {
     string key;
-    if (!ParseLet(&key, &depth_value, err))
+    EvalString value;
+    if (!ParseLet(&key, &value, err))
       return false;
 
-    if (key != "depth") {
-      return lexer_.Error("unexpected variable '" + key + "'", err);
+    if (key == "depth") {
+      depth_value = value;
+      depth_position = lexer_.GetPosition();
+    } else {
+      // Any other variable declares a named resource and its capacity.
+      resources.emplace_back(out_->String(key), out_->EvalString(value));
+      resource_positions.push_back(lexer_.GetPosition());
     }
-    depth_position = lexer_.GetPosition();
   }
 
   if (depth_position == SIZE_MAX)
@@ -116,6 +123,8 @@ bool ManifestToBinParser::ParsePool(string* err) {
   out_->WritePool(
       name,
       out_->EvalString(depth_value),
+      resources,
+      resource_positions,
       pool_position,
       depth_position,
       lexer_.GetPosition()
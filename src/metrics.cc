@@ -47,8 +47,11 @@ constexpr int64_t GetFrequency() {
 }
 
 int64_t TimerToMicros(int64_t dt) {
-  // dt is in ticks.  We want microseconds.
-  return (dt * 1000000) / GetFrequency();
+  // dt is in ticks.  We want microseconds.  Multiplying first would
+  // overflow after a few hours of nanosecond ticks.
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::duration(dt))
+      .count();
 }
 
 int64_t TimerToMicros(double dt) {
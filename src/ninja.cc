@@ -20,6 +20,8 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <map>
+#include <set>
 
 #ifdef _WIN32
 #include "getopt.h"
@@ -36,17 +38,23 @@
 #include "browse.h"
 #include "build.h"
 #include "build_log.h"
+#include "build_snapshot.h"
 #include "deps_log.h"
 #include "clean.h"
 #include "debug_flags.h"
 #include "depfile_parser.h"
 #include "disk_interface.h"
+#include "failure_log.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "jobserver.h"
 #include "json.h"
 #include "manifest_parser.h"
 #include "metrics.h"
 #include "missing_deps.h"
+#ifndef _WIN32
+#include "remote.h"
+#endif
 #include "state.h"
 #include "status.h"
 #include "util.h"
@@ -82,6 +90,13 @@ struct Options {
 
   /// Whether phony cycles should warn or print an error.
   bool phony_cycle_should_err;
+
+  /// File listing the files changed since the last build, or "-" for
+  /// stdin; see BuildSnapshot.
+  const char* changed_file;
+
+  /// Whether to serve a jobserver to the commands run.
+  bool serve_jobserver;
 };
 
 /// The Ninja main() loads up a series of data structures; various tools need
@@ -137,7 +152,9 @@ struct NinjaMain : public BuildLogUser {
   int ToolRestat(const Options* options, int argc, char* argv[]);
   int ToolUrtle(const Options* options, int argc, char** argv);
   int ToolRules(const Options* options, int argc, char* argv[]);
+  int ToolResources(const Options* options, int argc, char* argv[]);
   int ToolWinCodePage(const Options* options, int argc, char* argv[]);
+  int ToolRemoteWorker(const Options* options, int argc, char* argv[]);
 
   /// Open the build log.
   /// @return false on error.
@@ -158,7 +175,7 @@ struct NinjaMain : public BuildLogUser {
 
   /// Build the targets listed on the command line.
   /// @return an exit code.
-  int RunBuild(int argc, char** argv, Status* status);
+  int RunBuild(const Options* options, int argc, char** argv, Status* status);
 
   /// Dump the output requested by '-d stats'.
   void DumpMetrics();
@@ -227,9 +244,27 @@ void Usage(const BuildConfig& config) {
 "  -f FILE  specify input build file [default=build.ninja]\n"
 "\n"
 "  -j N     run N jobs in parallel (0 means infinity) [default=%d on this system]\n"
+"  --jobserver  share the -j limit with commands through a make jobserver\n"
+"  --adaptive-jobs MIN:MAX  raise or lower -j between MIN and MAX as cpu\n"
+"                           use and pressure change\n"
 "  -k N     keep going until N jobs fail (0 means infinity) [default=1]\n"
 "  -l N     do not start new jobs if the load average is greater than N\n"
+"  --max-pressure LIST  do not start new jobs while cpu or memory pressure\n"
+"                       is too high, e.g. cpu=80,memory=10,memory_use=90\n"
 "  -n       dry run (don't run commands but act like they succeeded)\n"
+"  --scan-threads N  check the graph for dirty files with N threads\n"
+"                    (0 means one per processor) [default=1]\n"
+"  --pipelined-scan  start commands while still checking the graph\n"
+"  --schedule POLICY  which commands to start first: critical-path (the\n"
+"                     longest chain of commands) or fail-fast (those which\n"
+"                     failed last time, then those with the newest inputs)\n"
+"                     [default=critical-path]\n"
+"  --direct-exec     run commands without /bin/sh where they don't need it\n"
+"  --remote HOST:PORT  run commands on the worker at HOST:PORT (see\n"
+"                      '-t remote-worker'); repeat for more workers\n"
+"  --remote-jobs N   run N commands on workers at once [default=-j per worker]\n"
+"  --changed FILE    only check files downstream of those listed in FILE\n"
+"                    (- for stdin), trusting the last build for the rest\n"
 "\n"
 "  -d MODE  enable debugging (use '-d list' to list modes)\n"
 "  -t TOOL  run a subtool (use '-t list' to list subtools)\n"
@@ -677,6 +712,94 @@ int NinjaMain::ToolRules(const Options* options, int argc, char* argv[]) {
   return 0;
 }
 
+namespace {
+
+/// The resource usage of the commands of one rule, as in the build log.
+struct RuleResources {
+  RuleResources() : edges(0), wall_millis(0) {}
+  int edges;
+  int64_t wall_millis;
+  /// Totals, but for |max_rss_kb| which is the largest of any command.
+  ResourceUsage usage;
+};
+
+bool MoreCpuTime(const pair<string, RuleResources>& a,
+                 const pair<string, RuleResources>& b) {
+  int64_t a_cpu = a.second.usage.user_millis + a.second.usage.system_millis;
+  int64_t b_cpu = b.second.usage.user_millis + b.second.usage.system_millis;
+  if (a_cpu != b_cpu)
+    return a_cpu > b_cpu;
+  return a.first < b.first;
+}
+
+}  // anonymous namespace
+
+int NinjaMain::ToolResources(const Options* options, int argc, char* argv[]) {
+  // The resources tool uses getopt, and expects argv[0] to contain the name
+  // of the tool, i.e. "resources".
+  argc++;
+  argv--;
+
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("h"))) != -1) {
+    switch (opt) {
+    case 'h':
+    default:
+      printf("usage: ninja -t resources\n"
+             "\n"
+             "Summarize the resource usage recorded in the build log by rule,\n"
+             "for the outputs still in the manifest.\n");
+      return 1;
+    }
+  }
+
+  map<string, RuleResources> rules;
+  set<const Edge*> seen;
+  const BuildLog::Entries& entries = build_log_.entries();
+  for (BuildLog::Entries::const_iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    const BuildLog::LogEntry& entry = *i->second;
+    // Logs before v7 didn't record any.
+    if (entry.usage == ResourceUsage())
+      continue;
+    Node* node = state_.LookupNode(entry.output);
+    if (!node || !node->in_edge())
+      continue;
+    // Each output of an edge has the same entry.
+    const Edge* edge = node->in_edge();
+    if (!seen.insert(edge).second)
+      continue;
+
+    RuleResources& rule = rules[edge->rule().name()];
+    ++rule.edges;
+    rule.wall_millis += entry.end_time - entry.start_time;
+    rule.usage.user_millis += entry.usage.user_millis;
+    rule.usage.system_millis += entry.usage.system_millis;
+    rule.usage.max_rss_kb = max(rule.usage.max_rss_kb, entry.usage.max_rss_kb);
+    rule.usage.read_bytes += entry.usage.read_bytes;
+    rule.usage.write_bytes += entry.usage.write_bytes;
+  }
+
+  vector<pair<string, RuleResources> > sorted(rules.begin(), rules.end());
+  sort(sorted.begin(), sorted.end(), MoreCpuTime);
+
+  printf("%-24s %7s %10s %10s %10s %9s %10s %10s\n", "rule", "edges",
+         "user s", "system s", "wall s", "max rss M", "read M", "written M");
+  const double kMiB = 1024.0 * 1024.0;
+  for (vector<pair<string, RuleResources> >::const_iterator i =
+           sorted.begin();
+       i != sorted.end(); ++i) {
+    const RuleResources& rule = i->second;
+    printf("%-24s %7d %10.1f %10.1f %10.1f %9.1f %10.1f %10.1f\n",
+           i->first.c_str(), rule.edges, rule.usage.user_millis / 1000.0,
+           rule.usage.system_millis / 1000.0, rule.wall_millis / 1000.0,
+           rule.usage.max_rss_kb / 1024.0, rule.usage.read_bytes / kMiB,
+           rule.usage.write_bytes / kMiB);
+  }
+  return 0;
+}
+
 #ifdef _WIN32
 int NinjaMain::ToolWinCodePage(const Options* options, int argc, char* argv[]) {
   if (argc != 0) {
@@ -688,6 +811,28 @@ int NinjaMain::ToolWinCodePage(const Options* options, int argc, char* argv[]) {
 }
 #endif
 
+#ifndef _WIN32
+int NinjaMain::ToolRemoteWorker(const Options* options, int argc,
+                                char* argv[]) {
+  if (argc != 1) {
+    printf("usage: ninja -t remote-worker [HOST:]PORT\n"
+           "\n"
+           "Run the commands of builds started with --remote HOST:PORT, each in a\n"
+           "temporary directory.  HOST defaults to 127.0.0.1.  There is no\n"
+           "authentication: whoever can connect can run any command.\n");
+    return 1;
+  }
+  string err;
+  int fd = ListenRemote(argv[0], &err);
+  if (fd < 0) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  ServeRemote(fd);
+  return 0;
+}
+#endif
+
 enum PrintCommandMode { PCM_Single, PCM_All };
 void PrintCommands(Edge* edge, EdgeSet* seen, PrintCommandMode mode) {
   if (!edge)
@@ -1107,10 +1252,16 @@ const Tool* ChooseTool(const string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCompilationDatabase },
     { "recompact",  "recompacts ninja-internal data structures",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRecompact },
+#ifndef _WIN32
+    { "remote-worker",  "run commands for builds elsewhere that use --remote",
+      Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolRemoteWorker },
+#endif
     { "restat",  "restats all outputs in the build log",
       Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolRestat },
     { "rules",  "list all rules",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRules },
+    { "resources",  "summarize the resource usage in the build log by rule",
+      Tool::RUN_AFTER_LOGS, &NinjaMain::ToolResources },
     { "cleandead",  "clean built files that are no longer produced by the manifest",
       Tool::RUN_AFTER_LOGS, &NinjaMain::ToolCleanDead },
     { "urtle", NULL,
@@ -1158,8 +1309,11 @@ bool DebugEnable(const string& name) {
 "  explain      explain what caused a command to execute\n"
 "  keepdepfile  don't delete depfiles after they're read by ninja\n"
 "  keeprsp      don't delete @response files on success\n"
+"  jobs         log the changes --adaptive-jobs makes to the jobs limit\n"
 #ifdef _WIN32
 "  nostatcache  don't batch stat() calls per directory and cache them\n"
+#elif defined(__linux__)
+"  statcache    batch stat() calls per directory and cache them\n"
 #endif
 "multiple modes can be enabled via -d FOO -d BAR\n");
     return false;
@@ -1175,14 +1329,20 @@ bool DebugEnable(const string& name) {
   } else if (name == "keeprsp") {
     g_keep_rsp = true;
     return true;
+  } else if (name == "jobs") {
+    g_debug_jobs = true;
+    return true;
   } else if (name == "nostatcache") {
     g_experimental_statcache = false;
     return true;
+  } else if (name == "statcache") {
+    g_experimental_statcache = true;
+    return true;
   } else {
     const char* suggestion =
         SpellcheckString(name.c_str(),
                          "stats", "explain", "keepdepfile", "keeprsp",
-                         "nostatcache", NULL);
+                         "jobs", "nostatcache", "statcache", NULL);
     if (suggestion) {
       Error("unknown debug setting '%s', did you mean '%s'?",
             name.c_str(), suggestion);
@@ -1329,7 +1489,40 @@ bool NinjaMain::EnsureBuildDirExists() {
   return true;
 }
 
-int NinjaMain::RunBuild(int argc, char** argv, Status* status) {
+/// Read the paths listed one per line in |path|, or in stdin if it is "-".
+bool ReadChangedPaths(const char* path, vector<string>* paths, string* err) {
+  string contents;
+  if (strcmp(path, "-") == 0) {
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), stdin)) > 0)
+      contents.append(buf, len);
+    if (ferror(stdin)) {
+      *err = string("reading stdin: ") + strerror(errno);
+      return false;
+    }
+  } else if (::ReadFile(path, &contents, err) < 0) {
+    *err = string("reading ") + path + ": " + *err;
+    return false;
+  }
+
+  size_t start = 0;
+  while (start < contents.size()) {
+    size_t end = contents.find('\n', start);
+    if (end == string::npos)
+      end = contents.size();
+    string line = contents.substr(start, end - start);
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.resize(line.size() - 1);
+    if (!line.empty())
+      paths->push_back(line);
+    start = end + 1;
+  }
+  return true;
+}
+
+int NinjaMain::RunBuild(const Options* options, int argc, char** argv,
+                        Status* status) {
   string err;
   vector<Node*> targets;
   if (!CollectTargetsFromArgs(argc, argv, &targets, &err)) {
@@ -1337,10 +1530,70 @@ int NinjaMain::RunBuild(int argc, char** argv, Status* status) {
     return 1;
   }
 
-  disk_interface_.AllowStatCache(g_experimental_statcache);
+  // Commands started while the graph is scanned may change files the
+  // cache has already listed.
+  disk_interface_.AllowStatCache(g_experimental_statcache &&
+                                 !config_.pipelined_scan);
+
+  // Once a build has used --changed, keep its snapshot up to date.
+  string snapshot_path = ".ninja_snapshot";
+  if (!build_dir_.empty())
+    snapshot_path = build_dir_ + "/" + snapshot_path;
+  BuildSnapshot snapshot;
+  LoadStatus snapshot_status = snapshot.Load(snapshot_path, &disk_interface_,
+                                             &err);
+  if (snapshot_status == LOAD_ERROR) {
+    Warning("ignoring %s: %s", snapshot_path.c_str(), err.c_str());
+    snapshot = BuildSnapshot();
+    err.clear();
+  }
+  bool use_snapshot = options->changed_file ||
+                      snapshot_status == LOAD_SUCCESS;
+  TimeStamp manifest_mtime = 0;
+  if (use_snapshot) {
+    manifest_mtime = disk_interface_.Stat(options->input_file, &err);
+    if (manifest_mtime == -1) {
+      status->Error("%s", err.c_str());
+      return 1;
+    }
+  }
+  if (options->changed_file) {
+    vector<string> changed;
+    if (!ReadChangedPaths(options->changed_file, &changed, &err)) {
+      status->Error("%s", err.c_str());
+      return 1;
+    }
+    if (!snapshot.Apply(&state_, &deps_log_, changed, manifest_mtime, &err)) {
+      EXPLAIN("checking every file: %s", err.c_str());
+      err.clear();
+    }
+  }
+
+  // Commands may change files as soon as the scan starts them.
+  use_snapshot = use_snapshot && !config_.dry_run;
+  bool snapshot_valid = snapshot_status == LOAD_SUCCESS && use_snapshot;
+  if (snapshot_valid && config_.pipelined_scan) {
+    if (!snapshot.Invalidate(snapshot_path, &disk_interface_, &err)) {
+      status->Error("%s", err.c_str());
+      return 1;
+    }
+    snapshot_valid = false;
+  }
+
+  // Remember the commands that fail, to run them first next time.
+  string failures_path = ".ninja_failures";
+  if (!build_dir_.empty())
+    failures_path = build_dir_ + "/" + failures_path;
+  FailureLog failure_log;
+  if (failure_log.Load(failures_path, &disk_interface_, &err) == LOAD_ERROR) {
+    Warning("ignoring %s: %s", failures_path.c_str(), err.c_str());
+    failure_log = FailureLog();
+    err.clear();
+  }
 
   Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_,
                   status, start_time_millis_);
+  builder.SetFailureLog(&failure_log);
   for (size_t i = 0; i < targets.size(); ++i) {
     if (!builder.AddTarget(targets[i], &err)) {
       if (!err.empty()) {
@@ -1358,17 +1611,34 @@ int NinjaMain::RunBuild(int argc, char** argv, Status* status) {
 
   if (builder.AlreadyUpToDate()) {
     status->Info("no work to do.");
-    return 0;
-  }
+  } else {
+    // The build is about to change files, and may not finish.
+    if (snapshot_valid &&
+        !snapshot.Invalidate(snapshot_path, &disk_interface_, &err)) {
+      status->Error("%s", err.c_str());
+      return 1;
+    }
 
-  if (!builder.Build(&err)) {
-    status->Info("build stopped: %s.", err.c_str());
-    if (err.find("interrupted by user") != string::npos) {
-      return 2;
+    bool built = builder.Build(&err);
+    string write_err;
+    if (!config_.dry_run &&
+        !failure_log.Write(failures_path, &disk_interface_, &write_err))
+      status->Error("%s", write_err.c_str());
+    if (!built) {
+      status->Info("build stopped: %s.", err.c_str());
+      if (err.find("interrupted by user") != string::npos) {
+        return 2;
+      }
+      return 1;
     }
-    return 1;
   }
 
+  if (use_snapshot &&
+      !snapshot.Write(snapshot_path, &state_, manifest_mtime, &disk_interface_,
+                      &err)) {
+    status->Error("%s", err.c_str());
+    return 1;
+  }
   return 0;
 }
 
@@ -1418,12 +1688,25 @@ int ReadFlags(int* argc, char*** argv,
               Options* options, BuildConfig* config) {
   DeferGuessParallelism deferGuessParallelism(config);
 
-  enum { OPT_VERSION = 1, OPT_QUIET = 2 };
+  enum { OPT_VERSION = 1, OPT_QUIET = 2, OPT_SCAN_THREADS = 3,
+         OPT_CHANGED = 4, OPT_MAX_PRESSURE = 5, OPT_JOBSERVER = 6,
+         OPT_PIPELINED_SCAN = 7, OPT_SCHEDULE = 8, OPT_ADAPTIVE_JOBS = 9,
+         OPT_DIRECT_EXEC = 10, OPT_REMOTE = 11, OPT_REMOTE_JOBS = 12 };
   const option kLongOptions[] = {
     { "help", no_argument, NULL, 'h' },
     { "version", no_argument, NULL, OPT_VERSION },
     { "verbose", no_argument, NULL, 'v' },
     { "quiet", no_argument, NULL, OPT_QUIET },
+    { "scan-threads", required_argument, NULL, OPT_SCAN_THREADS },
+    { "changed", required_argument, NULL, OPT_CHANGED },
+    { "max-pressure", required_argument, NULL, OPT_MAX_PRESSURE },
+    { "jobserver", no_argument, NULL, OPT_JOBSERVER },
+    { "adaptive-jobs", required_argument, NULL, OPT_ADAPTIVE_JOBS },
+    { "pipelined-scan", no_argument, NULL, OPT_PIPELINED_SCAN },
+    { "schedule", required_argument, NULL, OPT_SCHEDULE },
+    { "direct-exec", no_argument, NULL, OPT_DIRECT_EXEC },
+    { "remote", required_argument, NULL, OPT_REMOTE },
+    { "remote-jobs", required_argument, NULL, OPT_REMOTE_JOBS },
     { NULL, 0, NULL, 0 }
   };
 
@@ -1471,6 +1754,21 @@ int ReadFlags(int* argc, char*** argv,
         config->max_load_average = value;
         break;
       }
+      case OPT_JOBSERVER:
+        options->serve_jobserver = true;
+        break;
+      case OPT_ADAPTIVE_JOBS: {
+        string err;
+        if (!config->adaptive_jobs.Parse(optarg, &err))
+          Fatal("--adaptive-jobs: %s", err.c_str());
+        break;
+      }
+      case OPT_MAX_PRESSURE: {
+        string err;
+        if (!config->pressure_limits.Parse(optarg, &err))
+          Fatal("--max-pressure: %s", err.c_str());
+        break;
+      }
       case 'n':
         config->dry_run = true;
         break;
@@ -1485,6 +1783,45 @@ int ReadFlags(int* argc, char*** argv,
       case OPT_QUIET:
         config->verbosity = BuildConfig::NO_STATUS_UPDATE;
         break;
+      case OPT_CHANGED:
+        options->changed_file = optarg;
+        break;
+      case OPT_PIPELINED_SCAN:
+        config->pipelined_scan = true;
+        break;
+      case OPT_DIRECT_EXEC:
+        config->direct_exec = true;
+        break;
+      case OPT_REMOTE:
+#ifdef _WIN32
+        Fatal("--remote is not supported on Windows");
+#endif
+        config->remote_workers.push_back(optarg);
+        break;
+      case OPT_REMOTE_JOBS: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value <= 0)
+          Fatal("invalid --remote-jobs parameter");
+        config->remote_parallelism = value;
+        break;
+      }
+      case OPT_SCHEDULE:
+        if (strcmp(optarg, "critical-path") == 0)
+          config->schedule = BuildConfig::SCHEDULE_CRITICAL_PATH;
+        else if (strcmp(optarg, "fail-fast") == 0)
+          config->schedule = BuildConfig::SCHEDULE_FAIL_FAST;
+        else
+          Fatal("unknown --schedule policy '%s'", optarg);
+        break;
+      case OPT_SCAN_THREADS: {
+        char* end;
+        int value = strtol(optarg, &end, 10);
+        if (*end != 0 || value < 0)
+          Fatal("invalid --scan-threads parameter");
+        config->scan_threads = value > 0 ? value : GetProcessorCount();
+        break;
+      }
       case 'w':
         if (!WarningEnable(optarg, options))
           return 1;
@@ -1505,6 +1842,18 @@ int ReadFlags(int* argc, char*** argv,
   *argv += optind;
   *argc -= optind;
 
+  // Under the jobserver of a parent make, its tokens limit the jobs run.
+  if (const char* makeflags = getenv("MAKEFLAGS")) {
+    string err;
+    if (!config->jobserver.Parse(makeflags, &err)) {
+      Warning("ignoring jobserver: %s", err.c_str());
+    } else if (config->jobserver.mode != JobserverConfig::kModeNone &&
+               deferGuessParallelism.needGuess) {
+      deferGuessParallelism.needGuess = false;
+      config->parallelism = INT_MAX;
+    }
+  }
+
   return -1;
 }
 
@@ -1523,6 +1872,15 @@ NORETURN void real_main(int argc, char** argv) {
   if (exit_code >= 0)
     exit(exit_code);
 
+  // Lives until exit(), which removes its fifo.
+  static JobserverServer jobserver;
+  if (options.serve_jobserver && !options.tool && !config.dry_run &&
+      config.jobserver.mode == JobserverConfig::kModeNone) {
+    string err;
+    if (!jobserver.Start(config.parallelism, &config.jobserver, &err))
+      Fatal("--jobserver: %s", err.c_str());
+  }
+
   Status* status = new StatusPrinter(config);
 
   if (options.working_dir) {
@@ -1589,7 +1947,7 @@ NORETURN void real_main(int argc, char** argv) {
       exit(1);
     }
 
-    int result = ninja.RunBuild(argc, argv, status);
+    int result = ninja.RunBuild(&options, argc, argv, status);
     if (g_metrics)
       ninja.DumpMetrics();
     exit(result);
@@ -0,0 +1,181 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "parallel_scan.h"
+
+#include <functional>
+
+#include "build_log.h"
+#include "depfile_parser.h"
+#include "deps_log.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "thread_pool.h"
+#include "util.h"
+
+using namespace std;
+
+ParallelScan::ParallelScan(State* state, DepsLog* deps_log,
+                           const DepfileParserOptions* depfile_parser_options,
+                           SnapshotDiskInterface* snapshot, int num_threads)
+    : state_(state), deps_log_(deps_log),
+      depfile_parser_options_(depfile_parser_options), snapshot_(snapshot),
+      num_threads_(num_threads), edge_count_(0) {}
+
+ParallelScan::~ParallelScan() {}
+
+void ParallelScan::Prefetch(Node* node) {
+  METRIC_RECORD("parallel scan prefetch");
+  if (!pool_)
+    pool_.reset(new ThreadPool(num_threads_));
+  GrowEdgeStates();
+
+  VisitNode(node);
+  pool_->Wait();
+
+  vector<string> paths;
+  for (size_t i = 0; i < kStripes; ++i) {
+    vector<string>& pending = stripes_[i].pending;
+    paths.insert(paths.end(), pending.begin(), pending.end());
+    pending.clear();
+  }
+  vector<TimeStamp> mtimes;
+  string err;
+  // On failure, leave every path for the serial scan to stat() and report.
+  if (snapshot_->disk()->StatBatch(paths, &mtimes, &err)) {
+    for (size_t i = 0; i < paths.size(); ++i)
+      snapshot_->AddStat(paths[i], mtimes[i]);
+  }
+
+  for (vector<EdgeResult>::iterator r = edge_results_.begin();
+       r != edge_results_.end(); ++r) {
+    if (r->depfile.empty())
+      continue;
+    snapshot_->AddFile(r->depfile, r->depfile_status, &r->depfile_contents);
+    r->depfile.clear();
+  }
+}
+
+bool ParallelScan::CommandHash(const Edge* edge, uint64_t* hash) const {
+  if ((size_t)edge->id_ >= edge_results_.size() ||
+      !edge_results_[edge->id_].has_command_hash)
+    return false;
+  *hash = edge_results_[edge->id_].command_hash;
+  return true;
+}
+
+void ParallelScan::GrowEdgeStates() {
+  size_t count = state_->edges_.size();
+  if (count <= edge_count_)
+    return;
+  unique_ptr<atomic<bool>[]> claimed(new atomic<bool>[count]);
+  for (size_t i = 0; i < count; ++i)
+    claimed[i] = i < edge_count_ && edge_claimed_[i].load();
+  edge_claimed_.swap(claimed);
+  edge_count_ = count;
+  edge_results_.resize(count);
+}
+
+bool ParallelScan::ClaimEdge(const Edge* edge) {
+  // Edges added since Prefetch() began (there should be none) are left to
+  // the serial scan.
+  if ((size_t)edge->id_ >= edge_count_)
+    return false;
+  return !edge_claimed_[edge->id_].exchange(true);
+}
+
+void ParallelScan::ClaimPath(const string& path) {
+  Stripe& stripe = stripes_[hash<string>()(path) % kStripes];
+  lock_guard<mutex> lock(stripe.mutex);
+  if (stripe.claimed.insert(path).second)
+    stripe.pending.push_back(path);
+}
+
+void ParallelScan::VisitNode(Node* node) {
+  Edge* in_edge = node->in_edge();
+  if (!in_edge) {
+    ClaimPath(node->path());
+    return;
+  }
+  if (ClaimEdge(in_edge))
+    pool_->Post([this, in_edge]() { VisitEdge(in_edge); });
+}
+
+void ParallelScan::VisitEdge(Edge* edge) {
+  EdgeResult* result = &edge_results_[edge->id_];
+
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o)
+    ClaimPath((*o)->path());
+
+  if (!edge->is_phony()) {
+    result->command_hash = BuildLog::LogEntry::HashCommand(
+        edge->EvaluateCommand(/*incl_rsp_file=*/true));
+    result->has_command_hash = true;
+  }
+
+  // Discovered dependencies, as ImplicitDepLoader will find them.  Stale
+  // ones are harmless: at worst, a few paths are stat()ed needlessly.
+  string deps_type = edge->GetBinding("deps");
+  if (!deps_type.empty()) {
+    DepsLog::Deps* deps =
+        deps_log_ && !edge->outputs_.empty()
+            ? deps_log_->GetDeps(edge->outputs_[0]) : NULL;
+    if (deps) {
+      for (int i = 0; i < deps->node_count; ++i)
+        VisitNode(deps->nodes[i]);
+    }
+  } else {
+    string depfile = edge->GetUnescapedDepfile();
+    if (!depfile.empty())
+      ReadDepfile(depfile, result);
+  }
+
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i)
+    VisitNode(*i);
+}
+
+void ParallelScan::ReadDepfile(const string& path, EdgeResult* result) {
+  string contents, err;
+  FileReader::Status status = snapshot_->disk()->ReadFile(path, &contents, &err);
+  if (status == FileReader::OtherError)
+    return;  // Let the serial scan report it.
+
+  if (status == FileReader::Okay && !contents.empty()) {
+    // The parser works in place, and the serial scan will parse the
+    // original again.
+    string copy = contents;
+    DepfileParser parser(depfile_parser_options_
+                         ? *depfile_parser_options_
+                         : DepfileParserOptions());
+    if (parser.Parse(&copy, &err)) {
+      for (vector<StringPiece>::iterator i = parser.ins_.begin();
+           i != parser.ins_.end(); ++i) {
+        uint64_t slash_bits;
+        CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits);
+        Node* node = state_->LookupNode(*i);
+        if (node)
+          VisitNode(node);
+        else
+          ClaimPath(i->AsString());
+      }
+    }
+  }
+
+  result->depfile = path;
+  result->depfile_status = status;
+  result->depfile_contents.swap(contents);
+}
@@ -0,0 +1,117 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_PARALLEL_SCAN_H_
+#define NINJA_PARALLEL_SCAN_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "disk_interface.h"
+
+struct DepfileParserOptions;
+struct DepsLog;
+struct Edge;
+struct Node;
+struct State;
+struct ThreadPool;
+
+/// ParallelScan gathers, on a pool of threads, what a DependencyScan of
+/// the graph below a node will ask of the disk: the mtime of every output,
+/// input and discovered dependency, and the contents of depfiles.  It also
+/// computes each edge's command hash.
+///
+/// Results go into a SnapshotDiskInterface, or are kept per edge; the graph
+/// itself is only read.  The DependencyScan that follows makes every
+/// decision, in its usual order, so its results and its EXPLAIN output
+/// are the same as without the prefetch.
+///
+/// Depfiles are read from the worker threads, so the DiskInterface behind
+/// the snapshot must have a thread-safe ReadFile().
+struct ParallelScan {
+  ParallelScan(State* state, DepsLog* deps_log,
+               const DepfileParserOptions* depfile_parser_options,
+               SnapshotDiskInterface* snapshot, int num_threads);
+  ~ParallelScan();
+
+  /// Fill the snapshot for the graph below |node|.  Edges and paths handled
+  /// by an earlier call are skipped.  Errors are left for the serial scan
+  /// to find and report.
+  void Prefetch(Node* node);
+
+  /// Get the hash of the command of |edge| (see BuildLog::LogEntry), if
+  /// Prefetch() computed it.
+  bool CommandHash(const Edge* edge, uint64_t* hash) const;
+
+ private:
+  /// What a worker found for one edge.  Only the thread that claimed the
+  /// edge writes to it.
+  struct EdgeResult {
+    EdgeResult() : has_command_hash(false), command_hash(0),
+                   depfile_status(FileReader::NotFound) {}
+    bool has_command_hash;
+    uint64_t command_hash;
+    std::string depfile;
+    FileReader::Status depfile_status;
+    std::string depfile_contents;
+  };
+
+  /// Paths are claimed in stripes, so workers rarely contend for a lock.
+  struct Stripe {
+    std::mutex mutex;
+    std::unordered_set<std::string> claimed;
+    /// Claimed paths not yet stat()ed.
+    std::vector<std::string> pending;
+  };
+
+  /// Make room to track every edge of the graph.
+  void GrowEdgeStates();
+
+  /// Claim |edge| for the calling thread; false if it was claimed already.
+  bool ClaimEdge(const Edge* edge);
+
+  /// Arrange for |path| to be stat()ed, unless it was already.
+  void ClaimPath(const std::string& path);
+
+  /// Visit the edge producing |node|, or claim |node|'s path if it is a
+  /// source file.
+  void VisitNode(Node* node);
+
+  /// Gather what the scan will need for |edge|; runs on a worker thread.
+  void VisitEdge(Edge* edge);
+
+  void ReadDepfile(const std::string& path, EdgeResult* result);
+
+  State* state_;
+  DepsLog* deps_log_;
+  const DepfileParserOptions* depfile_parser_options_;
+  SnapshotDiskInterface* snapshot_;
+  int num_threads_;
+  std::unique_ptr<ThreadPool> pool_;
+
+  /// Whether each edge, indexed by Edge::id_, has been claimed.
+  std::unique_ptr<std::atomic<bool>[]> edge_claimed_;
+  size_t edge_count_;
+  /// Indexed like |edge_claimed_|.
+  std::vector<EdgeResult> edge_results_;
+
+  static const size_t kStripes = 64;
+  Stripe stripes_[kStripes];
+};
+
+#endif  // NINJA_PARALLEL_SCAN_H_
@@ -0,0 +1,111 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Stress-tests the Plan's bookkeeping as edges finish, with every edge
+// feeding one aggregate edge (like a final link or archive step).
+//
+// Usage: plan_perftest [number of edges, default 100000]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+#include "build.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+
+using namespace std;
+
+/// Build a graph of |count| edges reading one source file, and a final
+/// edge reading all their outputs.
+void CreateGraph(State* state, const Rule* rule, int count) {
+  char buf[64];
+  for (int i = 1; i <= count; ++i) {
+    Edge* edge = state->AddEdge(rule);
+    state->AddIn(edge, "src/in", 0);
+    snprintf(buf, sizeof(buf), "gen/out%d", i);
+    state->AddOut(edge, buf, 0);
+  }
+  Edge* edge = state->AddEdge(rule);
+  for (int i = 1; i <= count; ++i) {
+    snprintf(buf, sizeof(buf), "gen/out%d", i);
+    state->AddIn(edge, buf, 0);
+  }
+  state->AddOut(edge, "gen/all", 0);
+}
+
+bool Run(int count) {
+  Rule rule("cat");
+  EvalString command;
+  command.AddText("cat ");
+  command.AddSpecial("in");
+  command.AddText(" > ");
+  command.AddSpecial("out");
+  rule.AddBinding("command", command);
+
+  State state;
+  CreateGraph(&state, &rule, count);
+  Node* target = state.edges_.back()->outputs_[0];
+  string err;
+
+  const int kNumRepetitions = 3;
+  int min = 0;
+  float total = 0;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    state.Reset();
+    for (vector<Edge*>::iterator e = state.edges_.begin();
+         e != state.edges_.end(); ++e)
+      (*e)->outputs_[0]->MarkDirty();
+
+    int64_t start = GetTimeMillis();
+    Plan plan;
+    if (!plan.AddTarget(target, &err)) {
+      fprintf(stderr, "%s\n", err.c_str());
+      return false;
+    }
+    int finished = 0;
+    while (Edge* edge = plan.FindWork()) {
+      if (!plan.EdgeFinished(edge, Plan::kEdgeSucceeded, &err)) {
+        fprintf(stderr, "%s\n", err.c_str());
+        return false;
+      }
+      ++finished;
+    }
+    int delta = (int)(GetTimeMillis() - start);
+    if (plan.more_to_do() || finished != (int)state.edges_.size()) {
+      fprintf(stderr, "only %d edges ran\n", finished);
+      return false;
+    }
+    if (i == 0 || delta < min)
+      min = delta;
+    total += delta;
+  }
+  printf("%d edges into one: min %dms  avg %.1fms\n", count, min,
+         total / kNumRepetitions);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int count = 100000;
+  if (argc > 1)
+    count = atoi(argv[1]);
+  if (count <= 0) {
+    fprintf(stderr, "usage: %s [number of edges]\n", argv[0]);
+    return 1;
+  }
+  return Run(count) ? 0 : 1;
+}
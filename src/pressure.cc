@@ -0,0 +1,164 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pressure.h"
+
+#include <stdlib.h>
+
+#include "debug_flags.h"
+#include "util.h"
+
+using namespace std;
+
+bool ParsePressure(const string& contents, double* avg10) {
+  // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  // full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  size_t line = 0;
+  while (line < contents.size()) {
+    if (contents.compare(line, 11, "some avg10=") == 0) {
+      const char* start = contents.c_str() + line + 11;
+      char* end;
+      *avg10 = strtod(start, &end);
+      return end != start;
+    }
+    line = contents.find('\n', line);
+    if (line == string::npos)
+      break;
+    ++line;
+  }
+  return false;
+}
+
+namespace {
+
+/// Read a file holding a single integer, as cgroup files do.  Returns -1 if
+/// it is missing or holds something else (e.g. "max").
+int64_t ReadCount(const string& path) {
+  string contents, err;
+  if (path.empty() || ::ReadFile(path, &contents, &err) < 0)
+    return -1;
+  char* end;
+  int64_t value = strtoll(contents.c_str(), &end, 10);
+  if (end == contents.c_str() || (*end != '\0' && *end != '\n'))
+    return -1;
+  return value;
+}
+
+}  // namespace
+
+PressureReader::PressureReader()
+    : located_(false), proc_pressure_dir_("/proc/pressure") {}
+
+PressureReader::PressureReader(const string& cgroup_dir,
+                               const string& proc_pressure_dir)
+    : located_(true), cgroup_dir_(cgroup_dir),
+      proc_pressure_dir_(proc_pressure_dir) {}
+
+double PressureReader::ReadPressure(const string& cgroup_file,
+                                    const string& proc_file) const {
+  string contents, err;
+  double avg10;
+  if (!cgroup_dir_.empty() &&
+      ::ReadFile(cgroup_dir_ + "/" + cgroup_file, &contents, &err) >= 0 &&
+      ParsePressure(contents, &avg10)) {
+    return avg10;
+  }
+  contents.clear();
+  if (!proc_pressure_dir_.empty() &&
+      ::ReadFile(proc_pressure_dir_ + "/" + proc_file, &contents, &err) >= 0 &&
+      ParsePressure(contents, &avg10)) {
+    return avg10;
+  }
+  return -1;
+}
+
+PressureReading PressureReader::Read() {
+  if (!located_) {
+    cgroup_dir_ = GetCGroup2Path();
+    located_ = true;
+  }
+  PressureReading reading;
+  reading.cpu = ReadPressure("cpu.pressure", "cpu");
+  reading.memory = ReadPressure("memory.pressure", "memory");
+  if (!cgroup_dir_.empty()) {
+    int64_t current = ReadCount(cgroup_dir_ + "/memory.current");
+    int64_t max = ReadCount(cgroup_dir_ + "/memory.max");
+    if (current >= 0 && max > 0)
+      reading.memory_use = 100.0 * current / max;
+  }
+  return reading;
+}
+
+bool PressureLimits::Parse(const string& spec, string* err) {
+  size_t pos = 0;
+  while (pos <= spec.size()) {
+    size_t next = spec.find(',', pos);
+    if (next == string::npos)
+      next = spec.size();
+    string item = spec.substr(pos, next - pos);
+    pos = next + 1;
+
+    size_t eq = item.find('=');
+    string name = item.substr(0, eq);
+    double* limit = NULL;
+    if (name == "cpu")
+      limit = &max_cpu;
+    else if (name == "memory")
+      limit = &max_memory;
+    else if (name == "memory_use")
+      limit = &max_memory_use;
+    if (!limit || eq == string::npos) {
+      *err = "unknown pressure limit '" + item +
+             "' (expected cpu=N, memory=N or memory_use=N)";
+      return false;
+    }
+    const char* start = item.c_str() + eq + 1;
+    char* end;
+    *limit = strtod(start, &end);
+    if (end == start || *end != '\0' || *limit < 0) {
+      *err = "invalid pressure limit '" + item + "'";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool AdmissionController::Over(double reading, double limit,
+                               double ratio) const {
+  return limit > 0 && reading >= 0 && reading >= limit * ratio;
+}
+
+bool AdmissionController::Admit(int64_t now_millis) {
+  if (!limits_.enabled())
+    return true;
+  if (has_read_ && now_millis - last_read_millis_ < kReadIntervalMillis)
+    return !throttled_;
+  has_read_ = true;
+  last_read_millis_ = now_millis;
+
+  PressureReading r = reader_->Read();
+  // Stop at the limits, but only resume below resume_ratio of them, so that
+  // readings hovering around a limit don't flip admission on every read.
+  double ratio = throttled_ ? limits_.resume_ratio : 1.0;
+  bool over = Over(r.cpu, limits_.max_cpu, ratio) ||
+              Over(r.memory, limits_.max_memory, ratio) ||
+              Over(r.memory_use, limits_.max_memory_use, ratio);
+  if (over != throttled_) {
+    EXPLAIN("%s new commands: cpu pressure %.1f%%, memory pressure %.1f%%, "
+            "memory use %.1f%%", over ? "pausing" : "resuming", r.cpu,
+            r.memory, r.memory_use);
+  }
+  throttled_ = over;
+  return !throttled_;
+}
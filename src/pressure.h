@@ -0,0 +1,107 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_PRESSURE_H_
+#define NINJA_PRESSURE_H_
+
+#include <stdint.h>
+
+#include <string>
+
+/// How starved of cpu and memory the tasks of this process's cgroup (or of
+/// the whole system) are.  Negative values mean a reading is unavailable.
+struct PressureReading {
+  PressureReading() : cpu(-1), memory(-1), memory_use(-1) {}
+
+  /// Percentage of the last 10 seconds some task waited for a cpu, from the
+  /// "some avg10" field of the kernel's pressure stall information.
+  double cpu;
+  /// Likewise, for time spent waiting for memory (reclaim, swap-in).
+  double memory;
+  /// memory.current as a percentage of memory.max.
+  double memory_use;
+};
+
+/// Parse the "some avg10" value out of the contents of a PSI file such as
+/// /proc/pressure/memory.  Returns false if there is none.
+bool ParsePressure(const std::string& contents, double* avg10);
+
+/// Reads PressureReadings from the files of a cgroup v2 directory, falling
+/// back to the system-wide files in /proc/pressure.
+struct PressureReader {
+  /// Read the cgroup this process is in, found on the first Read().
+  PressureReader();
+  /// Read the given directories instead; either may be empty.
+  PressureReader(const std::string& cgroup_dir,
+                 const std::string& proc_pressure_dir);
+  virtual ~PressureReader() {}
+
+  virtual PressureReading Read();
+
+ private:
+  double ReadPressure(const std::string& cgroup_file,
+                      const std::string& proc_file) const;
+
+  bool located_;
+  std::string cgroup_dir_;
+  std::string proc_pressure_dir_;
+};
+
+/// Thresholds above which no new commands are started, in percent.
+/// A threshold of 0 or less is disabled.
+struct PressureLimits {
+  PressureLimits()
+      : max_cpu(0), max_memory(0), max_memory_use(0), resume_ratio(0.8) {}
+
+  bool enabled() const {
+    return max_cpu > 0 || max_memory > 0 || max_memory_use > 0;
+  }
+
+  /// Parse a comma-separated list of "cpu=N", "memory=N" and
+  /// "memory_use=N" settings.
+  bool Parse(const std::string& spec, std::string* err);
+
+  double max_cpu;
+  double max_memory;
+  double max_memory_use;
+  /// Once a threshold has been crossed, commands only start again when every
+  /// reading is below this fraction of its threshold.
+  double resume_ratio;
+};
+
+/// Decides whether new commands may start, given the PressureLimits.
+struct AdmissionController {
+  AdmissionController(const PressureLimits& limits, PressureReader* reader)
+      : limits_(limits), reader_(reader), throttled_(false),
+        last_read_millis_(0), has_read_(false) {}
+
+  /// Return false while pressure is too high to start more commands.
+  /// Readings are taken at most every kReadIntervalMillis.
+  bool Admit(int64_t now_millis);
+
+  bool throttled() const { return throttled_; }
+
+  static const int64_t kReadIntervalMillis = 100;
+
+ private:
+  bool Over(double reading, double limit, double ratio) const;
+
+  PressureLimits limits_;
+  PressureReader* reader_;
+  bool throttled_;
+  int64_t last_read_millis_;
+  bool has_read_;
+};
+
+#endif  // NINJA_PRESSURE_H_
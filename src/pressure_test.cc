@@ -0,0 +1,159 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pressure.h"
+
+#include "disk_interface.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+const char kPressure[] =
+    "some avg10=12.50 avg60=3.00 avg300=1.00 total=1234\n"
+    "full avg10=2.00 avg60=1.00 avg300=0.50 total=567\n";
+
+TEST(PressureTest, ParsePressure) {
+  double avg10 = 0;
+  EXPECT_TRUE(ParsePressure(kPressure, &avg10));
+  EXPECT_EQ(12.5, avg10);
+
+  // The cpu file of older kernels has no "full" line.
+  EXPECT_TRUE(ParsePressure("some avg10=0.00 avg60=0.00 avg300=0.00 total=0",
+                            &avg10));
+  EXPECT_EQ(0.0, avg10);
+
+  EXPECT_FALSE(ParsePressure("", &avg10));
+  EXPECT_FALSE(ParsePressure("full avg10=2.00 avg60=1.00\n", &avg10));
+  EXPECT_FALSE(ParsePressure("some avg10=\n", &avg10));
+}
+
+TEST(PressureTest, ParseLimits) {
+  PressureLimits limits;
+  string err;
+  EXPECT_FALSE(limits.enabled());
+  EXPECT_TRUE(limits.Parse("cpu=80,memory=10.5,memory_use=90", &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(limits.enabled());
+  EXPECT_EQ(80.0, limits.max_cpu);
+  EXPECT_EQ(10.5, limits.max_memory);
+  EXPECT_EQ(90.0, limits.max_memory_use);
+
+  EXPECT_FALSE(limits.Parse("io=5", &err));
+  EXPECT_EQ("unknown pressure limit 'io=5' "
+            "(expected cpu=N, memory=N or memory_use=N)", err);
+  EXPECT_FALSE(limits.Parse("cpu=lots", &err));
+  EXPECT_EQ("invalid pressure limit 'cpu=lots'", err);
+}
+
+struct PressureReaderTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-PressureReaderTest");
+    ASSERT_TRUE(disk_.MakeDir("cgroup"));
+    ASSERT_TRUE(disk_.MakeDir("proc"));
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+};
+
+TEST_F(PressureReaderTest, CGroupFiles) {
+  ASSERT_TRUE(disk_.WriteFile("cgroup/cpu.pressure", kPressure));
+  ASSERT_TRUE(disk_.WriteFile("cgroup/memory.pressure",
+                              "some avg10=4.00 avg60=0 avg300=0 total=0\n"));
+  ASSERT_TRUE(disk_.WriteFile("cgroup/memory.current", "750\n"));
+  ASSERT_TRUE(disk_.WriteFile("cgroup/memory.max", "1000\n"));
+  ASSERT_TRUE(disk_.WriteFile("proc/memory",
+                              "some avg10=99.00 avg60=0 avg300=0 total=0\n"));
+
+  PressureReader reader("cgroup", "proc");
+  PressureReading reading = reader.Read();
+  EXPECT_EQ(12.5, reading.cpu);
+  EXPECT_EQ(4.0, reading.memory);
+  EXPECT_EQ(75.0, reading.memory_use);
+}
+
+TEST_F(PressureReaderTest, FallBackToSystem) {
+  // No memory limit, and no pressure files in the cgroup.
+  ASSERT_TRUE(disk_.WriteFile("cgroup/memory.current", "750\n"));
+  ASSERT_TRUE(disk_.WriteFile("cgroup/memory.max", "max\n"));
+  ASSERT_TRUE(disk_.WriteFile("proc/memory", kPressure));
+
+  PressureReader reader("cgroup", "proc");
+  PressureReading reading = reader.Read();
+  EXPECT_EQ(-1.0, reading.cpu);
+  EXPECT_EQ(12.5, reading.memory);
+  EXPECT_EQ(-1.0, reading.memory_use);
+}
+
+struct FakePressureReader : public PressureReader {
+  FakePressureReader() : PressureReader("", ""), reads(0) {}
+  virtual PressureReading Read() {
+    ++reads;
+    return reading;
+  }
+  PressureReading reading;
+  int reads;
+};
+
+TEST(AdmissionControllerTest, Hysteresis) {
+  FakePressureReader reader;
+  PressureLimits limits;
+  limits.max_memory = 10;
+  limits.resume_ratio = 0.5;
+  AdmissionController admission(limits, &reader);
+  int64_t now = 1000;
+
+  reader.reading.memory = 9;
+  EXPECT_TRUE(admission.Admit(now));
+
+  // Readings are not taken again within the interval.
+  reader.reading.memory = 20;
+  EXPECT_TRUE(admission.Admit(now + 1));
+  EXPECT_EQ(1, reader.reads);
+
+  now += AdmissionController::kReadIntervalMillis;
+  EXPECT_FALSE(admission.Admit(now));
+  EXPECT_TRUE(admission.throttled());
+
+  // Below the limit, but not yet below half of it.
+  reader.reading.memory = 7;
+  now += AdmissionController::kReadIntervalMillis;
+  EXPECT_FALSE(admission.Admit(now));
+
+  reader.reading.memory = 4;
+  now += AdmissionController::kReadIntervalMillis;
+  EXPECT_TRUE(admission.Admit(now));
+  EXPECT_FALSE(admission.throttled());
+
+  // A missing reading never holds commands back.
+  reader.reading.memory = -1;
+  now += AdmissionController::kReadIntervalMillis;
+  EXPECT_TRUE(admission.Admit(now));
+}
+
+TEST(AdmissionControllerTest, Disabled) {
+  FakePressureReader reader;
+  reader.reading.cpu = 100;
+  AdmissionController admission(PressureLimits(), &reader);
+  EXPECT_TRUE(admission.Admit(0));
+  EXPECT_EQ(0, reader.reads);
+}
+
+}  // anonymous namespace
@@ -0,0 +1,896 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "remote.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "util.h"
+
+extern char** environ;
+
+using namespace std;
+
+namespace {
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;  // Sockets have SO_NOSIGPIPE instead.
+#endif
+
+void AppendRecord(const char* tag, const string& data, string* out) {
+  char header[64];
+  snprintf(header, sizeof(header), "%s %zu\n", tag, data.size());
+  out->append(header);
+  out->append(data);
+}
+
+/// Append a record |tag| with the mode and path of |file|, followed by its
+/// contents.
+void AppendFile(const char* tag, const RemoteFile& file, string* out) {
+  char mode[16];
+  snprintf(mode, sizeof(mode), "%o ", file.mode);
+  AppendRecord(tag, mode + file.path, out);
+  AppendRecord("data", file.contents, out);
+}
+
+/// Parse the "<mode> <path>" of an input or output file.
+bool ParseFile(const string& data, RemoteFile* file) {
+  const char* start = data.c_str();
+  char* end;
+  long mode = strtol(start, &end, 8);
+  if (end == start || *end != ' ' || end[1] == '\0')
+    return false;
+  file->mode = (int)(mode & 0777);
+  file->path = end + 1;
+  return true;
+}
+
+/// Set up a socket to a peer: no SIGPIPE, no delay for small messages, and
+/// not inherited by commands.
+void SetUpSocket(int fd) {
+  SetCloseOnExec(fd);
+  int on = 1;
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/// Split "HOST:PORT" into its parts, with |host| defaulting to 127.0.0.1.
+bool LookUp(const string& address, bool passive, struct addrinfo** result,
+            string* err) {
+  string host = "127.0.0.1";
+  string port = address;
+  size_t colon = address.rfind(':');
+  if (colon != string::npos) {
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+  }
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (passive)
+    hints.ai_flags = AI_PASSIVE;
+  int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, result);
+  if (ret != 0) {
+    *err = address + ": " + gai_strerror(ret);
+    return false;
+  }
+  return true;
+}
+
+int ConnectRemote(const string& address, string* err) {
+  struct addrinfo* addrs;
+  if (!LookUp(address, false, &addrs, err))
+    return -1;
+  int fd = -1;
+  for (struct addrinfo* a = addrs; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    *err = strerror(errno);
+  freeaddrinfo(addrs);
+  if (fd >= 0)
+    SetUpSocket(fd);
+  return fd;
+}
+
+bool SendAll(int fd, const string& data) {
+  const char* p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    ssize_t len = send(fd, p, left, kSendFlags);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += len;
+    left -= len;
+  }
+  return true;
+}
+
+int RemoveEntry(const char* path, const struct stat*, int, struct FTW*) {
+  remove(path);
+  return 0;
+}
+
+/// Run |request|'s command in the directory |root|, and fill in |response|.
+/// Returns false if the client went away, which kills the command.
+bool RunInSandbox(const string& root, const RemoteRequest& request,
+                  int client_fd, RemoteResponse* response) {
+  response->exit_code = 1;
+  string workdir = root;
+  if (request.cwd.empty() || request.cwd[0] != '/' ||
+      (request.cwd != "/" &&
+       !SandboxPath(root, "/", request.cwd.substr(1), &workdir))) {
+    response->output = "ninja: bad working directory '" + request.cwd + "'\n";
+    return true;
+  }
+  RealDiskInterface disk;
+  if (!disk.MakeDirs(workdir + "/.")) {
+    response->output = "ninja: can't create " + workdir + "\n";
+    return true;
+  }
+  for (vector<RemoteFile>::const_iterator i = request.inputs.begin();
+       i != request.inputs.end(); ++i) {
+    string path;
+    if (!SandboxPath(root, request.cwd, i->path, &path)) {
+      response->output = "ninja: bad input path '" + i->path + "'\n";
+      return true;
+    }
+    if (!disk.MakeDirs(path) || !disk.WriteFile(path, i->contents) ||
+        chmod(path.c_str(), i->mode) < 0) {
+      response->output = "ninja: can't write " + i->path + "\n";
+      return true;
+    }
+  }
+  for (vector<string>::const_iterator o = request.outputs.begin();
+       o != request.outputs.end(); ++o) {
+    string path;
+    if (!SandboxPath(root, request.cwd, *o, &path) || !disk.MakeDirs(path)) {
+      response->output = "ninja: bad output path '" + *o + "'\n";
+      return true;
+    }
+  }
+
+  int output_pipe[2];
+  if (pipe(output_pipe) < 0)
+    Fatal("pipe: %s", strerror(errno));
+  vector<char*> envp;
+  for (vector<string>::const_iterator e = request.env.begin();
+       e != request.env.end(); ++e)
+    envp.push_back(const_cast<char*>(e->c_str()));
+  envp.push_back(NULL);
+  const char* argv[] = { "/bin/sh", "-c", request.command.c_str(), NULL };
+  pid_t pid = fork();
+  if (pid < 0)
+    Fatal("fork: %s", strerror(errno));
+  if (pid == 0) {
+    setpgid(0, 0);
+    int devnull = open("/dev/null", O_RDONLY);
+    if (chdir(workdir.c_str()) < 0 || devnull < 0 || dup2(devnull, 0) < 0 ||
+        dup2(output_pipe[1], 1) < 0 || dup2(output_pipe[1], 2) < 0)
+      _exit(127);
+    execve("/bin/sh", const_cast<char**>(argv), &envp[0]);
+    _exit(127);
+  }
+  close(output_pipe[1]);
+
+  // Watch the client too, so that the command dies with its connection.
+  bool connected = true;
+  struct pollfd fds[2];
+  fds[0].fd = output_pipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = client_fd;
+  fds[1].events = POLLIN;
+  int nfds = 2;
+  for (;;) {
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      Fatal("poll: %s", strerror(errno));
+    }
+    if (nfds == 2 && fds[1].revents) {
+      char c;
+      if (recv(client_fd, &c, 1, MSG_PEEK) <= 0) {
+        kill(-pid, SIGKILL);
+        connected = false;
+      }
+      nfds = 1;
+    }
+    if (fds[0].revents) {
+      char buf[64 << 10];
+      ssize_t len = read(output_pipe[0], buf, sizeof(buf));
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        break;
+      response->output.append(buf, len);
+    }
+  }
+  close(output_pipe[0]);
+
+  int status;
+  struct rusage ru;
+  while (wait4(pid, &status, 0, &ru) < 0) {
+    if (errno != EINTR)
+      Fatal("wait4: %s", strerror(errno));
+  }
+  if (WIFEXITED(status))
+    response->exit_code = WEXITSTATUS(status);
+  else
+    response->exit_code = 128 + WTERMSIG(status);
+  response->usage.user_millis = (int64_t)ru.ru_utime.tv_sec * 1000 +
+                                ru.ru_utime.tv_usec / 1000;
+  response->usage.system_millis = (int64_t)ru.ru_stime.tv_sec * 1000 +
+                                  ru.ru_stime.tv_usec / 1000;
+#ifdef __APPLE__
+  response->usage.max_rss_kb = ru.ru_maxrss / 1024;  // In bytes.
+#else
+  response->usage.max_rss_kb = ru.ru_maxrss;
+#endif
+
+  for (vector<string>::const_iterator o = request.outputs.begin();
+       o != request.outputs.end(); ++o) {
+    string path, err;
+    SandboxPath(root, request.cwd, *o, &path);
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+      continue;
+    RemoteFile file;
+    file.path = *o;
+    file.mode = st.st_mode & 0777;
+    if (::ReadFile(path, &file.contents, &err) == 0)
+      response->outputs.push_back(std::move(file));
+  }
+  return connected;
+}
+
+/// Serve the requests that come in on |fd| until the client goes away.
+void ServeConnection(int fd) {
+  const char* tmpdir = getenv("TMPDIR");
+  string temp = string(tmpdir && *tmpdir ? tmpdir : "/tmp") +
+                "/ninja-remote-XXXXXX";
+  for (;;) {
+    RemoteDecoder decoder("run");
+    string err;
+    char buf[64 << 10];
+    while (!decoder.done()) {
+      ssize_t len = recv(fd, buf, sizeof(buf), 0);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        return;
+      if (!decoder.Feed(buf, len, &err)) {
+        Error("%s", err.c_str());
+        return;
+      }
+    }
+
+    RemoteRequest request;
+    RemoteResponse response;
+    if (!decoder.Decode(&request, &err)) {
+      response.exit_code = 1;
+      response.output = "ninja: " + err + "\n";
+    } else {
+      string root = temp;
+      if (!mkdtemp(&root[0]))
+        Fatal("mkdtemp: %s", strerror(errno));
+      bool connected = RunInSandbox(root, request, fd, &response);
+      nftw(root.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+      if (!connected)
+        return;
+    }
+    string out;
+    response.Encode(&out);
+    if (!SendAll(fd, out))
+      return;
+  }
+}
+
+}  // namespace
+
+void RemoteRequest::Encode(string* out) const {
+  AppendRecord("cwd", cwd, out);
+  for (vector<string>::const_iterator e = env.begin(); e != env.end(); ++e)
+    AppendRecord("env", *e, out);
+  for (vector<RemoteFile>::const_iterator i = inputs.begin();
+       i != inputs.end(); ++i)
+    AppendFile("input", *i, out);
+  for (vector<string>::const_iterator o = outputs.begin();
+       o != outputs.end(); ++o)
+    AppendRecord("output", *o, out);
+  AppendRecord("command", command, out);
+  AppendRecord("run", "", out);
+}
+
+void RemoteResponse::Encode(string* out) const {
+  for (vector<RemoteFile>::const_iterator o = outputs.begin();
+       o != outputs.end(); ++o)
+    AppendFile("output", *o, out);
+  AppendRecord("stdout", output, out);
+  char buf[96];
+  snprintf(buf, sizeof(buf), "%lld %lld %lld", (long long)usage.user_millis,
+           (long long)usage.system_millis, (long long)usage.max_rss_kb);
+  AppendRecord("usage", buf, out);
+  snprintf(buf, sizeof(buf), "%d", exit_code);
+  AppendRecord("exit", buf, out);
+}
+
+bool RemoteDecoder::Feed(const char* data, size_t size, string* err) {
+  buf_.append(data, size);
+  size_t pos = 0;
+  while (!done_) {
+    size_t newline = buf_.find('\n', pos);
+    if (newline == string::npos) {
+      if (buf_.size() - pos > 64) {
+        *err = "record header too long";
+        return false;
+      }
+      break;
+    }
+    size_t space = buf_.find(' ', pos);
+    const char* start = buf_.c_str() + space + 1;
+    char* end;
+    unsigned long long len = strtoull(start, &end, 10);
+    if (space == pos || space >= newline || end == start ||
+        end != buf_.c_str() + newline) {
+      *err = "malformed record header '" + buf_.substr(pos, newline - pos) +
+             "'";
+      return false;
+    }
+    if (buf_.size() - newline - 1 < len)
+      break;
+    string tag = buf_.substr(pos, space - pos);
+    records_.push_back(make_pair(tag, buf_.substr(newline + 1, len)));
+    pos = newline + 1 + len;
+    if (tag == last_tag_)
+      done_ = true;
+  }
+  buf_.erase(0, pos);
+  if (done_ && !buf_.empty()) {
+    *err = "data after the end of the message";
+    return false;
+  }
+  return true;
+}
+
+bool RemoteDecoder::Decode(RemoteRequest* request, string* err) const {
+  for (size_t i = 0; i < records_.size(); ++i) {
+    const string& tag = records_[i].first;
+    const string& data = records_[i].second;
+    if (tag == "cwd") {
+      request->cwd = data;
+    } else if (tag == "env") {
+      request->env.push_back(data);
+    } else if (tag == "input") {
+      RemoteFile file;
+      if (!ParseFile(data, &file) || i + 1 == records_.size() ||
+          records_[i + 1].first != "data") {
+        *err = "malformed input '" + data + "'";
+        return false;
+      }
+      file.contents = records_[++i].second;
+      request->inputs.push_back(std::move(file));
+    } else if (tag == "output") {
+      request->outputs.push_back(data);
+    } else if (tag == "command") {
+      request->command = data;
+    }
+  }
+  return true;
+}
+
+bool RemoteDecoder::Decode(RemoteResponse* response, string* err) const {
+  for (size_t i = 0; i < records_.size(); ++i) {
+    const string& tag = records_[i].first;
+    const string& data = records_[i].second;
+    if (tag == "output") {
+      RemoteFile file;
+      if (!ParseFile(data, &file) || i + 1 == records_.size() ||
+          records_[i + 1].first != "data") {
+        *err = "malformed output '" + data + "'";
+        return false;
+      }
+      file.contents = records_[++i].second;
+      response->outputs.push_back(std::move(file));
+    } else if (tag == "stdout") {
+      response->output = data;
+    } else if (tag == "usage") {
+      long long user, system, rss;
+      if (sscanf(data.c_str(), "%lld %lld %lld", &user, &system, &rss) == 3) {
+        response->usage.user_millis = user;
+        response->usage.system_millis = system;
+        response->usage.max_rss_kb = rss;
+      }
+    } else if (tag == "exit") {
+      response->exit_code = atoi(data.c_str());
+    }
+  }
+  return true;
+}
+
+bool SandboxPath(const string& root, const string& cwd, const string& path,
+                 string* result) {
+  if (path.empty() || path[0] == '/' || cwd.empty() || cwd[0] != '/')
+    return false;
+  string full = cwd + "/" + path;
+  vector<string> parts;
+  size_t start = 0;
+  while (start <= full.size()) {
+    size_t end = full.find('/', start);
+    if (end == string::npos)
+      end = full.size();
+    string part = full.substr(start, end - start);
+    if (part == "..") {
+      if (parts.empty())
+        return false;
+      parts.pop_back();
+    } else if (!part.empty() && part != ".") {
+      parts.push_back(part);
+    }
+    start = end + 1;
+  }
+  *result = root;
+  for (vector<string>::const_iterator p = parts.begin(); p != parts.end();
+       ++p)
+    *result += "/" + *p;
+  return true;
+}
+
+int ListenRemote(const string& address, string* err) {
+  struct addrinfo* addrs;
+  if (!LookUp(address, true, &addrs, err))
+    return -1;
+  int fd = -1;
+  for (struct addrinfo* a = addrs; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0)
+      continue;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 64) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    *err = address + ": " + strerror(errno);
+  freeaddrinfo(addrs);
+  if (fd >= 0)
+    SetCloseOnExec(fd);
+  return fd;
+}
+
+void ServeRemote(int listen_fd) {
+  // Connections are served by children nobody waits for.
+  signal(SIGCHLD, SIG_IGN);
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      Fatal("accept: %s", strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+      Fatal("fork: %s", strerror(errno));
+    if (pid == 0) {
+      signal(SIGCHLD, SIG_DFL);
+      close(listen_fd);
+      SetUpSocket(fd);
+      ServeConnection(fd);
+      _exit(0);
+    }
+    close(fd);
+  }
+}
+
+struct RemoteCommandRunner::Job {
+  Job() : edge(NULL), worker(0), fd(-1), sent(0), reused(false),
+          received(false), decoder("exit") {}
+
+  Edge* edge;
+  size_t worker;
+  int fd;
+  std::string request;
+  size_t sent;
+  /// Whether |fd| served an earlier job, and may have gone stale since.
+  bool reused;
+  bool received;
+  RemoteDecoder decoder;
+  std::vector<std::string> outputs;
+};
+
+RemoteCommandRunner::RemoteCommandRunner(const BuildConfig& config)
+    : workers_(config.remote_workers), load_(workers_.size()),
+      interrupted_(false), config_(config) {
+  parallelism_ = config.remote_parallelism > 0
+                     ? (size_t)config.remote_parallelism
+                     : (size_t)config.parallelism * workers_.size();
+  vector<char> cwd(1024);
+  while (!getcwd(&cwd[0], cwd.size())) {
+    if (errno != ERANGE)
+      Fatal("getcwd: %s", strerror(errno));
+    cwd.resize(cwd.size() * 2);
+  }
+  cwd_ = &cwd[0];
+  for (char** e = environ; *e; ++e)
+    env_.push_back(*e);
+}
+
+RemoteCommandRunner::~RemoteCommandRunner() {
+  Abort();
+}
+
+bool RemoteCommandRunner::CanRunMore() const {
+  return jobs_.size() + local_edges_.size() < parallelism_;
+}
+
+namespace {
+
+/// Add the file at |path| to the inputs of |request|, unless it is absolute,
+/// like a system header that workers should have already, or not a file.
+void AddInput(const string& path, set<string>* seen, RemoteRequest* request) {
+  if (path.empty() || path[0] == '/' || !seen->insert(path).second)
+    return;
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+    return;
+  RemoteFile file;
+  file.path = path;
+  file.mode = st.st_mode & 0777;
+  string err;
+  if (::ReadFile(path, &file.contents, &err) == 0)
+    request->inputs.push_back(std::move(file));
+}
+
+}  // namespace
+
+bool RemoteCommandRunner::StartCommand(Edge* edge) {
+  // Without its deps, a command would miss the headers it includes.
+  if (edge->deps_missing_ || edge->use_console()) {
+    bool direct_exec =
+        config_.direct_exec || edge->GetBindingBool("direct_exec");
+    Subprocess* subproc =
+        local_.Add(edge->EvaluateCommand(), edge->use_console(), direct_exec)
+            .get();
+    if (!subproc)
+      return false;
+    local_edges_.insert(make_pair(subproc, edge));
+    return true;
+  }
+
+  unique_ptr<Job> job(new Job);
+  job->edge = edge;
+
+  // Inputs include those the deps log and depfiles added while scanning.
+  RemoteRequest request;
+  request.cwd = cwd_;
+  request.env = env_;
+  request.command = edge->EvaluateCommand();
+  set<string> seen;
+  for (vector<Node*>::const_iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i)
+    AddInput((*i)->path(), &seen, &request);
+  string rspfile = edge->GetUnescapedRspfile();
+  if (!rspfile.empty())
+    AddInput(rspfile, &seen, &request);
+  for (vector<Node*>::const_iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o)
+    job->outputs.push_back((*o)->path());
+  string depfile = edge->GetUnescapedDepfile();
+  if (!depfile.empty())
+    job->outputs.push_back(depfile);
+  request.outputs = job->outputs;
+  request.Encode(&job->request);
+
+  job->worker = min_element(load_.begin(), load_.end()) - load_.begin();
+  ++load_[job->worker];
+  string err;
+  job->fd = Connect(job->worker, &job->reused, &err);
+  Job* started = job.get();
+  jobs_.push_back(std::move(job));
+  if (started->fd < 0) {
+    Finish(started, ExitFailure, "ninja: can't reach remote worker " +
+                                     workers_[started->worker] + ": " + err +
+                                     "\n");
+  }
+  return true;
+}
+
+int RemoteCommandRunner::Connect(size_t worker, bool* reused, string* err) {
+  vector<int>& idle = idle_[worker];
+  *reused = !idle.empty();
+  if (*reused) {
+    int fd = idle.back();
+    idle.pop_back();
+    return fd;
+  }
+  int fd = ConnectRemote(workers_[worker], err);
+  if (fd < 0)
+    return -1;
+  if (fd >= FD_SETSIZE) {
+    close(fd);
+    *err = "too many connections";
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+bool RemoteCommandRunner::WaitForCommand(Result* result) {
+  for (;;) {
+    CollectLocal();
+    if (!finished_.empty()) {
+      *result = std::move(finished_.front());
+      finished_.pop_front();
+      return true;
+    }
+    if (interrupted_ || (jobs_.empty() && local_edges_.empty()))
+      return false;
+    if (DoWork(-1))
+      return false;
+  }
+}
+
+bool RemoteCommandRunner::PollCommand(Result* result) {
+  CollectLocal();
+  if (finished_.empty()) {
+    if (interrupted_ || (jobs_.empty() && local_edges_.empty()))
+      return false;
+    if (DoWork(0)) {
+      interrupted_ = true;
+      return false;
+    }
+    CollectLocal();
+    if (finished_.empty())
+      return false;
+  }
+  *result = std::move(finished_.front());
+  finished_.pop_front();
+  return true;
+}
+
+vector<Edge*> RemoteCommandRunner::GetActiveEdges() {
+  vector<Edge*> edges;
+  for (vector<unique_ptr<Job> >::const_iterator j = jobs_.begin();
+       j != jobs_.end(); ++j)
+    edges.push_back((*j)->edge);
+  for (map<Subprocess*, Edge*>::const_iterator e = local_edges_.begin();
+       e != local_edges_.end(); ++e)
+    edges.push_back(e->second);
+  return edges;
+}
+
+void RemoteCommandRunner::Abort() {
+  // Workers kill the commands of connections that close.
+  for (vector<unique_ptr<Job> >::const_iterator j = jobs_.begin();
+       j != jobs_.end(); ++j) {
+    if ((*j)->fd >= 0)
+      close((*j)->fd);
+  }
+  jobs_.clear();
+  for (map<size_t, vector<int> >::iterator w = idle_.begin();
+       w != idle_.end(); ++w) {
+    for (vector<int>::iterator fd = w->second.begin();
+         fd != w->second.end(); ++fd)
+      close(*fd);
+  }
+  idle_.clear();
+  local_.Clear();
+  local_edges_.clear();
+  finished_.clear();
+  fill(load_.begin(), load_.end(), 0);
+}
+
+void RemoteCommandRunner::CollectLocal() {
+  while (std::shared_ptr<Subprocess> subproc = local_.NextFinished()) {
+    Result result;
+    result.status = subproc->Finish();
+    subproc->TakeOutput(&result.output);
+    result.usage = subproc->GetResourceUsage();
+    map<Subprocess*, Edge*>::iterator e = local_edges_.find(subproc.get());
+    result.edge = e->second;
+    local_edges_.erase(e);
+    finished_.push_back(std::move(result));
+  }
+}
+
+bool RemoteCommandRunner::DoWork(int64_t timeout_millis) {
+  // Local commands only run until the deps are known, so look at them every
+  // so often while waiting for workers rather than wait for both at once.
+  if (!local_edges_.empty()) {
+    if (jobs_.empty())
+      return local_.DoWork(timeout_millis);
+    if (local_.DoWork(0))
+      return true;
+    const int64_t kLocalPollMillis = 10;
+    if (!local_.finished_.empty())
+      timeout_millis = 0;
+    else if (timeout_millis < 0 || timeout_millis > kLocalPollMillis)
+      timeout_millis = kLocalPollMillis;
+  }
+
+  fd_set readable, writable;
+  FD_ZERO(&readable);
+  FD_ZERO(&writable);
+  int nfds = 0;
+  for (vector<unique_ptr<Job> >::const_iterator j = jobs_.begin();
+       j != jobs_.end(); ++j) {
+    FD_SET((*j)->fd, &readable);
+    if ((*j)->sent < (*j)->request.size())
+      FD_SET((*j)->fd, &writable);
+    nfds = max(nfds, (*j)->fd + 1);
+  }
+
+  struct timespec timeout;
+  timeout.tv_sec = timeout_millis / 1000;
+  timeout.tv_nsec = (timeout_millis % 1000) * 1000000;
+  SubprocessSet::interrupted_ = 0;
+  int ret = pselect(nfds, &readable, &writable, NULL,
+                    timeout_millis >= 0 ? &timeout : NULL,
+                    &local_.old_mask_);
+  if (ret == -1) {
+    if (errno != EINTR)
+      Fatal("pselect: %s", strerror(errno));
+    return SubprocessSet::IsInterrupted();
+  }
+  SubprocessSet::HandlePendingInterruption();
+  if (SubprocessSet::IsInterrupted())
+    return true;
+
+  // Finishing a job removes it from |jobs_|.
+  vector<Job*> ready;
+  for (vector<unique_ptr<Job> >::const_iterator j = jobs_.begin();
+       j != jobs_.end(); ++j) {
+    if (FD_ISSET((*j)->fd, &readable) || FD_ISSET((*j)->fd, &writable))
+      ready.push_back(j->get());
+  }
+  for (vector<Job*>::iterator j = ready.begin(); j != ready.end(); ++j)
+    OnReady(*j, FD_ISSET((*j)->fd, &readable), FD_ISSET((*j)->fd, &writable));
+  return false;
+}
+
+void RemoteCommandRunner::OnReady(Job* job, bool readable, bool writable) {
+  string error;
+  if (writable && job->sent < job->request.size()) {
+    ssize_t len = send(job->fd, job->request.data() + job->sent,
+                       job->request.size() - job->sent, kSendFlags);
+    if (len >= 0)
+      job->sent += len;
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      error = strerror(errno);
+  }
+  if (readable && error.empty()) {
+    char buf[64 << 10];
+    ssize_t len = recv(job->fd, buf, sizeof(buf), 0);
+    if (len == 0) {
+      error = "connection closed";
+    } else if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        error = strerror(errno);
+    } else {
+      job->received = true;
+      string err;
+      if (!job->decoder.Feed(buf, len, &err)) {
+        Finish(job, ExitFailure, "ninja: bad response from remote worker " +
+                                     workers_[job->worker] + ": " + err +
+                                     "\n");
+        return;
+      }
+    }
+  }
+
+  if (!error.empty()) {
+    // A connection kept from an earlier job may have gone stale, e.g. as
+    // its worker restarted; try again on a new one.
+    if (job->reused && !job->received) {
+      close(job->fd);
+      job->sent = 0;
+      string err;
+      job->fd = Connect(job->worker, &job->reused, &err);
+      if (job->fd >= 0)
+        return;
+      error = err;
+    }
+    Finish(job, ExitFailure, "ninja: lost remote worker " +
+                                 workers_[job->worker] + ": " + error + "\n");
+    return;
+  }
+  if (!job->decoder.done())
+    return;
+
+  RemoteResponse response;
+  string err;
+  if (!job->decoder.Decode(&response, &err)) {
+    Finish(job, ExitFailure, "ninja: bad response from remote worker " +
+                                 workers_[job->worker] + ": " + err + "\n");
+    return;
+  }
+  // Keep the connection for the next job.
+  idle_[job->worker].push_back(job->fd);
+  job->fd = -1;
+
+  string errors;
+  RealDiskInterface disk;
+  for (vector<RemoteFile>::const_iterator o = response.outputs.begin();
+       o != response.outputs.end(); ++o) {
+    if (find(job->outputs.begin(), job->outputs.end(), o->path) ==
+        job->outputs.end()) {
+      errors += "ninja: remote worker sent undeclared output " + o->path +
+                "\n";
+    } else if (!disk.WriteFile(o->path, o->contents) ||
+               chmod(o->path.c_str(), o->mode) < 0) {
+      errors += "ninja: can't write " + o->path + "\n";
+    }
+  }
+  Finish(job, response.exit_code == 0 && errors.empty() ? ExitSuccess
+                                                         : ExitFailure,
+         response.output + errors, response.usage);
+}
+
+void RemoteCommandRunner::Finish(Job* job, ExitStatus status,
+                                 const string& output,
+                                 const ResourceUsage& usage) {
+  if (job->fd >= 0)
+    close(job->fd);
+  --load_[job->worker];
+  Result result;
+  result.edge = job->edge;
+  result.status = status;
+  result.output.Append(output);
+  result.usage = usage;
+  finished_.push_back(std::move(result));
+  for (vector<unique_ptr<Job> >::iterator j = jobs_.begin(); j != jobs_.end();
+       ++j) {
+    if (j->get() == job) {
+      jobs_.erase(j);
+      break;
+    }
+  }
+}
@@ -0,0 +1,158 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef NINJA_REMOTE_H_
+#define NINJA_REMOTE_H_
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "build.h"
+#include "resource_usage.h"
+#include "subprocess.h"
+
+/// Running commands on worker daemons, reached over TCP.
+///
+/// A request and a response are each a list of records, each written as a
+/// tag, a space, the size of its data in decimal, a newline and the data.
+/// A request has the client's working directory ("cwd"), its environment
+/// ("env", one per variable), the files the command reads ("input", with
+/// the octal mode and path, followed by "data" with the contents), the
+/// paths of the files it writes ("output"), and the "command", and ends
+/// with "run".  The response has the files written ("output" and "data"
+/// as above), the command's "stdout", its "usage" (user and system
+/// milliseconds and peak kilobytes) and ends with "exit" and its exit code.
+/// Paths are relative to the working directory.  A connection carries one
+/// request and its response after another.
+
+/// A file shipped to or from a worker.
+struct RemoteFile {
+  RemoteFile() : mode(0644) {}
+  std::string path;
+  int mode;
+  std::string contents;
+};
+
+struct RemoteRequest {
+  std::string cwd;
+  std::vector<std::string> env;
+  std::vector<RemoteFile> inputs;
+  std::vector<std::string> outputs;
+  std::string command;
+
+  void Encode(std::string* out) const;
+};
+
+struct RemoteResponse {
+  RemoteResponse() : exit_code(-1) {}
+  int exit_code;
+  std::string output;
+  ResourceUsage usage;
+  std::vector<RemoteFile> outputs;
+
+  void Encode(std::string* out) const;
+};
+
+/// Collects the records of a request or response as they arrive.
+struct RemoteDecoder {
+  /// Decode a message ending with the record tagged |last_tag|.
+  explicit RemoteDecoder(const char* last_tag)
+      : last_tag_(last_tag), done_(false) {}
+
+  /// Take in more of the message.  Returns false if it is malformed.
+  bool Feed(const char* data, size_t size, std::string* err);
+
+  /// Whether the whole message has arrived.
+  bool done() const { return done_; }
+
+  /// Fill in the message once done().  Return false if it is malformed.
+  bool Decode(RemoteRequest* request, std::string* err) const;
+  bool Decode(RemoteResponse* response, std::string* err) const;
+
+ private:
+  std::string last_tag_;
+  bool done_;
+  std::string buf_;
+  std::vector<std::pair<std::string, std::string> > records_;
+};
+
+/// Join |path|, relative to the absolute |cwd|, onto the directory |root|.
+/// Returns false if |path| is absolute or leads out of |root|.
+bool SandboxPath(const std::string& root, const std::string& cwd,
+                 const std::string& path, std::string* result);
+
+/// Listen for clients on |address|, "[HOST:]PORT", where HOST defaults to
+/// 127.0.0.1.  Returns the socket, or -1 with |err| set.
+int ListenRemote(const std::string& address, std::string* err);
+
+/// Run the requests of the clients that connect to |listen_fd|, in a child
+/// process per connection, each in a temporary directory of its own.
+/// Never returns.
+void ServeRemote(int listen_fd);
+
+/// Runs the commands of a build on workers, spread over them by how many
+/// commands each is running.  Commands whose deps aren't known yet, as on
+/// a first build, and those in the console pool run locally.
+struct RemoteCommandRunner : public CommandRunner {
+  explicit RemoteCommandRunner(const BuildConfig& config);
+  virtual ~RemoteCommandRunner();
+  virtual bool CanRunMore() const;
+  virtual bool StartCommand(Edge* edge);
+  virtual bool WaitForCommand(Result* result);
+  virtual bool PollCommand(Result* result);
+  virtual std::vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+
+ private:
+  struct Job;
+
+  /// Wait for jobs to make progress, at most |timeout_millis| if it isn't
+  /// -1.  Returns true if interrupted.
+  bool DoWork(int64_t timeout_millis);
+  /// Send the rest of |job|'s request, or read its response.
+  void OnReady(Job* job, bool readable, bool writable);
+  /// Move the local commands that finished to |finished_|.
+  void CollectLocal();
+  /// Report |job| as done, and forget it.
+  void Finish(Job* job, ExitStatus status, const std::string& output,
+              const ResourceUsage& usage = ResourceUsage());
+  /// Return a connection to the worker |worker|, an idle one if there is
+  /// one, as |reused| says, or -1 with |err| set.
+  int Connect(size_t worker, bool* reused, std::string* err);
+
+  std::vector<std::string> workers_;
+  /// Number of jobs running on each worker.
+  std::vector<int> load_;
+  /// Connections to each worker that have no job.
+  std::map<size_t, std::vector<int> > idle_;
+  size_t parallelism_;
+  std::string cwd_;
+  std::vector<std::string> env_;
+
+  std::vector<std::unique_ptr<Job> > jobs_;
+  std::deque<Result> finished_;
+  /// Whether PollCommand() saw an interruption WaitForCommand() must report.
+  bool interrupted_;
+  const BuildConfig& config_;
+  /// Runs the local commands, and turns SIGINT and friends into
+  /// SubprocessSet::IsInterrupted() for the remote ones too.
+  SubprocessSet local_;
+  std::map<Subprocess*, Edge*> local_edges_;
+};
+
+#endif  // NINJA_REMOTE_H_
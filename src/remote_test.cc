@@ -0,0 +1,206 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "remote.h"
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "graph.h"
+#include "test.h"
+
+using namespace std;
+
+namespace {
+
+TEST(RemoteTest, Request) {
+  RemoteRequest request;
+  request.cwd = "/home/user/out";
+  request.env.push_back("PATH=/bin");
+  RemoteFile input;
+  input.path = "../src/a.c";
+  input.mode = 0755;
+  input.contents = "int main() {}\n";
+  request.inputs.push_back(input);
+  request.outputs.push_back("a.o");
+  request.command = "cc -c ../src/a.c -o a.o";
+  string encoded;
+  request.Encode(&encoded);
+
+  // Records may arrive in any pieces.
+  RemoteDecoder decoder("run");
+  string err;
+  for (size_t i = 0; i < encoded.size(); ++i) {
+    EXPECT_FALSE(decoder.done());
+    ASSERT_TRUE(decoder.Feed(&encoded[i], 1, &err));
+  }
+  ASSERT_TRUE(decoder.done());
+  RemoteRequest decoded;
+  ASSERT_TRUE(decoder.Decode(&decoded, &err));
+  EXPECT_EQ(request.cwd, decoded.cwd);
+  ASSERT_EQ(1u, decoded.env.size());
+  EXPECT_EQ("PATH=/bin", decoded.env[0]);
+  ASSERT_EQ(1u, decoded.inputs.size());
+  EXPECT_EQ("../src/a.c", decoded.inputs[0].path);
+  EXPECT_EQ(0755, decoded.inputs[0].mode);
+  EXPECT_EQ(input.contents, decoded.inputs[0].contents);
+  ASSERT_EQ(1u, decoded.outputs.size());
+  EXPECT_EQ("a.o", decoded.outputs[0]);
+  EXPECT_EQ(request.command, decoded.command);
+}
+
+TEST(RemoteTest, Response) {
+  RemoteResponse response;
+  response.exit_code = 2;
+  response.output = "warning\n";
+  response.usage.user_millis = 10;
+  response.usage.max_rss_kb = 2048;
+  RemoteFile output;
+  output.path = "a.o";
+  output.contents = string("\0\1\n", 3);
+  response.outputs.push_back(output);
+  string encoded;
+  response.Encode(&encoded);
+
+  RemoteDecoder decoder("exit");
+  string err;
+  ASSERT_TRUE(decoder.Feed(encoded.data(), encoded.size(), &err));
+  ASSERT_TRUE(decoder.done());
+  RemoteResponse decoded;
+  ASSERT_TRUE(decoder.Decode(&decoded, &err));
+  EXPECT_EQ(2, decoded.exit_code);
+  EXPECT_EQ("warning\n", decoded.output);
+  EXPECT_EQ(10, decoded.usage.user_millis);
+  EXPECT_EQ(2048, decoded.usage.max_rss_kb);
+  ASSERT_EQ(1u, decoded.outputs.size());
+  EXPECT_EQ(0644, decoded.outputs[0].mode);
+  EXPECT_EQ(output.contents, decoded.outputs[0].contents);
+}
+
+TEST(RemoteTest, Malformed) {
+  string err;
+  RemoteDecoder decoder("run");
+  EXPECT_FALSE(decoder.Feed("cwd x\n", 6, &err));
+  EXPECT_EQ("malformed record header 'cwd x'", err);
+
+  RemoteDecoder missing_data("run");
+  // Records end with their data, with nothing in between.
+  string encoded = "input 7\n644 a.crun 0\n";
+  ASSERT_TRUE(missing_data.Feed(encoded.data(), encoded.size(), &err));
+  RemoteRequest request;
+  EXPECT_FALSE(missing_data.Decode(&request, &err));
+  EXPECT_EQ("malformed input '644 a.c'", err);
+}
+
+TEST(RemoteTest, SandboxPath) {
+  string path;
+  EXPECT_TRUE(SandboxPath("/tmp/s", "/home/out", "a/./b.c", &path));
+  EXPECT_EQ("/tmp/s/home/out/a/b.c", path);
+  EXPECT_TRUE(SandboxPath("/tmp/s", "/home/out", "../src/a.c", &path));
+  EXPECT_EQ("/tmp/s/home/src/a.c", path);
+  EXPECT_FALSE(SandboxPath("/tmp/s", "/home/out", "../../../etc/passwd",
+                           &path));
+  EXPECT_FALSE(SandboxPath("/tmp/s", "/home/out", "/etc/passwd", &path));
+  EXPECT_FALSE(SandboxPath("/tmp/s", "/home/out", "", &path));
+}
+
+/// Runs edges on a worker serving from a child process.
+struct RemoteRunnerTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-RemoteRunnerTest");
+    string err;
+    int fd = ListenRemote("127.0.0.1:0", &err);
+    ASSERT_GE(fd, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    ASSERT_EQ(0, getsockname(fd, (struct sockaddr*)&addr, &len));
+    server_ = fork();
+    if (server_ == 0)
+      ServeRemote(fd);
+    close(fd);
+    config_.remote_workers.push_back("127.0.0.1:" +
+                                     to_string(ntohs(addr.sin_port)));
+  }
+
+  virtual void TearDown() {
+    kill(server_, SIGTERM);
+    waitpid(server_, NULL, 0);
+    temp_dir_.Cleanup();
+  }
+
+  /// Run |edge| to completion.
+  void RunEdge(RemoteCommandRunner* runner, Edge* edge,
+           CommandRunner::Result* result) {
+    ASSERT_TRUE(runner->StartCommand(edge));
+    ASSERT_TRUE(runner->WaitForCommand(result));
+    EXPECT_EQ(edge, result->edge);
+  }
+
+  BuildConfig config_;
+  RealDiskInterface disk_;
+  ScopedTempDir temp_dir_;
+  pid_t server_;
+};
+
+TEST_F(RemoteRunnerTest, Run) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule copy\n"
+"  command = cp $in $out && echo copied\n"
+"rule fail\n"
+"  command = echo oops; exit 3\n"
+"build sub/out: copy in\n"
+"build failed: fail in\n"));
+  ASSERT_TRUE(disk_.WriteFile("in", "contents\n"));
+  ASSERT_TRUE(disk_.MakeDirs("sub/out"));
+
+  RemoteCommandRunner runner(config_);
+  EXPECT_TRUE(runner.CanRunMore());
+  CommandRunner::Result result;
+  ASSERT_NO_FATAL_FAILURE(
+      RunEdge(&runner, state_.LookupNode("sub/out")->in_edge(), &result));
+  EXPECT_EQ(ExitSuccess, result.status);
+  EXPECT_EQ("copied\n", result.output.ToString());
+  string contents, err;
+  ASSERT_EQ(0, ::ReadFile("sub/out", &contents, &err));
+  EXPECT_EQ("contents\n", contents);
+
+  // The next command reuses the connection.
+  result = CommandRunner::Result();
+  ASSERT_NO_FATAL_FAILURE(
+      RunEdge(&runner, GetNode("failed")->in_edge(), &result));
+  EXPECT_EQ(ExitFailure, result.status);
+  EXPECT_EQ("oops\n", result.output.ToString());
+  EXPECT_EQ(0, disk_.Stat("failed", &err));
+}
+
+TEST_F(RemoteRunnerTest, NoWorker) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in\n"));
+  // Nothing listens on the port the server had, once it is gone.
+  kill(server_, SIGTERM);
+  waitpid(server_, NULL, 0);
+
+  RemoteCommandRunner runner(config_);
+  CommandRunner::Result result;
+  ASSERT_NO_FATAL_FAILURE(RunEdge(&runner, GetNode("out")->in_edge(), &result));
+  EXPECT_EQ(ExitFailure, result.status);
+  EXPECT_EQ(0u, result.output.ToString().find(
+                    "ninja: can't reach remote worker 127.0.0.1:"));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,42 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_RESOURCE_USAGE_H_
+#define NINJA_RESOURCE_USAGE_H_
+
+#include <stdint.h>
+
+/// What a command and the children it waited for used while it ran.
+/// Fields the platform can't tell are 0.
+struct ResourceUsage {
+  ResourceUsage()
+      : user_millis(0), system_millis(0), max_rss_kb(0), read_bytes(0),
+        write_bytes(0) {}
+
+  bool operator==(const ResourceUsage& o) const {
+    return user_millis == o.user_millis && system_millis == o.system_millis &&
+           max_rss_kb == o.max_rss_kb && read_bytes == o.read_bytes &&
+           write_bytes == o.write_bytes;
+  }
+
+  int64_t user_millis;
+  int64_t system_millis;
+  /// The peak resident set size of the largest process.
+  int64_t max_rss_kb;
+  /// Bytes passed through read() and write() calls, cached or not.
+  int64_t read_bytes;
+  int64_t write_bytes;
+};
+
+#endif  // NINJA_RESOURCE_USAGE_H_
@@ -23,36 +23,117 @@
 
 using namespace std;
 
+bool Pool::AddResource(const string& name, int capacity) {
+  if (FindResource(name) >= 0)
+    return false;
+  resources_.push_back(Resource(name, capacity));
+  return true;
+}
+
+int Pool::FindResource(const string& name) const {
+  for (size_t i = 0; i < resources_.size(); ++i) {
+    if (resources_[i].name == name)
+      return (int)i;
+  }
+  return -1;
+}
+
+void Pool::SetResourceUse(const Edge& edge, size_t index, int amount) {
+  vector<int>& use = resource_use_[edge.id_];
+  if (use.size() <= index)
+    use.resize(index + 1, 0);
+  use[index] = amount;
+}
+
+int Pool::ResourceUse(const Edge& edge, size_t index) const {
+  unordered_map<size_t, vector<int> >::const_iterator i =
+      resource_use_.find(edge.id_);
+  if (i == resource_use_.end() || index >= i->second.size())
+    return 0;
+  return i->second[index];
+}
+
+bool Pool::ShouldDelayEdge(const Edge& edge) const {
+  for (size_t dim = 0; dim <= resources_.size(); ++dim) {
+    if (Demand(edge, dim) != 0)
+      return true;
+  }
+  return false;
+}
+
 void Pool::EdgeScheduled(const Edge& edge) {
   if (depth_ != 0)
     current_use_ += edge.weight();
+  for (size_t i = 0; i < resources_.size(); ++i)
+    resources_[i].current_use += ResourceUse(edge, i);
 }
 
 void Pool::EdgeFinished(const Edge& edge) {
   if (depth_ != 0)
     current_use_ -= edge.weight();
+  for (size_t i = 0; i < resources_.size(); ++i)
+    resources_[i].current_use -= ResourceUse(edge, i);
 }
 
 void Pool::DelayEdge(Edge* edge) {
-  assert(depth_ != 0);
+  assert(ShouldDelayEdge(*edge));
   delayed_.insert(edge);
 }
 
-void Pool::RetrieveReadyEdges(EdgeSet* ready_queue) {
+int Pool::Demand(const Edge& edge, size_t dim) const {
+  if (dim == 0)
+    return depth_ != 0 ? edge.weight() : 0;
+  return ResourceUse(edge, dim - 1);
+}
+
+bool Pool::Fits(const Edge& edge, const vector<bool>& blocked) const {
+  for (size_t dim = 0; dim < blocked.size(); ++dim) {
+    int demand = Demand(edge, dim);
+    if (demand == 0)
+      continue;
+    if (blocked[dim])
+      return false;
+    if (dim == 0 ? current_use_ + demand > depth_
+                 : resources_[dim - 1].current_use + demand >
+                       resources_[dim - 1].capacity)
+      return false;
+  }
+  return true;
+}
+
+void Pool::RetrieveReadyEdges(EdgePriorityQueue* ready_queue) {
+  // Take edges in priority order, packing in any later edge that still fits
+  // when an earlier one does not. An edge that has to wait blocks the
+  // dimensions it needs for everything behind it, so that lighter edges
+  // cannot keep it waiting forever.
+  vector<bool> blocked(resources_.size() + 1, false);
+  size_t num_blocked = 0;
   DelayedEdges::iterator it = delayed_.begin();
-  while (it != delayed_.end()) {
+  while (it != delayed_.end() && num_blocked < blocked.size()) {
     Edge* edge = *it;
-    if (current_use_ + edge->weight() > depth_)
-      break;
-    ready_queue->insert(edge);
-    EdgeScheduled(*edge);
+    if (Fits(*edge, blocked)) {
+      ready_queue->push(edge);
+      EdgeScheduled(*edge);
+      delayed_.erase(it++);
+      continue;
+    }
+    for (size_t dim = 0; dim < blocked.size(); ++dim) {
+      if (Demand(*edge, dim) != 0 && !blocked[dim]) {
+        blocked[dim] = true;
+        ++num_blocked;
+      }
+    }
     ++it;
   }
-  delayed_.erase(delayed_.begin(), it);
 }
 
 void Pool::Dump() const {
-  printf("%s (%d/%d) ->\n", name_.c_str(), current_use_, depth_);
+  printf("%s (%d/%d", name_.c_str(), current_use_, depth_);
+  for (size_t i = 0; i < resources_.size(); ++i) {
+    printf(" %s %d/%d", resources_[i].name.c_str(), resources_[i].current_use,
+           resources_[i].capacity);
+  }
+  printf(") ->\n");
   for (DelayedEdges::const_iterator it = delayed_.begin();
        it != delayed_.end(); ++it)
   {
@@ -18,6 +18,7 @@
 #include <map>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "eval_env.h"
@@ -37,18 +38,42 @@ struct Rule;
 /// allowing the Plan to schedule it. The Pool will relinquish queued Edges when
 /// the total scheduled weight diminishes enough (i.e. when a scheduled edge
 /// completes).
+///
+/// A Pool may also have named resources (e.g. memory), each with a capacity
+/// that the resource use of its scheduled edges may not exceed.
 struct Pool {
   Pool(const std::string& name, int depth)
     : name_(name), current_use_(0), depth_(depth), delayed_() {}
 
+  struct Resource {
+    Resource(const std::string& name, int capacity)
+        : name(name), capacity(capacity), current_use(0) {}
+    std::string name;
+    int capacity;
+    int current_use;
+  };
+
   // A depth of 0 is infinite
   bool is_valid() const { return depth_ >= 0; }
   int depth() const { return depth_; }
   const std::string& name() const { return name_; }
   int current_use() const { return current_use_; }
 
-  /// true if the Pool might delay this edge
-  bool ShouldDelayEdge() const { return depth_ != 0; }
+  /// Add a named resource; edges in this Pool may then declare their use of
+  /// it. Returns false if the Pool already has a resource of that name.
+  bool AddResource(const std::string& name, int capacity);
+  /// Return the index of the named resource, or -1 if there is none.
+  int FindResource(const std::string& name) const;
+  const std::vector<Resource>& resources() const { return resources_; }
+
+  /// Record that |edge| uses |amount| of the |index|th resource.
+  void SetResourceUse(const Edge& edge, size_t index, int amount);
+  /// How much of the |index|th resource |edge| uses.
+  int ResourceUse(const Edge& edge, size_t index) const;
+
+  /// true if the Pool might delay this edge, i.e. it takes up any of the
+  /// Pool's depth or resources
+  bool ShouldDelayEdge(const Edge& edge) const;
 
   /// informs this Pool that the given edge is committed to be run.
   /// Pool will count this edge as using resources from this pool.
@@ -62,7 +87,7 @@ struct Pool {
   void DelayEdge(Edge* edge);
 
   /// Pool will add zero or more edges to the ready_queue
-  void RetrieveReadyEdges(EdgeSet* ready_queue);
+  void RetrieveReadyEdges(EdgePriorityQueue* ready_queue);
 
   /// Dump the Pool and its edges (useful for debugging).
   void Dump() const;
@@ -74,17 +99,19 @@ struct Pool {
   /// currently scheduled in the Plan (i.e. the edges in Plan::ready_).
   int current_use_;
   int depth_;
-
-  struct WeightedEdgeCmp {
-    bool operator()(const Edge* a, const Edge* b) const {
-      if (!a) return b;
-      if (!b) return false;
-      int weight_diff = a->weight() - b->weight();
-      return ((weight_diff < 0) || (weight_diff == 0 && EdgeCmp()(a, b)));
-    }
-  };
-
-  typedef std::set<Edge*, WeightedEdgeCmp> DelayedEdges;
+  std::vector<Resource> resources_;
+  /// The resource use of the edges which declare any, by Edge::id_, so
+  /// that other edges pay nothing for it.
+  std::unordered_map<size_t, std::vector<int> > resource_use_;
+
+  /// The amount of dimension |dim| that |edge| uses while running, where
+  /// dimension 0 is the depth and dimension i is resources_[i - 1].
+  int Demand(const Edge& edge, size_t dim) const;
+  /// Return true if there is room to start |edge| without touching any of
+  /// the |blocked| dimensions.
+  bool Fits(const Edge& edge, const std::vector<bool>& blocked) const;
+
+  typedef std::set<Edge*, EdgePriorityGreater> DelayedEdges;
   DelayedEdges delayed_;
 };
 
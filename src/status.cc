@@ -59,7 +59,9 @@ void StatusPrinter::BuildEdgeStarted(const Edge* edge,
 }
 
 void StatusPrinter::BuildEdgeFinished(Edge* edge, int64_t end_time_millis,
-                                      bool success, const string& output) {
+                                      bool success,
+                                      const CommandOutput& output,
+                                      const ResourceUsage& usage) {
   time_millis_ = end_time_millis;
   ++finished_edges_;
 
@@ -101,18 +103,12 @@ void StatusPrinter::BuildEdgeFinished(Edge* edge, int64_t end_time_millis,
     // (Launching subprocesses in pseudo ttys doesn't work because there are
     // only a few hundred available on some systems, and ninja can launch
     // thousands of parallel compile commands.)
-    string final_output;
-    if (!printer_.supports_color())
-      final_output = StripAnsiEscapeCodes(output);
-    else
-      final_output = output;
-
 #ifdef _WIN32
     // Fix extra CR being added on Windows, writing out CR CR LF (#773)
     _setmode(_fileno(stdout), _O_BINARY);  // Begin Windows extra CR fix
 #endif
 
-    printer_.PrintOnNewLine(final_output);
+    printer_.PrintOnNewLine(output, !printer_.supports_color());
 
 #ifdef _WIN32
     _setmode(_fileno(stdout), _O_TEXT);  // End Windows extra CR fix
@@ -20,11 +20,19 @@
 #include <unistd.h>
 #include <cstdio>
 #include <cstring>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <spawn.h>
+#include <algorithm>
+#include <climits>
 #include <memory>
 
-#if defined(USE_PPOLL)
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#elif defined(USE_PPOLL)
 #include <poll.h>
 #else
 #include <sys/select.h>
@@ -36,30 +44,136 @@ extern char** environ;
 
 using namespace std;
 
+namespace {
+
+/// Map how a child ended, by exit code or by |signaled| with a signal, to
+/// an ExitStatus.
+ExitStatus ExitStatusOf(bool signaled, int value) {
+  if (!signaled)
+    return value == 0 ? ExitSuccess : ExitFailure;
+  if (value == SIGINT || value == SIGTERM || value == SIGHUP)
+    return ExitInterrupted;
+  return ExitFailure;
+}
+
+/// Take the times and peak memory of a reaped child from |ru|.
+void SetRusage(const struct rusage& ru, ResourceUsage* usage) {
+  usage->user_millis = (int64_t)ru.ru_utime.tv_sec * 1000 +
+                       ru.ru_utime.tv_usec / 1000;
+  usage->system_millis = (int64_t)ru.ru_stime.tv_sec * 1000 +
+                         ru.ru_stime.tv_usec / 1000;
+#ifdef __APPLE__
+  usage->max_rss_kb = ru.ru_maxrss / 1024;  // In bytes.
+#else
+  usage->max_rss_kb = ru.ru_maxrss;
+#endif
+}
+
+/// Read the I/O counters of |pid| from /proc.  It must not be reaped yet,
+/// and they include those of the children it reaped.
+void ReadProcIo(pid_t pid, ResourceUsage* usage) {
+#ifdef __linux__
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return;
+  long long rchar, wchar;
+  if (fscanf(f, "rchar: %lld wchar: %lld", &rchar, &wchar) == 2) {
+    usage->read_bytes = rchar;
+    usage->write_bytes = wchar;
+  }
+  fclose(f);
+#endif
+}
+
+/// Write all of |data| to the socket |fd|.  A peer that is gone makes it
+/// fail with EPIPE rather than raise SIGPIPE.
+bool SendAll(int fd, const string& data) {
+  const char* p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+#ifdef MSG_NOSIGNAL
+    ssize_t len = send(fd, p, left, MSG_NOSIGNAL);
+#else
+    ssize_t len = write(fd, p, left);  // The socket has SO_NOSIGPIPE.
+#endif
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += len;
+    left -= len;
+  }
+  return true;
+}
+
+#ifdef USE_EPOLL
+#ifndef P_PIDFD
+#define P_PIDFD ((idtype_t)3)
+#endif
+
+/// The events of a subprocess's pidfd are told apart from those of its
+/// pipe by this bit of their data; those of the signalfd have no data.
+const uint64_t kExitEvent = 1;
+
+void AddEvent(int epoll_fd, int fd, uint32_t events, uint64_t data) {
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.u64 = data;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+}
+#endif  // USE_EPOLL
+
+}  // anonymous namespace
+
 Subprocess::Subprocess(bool use_console) : fd_(-1), pid_(-1),
+                                           running_index_(0),
+#ifdef USE_EPOLL
+                                           pidfd_(-1), exited_(false),
+                                           exit_status_(ExitFailure),
+#endif
+                                           on_worker_(false),
+                                           worker_status_(ExitFailure),
+                                           worker_remaining_(0),
                                            use_console_(use_console) {
 }
 
 Subprocess::~Subprocess() {
-  if (fd_ >= 0)
+  // The worker, if any, owns fd_.
+  if (fd_ >= 0 && !on_worker_)
     close(fd_);
+#ifdef USE_EPOLL
+  if (pidfd_ >= 0)
+    close(pidfd_);
+#endif
   // Reap child if forgotten.
   if (pid_ != -1)
     Finish();
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool direct_exec) {
   int output_pipe[2];
   if (pipe(output_pipe) < 0)
     Fatal("pipe: %s", strerror(errno));
   fd_ = output_pipe[0];
-#if !defined(USE_PPOLL)
-  // If available, we use ppoll in DoWork(); otherwise we use pselect
-  // and so must avoid overly-large FDs.
+#if !defined(USE_PPOLL) && !defined(USE_EPOLL)
+  // If available, we use epoll or ppoll in DoWork(); otherwise we use
+  // pselect and so must avoid overly-large FDs.
   if (fd_ >= static_cast<int>(FD_SETSIZE))
     Fatal("pipe: %s", strerror(EMFILE));
-#endif  // !USE_PPOLL
+#endif  // !USE_PPOLL && !USE_EPOLL
   SetCloseOnExec(fd_);
+#ifdef USE_EPOLL
+  // Edge-triggered, so OnPipeReady() must drain the pipe without blocking.
+  if (fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK) < 0)
+    Fatal("fcntl: %s", strerror(errno));
+  AddEvent(set->epoll_fd_, fd_, EPOLLIN | EPOLLET, (uintptr_t)this);
+#endif
 
   posix_spawn_file_actions_t action;
   int err = posix_spawn_file_actions_init(&action);
@@ -117,11 +231,28 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   if (err != 0)
     Fatal("posix_spawnattr_setflags: %s", strerror(err));
 
-  const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
-  err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
-        const_cast<char**>(spawned_args), environ);
-  if (err != 0)
-    Fatal("posix_spawn: %s", strerror(err));
+  // posix_spawn() shares the parent's memory with the child until it
+  // execs (vfork, or clone(CLONE_VM) in glibc), so it costs the same
+  // however big ninja is; skipping the shell saves its exec and startup.
+  vector<string> args;
+  err = -1;
+  if (direct_exec && SplitSimpleCommand(command, &args)) {
+    vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (size_t i = 0; i < args.size(); ++i)
+      argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+    // If the program can't be found or run, the shell reports it the
+    // usual way below.
+    err = posix_spawnp(&pid_, argv[0], &action, &attr, argv.data(), environ);
+  }
+  if (err != 0) {
+    const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
+    err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
+          const_cast<char**>(spawned_args), environ);
+    if (err != 0)
+      Fatal("posix_spawn: %s", strerror(err));
+  }
 
   err = posix_spawnattr_destroy(&attr);
   if (err != 0)
@@ -131,28 +262,277 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
     Fatal("posix_spawn_file_actions_destroy: %s", strerror(err));
 
   close(output_pipe[1]);
+
+#if defined(USE_EPOLL) && defined(SYS_pidfd_open)
+  // posix_spawn() can't hand us a pidfd (CLONE_PIDFD) itself, but the
+  // child can't be reaped, and its pid reused, before we get one.
+  pidfd_ = (int)syscall(SYS_pidfd_open, pid_, 0);
+  if (pidfd_ >= 0)
+    AddEvent(set->epoll_fd_, pidfd_, EPOLLIN, (uintptr_t)this | kExitEvent);
+#endif
   return true;
 }
 
 void Subprocess::OnPipeReady() {
-  char buf[4 << 10];
-  ssize_t len = read(fd_, buf, sizeof(buf));
-  if (len > 0) {
-    buf_.append(buf, len);
-  } else {
-    if (len < 0)
+  if (on_worker_) {
+    OnWorkerReady();
+    return;
+  }
+  char buf[64 << 10];
+  for (;;) {
+    ssize_t len = read(fd_, buf, sizeof(buf));
+    if (len > 0) {
+      buf_.Append(buf, len);
+#ifdef USE_EPOLL
+      // No more events come until the pipe has been read dry.
+      continue;
+#else
+      return;
+#endif
+    }
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if (errno == EINTR)
+        continue;
       Fatal("read: %s", strerror(errno));
+    }
+    // Closing the fd also takes it out of the epoll set, as nobody else
+    // has it open.
     close(fd_);
     fd_ = -1;
+    return;
+  }
+}
+
+bool Subprocess::StartOnWorker(SubprocessSet* set,
+                               std::unique_ptr<Worker> worker,
+                               const string& command) {
+  char header[32];
+  snprintf(header, sizeof(header), "%zu\n", command.size());
+  if (!SendAll(worker->fd_, header + command))
+    return false;
+  on_worker_ = true;
+  worker_ = std::move(worker);
+  fd_ = worker_->fd_;
+#ifdef USE_EPOLL
+  AddEvent(set->epoll_fd_, fd_, EPOLLIN | EPOLLET, (uintptr_t)this);
+#endif
+  return true;
+}
+
+void Subprocess::OnWorkerReady() {
+  char buf[64 << 10];
+  for (;;) {
+#ifdef USE_EPOLL
+    // The socket blocks, for requests; only reads must not.
+    ssize_t len = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT);
+#else
+    ssize_t len = recv(fd_, buf, sizeof(buf), 0);
+#endif
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if (errno == EINTR)
+        continue;
+    }
+    if (len <= 0)
+      break;  // The worker is gone.
+
+    // "<exit code> <length>\n<output>"
+    const char* data = buf;
+    size_t size = len;
+    bool has_header =
+        !worker_header_.empty() && *worker_header_.rbegin() == '\n';
+    if (!has_header) {
+      const char* newline = (const char*)memchr(data, '\n', size);
+      size_t header_size = newline ? newline - data + 1 : size;
+      worker_header_.append(data, header_size);
+      data += header_size;
+      size -= header_size;
+      if (newline) {
+        int exit_code;
+        unsigned long long remaining;
+        char end;
+        if (sscanf(worker_header_.c_str(), "%d %llu%c", &exit_code,
+                   &remaining, &end) != 3 || end != '\n')
+          break;
+        worker_status_ = exit_code == 0 ? ExitSuccess : ExitFailure;
+        worker_remaining_ = remaining;
+        has_header = true;
+      } else if (worker_header_.size() > 64) {
+        break;  // Not an answer.
+      }
+    }
+    if (has_header) {
+      if (size > worker_remaining_)
+        break;  // The worker says more than it should.
+      buf_.Append(data, size);
+      worker_remaining_ -= size;
+      if (worker_remaining_ == 0) {
+        fd_ = -1;
+        return;
+      }
+    }
+#ifndef USE_EPOLL
+    return;  // Until poll says there is more.
+#endif
   }
+
+  // A worker that dies, or doesn't keep to the protocol, can't be trusted
+  // with another command.  Its next one starts a new worker.
+  buf_.Assign("ninja: worker '" + worker_->command_ + "' " + worker_->Reap() +
+              "\n");
+  worker_status_ = ExitFailure;
+  fd_ = -1;
+  worker_.reset();
 }
 
+Worker::Worker(const string& command) : command_(command), pid_(-1),
+                                        fd_(-1) {}
+
+Worker::~Worker() {
+  if (fd_ >= 0)
+    close(fd_);
+  if (pid_ != -1) {
+    // A worker that answered has nothing left to do; one that didn't was
+    // interrupted along with the build.
+    kill(-pid_, SIGTERM);
+    while (waitpid(pid_, NULL, 0) < 0 && errno == EINTR) {
+    }
+  }
+}
+
+void Worker::Start(SubprocessSet* set) {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+    Fatal("socketpair: %s", strerror(errno));
+  fd_ = sockets[0];
+#if !defined(USE_PPOLL) && !defined(USE_EPOLL)
+  if (fd_ >= static_cast<int>(FD_SETSIZE))
+    Fatal("socketpair: %s", strerror(EMFILE));
+#endif  // !USE_PPOLL && !USE_EPOLL
+  // Other commands mustn't hold on to either end, or the worker won't see
+  // its stdin close, nor ninja the worker die.
+  SetCloseOnExec(sockets[0]);
+  SetCloseOnExec(sockets[1]);
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+  posix_spawn_file_actions_t action;
+  int err = posix_spawn_file_actions_init(&action);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions_init: %s", strerror(err));
+  err = posix_spawn_file_actions_adddup2(&action, sockets[1], 0);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions_adddup2: %s", strerror(err));
+  err = posix_spawn_file_actions_adddup2(&action, sockets[1], 1);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions_adddup2: %s", strerror(err));
+
+  posix_spawnattr_t attr;
+  err = posix_spawnattr_init(&attr);
+  if (err != 0)
+    Fatal("posix_spawnattr_init: %s", strerror(err));
+  err = posix_spawnattr_setsigmask(&attr, &set->old_mask_);
+  if (err != 0)
+    Fatal("posix_spawnattr_setsigmask: %s", strerror(err));
+  // Like other commands, the worker is in a process group of its own, so
+  // ctrl-c reaches it only through ninja.
+  err = posix_spawnattr_setflags(&attr,
+                                 POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+  if (err != 0)
+    Fatal("posix_spawnattr_setflags: %s", strerror(err));
+
+  const char* spawned_args[] = { "/bin/sh", "-c", command_.c_str(), NULL };
+  err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
+                    const_cast<char**>(spawned_args), environ);
+  if (err != 0)
+    Fatal("posix_spawn: %s", strerror(err));
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&action);
+  close(sockets[1]);
+}
+
+string Worker::Reap() {
+  int status;
+  pid_t pid = pid_;
+  pid_ = -1;
+  if (waitpid(pid, &status, 0) < 0)
+    return "is gone";
+  char reason[64];
+  if (WIFSIGNALED(status)) {
+    snprintf(reason, sizeof(reason), "was killed by signal %d",
+             WTERMSIG(status));
+  } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+    snprintf(reason, sizeof(reason), "exited with status %d",
+             WEXITSTATUS(status));
+  } else {
+    snprintf(reason, sizeof(reason), "didn't answer");
+  }
+  return reason;
+}
+
+#ifdef USE_EPOLL
+void Subprocess::OnExit() {
+  ReadProcIo(pid_, &usage_);
+  // Only the system call, not its libc wrapper, hands out the rusage.
+  siginfo_t info;
+  struct rusage ru;
+  memset(&info, 0, sizeof(info));
+  memset(&ru, 0, sizeof(ru));
+  while (syscall(SYS_waitid, P_PIDFD, pidfd_, &info, WEXITED, &ru) < 0) {
+    // Kernels before 5.4 have pidfds, but can't wait on them.
+    if (errno == EINVAL &&
+        syscall(SYS_waitid, P_PID, pid_, &info, WEXITED, &ru) == 0)
+      break;
+    if (errno != EINTR)
+      Fatal("waitid(%d): %s", pid_, strerror(errno));
+  }
+  pid_ = -1;
+  exited_ = true;
+  exit_status_ = ExitStatusOf(info.si_code != CLD_EXITED, info.si_status);
+  SetRusage(ru, &usage_);
+  close(pidfd_);
+  pidfd_ = -1;
+
+  // Whatever the child wrote is in the pipe by now.  Don't wait for the
+  // end of it: a grandchild left running in the background may hold it
+  // open for much longer.
+  if (fd_ >= 0) {
+    OnPipeReady();
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+}
+#endif  // USE_EPOLL
+
 ExitStatus Subprocess::Finish() {
+  if (on_worker_)
+    return worker_status_;
+#ifdef USE_EPOLL
+  if (exited_)
+    return exit_status_;
+#endif
   assert(pid_ != -1);
+#if defined(__linux__) && defined(WNOWAIT)
+  // Leave the child a zombie until its I/O counters are read.
+  siginfo_t info;
+  while (waitid(P_PID, pid_, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {
+  }
+  ReadProcIo(pid_, &usage_);
+#endif
   int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  struct rusage ru;
+  if (wait4(pid_, &status, 0, &ru) < 0)
+    Fatal("wait4(%d): %s", pid_, strerror(errno));
   pid_ = -1;
+  SetRusage(ru, &usage_);
 
 #ifdef _AIX
   if (WIFEXITED(status) && WEXITSTATUS(status) & 0x80) {
@@ -164,26 +544,24 @@ ExitStatus Subprocess::Finish() {
   }
 #endif
 
-  if (WIFEXITED(status)) {
-    int exit = WEXITSTATUS(status);
-    if (exit == 0)
-      return ExitSuccess;
-  } else if (WIFSIGNALED(status)) {
-    if (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGTERM
-        || WTERMSIG(status) == SIGHUP)
-      return ExitInterrupted;
-  }
+  if (WIFEXITED(status))
+    return ExitStatusOf(false, WEXITSTATUS(status));
+  if (WIFSIGNALED(status))
+    return ExitStatusOf(true, WTERMSIG(status));
   return ExitFailure;
 }
 
 bool Subprocess::Done() const {
+#ifdef USE_EPOLL
+  if (exited_)
+    return true;
+  // With a pidfd, the end of the output isn't the end of the child.
+  if (pidfd_ >= 0)
+    return false;
+#endif
   return fd_ == -1;
 }
 
-const string& Subprocess::GetOutput() const {
-  return buf_;
-}
-
 int SubprocessSet::interrupted_;
 
 void SubprocessSet::SetInterruptedFlag(int signum) {
@@ -214,6 +592,16 @@ SubprocessSet::SubprocessSet() {
   if (sigprocmask(SIG_BLOCK, &set, &old_mask_) < 0)
     Fatal("sigprocmask: %s", strerror(errno));
 
+#ifdef USE_EPOLL
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0)
+    Fatal("epoll_create1: %s", strerror(errno));
+  // The signals stay blocked, and pending until read from here.
+  signal_fd_ = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd_ >= 0)
+    AddEvent(epoll_fd_, signal_fd_, EPOLLIN, 0);
+#endif
+
   struct sigaction act;
   memset(&act, 0, sizeof(act));
   act.sa_handler = SetInterruptedFlag;
@@ -235,21 +623,142 @@ SubprocessSet::~SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigprocmask(SIG_SETMASK, &old_mask_, 0) < 0)
     Fatal("sigprocmask: %s", strerror(errno));
+#ifdef USE_EPOLL
+  if (signal_fd_ >= 0)
+    close(signal_fd_);
+  close(epoll_fd_);
+#endif
 }
 
-std::shared_ptr<Subprocess> SubprocessSet::Add(const string& command, bool use_console) {
+std::shared_ptr<Subprocess> SubprocessSet::Add(const string& command,
+                                               bool use_console,
+                                               bool direct_exec) {
   std::shared_ptr<Subprocess> subprocess(new Subprocess(use_console));
+  subprocess->running_index_ = running_.size();
   running_.push_back(subprocess);
-  if (!subprocess->Start(this, command)) {
+  if (!subprocess->Start(this, command, direct_exec)) {
     return nullptr;
   }
   return subprocess;
 }
 
-#ifdef USE_PPOLL
-bool SubprocessSet::DoWork() {
+std::shared_ptr<Subprocess> SubprocessSet::AddToWorker(
+    const string& worker_command, const string& command) {
+  std::shared_ptr<Subprocess> subprocess(new Subprocess(false));
+  std::vector<std::unique_ptr<Worker> >& idle = idle_workers_[worker_command];
+  for (;;) {
+    std::unique_ptr<Worker> worker;
+    bool fresh = idle.empty();
+    if (fresh) {
+      worker.reset(new Worker(worker_command));
+      worker->Start(this);
+    } else {
+      worker = std::move(idle.back());
+      idle.pop_back();
+      // One that died while idle would never answer.
+      if (waitpid(worker->pid_, NULL, WNOHANG) != 0) {
+        worker->pid_ = -1;
+        continue;
+      }
+    }
+    if (subprocess->StartOnWorker(this, std::move(worker), command))
+      break;
+    // One that is gone before it got the command is replaced, unless it
+    // was just started.
+    if (!fresh)
+      continue;
+    subprocess->buf_.Assign("ninja: can't send command to worker '" +
+                            worker_command + "': " + strerror(errno) + "\n");
+    subprocess->on_worker_ = true;
+    finished_.push(subprocess);
+    return subprocess;
+  }
+  subprocess->running_index_ = running_.size();
+  running_.push_back(subprocess);
+  return subprocess;
+}
+
+void SubprocessSet::OnPipeReady(Subprocess* subproc) {
+  subproc->OnPipeReady();
+  if (!subproc->Done())
+    return;
+  if (subproc->worker_) {
+#ifdef USE_EPOLL
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, subproc->worker_->fd_, NULL);
+#endif
+    idle_workers_[subproc->worker_->command_].push_back(
+        std::move(subproc->worker_));
+  }
+  Finished(subproc);
+}
+
+void SubprocessSet::Finished(Subprocess* subproc) {
+  // Swap the last running subprocess into its place.
+  size_t index = subproc->running_index_;
+  assert(running_[index].get() == subproc);
+  finished_.push(running_[index]);
+  if (index != running_.size() - 1) {
+    running_[index] = running_.back();
+    running_[index]->running_index_ = index;
+  }
+  running_.pop_back();
+}
+
+#if defined(USE_EPOLL)
+bool SubprocessSet::DoWork(int64_t timeout_millis) {
+  epoll_event events[64];
+  const int kMaxEvents = sizeof(events) / sizeof(events[0]);
+  int timeout = timeout_millis < 0 ? -1 :
+      (int)std::min<int64_t>(timeout_millis, INT_MAX);
+  interrupted_ = 0;
+  int ret;
+  if (signal_fd_ >= 0)
+    ret = epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+  else
+    ret = epoll_pwait(epoll_fd_, events, kMaxEvents, timeout, &old_mask_);
+  if (ret == -1) {
+    if (errno != EINTR) {
+      perror("ninja: epoll_wait");
+      return false;
+    }
+    return IsInterrupted();
+  }
+
+  if (signal_fd_ >= 0) {
+    signalfd_siginfo info;
+    while (read(signal_fd_, &info, sizeof(info)) == sizeof(info))
+      interrupted_ = info.ssi_signo;
+  } else {
+    HandlePendingInterruption();
+  }
+  if (IsInterrupted())
+    return true;
+
+  for (int i = 0; i < ret; ++i) {
+    uint64_t data = events[i].data.u64;
+    if (data == 0)
+      continue;  // The signalfd, read above.
+    Subprocess* subproc = reinterpret_cast<Subprocess*>(data & ~kExitEvent);
+    // Its exit may have come in the same batch, and finished it already.
+    if (subproc->Done())
+      continue;
+    if (data & kExitEvent) {
+      subproc->OnExit();
+      Finished(subproc);
+    } else {
+      OnPipeReady(subproc);
+    }
+  }
+
+  return IsInterrupted();
+}
+
+#elif defined(USE_PPOLL)
+bool SubprocessSet::DoWork(int64_t timeout_millis) {
   vector<pollfd> fds;
-  nfds_t nfds = 0;
+  vector<Subprocess*> subprocs;
+  fds.reserve(running_.size());
+  subprocs.reserve(running_.size());
 
   for (auto & i : running_) {
     int fd = i->fd_;
@@ -257,11 +766,14 @@ bool SubprocessSet::DoWork() {
       continue;
     pollfd pfd = { fd, POLLIN | POLLPRI, 0 };
     fds.push_back(pfd);
-    ++nfds;
+    subprocs.push_back(i.get());
   }
 
+  timespec timeout = { (time_t)(timeout_millis / 1000),
+                       (long)(timeout_millis % 1000) * 1000000 };
   interrupted_ = 0;
-  int ret = ppoll(&fds.front(), nfds, nullptr, &old_mask_);
+  int ret = ppoll(fds.data(), fds.size(),
+                  timeout_millis < 0 ? nullptr : &timeout, &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: ppoll");
@@ -274,29 +786,16 @@ bool SubprocessSet::DoWork() {
   if (IsInterrupted())
     return true;
 
-  nfds_t cur_nfd = 0;
-  for (auto i = running_.begin();
-       i != running_.end(); ) {
-    int fd = (*i)->fd_;
-    if (fd < 0)
-      continue;
-    assert(fd == fds[cur_nfd].fd);
-    if (fds[cur_nfd++].revents) {
-      (*i)->OnPipeReady();
-      if ((*i)->Done()) {
-        finished_.push(*i);
-        i = running_.erase(i);
-        continue;
-      }
-    }
-    ++i;
+  for (size_t i = 0; i < fds.size(); ++i) {
+    if (fds[i].revents)
+      OnPipeReady(subprocs[i]);
   }
 
   return IsInterrupted();
 }
 
-#else  // !defined(USE_PPOLL)
-bool SubprocessSet::DoWork() {
+#else  // !defined(USE_EPOLL) && !defined(USE_PPOLL)
+bool SubprocessSet::DoWork(int64_t timeout_millis) {
   fd_set set;
   int nfds = 0;
   FD_ZERO(&set);
@@ -311,8 +810,11 @@ bool SubprocessSet::DoWork() {
     }
   }
 
+  timespec timeout = { (time_t)(timeout_millis / 1000),
+                       (long)(timeout_millis % 1000) * 1000000 };
   interrupted_ = 0;
-  int ret = pselect(nfds, &set, 0, 0, 0, &old_mask_);
+  int ret = pselect(nfds, &set, 0, 0, timeout_millis < 0 ? 0 : &timeout,
+                    &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: pselect");
@@ -325,23 +827,20 @@ bool SubprocessSet::DoWork() {
   if (IsInterrupted())
     return true;
 
+  // OnPipeReady() reorders running_, so collect the ready ones first.
+  vector<Subprocess*> ready;
   for (auto i = running_.begin();
-       i != running_.end(); ) {
+       i != running_.end(); ++i) {
     int fd = (*i)->fd_;
-    if (fd >= 0 && FD_ISSET(fd, &set)) {
-      (*i)->OnPipeReady();
-      if ((*i)->Done()) {
-        finished_.push(*i);
-        i = running_.erase(i);
-        continue;
-      }
-    }
-    ++i;
+    if (fd >= 0 && FD_ISSET(fd, &set))
+      ready.push_back(i->get());
   }
+  for (size_t i = 0; i < ready.size(); ++i)
+    OnPipeReady(ready[i]);
 
   return IsInterrupted();
 }
-#endif  // !defined(USE_PPOLL)
+#endif  // !defined(USE_EPOLL) && !defined(USE_PPOLL)
 
 std::shared_ptr<Subprocess> SubprocessSet::NextFinished() {
   if (finished_.empty())
@@ -352,10 +851,21 @@ std::shared_ptr<Subprocess> SubprocessSet::NextFinished() {
 }
 
 void SubprocessSet::Clear() {
-  for (auto & i : running_)
+  for (auto & i : running_) {
     // Since the foreground process is in our process group, it will receive
     // the interruption signal (i.e. SIGINT or SIGTERM) at the same time as us.
-    if (!i->use_console_)
+    if (i->on_worker_)
+      kill(-i->worker_->pid_, interrupted_);
+    else if (!i->use_console_)
       kill(-i->pid_, interrupted_);
+#ifdef USE_EPOLL
+    // Somebody may hold on to the subprocess, and its fds, after this.
+    if (i->fd_ >= 0)
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, i->fd_, NULL);
+    if (i->pidfd_ >= 0)
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, i->pidfd_, NULL);
+#endif
+  }
   running_.clear();
+  idle_workers_.clear();
 }
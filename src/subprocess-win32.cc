@@ -17,12 +17,29 @@
 #include <assert.h>
 #include <stdio.h>
 
+// Take GetProcessMemoryInfo() from kernel32 rather than psapi.dll.
+#ifndef PSAPI_VERSION
+#define PSAPI_VERSION 2
+#endif
+#include <psapi.h>
+
 #include <algorithm>
 
 #include "util.h"
 
 using namespace std;
 
+namespace {
+
+int64_t FileTimeMillis(const FILETIME& time) {
+  ULARGE_INTEGER value;
+  value.LowPart = time.dwLowDateTime;
+  value.HighPart = time.dwHighDateTime;
+  return (int64_t)(value.QuadPart / 10000);  // In units of 100ns.
+}
+
+}  // anonymous namespace
+
 Subprocess::Subprocess(bool use_console) : child_(NULL) , overlapped_(),
       is_reading_(false),
       use_console_(use_console) {
@@ -74,7 +91,9 @@ HANDLE Subprocess::SetupPipe(HANDLE ioport) {
   return output_write_child;
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool direct_exec) {
+  // CreateProcess() runs commands without a shell already.
   HANDLE child_pipe = SetupPipe(set->ioport_);
 
   SECURITY_ATTRIBUTES security_attributes;
@@ -123,8 +142,8 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
       CloseHandle(nul);
       pipe_ = NULL;
       // child_ is already NULL;
-      buf_ = "CreateProcess failed: The system cannot find the file "
-          "specified.\n";
+      buf_.Assign("CreateProcess failed: The system cannot find the file "
+                  "specified.\n");
       return true;
     } else {
       fprintf(stderr, "\nCreateProcess failed. Command attempted:\n\"%s\"\n",
@@ -166,7 +185,7 @@ void Subprocess::OnPipeReady() {
   }
 
   if (is_reading_ && bytes)
-    buf_.append(overlapped_buf_, bytes);
+    buf_.Append(overlapped_buf_, bytes);
 
   memset(&overlapped_, 0, sizeof(overlapped_));
   is_reading_ = true;
@@ -195,6 +214,22 @@ ExitStatus Subprocess::Finish() {
   DWORD exit_code = 0;
   GetExitCodeProcess(child_, &exit_code);
 
+  // Unlike on POSIX, this doesn't include what the child's children used.
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (GetProcessTimes(child_, &creation_time, &exit_time, &kernel_time,
+                      &user_time)) {
+    usage_.user_millis = FileTimeMillis(user_time);
+    usage_.system_millis = FileTimeMillis(kernel_time);
+  }
+  PROCESS_MEMORY_COUNTERS memory;
+  if (GetProcessMemoryInfo(child_, &memory, sizeof(memory)))
+    usage_.max_rss_kb = memory.PeakWorkingSetSize / 1024;
+  IO_COUNTERS io;
+  if (GetProcessIoCounters(child_, &io)) {
+    usage_.read_bytes = io.ReadTransferCount;
+    usage_.write_bytes = io.WriteTransferCount;
+  }
+
   CloseHandle(child_);
   child_ = NULL;
 
@@ -207,10 +242,6 @@ bool Subprocess::Done() const {
   return pipe_ == NULL;
 }
 
-const string& Subprocess::GetOutput() const {
-  return buf_;
-}
-
 HANDLE SubprocessSet::ioport_;
 
 SubprocessSet::SubprocessSet() {
@@ -238,9 +269,11 @@ BOOL WINAPI SubprocessSet::NotifyInterrupted(DWORD dwCtrlType) {
   return FALSE;
 }
 
-std::shared_ptr<Subprocess> SubprocessSet::Add(const string& command, bool use_console) {
+std::shared_ptr<Subprocess> SubprocessSet::Add(const string& command,
+                                               bool use_console,
+                                               bool direct_exec) {
   auto subprocess = std::shared_ptr<Subprocess>(new Subprocess(use_console));
-  if (!subprocess->Start(this, command)) {
+  if (!subprocess->Start(this, command, direct_exec)) {
     return nullptr;
   }
   if (subprocess->child_)
@@ -250,13 +283,21 @@ std::shared_ptr<Subprocess> SubprocessSet::Add(const string& command, bool use_c
   return subprocess;
 }
 
-bool SubprocessSet::DoWork() {
+std::shared_ptr<Subprocess> SubprocessSet::AddToWorker(
+    const string& worker_command, const string& command) {
+  return Add(command);
+}
+
+bool SubprocessSet::DoWork(int64_t timeout_millis) {
   DWORD bytes_read;
   std::shared_ptr<Subprocess> subproc;
   OVERLAPPED* overlapped;
 
+  DWORD timeout = timeout_millis < 0 ? INFINITE : (DWORD)timeout_millis;
   if (!GetQueuedCompletionStatus(ioport_, &bytes_read, (PULONG_PTR)&subproc,
-                                 &overlapped, INFINITE)) {
+                                 &overlapped, timeout)) {
+    if (!overlapped && GetLastError() == WAIT_TIMEOUT)
+      return false;
     if (GetLastError() != ERROR_BROKEN_PIPE)
       Win32Fatal("GetQueuedCompletionStatus");
   }
@@ -15,11 +15,14 @@
 #ifndef NINJA_SUBPROCESS_H_
 #define NINJA_SUBPROCESS_H_
 
+#include <map>
 #include <string>
 #include <vector>
 #include <queue>
 #include <memory>
 
+#include <stdint.h>
+
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -34,7 +37,35 @@
 #  endif
 #endif
 
+#include "command_output.h"
 #include "exit_status.h"
+#include "resource_usage.h"
+
+#ifndef _WIN32
+/// A long-lived process, started by the `worker` command of a rule, that
+/// runs the commands of the rule's edges one at a time, so that they don't
+/// each pay for starting a new process.
+///
+/// Its stdin and stdout are a socket.  Ninja writes each command to it as
+/// "<length>\n" followed by that many bytes, and the worker answers with
+/// "<exit code> <length>\n" followed by that many bytes of output.  Its
+/// stderr is ninja's.  It should exit once its stdin closes.
+struct Worker {
+  explicit Worker(const std::string& command);
+  /// Close the socket, and terminate and reap the worker if it still runs.
+  ~Worker();
+
+  void Start(struct SubprocessSet* set);
+  /// Reap the worker, which has closed its end of the socket, and describe
+  /// how it ended.
+  std::string Reap();
+
+  std::string command_;
+  pid_t pid_;
+  /// Our end of the socket.
+  int fd_;
+};
+#endif  // !_WIN32
 
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
@@ -49,15 +80,35 @@ struct Subprocess {
 
   bool Done() const;
 
-  const std::string& GetOutput() const;
+  /// The whole output, read into memory.
+  std::string GetOutput() const { return buf_.ToString(); }
+  /// Move the output to |output|, without reading it into memory.
+  void TakeOutput(CommandOutput* output) { *output = std::move(buf_); }
+
+  /// What the command used, once Finish() returned.
+  const ResourceUsage& GetResourceUsage() const { return usage_; }
 
  private:
   explicit Subprocess(bool use_console);
-  bool Start(struct SubprocessSet* set, const std::string& command);
+  bool Start(struct SubprocessSet* set, const std::string& command,
+             bool direct_exec);
   void OnPipeReady();
+#ifndef _WIN32
+  /// Send |command| to |worker| to run.  Returns false if it couldn't be
+  /// sent, as the worker is gone.
+  bool StartOnWorker(struct SubprocessSet* set, std::unique_ptr<Worker> worker,
+                     const std::string& command);
+  /// Read the worker's answer, or notice it died.
+  void OnWorkerReady();
+#endif
+#ifdef USE_EPOLL
+  /// Reap the child, which has exited, and take what output it left.
+  void OnExit();
+#endif
 
-  std::string buf_;
+  CommandOutput buf_;
   std::string debug_;
+  ResourceUsage usage_;
 
 #ifdef _WIN32
   /// Set up pipe_ as the parent-side pipe of the subprocess; return the
@@ -67,26 +118,57 @@ struct Subprocess {
   HANDLE child_;
   HANDLE pipe_;
   OVERLAPPED overlapped_;
-  char overlapped_buf_[4 << 10];
+  char overlapped_buf_[64 << 10];
   bool is_reading_;
 #else
   int fd_;
   pid_t pid_;
+  /// Where this subprocess is in SubprocessSet::running_ while it runs, so
+  /// that it can be taken out without a search.
+  size_t running_index_;
+#ifdef USE_EPOLL
+  /// A pidfd for the child, readable once it exits, or -1 if the kernel
+  /// has none; then the end of its output is taken as its exit.
+  int pidfd_;
+  bool exited_;
+  ExitStatus exit_status_;
+#endif
+  /// The worker running the command, if it runs on one, until it answers;
+  /// then fd_ is -1 and the worker is handed back to the SubprocessSet.
+  std::unique_ptr<Worker> worker_;
+  bool on_worker_;
+  ExitStatus worker_status_;
+  /// The first line of the worker's answer, as far as it came.
+  std::string worker_header_;
+  /// How much output the worker has yet to send.
+  size_t worker_remaining_;
 #endif
   bool use_console_;
 
   friend struct SubprocessSet;
 };
 
-/// SubprocessSet runs a ppoll/pselect() loop around a set of Subprocesses.
-/// DoWork() waits for any state change in subprocesses; finished_
-/// is a queue of subprocesses as they finish.
+/// SubprocessSet runs an epoll, ppoll or pselect() loop around a set of
+/// Subprocesses.  DoWork() waits for any state change in subprocesses;
+/// finished_ is a queue of subprocesses as they finish.
 struct SubprocessSet {
   SubprocessSet();
   ~SubprocessSet();
 
-  std::shared_ptr<Subprocess> Add(const std::string& command, bool use_console = false);
-  bool DoWork();
+  /// Start |command|.  With |direct_exec|, a command SplitSimpleCommand()
+  /// can split runs without /bin/sh.
+  std::shared_ptr<Subprocess> Add(const std::string& command,
+                                  bool use_console = false,
+                                  bool direct_exec = false);
+  /// Run |command| on an idle worker started by |worker_command|, or on a
+  /// new one if none is idle.  Workers that die are replaced.  On Windows,
+  /// which has no workers, the command runs as usual.
+  std::shared_ptr<Subprocess> AddToWorker(const std::string& worker_command,
+                                          const std::string& command);
+  /// Wait for a state change in the subprocesses, and return whether the
+  /// wait was interrupted.  A |timeout_millis| of 0 only checks for
+  /// changes, and a negative one waits for as long as it takes.
+  bool DoWork(int64_t timeout_millis = -1);
   std::shared_ptr<Subprocess> NextFinished();
   void Clear();
 
@@ -105,6 +187,24 @@ struct SubprocessSet {
 
   static bool IsInterrupted() { return interrupted_ != 0; }
 
+  /// Read from |subproc|, whose output is ready, and move it to finished_
+  /// once it is done, and its worker, if any, to idle_workers_.
+  void OnPipeReady(Subprocess* subproc);
+  /// Move |subproc|, which is done, from running_ to finished_.
+  void Finished(Subprocess* subproc);
+
+  /// Idle workers, by the command that started them.
+  std::map<std::string, std::vector<std::unique_ptr<Worker> > > idle_workers_;
+
+#ifdef USE_EPOLL
+  /// Every running subprocess's fd and pidfd are registered here as it
+  /// starts, and stay registered until they are closed.
+  int epoll_fd_;
+  /// Delivers the signals above as events, or -1 if unavailable; then
+  /// DoWork() unblocks them while it waits instead.
+  int signal_fd_;
+#endif
+
   struct sigaction old_int_act_;
   struct sigaction old_term_act_;
   struct sigaction old_hup_act_;
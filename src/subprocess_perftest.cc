@@ -0,0 +1,80 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures how fast a SubprocessSet spawns and reaps trivial commands,
+// keeping a fixed number of them running at once as a build would, both
+// through /bin/sh and, where possible, without it.  One at a time, this is
+// the latency of starting a command.
+//
+// Usage: subprocess_perftest [commands, default 5000] [parallelism, default 64]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+#include "subprocess.h"
+
+using namespace std;
+
+#ifdef _WIN32
+const char kCommand[] = "cmd /c exit 0";
+#else
+const char kCommand[] = "/bin/true";
+#endif
+
+bool Run(int count, int parallelism, bool direct_exec) {
+  SubprocessSet subprocs;
+  int started = 0, finished = 0;
+  int64_t start = GetTimeMillis();
+  while (finished < count) {
+    while (started < count && (int)subprocs.running_.size() < parallelism) {
+      if (!subprocs.Add(kCommand, false, direct_exec)) {
+        fprintf(stderr, "failed to start command %d\n", started);
+        return false;
+      }
+      ++started;
+    }
+    if (subprocs.DoWork()) {
+      fprintf(stderr, "interrupted\n");
+      return false;
+    }
+    while (shared_ptr<Subprocess> subproc = subprocs.NextFinished()) {
+      if (subproc->Finish() != ExitSuccess) {
+        fprintf(stderr, "command failed: %s\n", subproc->GetOutput().c_str());
+        return false;
+      }
+      ++finished;
+    }
+  }
+  int64_t delta = GetTimeMillis() - start;
+  printf("%-6s %d commands, %d at a time: %dms (%.0f commands/s)\n",
+         direct_exec ? "direct" : "shell", count, parallelism, (int)delta,
+         delta > 0 ? 1000.0 * count / delta : 0.0);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int count = 5000;
+  int parallelism = 64;
+  if (argc > 1)
+    count = atoi(argv[1]);
+  if (argc > 2)
+    parallelism = atoi(argv[2]);
+  if (count <= 0 || parallelism <= 0) {
+    fprintf(stderr, "usage: %s [commands] [parallelism]\n", argv[0]);
+    return 1;
+  }
+  return Run(count, parallelism, false) && Run(count, parallelism, true)
+      ? 0 : 1;
+}
@@ -14,6 +14,7 @@
 
 #include "subprocess.h"
 
+#include "metrics.h"
 #include "test.h"
 
 #ifndef _WIN32
@@ -23,6 +24,9 @@
 #include <sys/resource.h>
 #include <unistd.h>
 #endif
+#ifdef USE_EPOLL
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
@@ -122,6 +126,22 @@ TEST_F(SubprocessTest, InterruptParentWithSigTerm) {
   ASSERT_FALSE("We should have been interrupted");
 }
 
+TEST_F(SubprocessTest, DoWorkTimeout) {
+  auto subproc = subprocs_.Add("sleep 0.1");
+  ASSERT_NE(nullptr, subproc);
+
+  // Checking without waiting finds nothing finished yet.
+  EXPECT_FALSE(subprocs_.DoWork(0));
+  EXPECT_FALSE(subproc->Done());
+  EXPECT_EQ(nullptr, subprocs_.NextFinished());
+
+  while (!subproc->Done()) {
+    subprocs_.DoWork(10);
+  }
+
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+}
+
 TEST_F(SubprocessTest, InterruptChildWithSigHup) {
   auto subproc = subprocs_.Add("kill -HUP $$");
   ASSERT_NE(nullptr, subproc);
@@ -215,7 +235,7 @@ TEST_F(SubprocessTest, SetWithMulti) {
   }
 }
 
-#if defined(USE_PPOLL)
+#if defined(USE_PPOLL) || defined(USE_EPOLL)
 TEST_F(SubprocessTest, SetWithLots) {
   // Arbitrary big number; needs to be over 1024 to confirm we're no longer
   // hostage to pselect.
@@ -246,6 +266,164 @@ TEST_F(SubprocessTest, SetWithLots) {
 }
 #endif  // !__APPLE__ && !_WIN32
 
+#ifndef _WIN32
+// Output larger than a pipe buffer, which has to be read over several
+// wakeups (or, with epoll, drained on each).
+TEST_F(SubprocessTest, LargeOutput) {
+  auto subproc = subprocs_.Add("seq 1 100000");
+  auto slow = subprocs_.Add("sleep 0.1; echo slow");
+  ASSERT_NE(nullptr, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ(588895u, subproc->GetOutput().size());
+  EXPECT_EQ("99999\n100000\n", subproc->GetOutput().substr(588895 - 13));
+
+  // The other subprocess took its place in the running list.
+  ASSERT_EQ(1u, subprocs_.running_.size());
+  EXPECT_EQ(slow, subprocs_.running_[0]);
+  while (!slow->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ("slow\n", slow->GetOutput());
+  EXPECT_EQ(0u, subprocs_.running_.size());
+}
+#endif  // _WIN32
+
+#if defined(USE_EPOLL) && defined(SYS_pidfd_open)
+// A grandchild left running in the background holds on to the output pipe,
+// but the subprocess is done as soon as its own process exits.
+TEST_F(SubprocessTest, ExitBeforeEndOfOutput) {
+  int pidfd = (int)syscall(SYS_pidfd_open, getpid(), 0);
+  if (pidfd < 0) {
+    printf("no pidfd_open() in this kernel, skipping test\n");
+    return;
+  }
+  close(pidfd);
+
+  int64_t start = GetTimeMillis();
+  auto subproc = subprocs_.Add("sleep 3 & echo started");
+  ASSERT_NE(nullptr, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_LT(GetTimeMillis() - start, 2000);
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("started\n", subproc->GetOutput());
+  EXPECT_EQ(0u, subprocs_.running_.size());
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(SubprocessTest, DirectExec) {
+  auto subproc = subprocs_.Add("printf '%s|' 'a b' c\"d\"", false, true);
+  ASSERT_NE(nullptr, subproc);
+  // Needs the shell.
+  auto shell = subprocs_.Add("printf %s \"$0\"", false, true);
+  ASSERT_NE(nullptr, shell);
+  // The shell tells about programs that can't be run.
+  auto missing = subprocs_.Add("ninja_no_such_command -x", false, true);
+  ASSERT_NE(nullptr, missing);
+
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("a b|cd|", subproc->GetOutput());
+  EXPECT_EQ(ExitSuccess, shell->Finish());
+  EXPECT_EQ("/bin/sh", shell->GetOutput());
+  EXPECT_EQ(ExitFailure, missing->Finish());
+  EXPECT_NE(string::npos, missing->GetOutput().find("ninja_no_such_command"));
+}
+#endif  // _WIN32
+
+#ifndef _WIN32
+// What the children the shell waited for used counts too.
+TEST_F(SubprocessTest, ResourceUsage) {
+  auto subproc = subprocs_.Add(
+      "i=0; while [ $i -lt 50000 ]; do i=$((i+1)); done; "
+      "head -c 1000000 /dev/zero > /dev/null");
+  ASSERT_NE(nullptr, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+
+  const ResourceUsage& usage = subproc->GetResourceUsage();
+  EXPECT_GT(usage.user_millis + usage.system_millis, 0);
+  EXPECT_GT(usage.max_rss_kb, 0);
+#ifdef __linux__
+  EXPECT_GE(usage.read_bytes, 1000000);
+  EXPECT_GE(usage.write_bytes, 1000000);
+#endif
+}
+#endif  // _WIN32
+
+#ifndef _WIN32
+// A worker that answers each command with its pid and the command, fails
+// commands starting with "fail", and dies on "crash".
+const char kEchoWorker[] =
+    "while read n; do"
+    "  req=$(head -c $n);"
+    "  case $req in crash) exit 3;; esac;"
+    "  code=0; case $req in fail*) code=1;; esac;"
+    "  out=\"$$ $req\";"
+    "  printf '%d %d\\n%s' $code ${#out} \"$out\";"
+    "done";
+
+/// Run |command| on an echo worker and return the pid of the worker.
+string RunOnWorker(SubprocessSet* subprocs, const string& command,
+                   ExitStatus expected) {
+  auto subproc = subprocs->AddToWorker(kEchoWorker, command);
+  EXPECT_NE(nullptr, subproc);
+  while (!subproc->Done())
+    subprocs->DoWork();
+  EXPECT_EQ(expected, subproc->Finish());
+  EXPECT_EQ(subproc, subprocs->NextFinished());
+  const string& output = subproc->GetOutput();
+  size_t space = output.find(' ');
+  EXPECT_NE(string::npos, space);
+  EXPECT_EQ(command, output.substr(space + 1));
+  return output.substr(0, space);
+}
+
+TEST_F(SubprocessTest, Worker) {
+  string pid = RunOnWorker(&subprocs_, "gen a.txt", ExitSuccess);
+  // The worker is kept for the next command.
+  EXPECT_EQ(pid, RunOnWorker(&subprocs_, "gen 'b c.txt'", ExitSuccess));
+  EXPECT_EQ(pid, RunOnWorker(&subprocs_, "fail d.txt", ExitFailure));
+  EXPECT_EQ(pid, RunOnWorker(&subprocs_, "", ExitSuccess));
+
+  // Commands running at the same time get a worker each.
+  auto first = subprocs_.AddToWorker(kEchoWorker, "gen e.txt");
+  auto second = subprocs_.AddToWorker(kEchoWorker, "gen f.txt");
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, first->Finish());
+  EXPECT_EQ(ExitSuccess, second->Finish());
+  EXPECT_EQ(pid + " gen e.txt", first->GetOutput());
+  EXPECT_NE(pid + " gen f.txt", second->GetOutput());
+  EXPECT_EQ(2u, subprocs_.idle_workers_[kEchoWorker].size());
+}
+
+TEST_F(SubprocessTest, WorkerCrash) {
+  string pid = RunOnWorker(&subprocs_, "gen a.txt", ExitSuccess);
+
+  auto subproc = subprocs_.AddToWorker(kEchoWorker, "crash");
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(subproc, subprocs_.NextFinished());
+  EXPECT_EQ(ExitFailure, subproc->Finish());
+  EXPECT_NE(string::npos, subproc->GetOutput().find("exited with status 3"));
+  EXPECT_EQ(0u, subprocs_.idle_workers_[kEchoWorker].size());
+
+  // The next command starts a new worker.
+  string new_pid = RunOnWorker(&subprocs_, "gen a.txt", ExitSuccess);
+  EXPECT_NE(pid, new_pid);
+
+  // So does one after the idle worker died.
+  kill(atoi(new_pid.c_str()), SIGKILL);
+  usleep(100 * 1000);
+  EXPECT_NE(new_pid, RunOnWorker(&subprocs_, "gen b.txt", ExitSuccess));
+}
+#endif  // _WIN32
+
 // TODO: this test could work on Windows, just not sure how to simply
 // read stdin.
 #ifndef _WIN32
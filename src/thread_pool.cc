@@ -0,0 +1,126 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+using namespace std;
+
+namespace {
+
+/// The pool and worker index of the current thread, if it is a worker.
+thread_local ThreadPool* g_current_pool = NULL;
+thread_local int g_current_worker = -1;
+
+}  // namespace
+
+ThreadPool::ThreadPool(int num_threads)
+    : queued_(0), pending_(0), stopping_(false) {
+  if (num_threads < 1)
+    num_threads = 1;
+  for (int i = 0; i < num_threads; ++i)
+    workers_.push_back(unique_ptr<Worker>(new Worker));
+  // Start the threads only once |workers_| is complete, as they scan it.
+  for (int i = 0; i < num_threads; ++i)
+    workers_[i]->thread = thread(&ThreadPool::WorkerMain, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  Wait();
+  {
+    lock_guard<mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_available_.notify_all();
+  for (size_t i = 0; i < workers_.size(); ++i)
+    workers_[i]->thread.join();
+}
+
+void ThreadPool::Post(function<void()> task) {
+  ++pending_;
+  if (g_current_pool == this) {
+    Worker* worker = workers_[g_current_worker].get();
+    lock_guard<mutex> lock(worker->mutex);
+    worker->tasks.push_back(std::move(task));
+    ++queued_;
+  } else {
+    lock_guard<mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    ++queued_;
+  }
+  // Taking the lock orders the increment of |queued_| against a worker
+  // deciding to sleep.
+  { lock_guard<mutex> lock(mutex_); }
+  work_available_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  unique_lock<mutex> lock(mutex_);
+  while (pending_ > 0)
+    work_done_.wait(lock);
+}
+
+bool ThreadPool::TakeTask(int index, function<void()>* task) {
+  Worker* self = workers_[index].get();
+  {
+    lock_guard<mutex> lock(self->mutex);
+    if (!self->tasks.empty()) {
+      *task = std::move(self->tasks.back());
+      self->tasks.pop_back();
+      --queued_;
+      return true;
+    }
+  }
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (!tasks_.empty()) {
+      *task = std::move(tasks_.front());
+      tasks_.pop_front();
+      --queued_;
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker* victim = workers_[(index + i) % workers_.size()].get();
+    lock_guard<mutex> lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      *task = std::move(victim->tasks.front());
+      victim->tasks.pop_front();
+      --queued_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::WorkerMain(int index) {
+  g_current_pool = this;
+  g_current_worker = index;
+  function<void()> task;
+  for (;;) {
+    if (TakeTask(index, &task)) {
+      task();
+      task = nullptr;
+      if (--pending_ == 0) {
+        lock_guard<mutex> lock(mutex_);
+        work_done_.notify_all();
+      }
+      continue;
+    }
+    unique_lock<mutex> lock(mutex_);
+    while (queued_ == 0 && !stopping_)
+      work_available_.wait(lock);
+    if (queued_ == 0 && stopping_)
+      return;
+  }
+}
@@ -0,0 +1,79 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_THREAD_POOL_H_
+#define NINJA_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed set of worker threads that run posted tasks.
+///
+/// Tasks posted from outside the pool go to a shared queue and run in FIFO
+/// order.  Tasks posted by a running task go to that worker's own queue,
+/// which it works through newest first; idle workers steal the oldest
+/// tasks from other workers.  This suits walking a graph, where each task
+/// posts tasks for its children.
+struct ThreadPool {
+  explicit ThreadPool(int num_threads);
+
+  /// Waits for outstanding tasks and joins the worker threads.
+  ~ThreadPool();
+
+  /// Queue |task| to run on one of the worker threads.
+  void Post(std::function<void()> task);
+
+  /// Block until every task posted so far, and every task those post, has
+  /// finished.  Must not be called from a task.
+  void Wait();
+
+  int size() const { return (int)workers_.size(); }
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()> > tasks;
+    std::thread thread;
+  };
+
+  void WorkerMain(int index);
+
+  /// Take a task for worker |index|: its own newest, else the oldest shared
+  /// one, else the oldest of another worker's.
+  bool TakeTask(int index, std::function<void()>* task);
+
+  std::vector<std::unique_ptr<Worker> > workers_;
+
+  /// Guards |tasks_| and the condition variables.
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable work_done_;
+  std::deque<std::function<void()> > tasks_;
+  /// Number of tasks sitting in any queue.
+  std::atomic<int> queued_;
+  /// Number of tasks queued or running.
+  std::atomic<int> pending_;
+  bool stopping_;
+
+  ThreadPool(const ThreadPool&);  // DO NOT IMPLEMENT
+  void operator=(const ThreadPool&);  // DO NOT IMPLEMENT
+};
+
+#endif  // NINJA_THREAD_POOL_H_
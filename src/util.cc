@@ -299,6 +299,62 @@ void GetShellEscapedString(const string& input, string* result) {
   result->push_back(kQuote);
 }
 
+bool SplitSimpleCommand(const string& command, vector<string>* args) {
+  args->clear();
+  string word;
+  bool in_word = false;
+  for (size_t i = 0; i < command.size(); ++i) {
+    char ch = command[i];
+    if (ch == ' ' || ch == '\t') {
+      if (in_word)
+        args->push_back(word);
+      word.clear();
+      in_word = false;
+    } else if (ch == '\'' || ch == '"') {
+      size_t end = command.find(ch, i + 1);
+      if (end == string::npos)
+        return false;
+      // Double quotes still expand $ and `, and let \ escape them.
+      if (ch == '"' &&
+          command.find_first_of("$`\\!", i + 1) < end)
+        return false;
+      word.append(command, i + 1, end - i - 1);
+      in_word = true;
+      i = end;
+    } else if (IsKnownShellSafeCharacter(ch) || ch == ',' || ch == ':' ||
+               ch == '=' || ch == '@' || ch == '%') {
+      word.push_back(ch);
+      in_word = true;
+    } else {
+      return false;
+    }
+  }
+  if (in_word)
+    args->push_back(word);
+  if (args->empty())
+    return false;
+
+  // A variable assignment, or something the shell runs itself: keywords,
+  // and builtins with no program of their own or one which behaves
+  // differently.
+  const string& program = (*args)[0];
+  if (program.find('=') != string::npos)
+    return false;
+  static const char* const kShellWords[] = {
+    ".", ":", "alias", "bg", "break", "builtin", "case", "cd", "command",
+    "continue", "declare", "do", "done", "echo", "elif", "else", "esac",
+    "eval", "exec", "exit", "export", "fc", "fg", "fi", "for", "function",
+    "getopts", "hash", "if", "in", "jobs", "kill", "let", "local", "pwd",
+    "read", "readonly", "return", "select", "set", "shift", "source", "then",
+    "time", "times", "trap", "type", "typeset", "ulimit", "umask", "unalias",
+    "unset", "until", "wait", "while",
+  };
+  for (size_t i = 0; i < sizeof(kShellWords) / sizeof(kShellWords[0]); ++i) {
+    if (program == kShellWords[i])
+      return false;
+  }
+  return true;
+}
 
 void GetWin32EscapedString(const string& input, string* result) {
   assert(result);
@@ -658,6 +714,39 @@ int ParseCPUFromCGroup() {
 }
 #endif
 
+string GetCGroup2Path() {
+#if defined(linux) || defined(__GLIBC__)
+  // The unified hierarchy is the "0::" entry of /proc/self/cgroup.
+  ifstream cgroup("/proc/self/cgroup");
+  if (!cgroup.is_open())
+    return string();
+  string name;
+  string line;
+  while (getline(cgroup, line)) {
+    if (line.compare(0, 3, "0::") == 0) {
+      name = line.substr(3);
+      break;
+    }
+  }
+  if (name.empty())
+    return string();
+
+  ifstream mountinfo("/proc/self/mountinfo");
+  if (!mountinfo.is_open())
+    return string();
+  while (getline(mountinfo, line)) {
+    MountPoint mp;
+    if (!mp.parse(line) || mp.fsType != "cgroup2")
+      continue;
+    string path = name;
+    path = mp.translate(path);
+    if (!path.empty())
+      return path;
+  }
+#endif
+  return string();
+}
+
 int GetProcessorCount() {
 #ifdef _WIN32
   DWORD cpuCount = 0;
@@ -74,6 +74,13 @@ void CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits);
 void GetShellEscapedString(const std::string& input, std::string* result);
 void GetWin32EscapedString(const std::string& input, std::string* result);
 
+/// Split |command| into the program and arguments /bin/sh -c would run,
+/// if it is simple enough to run without a shell: words of plain or
+/// quoted text, without expansions, redirections, operators, variable
+/// assignments or shell builtins.  Returns false if it needs the shell.
+bool SplitSimpleCommand(const std::string& command,
+                        std::vector<std::string>* args);
+
 /// Read a file to a string (in text mode: with CRLF conversion
 /// on Windows).
 /// Returns -errno and fills in \a err on error.
@@ -99,6 +106,10 @@ std::string StripAnsiEscapeCodes(const std::string& in);
 /// guess for how many jobs to run in parallel.  @return 0 on error.
 int GetProcessorCount();
 
+/// @return the directory of this process's cgroup in the cgroup v2
+/// hierarchy, or an empty string if there is none.
+std::string GetCGroup2Path();
+
 /// @return the load average of the machine. A negative value is returned
 /// on error.
 double GetLoadAverage();
@@ -391,6 +391,40 @@ TEST(PathEscaping, SensibleWin32PathsAreNotNeedlesslyEscaped) {
   EXPECT_EQ(path, result);
 }
 
+TEST(SplitSimpleCommand, Simple) {
+  vector<string> args;
+  EXPECT_TRUE(SplitSimpleCommand(
+      "  cc -c foo.c\t-o out/foo.o -DX=1 -Wl,-z,now @rsp 100%  ", &args));
+  ASSERT_EQ(9u, args.size());
+  EXPECT_EQ("cc", args[0]);
+  EXPECT_EQ("foo.c", args[2]);
+  EXPECT_EQ("-o", args[3]);
+  EXPECT_EQ("-DX=1", args[5]);
+  EXPECT_EQ("100%", args[8]);
+
+  EXPECT_TRUE(SplitSimpleCommand(
+      "'/opt/my tools/cc' -DMSG=\"a b\" x'y'\"\"z ''", &args));
+  ASSERT_EQ(4u, args.size());
+  EXPECT_EQ("/opt/my tools/cc", args[0]);
+  EXPECT_EQ("-DMSG=a b", args[1]);
+  EXPECT_EQ("xyz", args[2]);
+  EXPECT_EQ("", args[3]);
+}
+
+TEST(SplitSimpleCommand, NeedsShell) {
+  const char* kCommands[] = {
+    "", "   ",
+    "cc $CFLAGS foo.c", "cc `foo`", "cc -c *.c", "cc foo.c > log",
+    "cc foo.c 2>&1", "a | b", "a && b", "a; b", "(a)", "cc ~/foo.c",
+    "cc foo.c # comment", "cc \\ foo", "cc 'unterminated",
+    "cc \"$HOME\"", "cc \"a\\\"b\"", "CC=gcc make", "cd out",
+    "echo -n hi", "exec cc", "if", "a\nb",
+  };
+  vector<string> args;
+  for (size_t i = 0; i < sizeof(kCommands) / sizeof(kCommands[0]); ++i)
+    EXPECT_FALSE(SplitSimpleCommand(kCommands[i], &args));
+}
+
 TEST(StripAnsiEscapeCodes, EscapeAtEnd) {
   string stripped = StripAnsiEscapeCodes("foo\33");
   EXPECT_EQ("foo", stripped);